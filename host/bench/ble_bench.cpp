@@ -0,0 +1,373 @@
+// -------------------------------------------------------------------------------------------------------------------
+/*
+Micro-benchmarks of the library's own costs on the host, against the fake
+bluedroid stack in replay mode (API calls of the server do nothing, events
+are delivered directly):
+
+    registration  AddService() + AddCharacteristic() building tables of 9 to 249 attributes
+    table created the attribute table event: handles stored, config descriptors found,
+                  event handlers of all values bound to their handles (BuildHandlerTable())
+    dispatch      a write event to a value with an event handler (hot) and without one (cold)
+    GetHandle     handle of an attribute index
+    advertising   CreatePassiveAdvertisingData() and CreateScanAdvertisingData()
+
+Every benchmark runs until it took at least 0.2 s (or the time given as
+argument in seconds) and reports the time and the heap allocations per
+operation. Only the measured part counts, setting up servers doesn't.
+With BLE_SERVER_STATIC_STORAGE tables beyond the limits of ble_config.h are skipped.
+
+    ble_bench [seconds] [name filter]
+*/
+// -------------------------------------------------------------------------------------------------------------------
+# include "fake_bt_stack.h"
+# include "ble_server.h"
+# include <atomic>
+# include <chrono>
+# include <cstdio>
+# include <cstddef>
+# include <cstdlib>
+# include <cstring>
+# include <memory>
+# include <new>
+# include <vector>
+// -------------------------------------------------------------------------------------------------------------------
+// defined in ble_server.cpp
+uint8_t CreatePassiveAdvertisingData(uint16_t uuid, const char* device_name, const uint8_t* broadcast, uint8_t broadcast_size, uint8_t* raw_adv_data);
+uint8_t CreateScanAdvertisingData(const ServiceVector& services, uint8_t* raw_adv_data);
+// -------------------------------------------------------------------------------------------------------------------
+/// Heap allocations of the whole program.
+static std::atomic<uint64_t> s_allocations{0};
+
+// The whole replaceable set goes through the two helpers below, so any new/delete pairing the compiler picks
+// (array, sized, aligned, nothrow) counts and frees consistently. They are kept out of line: inlined into a
+// delete-expression, free() on a pointer from a new-expression trips -Wmismatched-new-delete.
+__attribute__((noinline)) static void* Allocate(size_t size, size_t alignment)
+{
+    s_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (!size)
+        size = 1;
+    if (alignment <= alignof(std::max_align_t))
+        return malloc(size);
+    // aligned_alloc wants a multiple of the alignment
+    return aligned_alloc(alignment, (size + alignment - 1) & ~(alignment - 1));
+}
+__attribute__((noinline)) static void Release(void* p) { free(p); }
+
+static void* AllocateOrThrow(size_t size, size_t alignment)
+{
+    if (void* p = Allocate(size, alignment))
+        return p;
+    throw std::bad_alloc();
+}
+
+void* operator new(size_t size) { return AllocateOrThrow(size, 0); }
+void* operator new[](size_t size) { return AllocateOrThrow(size, 0); }
+void* operator new(size_t size, std::align_val_t al) { return AllocateOrThrow(size, (size_t)al); }
+void* operator new[](size_t size, std::align_val_t al) { return AllocateOrThrow(size, (size_t)al); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return Allocate(size, 0); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return Allocate(size, 0); }
+void* operator new(size_t size, std::align_val_t al, const std::nothrow_t&) noexcept { return Allocate(size, (size_t)al); }
+void* operator new[](size_t size, std::align_val_t al, const std::nothrow_t&) noexcept { return Allocate(size, (size_t)al); }
+
+void operator delete(void* p) noexcept { Release(p); }
+void operator delete[](void* p) noexcept { Release(p); }
+void operator delete(void* p, size_t) noexcept { Release(p); }
+void operator delete[](void* p, size_t) noexcept { Release(p); }
+void operator delete(void* p, std::align_val_t) noexcept { Release(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { Release(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { Release(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { Release(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { Release(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { Release(p); }
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { Release(p); }
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { Release(p); }
+// -------------------------------------------------------------------------------------------------------------------
+/// Sums up the time and the allocations of the measured parts of a benchmark.
+class Stopwatch
+{
+public:
+    void Start(void)
+    {
+        m_allocations -= s_allocations.load(std::memory_order_relaxed);
+        m_start = std::chrono::steady_clock::now();
+    }
+
+    void Stop(void)
+    {
+        m_ns += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - m_start).count();
+        m_allocations += s_allocations.load(std::memory_order_relaxed);
+    }
+
+    double GetNanoseconds(void) const { return m_ns; }
+    uint64_t GetAllocations(void) const { return m_allocations; }
+
+private:
+    std::chrono::steady_clock::time_point m_start;
+    double m_ns = 0;
+    uint64_t m_allocations = 0;
+};
+
+/// Runs \a ops operations, measuring them with the stopwatch.
+typedef void (*bench_func)(Stopwatch& watch, uint64_t ops);
+
+static double s_min_seconds = 0.2;
+static const char* s_filter = nullptr;
+/// Keeps results alive, so the compiler can't drop the measured code.
+static volatile uint32_t s_sink;
+// -------------------------------------------------------------------------------------------------------------------
+/// Runs benchmark \a name, which builds tables of \a attributes attributes with \a handlers event handlers.
+static void Run(const char* name, bench_func func, uint16_t attributes = 0, uint16_t handlers = 0)
+{
+    if (s_filter && !strstr(name, s_filter))
+        return;
+# ifdef BLE_SERVER_STATIC_STORAGE
+    if (attributes > BLE_MAX_SERVICE_ATTRIBUTES || handlers > BLE_MAX_EVENT_HANDLERS || attributes > BLE_MAX_HANDLE_RANGE)
+    {
+        printf("%-44s skipped, exceeds the storage limits of ble_config.h\n", name);
+        return;
+    }
+# endif
+
+    // warm up, then double the operations until the measured time is long enough
+    Stopwatch warm_up;
+    func(warm_up, 1);
+    for (uint64_t ops = 1; ; ops *= 2)
+    {
+        Stopwatch watch;
+        func(watch, ops);
+        if (watch.GetNanoseconds() >= s_min_seconds * 1e9 || ops >= (1ull << 32))
+        {
+            printf("%-44s %12.1f %10.2f %12llu\n", name, watch.GetNanoseconds() / ops,
+                   (double)watch.GetAllocations() / ops, (unsigned long long)ops);
+            return;
+        }
+    }
+}
+// -------------------------------------------------------------------------------------------------------------------
+static BLEServer* s_server = nullptr;
+static uint32_t s_handler_calls = 0;
+
+static void OnGATTEvent(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param)
+{
+    s_server->HandleGATTEvent(event, gatts_if, param);
+}
+
+static void OnValueEvent(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param)
+{
+    ++s_handler_calls;
+}
+
+static const uint16_t service_uuid = 0xfff0;
+static const uint16_t value_uuid = 0xfff1;
+static uint8_t s_value[20];
+static uint8_t s_config[2];
+// -------------------------------------------------------------------------------------------------------------------
+/// Adds a service with \a chars characteristics (1 + 2 * chars attributes), every fourth one with
+/// a client configuration descriptor (one attribute more) if \a with_config. Values get an
+/// event handler if \a with_handlers.
+static void AddTable(BLEServer& server, uint8_t chars, bool with_config, bool with_handlers)
+{
+    server.AddService(service_uuid);
+    for (uint8_t i = 0; i < chars; ++i)
+    {
+        server.AddCharacteristic(
+            &value_uuid, &char_prop_read_write_notify, ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE,
+            sizeof(s_value), sizeof(s_value), s_value, nullptr,
+            with_handlers ? OnValueEvent : nullptr,
+            with_config && i % 4 == 0 ? s_config : nullptr
+        );
+    }
+}
+// -------------------------------------------------------------------------------------------------------------------
+/// Attributes of a table of AddTable() with client configuration descriptors.
+static uint16_t GetAttributeCount(uint8_t chars)
+{
+    return (uint16_t)(1 + 2 * chars + (chars + 3) / 4);
+}
+
+/// Index of the value of characteristic \a i in a table of AddTable() with client configuration descriptors.
+static uint16_t GetValueIndex(uint8_t i)
+{
+    return (uint16_t)(2 + 2 * i + (i + 3) / 4);
+}
+// -------------------------------------------------------------------------------------------------------------------
+/// Creates a server, lets it handle the attribute table event of \a chars characteristics
+/// with handles from 40 on and returns the attribute count.
+static uint16_t CreateRegisteredServer(uint8_t chars, std::vector<uint16_t>& handles)
+{
+    FakeBTStack& stack = FakeBTStack::Instance();
+    s_server = new BLEServer("bench");
+    AddTable(*s_server, chars, true, true);
+    uint16_t count = GetAttributeCount(chars);
+    handles.resize(count);
+    for (uint16_t i = 0; i < count; ++i)
+        handles[i] = (uint16_t)(40 + i);
+
+    esp_ble_gatts_cb_param_t param = {};
+    param.add_attr_tab.status = ESP_GATT_OK;
+    param.add_attr_tab.svc_inst_id = 0;
+    param.add_attr_tab.num_handle = count;
+    param.add_attr_tab.handles = handles.data();
+    stack.DeliverGATTSEvent(ESP_GATTS_CREAT_ATTR_TAB_EVT, ESP_GATT_IF_NONE, &param);
+    return count;
+}
+
+static void DeleteServer(void)
+{
+    delete s_server;
+    s_server = nullptr;
+}
+// -------------------------------------------------------------------------------------------------------------------
+template <uint8_t CHARS>
+static void BenchRegistration(Stopwatch& watch, uint64_t ops)
+{
+    for (uint64_t op = 0; op < ops; ++op)
+    {
+        std::unique_ptr<BLEServer> server(new BLEServer("bench"));
+        watch.Start();
+        AddTable(*server, CHARS, false, false);
+        watch.Stop();
+    }
+}
+// -------------------------------------------------------------------------------------------------------------------
+template <uint8_t CHARS>
+static void BenchTableCreated(Stopwatch& watch, uint64_t ops)
+{
+    FakeBTStack& stack = FakeBTStack::Instance();
+    for (uint64_t op = 0; op < ops; ++op)
+    {
+        s_server = new BLEServer("bench");
+        AddTable(*s_server, CHARS, true, true);
+        uint16_t count = GetAttributeCount(CHARS);
+        std::vector<uint16_t> handles(count);
+        for (uint16_t i = 0; i < count; ++i)
+            handles[i] = (uint16_t)(40 + i);
+
+        esp_ble_gatts_cb_param_t param = {};
+        param.add_attr_tab.status = ESP_GATT_OK;
+        param.add_attr_tab.num_handle = count;
+        param.add_attr_tab.handles = handles.data();
+        watch.Start();
+        stack.DeliverGATTSEvent(ESP_GATTS_CREAT_ATTR_TAB_EVT, ESP_GATT_IF_NONE, &param);
+        watch.Stop();
+        DeleteServer();
+    }
+}
+// -------------------------------------------------------------------------------------------------------------------
+/// Write events of 2 bytes to the value of characteristic \a CHAR (or its declaration
+/// without event handler if not \a HOT) of a table of 100 characteristics.
+template <uint8_t CHAR, bool HOT>
+static void BenchDispatch(Stopwatch& watch, uint64_t ops)
+{
+    std::vector<uint16_t> handles;
+    CreateRegisteredServer(100, handles);
+    uint16_t handle = handles[GetValueIndex(CHAR) - (HOT ? 0 : 1)];
+
+    uint8_t data[2] = {1, 2};
+    esp_ble_gatts_cb_param_t param = {};
+    param.write.conn_id = 0;
+    param.write.handle = handle;
+    param.write.len = sizeof(data);
+    param.write.value = data;
+
+    FakeBTStack& stack = FakeBTStack::Instance();
+    uint32_t calls = s_handler_calls;
+    watch.Start();
+    for (uint64_t op = 0; op < ops; ++op)
+        stack.DeliverGATTSEvent(ESP_GATTS_WRITE_EVT, ESP_GATT_IF_NONE, &param);
+    watch.Stop();
+    if ((s_handler_calls - calls != 0) != HOT)
+        fprintf(stderr, "dispatch: handler %s called\n", HOT ? "not" : "unexpectedly");
+    DeleteServer();
+}
+// -------------------------------------------------------------------------------------------------------------------
+static void BenchGetHandle(Stopwatch& watch, uint64_t ops)
+{
+    std::vector<uint16_t> handles;
+    uint16_t count = CreateRegisteredServer(100, handles);
+    uint32_t sum = 0;
+    watch.Start();
+    for (uint64_t op = 0; op < ops; ++op)
+        sum += s_server->GetHandle(0, (uint8_t)(op % count));
+    watch.Stop();
+    s_sink = sum;
+    DeleteServer();
+}
+// -------------------------------------------------------------------------------------------------------------------
+static void BenchPassiveAdvertising(Stopwatch& watch, uint64_t ops)
+{
+    uint8_t raw[31];
+    uint32_t sum = 0;
+    watch.Start();
+    for (uint64_t op = 0; op < ops; ++op)
+        sum += CreatePassiveAdvertisingData(0xffe0, "MyDevice", nullptr, 0, raw);
+    watch.Stop();
+    s_sink = sum + raw[0];
+}
+// -------------------------------------------------------------------------------------------------------------------
+static void BenchPassiveAdvertisingBroadcast(Stopwatch& watch, uint64_t ops)
+{
+    // manufacturer data of 12 bytes shortens the name
+    const uint8_t broadcast[16] = {15, 0xFF, 0xE5, 0x02, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12};
+    uint8_t raw[31];
+    uint32_t sum = 0;
+    watch.Start();
+    for (uint64_t op = 0; op < ops; ++op)
+        sum += CreatePassiveAdvertisingData(0xffe0, "MyLongDeviceName", broadcast, sizeof(broadcast), raw);
+    watch.Stop();
+    s_sink = sum + raw[0];
+}
+// -------------------------------------------------------------------------------------------------------------------
+# ifndef BLE_SERVER_STATIC_STORAGE
+// services outside of a server exist only with the heap
+static void BenchScanAdvertising(Stopwatch& watch, uint64_t ops)
+{
+    ServiceVector services;
+    for (uint8_t i = 0; i < BLE_MAX_SERVICES; ++i)
+        services.push_back(BLEService::Create((uint16_t)(0xffe0 + i), i));
+    uint8_t raw[31];
+    uint32_t sum = 0;
+    watch.Start();
+    for (uint64_t op = 0; op < ops; ++op)
+        sum += CreateScanAdvertisingData(services, raw);
+    watch.Stop();
+    s_sink = sum + raw[0];
+}
+# endif
+// -------------------------------------------------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+    if (argc > 1)
+        s_min_seconds = atof(argv[1]);
+    if (argc > 2)
+        s_filter = argv[2];
+
+    FakeBTStack& stack = FakeBTStack::Instance();
+    FakeBTStack::Config config;
+    config.max_attributes_per_table = 255;
+    stack.Reset(config);
+    stack.SetReplay(true);
+    esp_ble_gatts_register_callback(OnGATTEvent);
+
+    printf("%-44s %12s %10s %12s\n", "benchmark", "ns/op", "allocs/op", "ops");
+    Run("registration 9 attributes", BenchRegistration<4>, 9);
+    Run("registration 49 attributes", BenchRegistration<24>, 49);
+    Run("registration 99 attributes", BenchRegistration<49>, 99);
+    Run("registration 249 attributes", BenchRegistration<124>, 249);
+    Run("table created 13 attributes, 5 handlers", BenchTableCreated<5>, 13, 5);
+    Run("table created 58 attributes, 25 handlers", BenchTableCreated<25>, 58, 25);
+    Run("table created 114 attributes, 50 handlers", BenchTableCreated<50>, 114, 50);
+    Run("table created 226 attributes, 100 handlers", BenchTableCreated<100>, 226, 100);
+    Run("dispatch write, first value (hot)", BenchDispatch<0, true>, 226, 100);
+    Run("dispatch write, first declaration (cold)", BenchDispatch<0, false>, 226, 100);
+    Run("dispatch write, last value (hot)", BenchDispatch<99, true>, 226, 100);
+    Run("dispatch write, last declaration (cold)", BenchDispatch<99, false>, 226, 100);
+    Run("GetHandle", BenchGetHandle, 226, 100);
+    Run("CreatePassiveAdvertisingData", BenchPassiveAdvertising);
+    Run("CreatePassiveAdvertisingData, broadcast", BenchPassiveAdvertisingBroadcast);
+# ifndef BLE_SERVER_STATIC_STORAGE
+    Run("CreateScanAdvertisingData, 8 services", BenchScanAdvertising);
+# endif
+    return 0;
+}
+// -------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,184 @@
+// -------------------------------------------------------------------------------------------------------------------
+/*
+Host implementation of the ESP-IDF services outside the BLE stack:
+error names, logging, controller / bluedroid setup and NVS (in memory).
+FreeRTOS is in freertos_stubs.cpp.
+*/
+// -------------------------------------------------------------------------------------------------------------------
+# include <esp_err.h>
+# include <esp_log.h>
+# include <esp_bt.h>
+# include <esp_bt_main.h>
+# include <nvs_flash.h>
+# include <nvs.h>
+# include <cstdarg>
+# include <chrono>
+# include <cstring>
+# include <map>
+# include <mutex>
+# include <string>
+# include <vector>
+// -------------------------------------------------------------------------------------------------------------------
+static esp_log_level_t log_level = ESP_LOG_WARN;
+static const auto start_time = std::chrono::steady_clock::now();
+// -------------------------------------------------------------------------------------------------------------------
+const char* esp_err_to_name(esp_err_t code)
+{
+    switch (code)
+    {
+        case ESP_OK: return "ESP_OK";
+        case ESP_FAIL: return "ESP_FAIL";
+        case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+        case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+        case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+        case ESP_ERR_INVALID_SIZE: return "ESP_ERR_INVALID_SIZE";
+        case ESP_ERR_NOT_FOUND: return "ESP_ERR_NOT_FOUND";
+        case ESP_ERR_NOT_SUPPORTED: return "ESP_ERR_NOT_SUPPORTED";
+        case ESP_ERR_TIMEOUT: return "ESP_ERR_TIMEOUT";
+        case ESP_ERR_NVS_NOT_FOUND: return "ESP_ERR_NVS_NOT_FOUND";
+        case ESP_ERR_NVS_INVALID_HANDLE: return "ESP_ERR_NVS_INVALID_HANDLE";
+        case ESP_ERR_NVS_INVALID_LENGTH: return "ESP_ERR_NVS_INVALID_LENGTH";
+        case ESP_ERR_NVS_NO_FREE_PAGES: return "ESP_ERR_NVS_NO_FREE_PAGES";
+        case ESP_ERR_NVS_NEW_VERSION_FOUND: return "ESP_ERR_NVS_NEW_VERSION_FOUND";
+        default: return "UNKNOWN ERROR";
+    }
+}
+// -------------------------------------------------------------------------------------------------------------------
+void esp_log_level_set(const char* tag, esp_log_level_t level)
+{
+    log_level = level;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void esp_log_write(esp_log_level_t level, const char* tag, const char* format, ...)
+{
+    if (level > log_level)
+        return;
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+// -------------------------------------------------------------------------------------------------------------------
+void esp_log_buffer_hexdump_internal(const char* tag, const void* buffer, uint16_t buff_len, esp_log_level_t level)
+{
+    if (level > log_level)
+        return;
+    const uint8_t* data = (const uint8_t*)buffer;
+    for (uint16_t i = 0; i < buff_len; i += 16)
+    {
+        fprintf(stderr, "%s: 0x%08x  ", tag, i);
+        for (uint16_t j = i; j < i + 16 && j < buff_len; ++j)
+            fprintf(stderr, "%02x ", data[j]);
+        fprintf(stderr, "\n");
+    }
+}
+// -------------------------------------------------------------------------------------------------------------------
+uint32_t esp_log_timestamp(void)
+{
+    return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start_time
+    ).count();
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t esp_bt_controller_mem_release(esp_bt_mode_t mode)
+{
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t esp_bt_controller_init(esp_bt_controller_config_t *cfg)
+{
+    return cfg ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t esp_bt_controller_enable(esp_bt_mode_t mode)
+{
+    return mode == ESP_BT_MODE_BLE || mode == ESP_BT_MODE_BTDM ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t esp_bluedroid_init(void)
+{
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t esp_bluedroid_enable(void)
+{
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t nvs_flash_init(void)
+{
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t nvs_flash_erase(void)
+{
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+/// Blobs of the host NVS by namespace and key, handles are indexes of the namespaces + 1.
+static std::mutex nvs_mutex;
+static std::vector<std::string> nvs_namespaces;
+static std::map<std::string, std::vector<uint8_t>> nvs_blobs;
+// -------------------------------------------------------------------------------------------------------------------
+static bool GetNVSKey(nvs_handle_t handle, const char* key, std::string& full_key)
+{
+    if (!handle || handle > nvs_namespaces.size() || !key)
+        return false;
+    full_key = nvs_namespaces[handle - 1] + "/" + key;
+    return true;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t nvs_open(const char* name, nvs_open_mode_t open_mode, nvs_handle_t* out_handle)
+{
+    std::lock_guard<std::mutex> lock(nvs_mutex);
+    nvs_namespaces.push_back(name);
+    *out_handle = (nvs_handle_t)nvs_namespaces.size();
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void nvs_close(nvs_handle_t handle)
+{
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char* key, void* out_value, size_t* length)
+{
+    std::lock_guard<std::mutex> lock(nvs_mutex);
+    std::string full_key;
+    if (!GetNVSKey(handle, key, full_key))
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    auto it = nvs_blobs.find(full_key);
+    if (it == nvs_blobs.end())
+        return ESP_ERR_NVS_NOT_FOUND;
+    if (out_value && *length < it->second.size())
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    *length = it->second.size();
+    if (out_value)
+        memcpy(out_value, it->second.data(), it->second.size());
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char* key, const void* value, size_t length)
+{
+    std::lock_guard<std::mutex> lock(nvs_mutex);
+    std::string full_key;
+    if (!GetNVSKey(handle, key, full_key))
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    nvs_blobs[full_key].assign((const uint8_t*)value, (const uint8_t*)value + length);
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char* key)
+{
+    std::lock_guard<std::mutex> lock(nvs_mutex);
+    std::string full_key;
+    if (!GetNVSKey(handle, key, full_key))
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    return nvs_blobs.erase(full_key) ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    std::lock_guard<std::mutex> lock(nvs_mutex);
+    return handle && handle <= nvs_namespaces.size() ? ESP_OK : ESP_ERR_NVS_INVALID_HANDLE;
+}
+// -------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,1231 @@
+// -------------------------------------------------------------------------------------------------------------------
+/*
+Runs server_example.cpp on the host against the fake bluedroid stack.
+
+A simulated phone connects, negotiates the MTU, subscribes to the RX channel
+(0xffe4) and then sends commands to the TX channel (0xffe9) in a loop, each one
+answered with a notification by the command dispatcher. The loop is meant to be
+profiled, e.g.:
+
+    perf record -g ./ble_example_host 5000000
+
+Afterwards the controller TX buffers are simulated and the server streams
+numbered frames in bursts exceeding the link capacity through
+BLEServer::Notify(), the phone checks that none is lost or reordered.
+Then a 30 KB log is sent with BLEServer::Stream() and reassembled by the phone.
+Then the commands are handled on the handler task (BLEServer::StartHandlerTask()),
+answered from there while the main thread keeps delivering events.
+
+Finally scenarios check features the example doesn't use, each one on a server of its
+own against a fresh stack (StartScenario()), e.g. long writes answered by the server.
+*/
+// -------------------------------------------------------------------------------------------------------------------
+# include "fake_bt_stack.h"
+# include "file_bond_store.h"
+# include "ble_server.h"
+# include "ble_characteristic.h"
+# include <esp_log.h>
+# include <atomic>
+# include <algorithm>
+# include <chrono>
+# include <thread>
+# include <cstdio>
+# include <cstdlib>
+# include <cstring>
+# include <string>
+# include <vector>
+// -------------------------------------------------------------------------------------------------------------------
+extern "C" void app_main(void);
+extern BLEServer *pServer;
+// -------------------------------------------------------------------------------------------------------------------
+class CountingClient : public FakeBTStack::Client
+{
+public:
+    uint64_t notifications = 0;
+    uint64_t unexpected = 0;
+    const char* expected = "Hello";
+
+    void OnNotification(uint16_t conn_id, uint16_t handle, const uint8_t* value, uint16_t len, bool is_indication) override
+    {
+        ++notifications;
+        if (len != strlen(expected) || 0 != memcmp(value, expected, len))
+            ++unexpected;
+    }
+};
+// -------------------------------------------------------------------------------------------------------------------
+class StreamClient : public FakeBTStack::Client
+{
+public:
+    uint32_t frames = 0;
+    uint32_t out_of_order = 0;
+
+    void OnNotification(uint16_t conn_id, uint16_t handle, const uint8_t* value, uint16_t len, bool is_indication) override
+    {
+        uint32_t seq = 0;
+        if (len >= sizeof(seq))
+            memcpy(&seq, value, sizeof(seq));
+        if (seq != frames)
+            ++out_of_order;
+        ++frames;
+    }
+};
+// -------------------------------------------------------------------------------------------------------------------
+/// Streams \a frames numbered frames to \a conn_id in bursts of 12 every 4th connection
+/// event, 3 frames per event on average against a link capacity of 4.
+static bool RunStream(FakeBTStack& stack, uint16_t conn_id, uint16_t handle, uint32_t frames)
+{
+    StreamClient client;
+    stack.SetClient(&client);
+    stack.SetTxBuffers(8, 4);
+    pServer->ResetNotifyStats(conn_id);
+
+    const uint32_t interval_us = stack.GetLastConnParams().min_int * 1250;
+    uint8_t frame[20] = {0};
+    uint32_t seq = 0;
+    uint32_t not_queued = 0;
+    for (uint32_t event = 0; client.frames < frames && event < frames * 4; ++event)
+    {
+        for (int i = 0; i < 12 && event % 4 == 0 && seq < frames; ++i)
+        {
+            memcpy(frame, &seq, sizeof(seq));
+            if (pServer->Notify(conn_id, handle, frame, sizeof(frame)) == ESP_OK)
+                ++seq;
+            else
+                ++not_queued;
+        }
+        stack.Pump();
+        stack.AdvanceTime(interval_us);
+        stack.Pump();
+    }
+
+    BLENotifyStats notify = pServer->GetNotifyStats(conn_id);
+    const FakeBTStack::Stats& stats = stack.GetStats();
+    printf("stream frames:   %u received of %u (%u out of order)\n", client.frames, frames, client.out_of_order);
+    printf("stream queue:    max depth %u, %u dropped, %u retransmitted, %u congestions, %u not queued\n",
+           notify.max_depth, notify.dropped, notify.retransmitted, notify.congestions, not_queued);
+    printf("stream stack:    %llu rejected\n", (unsigned long long)stats.rejected);
+    printf("stream rate:     %.0f notifications/s (simulated time)\n", notify.rate);
+
+    stack.SetTxBuffers(0, 4);
+    stack.SetClient(nullptr);
+    return client.frames == frames && client.out_of_order == 0;
+}
+// -------------------------------------------------------------------------------------------------------------------
+class ReassemblyClient : public FakeBTStack::Client
+{
+public:
+    std::vector<uint8_t> data;
+    uint32_t fragments = 0;
+    uint32_t errors = 0;
+    bool complete = false;
+
+    void OnNotification(uint16_t conn_id, uint16_t handle, const uint8_t* value, uint16_t len, bool is_indication) override
+    {
+        if (len < stream_header_size || value[1] != (uint8_t)fragments || ((value[0] & stream_frame_start) != 0) != (fragments == 0))
+            ++errors;
+        data.insert(data.end(), value + stream_header_size, value + len);
+        complete = value[0] & stream_frame_end;
+        ++fragments;
+    }
+};
+
+static bool stream_done = false;
+static void OnStreamDone(uint16_t conn_id, esp_err_t result)
+{
+    stream_done = result == ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+/// Streams a log of \a size bytes made of a header, the records and a checksum with the framing header.
+static bool RunLogStream(FakeBTStack& stack, uint16_t conn_id, uint16_t handle, size_t size)
+{
+    ReassemblyClient client;
+    stack.SetClient(&client);
+    stack.SetTxBuffers(8, 6);
+    pServer->ResetNotifyStats(conn_id);
+
+    uint8_t header[7] = {'L', 'O', 'G', 0, 0, 0, 0};
+    std::vector<uint8_t> records(size - sizeof(header) - 1);
+    for (size_t i = 0; i < records.size(); ++i)
+        records[i] = (uint8_t)(i * 31 + 7);
+    uint8_t checksum = 0x5A;
+    const BLEStreamBuffer parts[3] = {
+        {header, sizeof(header)}, {records.data(), records.size()}, {&checksum, 1}
+    };
+
+    stream_done = false;
+    int64_t start = stack.GetTime();
+    if (pServer->Stream(conn_id, handle, parts, 3, stream_flag_header, OnStreamDone) != ESP_OK)
+        return false;
+    const uint32_t interval_us = stack.GetLastConnParams().min_int * 1250;
+    while (!client.complete && stack.GetTime() - start < 60000000)
+    {
+        stack.Pump();
+        stack.AdvanceTime(interval_us);
+    }
+    stack.Pump();
+    double seconds = (stack.GetTime() - start) / 1e6;
+
+    std::vector<uint8_t> expected;
+    expected.reserve(size);
+    expected.insert(expected.end(), header, header + sizeof(header));
+    expected.insert(expected.end(), records.begin(), records.end());
+    expected.push_back(checksum);
+    bool ok = stream_done && client.complete && client.errors == 0 && client.data == expected;
+
+    BLENotifyStats notify = pServer->GetNotifyStats(conn_id);
+    printf("log stream:      %zu bytes in %u fragments, %.2f s simulated (%.0f bytes/s), %s\n",
+           client.data.size(), client.fragments, seconds, seconds > 0 ? client.data.size() / seconds : 0.0,
+           ok ? "reassembled" : "CORRUPT");
+    printf("log stream:      %u retransmitted, %u congestions\n", notify.retransmitted, notify.congestions);
+
+    stack.SetTxBuffers(0, 4);
+    stack.SetClient(nullptr);
+    return ok;
+}
+// -------------------------------------------------------------------------------------------------------------------
+class AsyncCountingClient : public FakeBTStack::Client
+{
+public:
+    std::atomic<uint32_t> notifications{0};
+
+    void OnNotification(uint16_t conn_id, uint16_t handle, const uint8_t* value, uint16_t len, bool is_indication) override
+    {
+        ++notifications;
+    }
+};
+// -------------------------------------------------------------------------------------------------------------------
+/// Sends \a commands commands with the command dispatcher running on the handler task.
+/// The phone waits while 16 commands are pending, so none is dropped.
+static bool RunHandlerTask(FakeBTStack& stack, uint16_t conn_id, uint16_t tx_handle, uint32_t commands)
+{
+    AsyncCountingClient client;
+    stack.SetClient(&client);
+    if (pServer->StartHandlerTask(BLE_HANDLER_TASK_PRIORITY, BLE_HANDLER_TASK_CORE) != ESP_OK)
+        return false;
+
+    const uint8_t command[3] = {0xAA, 0x02, 0x55};
+    double pump_max = 0;
+    for (uint32_t i = 0; i < commands; ++i)
+    {
+        while (pServer->GetHandlerStats().pending >= 16)
+            std::this_thread::yield();
+        stack.Write(conn_id, tx_handle, command, sizeof(command), false);
+        auto start = std::chrono::steady_clock::now();
+        stack.Pump();
+        pump_max = std::max(pump_max, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    // the task handles the commands still pending before it stops
+    pServer->StopHandlerTask();
+    // confirmations of the last notifications
+    stack.Pump();
+
+    BLEHandlerStats stats = pServer->GetHandlerStats();
+    printf("handler task:    %u commands, %u notifications, %.1f us max. event delivery\n",
+           commands, client.notifications.load(), pump_max * 1e6);
+    printf("handler ring:    %u dispatched, %u dropped, %u of %u bytes used at most\n",
+           stats.dispatched, stats.dropped, stats.max_used, stats.capacity);
+
+    stack.SetClient(nullptr);
+    return client.notifications == commands && stats.dispatched == commands && !stats.dropped;
+}
+// -------------------------------------------------------------------------------------------------------------------
+/// Peer of the scenarios, keeps what the server sent and the last responses of every connection.
+class ScenarioClient : public FakeBTStack::Client
+{
+public:
+    struct Received
+    {
+        uint16_t conn_id;
+        uint16_t handle;
+        std::vector<uint8_t> value;
+        bool is_indication;
+    };
+    std::vector<Received> received;
+    esp_gatt_status_t write_status[BLE_MAX_CONNECTIONS] = {};
+    esp_gatt_status_t read_status = ESP_GATT_OK;
+    std::vector<uint8_t> read_value;
+
+    void OnNotification(uint16_t conn_id, uint16_t handle, const uint8_t* value, uint16_t len, bool is_indication) override
+    {
+        received.push_back({conn_id, handle, std::vector<uint8_t>(value, value + len), is_indication});
+    }
+
+    void OnWriteResponse(uint16_t conn_id, uint16_t handle, esp_gatt_status_t status) override
+    {
+        if (conn_id < BLE_MAX_CONNECTIONS)
+            write_status[conn_id] = status;
+    }
+
+    void OnReadResponse(uint16_t conn_id, uint16_t handle, esp_gatt_status_t status, const uint8_t* value, uint16_t len) override
+    {
+        read_status = status;
+        read_value.clear();
+        if (value)
+            read_value.insert(read_value.end(), value, value + len);
+    }
+
+    /// Number of notifications (or indications) received for \a handle.
+    size_t Count(uint16_t handle, bool is_indication = false) const
+    {
+        return std::count_if(received.begin(), received.end(), [&](const Received& r)
+            { return r.handle == handle && r.is_indication == is_indication; });
+    }
+};
+
+static void OnScenarioGATTEvent(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param)
+{
+    if (pServer)
+        pServer->HandleGATTEvent(event, gatts_if, param);
+}
+
+static void OnScenarioGAPEvent(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t* param)
+{
+    if (pServer)
+        pServer->HandleGAPEvent(event, param);
+}
+
+/// Address of the \a nth phone of the scenarios.
+static void GetPhone(uint8_t nth, esp_bd_addr_t bda)
+{
+    const esp_bd_addr_t phone = {0x11, 0x22, 0x33, 0x44, 0x55, 0x60};
+    memcpy(bda, phone, sizeof(esp_bd_addr_t));
+    bda[5] += nth;
+}
+
+/// Replaces the server by \a server with its attributes added, registered with a fresh stack
+/// (or with the device restarted, the bonds kept by the stack, if \a restart).
+/// \a on_event gets the GATT events instead of the server, it passes them on.
+static void StartScenario(
+    FakeBTStack& stack, BLEServer* server, ScenarioClient& client, bool restart = false,
+    esp_gatts_cb_t on_event = OnScenarioGATTEvent
+)
+{
+    delete pServer;
+    if (restart)
+        stack.Restart();
+    else
+        stack.Reset();
+    stack.SetClient(&client);
+    pServer = server;
+    esp_ble_gatts_register_callback(on_event);
+    esp_ble_gap_register_callback(OnScenarioGAPEvent);
+    esp_ble_gatts_app_register(0x55);
+    stack.Pump();
+}
+
+/// Connects the \a nth phone.
+static uint16_t ConnectPhone(FakeBTStack& stack, uint8_t nth = 0)
+{
+    esp_bd_addr_t bda;
+    GetPhone(nth, bda);
+    uint16_t conn_id = stack.Connect(bda);
+    stack.Pump();
+    return conn_id;
+}
+
+/// Prints the failed \a check of \a scenario.
+static bool Check(const char* scenario, const char* check, bool ok)
+{
+    if (!ok)
+        printf("%-16s FAILED: %s\n", scenario, check);
+    return ok;
+}
+// -------------------------------------------------------------------------------------------------------------------
+static const uint16_t scenario_service_uuid = 0xfff0;
+
+/// Configures the server of a scenario, \a index is the one of its characteristic in service \a service_id.
+typedef void (*scenario_setup_func)(BLEServer& server, uint8_t service_id, BLEService::size_type index);
+
+/// Server \a name with a 2 byte characteristic \a uuid with \a properties and a client
+/// configuration descriptor in the scenario service, configured further by \a setup.
+static BLEServer* CreateScenarioServer(const char* name, const uint16_t* uuid, const uint8_t* properties, scenario_setup_func setup)
+{
+    static uint8_t value[2];
+    static uint8_t config[2];
+    BLEServer* server = new BLEServer(name);
+    uint8_t service_id = server->AddService(scenario_service_uuid);
+    BLEService::size_type index = server->AddCharacteristic(
+        uuid, properties, ESP_GATT_PERM_READ, sizeof(value), sizeof(value), value,
+        nullptr, BLEEventHandler(), config
+    );
+    setup(*server, service_id, index);
+    return server;
+}
+
+static const uint16_t long_write_uuid = 0xfff1;
+
+/// Writes the server assembles from prepare writes: a 20 byte characteristic answered by the server.
+class LongWriteSensor
+{
+public:
+    uint8_t value[20] = {0};
+    uint32_t writes = 0;
+    uint16_t len = 0;
+
+    void OnEvent(const BLEEventContext& context)
+    {
+        if (context.event == ESP_GATTS_WRITE_EVT && !context.param->write.is_prep)
+        {
+            ++writes;
+            len = context.param->write.len;
+        }
+    }
+};
+
+/// Long writes answered by the server: a valid one, one exceeding the characteristic, a cancel
+/// after a failed part and more long writes at once than BLE_PREPARE_BUFFERS.
+static bool RunLongWrites(FakeBTStack& stack)
+{
+    ScenarioClient client;
+    LongWriteSensor sensor;
+    BLEServer* server = new BLEServer("LongWrite");
+    server->AddService(scenario_service_uuid);
+    server->AddCharacteristic(
+        &long_write_uuid, &char_prop_read_write, ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE,
+        sizeof(sensor.value), sizeof(sensor.value), sensor.value, nullptr,
+        BLEEventHandler::Bind<&LongWriteSensor::OnEvent>(&sensor), nullptr, ESP_GATT_RSP_BY_APP
+    );
+    StartScenario(stack, server, client);
+    uint16_t conn_id = ConnectPhone(stack);
+    uint16_t handle = stack.FindHandle(long_write_uuid);
+
+    bool ok = true;
+    uint8_t part[18];
+    memset(part, 0x5A, sizeof(part));
+    stack.PrepareWrite(conn_id, handle, 0, part, sizeof(part));
+    stack.PrepareWrite(conn_id, handle, sizeof(part), part, 2);
+    stack.ExecuteWrite(conn_id);
+    stack.Pump();
+    ok = Check("long write", "20 bytes in one write event", sensor.writes == 1 && sensor.len == 20) && ok;
+    ok = Check("long write", "20 bytes executed", client.write_status[conn_id] == ESP_GATT_OK) && ok;
+
+    stack.PrepareWrite(conn_id, handle, 0, part, sizeof(part));
+    stack.PrepareWrite(conn_id, handle, sizeof(part), part, sizeof(part));
+    stack.ExecuteWrite(conn_id);
+    stack.Pump();
+    ok = Check("long write", "36 bytes refused", client.write_status[conn_id] == ESP_GATT_INVALID_ATTR_LEN) && ok;
+    ok = Check("long write", "36 bytes not delivered", sensor.writes == 1) && ok;
+
+    stack.PrepareWrite(conn_id, handle, 30, part, 2);
+    stack.ExecuteWrite(conn_id, false);
+    stack.Pump();
+    ok = Check("long write", "cancel answered OK", client.write_status[conn_id] == ESP_GATT_OK) && ok;
+    ok = Check("long write", "cancel not delivered", sensor.writes == 1) && ok;
+
+    // every phone starts a long write, one more than there are buffers
+    uint16_t phones[BLE_PREPARE_BUFFERS + 1] = {conn_id};
+    for (uint8_t i = 1; i <= BLE_PREPARE_BUFFERS; ++i)
+        phones[i] = ConnectPhone(stack, i);
+    for (uint16_t phone : phones)
+    {
+        stack.PrepareWrite(phone, handle, 0, part, 4);
+        stack.Pump();
+    }
+    ok = Check("long write", "pool exhausted", client.write_status[phones[BLE_PREPARE_BUFFERS]] == ESP_GATT_PREPARE_Q_FULL) && ok;
+    stack.ExecuteWrite(phones[0], false);
+    stack.ExecuteWrite(phones[BLE_PREPARE_BUFFERS], false);
+    stack.PrepareWrite(phones[BLE_PREPARE_BUFFERS], handle, 0, part, 4);
+    stack.ExecuteWrite(phones[BLE_PREPARE_BUFFERS]);
+    stack.Pump();
+    ok = Check("long write", "buffer reused", client.write_status[phones[BLE_PREPARE_BUFFERS]] == ESP_GATT_OK && sensor.writes == 2) && ok;
+
+    printf("long writes:     %s\n", ok ? "ok" : "FAILED");
+    return ok;
+}
+// -------------------------------------------------------------------------------------------------------------------
+static const uint16_t computed_uuid = 0xfff2;
+static uint8_t computed_value[40];
+static uint32_t computed_calls = 0;
+
+/// 40 bytes (read in parts with the default MTU) telling the client and the computation.
+static esp_gatt_status_t OnReadComputed(uint16_t conn_id, uint16_t handle, uint8_t* value, uint16_t& len)
+{
+    ++computed_calls;
+    memset(value, (uint8_t)(conn_id << 4 | (computed_calls & 0x0F)), sizeof(computed_value));
+    len = sizeof(computed_value);
+    return ESP_GATT_OK;
+}
+
+/// Read events reaching the handler of the computed value, the server answers them itself.
+static uint32_t computed_read_events = 0;
+
+static void OnComputedEvent(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param)
+{
+    if (event == ESP_GATTS_READ_EVT)
+        ++computed_read_events;
+}
+
+/// Reads \a handle of \a conn_id at \a offset, \returns the status of the response.
+static esp_gatt_status_t ReadPart(FakeBTStack& stack, ScenarioClient& client, uint16_t conn_id, uint16_t handle, uint16_t offset)
+{
+    client.read_status = ESP_GATT_ERROR;
+    stack.Read(conn_id, handle, offset);
+    stack.Pump();
+    return client.read_status;
+}
+
+/// Computed values read by two clients: the cache serves the client it was computed for,
+/// a long read isn't continued with a value computed for another client or too long ago.
+static bool RunComputedValues(FakeBTStack& stack)
+{
+    ScenarioClient client;
+    BLEServer* server = new BLEServer("Computed");
+    server->AddService(scenario_service_uuid);
+    server->AddCharacteristic(
+        &computed_uuid, &char_prop_read, ESP_GATT_PERM_READ, sizeof(computed_value), computed_value, OnReadComputed, 500,
+        nullptr, OnComputedEvent
+    );
+    StartScenario(stack, server, client);
+    uint16_t phone_a = ConnectPhone(stack, 0);
+    uint16_t phone_b = ConnectPhone(stack, 1);
+    uint16_t handle = stack.FindHandle(computed_uuid);
+    computed_calls = 0;
+    computed_read_events = 0;
+
+    bool ok = true;
+    ReadPart(stack, client, phone_a, handle, 0);
+    uint8_t first = client.read_value.empty() ? 0 : client.read_value[0];
+    ok = Check("computed value", "long read", ReadPart(stack, client, phone_a, handle, 22) == ESP_GATT_OK
+        && client.read_value.size() == 18 && client.read_value[0] == first) && ok;
+    ReadPart(stack, client, phone_a, handle, 0);
+    ok = Check("computed value", "cached for the same client", computed_calls == 1) && ok;
+
+    ReadPart(stack, client, phone_b, handle, 0);
+    ok = Check("computed value", "computed for another client", computed_calls == 2
+        && !client.read_value.empty() && client.read_value[0] >> 4 == phone_b) && ok;
+    ok = Check("computed value", "torn long read refused", ReadPart(stack, client, phone_a, handle, 22) == gatt_status_value_changed) && ok;
+
+    ReadPart(stack, client, phone_a, handle, 0);
+    stack.AdvanceTime((BLE_READ_PROVIDER_HOLD_MS + 100) * 1000);
+    ok = Check("computed value", "stale long read refused", ReadPart(stack, client, phone_a, handle, 22) == gatt_status_value_changed) && ok;
+    ok = Check("computed value", "reads not passed to the handler", computed_read_events == 0) && ok;
+
+    printf("computed values: %s\n", ok ? "ok" : "FAILED");
+    return ok;
+}
+// -------------------------------------------------------------------------------------------------------------------
+static const uint16_t limited_uuid = 0xfff3;
+static const uint16_t bulk_uuid = 0xfff4;
+
+/// Subscribes \a conn_id to notifications (or indications) of the characteristic value \a handle.
+static void Subscribe(FakeBTStack& stack, uint16_t conn_id, uint16_t handle, bool indicate = false)
+{
+    const uint8_t config[2] = {(uint8_t)(indicate ? 0x02 : 0x01), 0x00};
+    stack.Write(conn_id, stack.FindDescriptor(handle, ESP_GATT_UUID_CHAR_CLIENT_CONFIG), config, sizeof(config));
+    stack.Pump();
+}
+
+/// Runs the connection events (and timers) of \a ms milliseconds in steps of \a step_us.
+static void RunEvents(FakeBTStack& stack, uint32_t ms, uint32_t step_us = 7500)
+{
+    for (int64_t end = stack.GetTime() + ms * 1000; stack.GetTime() < end; )
+    {
+        stack.AdvanceTime(step_us);
+        stack.Pump();
+    }
+}
+
+/// A limited value flushed while the notification queue of the phone is full reaches the
+/// phone once the queue has room, the latest sample and only once.
+static bool RunLimitedValues(FakeBTStack& stack)
+{
+    static uint8_t limited[2];
+    static uint8_t limited_config[2];
+    static uint8_t bulk[20];
+    static uint8_t bulk_config[2];
+    ScenarioClient client;
+    BLEServer* server = new BLEServer("Limited");
+    uint8_t service_id = server->AddService(scenario_service_uuid);
+    BLEService::size_type limited_index = server->AddCharacteristic(
+        &limited_uuid, &char_prop_read_notify, ESP_GATT_PERM_READ, sizeof(limited), sizeof(limited), limited,
+        nullptr, BLEEventHandler(), limited_config
+    );
+    server->AddCharacteristic(
+        &bulk_uuid, &char_prop_read_notify, ESP_GATT_PERM_READ, sizeof(bulk), sizeof(bulk), bulk,
+        nullptr, BLEEventHandler(), bulk_config
+    );
+    server->SetNotifyLimit(service_id, limited_index, {100, deadband_u16, 5});
+    StartScenario(stack, server, client);
+    uint16_t conn_id = ConnectPhone(stack);
+    uint16_t limited_handle = stack.FindHandle(limited_uuid);
+    uint16_t bulk_handle = stack.FindHandle(bulk_uuid);
+    Subscribe(stack, conn_id, limited_handle);
+    Subscribe(stack, conn_id, bulk_handle);
+
+    // the first batch goes to the TX buffers, the rest fills the queue
+    stack.SetTxBuffers(2, 1);
+    uint32_t queued = 0;
+    while (pServer->Notify(conn_id, bulk_handle, bulk, sizeof(bulk)) == ESP_OK)
+        ++queued;
+    while (pServer->Notify(conn_id, bulk_handle, bulk, sizeof(limited)) == ESP_OK)
+        ++queued;
+    pServer->UpdateValue(limited_handle, (uint16_t)1000);
+    stack.AdvanceTime(1000);
+    stack.Pump();
+    pServer->UpdateValue(limited_handle, (uint16_t)1002);   // within the deadband
+    RunEvents(stack, 2000);
+
+    bool ok = Check("limited value", "bulk delivered", client.Count(bulk_handle) == queued);
+    ok = Check("limited value", "latest value delivered once", client.Count(limited_handle) == 1) && ok;
+    for (const ScenarioClient::Received& r : client.received)
+    {
+        if (r.handle == limited_handle)
+            ok = Check("limited value", "value", r.value.size() == 2 && r.value[0] == (1000 & 0xFF) && r.value[1] == (1000 >> 8)) && ok;
+    }
+
+    stack.SetTxBuffers(0, 4);
+    printf("limited values:  %s\n", ok ? "ok" : "FAILED");
+    return ok;
+}
+// -------------------------------------------------------------------------------------------------------------------
+static const uint16_t cached_uuid = 0xfff5;
+
+/// Server with a single read/write characteristic with a description, \a cached enables GATT caching.
+static BLEServer* CreateCachingServer(uint8_t* value, bool cached)
+{
+    BLEServer* server = new BLEServer("Caching");
+    if (cached)
+        server->EnableGATTCaching();
+    server->AddService(scenario_service_uuid);
+    server->AddCharacteristic(&cached_uuid, &char_prop_read_write, ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE, 2, 2, value, "Cached");
+    return server;
+}
+
+/// GATT caching: the hash of the attribute tables of the server, Service Changed sent through the
+/// stack and the change-aware transitions of a client with robust caching enabled.
+static bool RunGATTCaching(FakeBTStack& stack)
+{
+    static uint8_t value[2] = {1, 2};
+    ScenarioClient client;
+    uint8_t hash[database_hash_size];
+    uint8_t mac[BLECMAC::block_size];
+
+    // RFC 4493 examples 1 and 2
+    const uint8_t rfc_key[16] = {0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c};
+    const uint8_t rfc_message[16] = {0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a};
+    const uint8_t rfc_mac_empty[16] = {0xbb, 0x1d, 0x69, 0x29, 0xe9, 0x59, 0x37, 0x28, 0x7f, 0xa3, 0x7d, 0x12, 0x9b, 0x75, 0x67, 0x46};
+    const uint8_t rfc_mac_block[16] = {0x07, 0x0a, 0x16, 0xb4, 0x6b, 0x4d, 0x41, 0x44, 0xf7, 0x9b, 0xdd, 0x9d, 0xd0, 0x4a, 0x28, 0x7c};
+    BLECMAC empty(rfc_key);
+    empty.Finish(mac);
+    bool ok = Check("gatt caching", "AES-CMAC of an empty message", memcmp(mac, rfc_mac_empty, sizeof(mac)) == 0);
+    BLECMAC block(rfc_key);
+    block.Update(rfc_message, sizeof(rfc_message));
+    block.Finish(mac);
+    ok = Check("gatt caching", "AES-CMAC of a block", memcmp(mac, rfc_mac_block, sizeof(mac)) == 0) && ok;
+
+    StartScenario(stack, CreateCachingServer(value, false), client);
+    ok = Check("gatt caching", "no hash without caching", !pServer->GetDatabaseHash(hash)) && ok;
+
+    // service declaration (40), characteristic declaration (41) with the value handle and UUID, the
+    // description (43) without its value: handle, type and value in little endian
+    StartScenario(stack, CreateCachingServer(value, true), client);
+    const uint8_t tables[] = {
+        0x28, 0x00, 0x00, 0x28, 0xf0, 0xff,
+        0x29, 0x00, 0x03, 0x28, char_prop_read_write, 0x2a, 0x00, 0xf5, 0xff,
+        0x2b, 0x00, 0x01, 0x29
+    };
+    const uint8_t zero_key[16] = {0};
+    BLECMAC expected(zero_key);
+    expected.Update(tables, sizeof(tables));
+    expected.Finish(mac);
+    std::reverse(mac, mac + sizeof(mac));
+    ok = Check("gatt caching", "hash of the tables", pServer->GetDatabaseHash(hash) && memcmp(hash, mac, sizeof(mac)) == 0) && ok;
+
+    // the client reads the hash of the stack and enables robust caching, subscribed to Service Changed
+    uint16_t conn_id = ConnectPhone(stack);
+    uint16_t handle = stack.FindHandle(cached_uuid);
+    uint16_t changed_handle = stack.FindHandle(service_changed_uuid);
+    uint16_t features_handle = stack.FindHandle(client_features_uuid);
+    uint16_t hash_handle = stack.FindHandle(database_hash_uuid);
+    ok = Check("gatt caching", "hash of the stack", ReadPart(stack, client, conn_id, hash_handle, 0) == ESP_GATT_OK
+        && client.read_value.size() == database_hash_size) && ok;
+    std::vector<uint8_t> stack_hash = client.read_value;
+    const uint8_t robust = client_feature_robust_caching, none = 0;
+    stack.Write(conn_id, features_handle, &robust, 1);
+    ok = Check("gatt caching", "robust caching enabled", client.write_status[conn_id] == ESP_GATT_OK) && ok;
+    stack.Write(conn_id, features_handle, &none, 1);
+    ok = Check("gatt caching", "features not disabled", client.write_status[conn_id] == gatt_status_value_not_allowed) && ok;
+    Subscribe(stack, conn_id, changed_handle, true);
+    ok = Check("gatt caching", "change-aware", stack.IsChangeAware(conn_id)
+        && ReadPart(stack, client, conn_id, handle, 0) == ESP_GATT_OK) && ok;
+
+    // unaware until the next request after the refused one, commands are ignored
+    stack.SetAutoConfirm(false);
+    ok = Check("gatt caching", "service changed sent", pServer->SendServiceChanged(conn_id) == ESP_OK) && ok;
+    ok = Check("gatt caching", "service changed indicated", client.Count(changed_handle, true) == 1
+        && client.received.back().value == std::vector<uint8_t>({0x01, 0x00, 0xff, 0xff})) && ok;
+    const uint8_t other[2] = {3, 4};
+    stack.Write(conn_id, handle, other, sizeof(other), false);
+    stack.Pump();
+    ok = Check("gatt caching", "command ignored", (*stack.GetValue(handle))[0] == value[0]) && ok;
+    ok = Check("gatt caching", "request out of sync", !stack.IsChangeAware(conn_id)
+        && ReadPart(stack, client, conn_id, handle, 0) == gatt_status_out_of_sync) && ok;
+    ok = Check("gatt caching", "next request answered", ReadPart(stack, client, conn_id, handle, 0) == ESP_GATT_OK
+        && stack.IsChangeAware(conn_id)) && ok;
+    uint64_t events = stack.GetStats().gatts_events;
+    stack.ConfirmIndication(conn_id);
+    stack.Pump();
+    ok = Check("gatt caching", "confirmation kept by the stack", stack.GetStats().gatts_events == events) && ok;
+
+    // reading the hash, then the next request
+    pServer->SendServiceChanged(conn_id);
+    ReadPart(stack, client, conn_id, hash_handle, 0);
+    ok = Check("gatt caching", "aware after the hash", !stack.IsChangeAware(conn_id)
+        && ReadPart(stack, client, conn_id, handle, 0) == ESP_GATT_OK && stack.IsChangeAware(conn_id)) && ok;
+    stack.ConfirmIndication(conn_id);
+
+    // confirming the indication
+    pServer->SendServiceChanged(conn_id);
+    stack.ConfirmIndication(conn_id);
+    ok = Check("gatt caching", "aware after the confirmation", stack.IsChangeAware(conn_id)
+        && ReadPart(stack, client, conn_id, handle, 0) == ESP_GATT_OK) && ok;
+    stack.SetAutoConfirm(true);
+
+    // another characteristic, other hashes
+    uint8_t old_hash[database_hash_size];
+    memcpy(old_hash, hash, sizeof(hash));
+    BLEServer* server = CreateCachingServer(value, true);
+    server->AddCharacteristic(&limited_uuid, &char_prop_read, ESP_GATT_PERM_READ, 2, 2, value);
+    StartScenario(stack, server, client);
+    conn_id = ConnectPhone(stack);
+    ReadPart(stack, client, conn_id, hash_handle, 0);
+    ok = Check("gatt caching", "hashes changed", pServer->GetDatabaseHash(hash) && memcmp(hash, old_hash, sizeof(hash)) != 0
+        && client.read_value.size() == database_hash_size && client.read_value != stack_hash) && ok;
+
+    printf("gatt caching:    %s\n", ok ? "ok" : "FAILED");
+    return ok;
+}
+// -------------------------------------------------------------------------------------------------------------------
+static const uint16_t bonded_uuid = 0xfff6;
+
+static BLEBondStore* bond_store = nullptr;
+static bool bond_extra = false;
+
+static void SetupBondServer(BLEServer& server, uint8_t service_id, BLEService::size_type index)
+{
+    static uint8_t value[2];
+    server.SetNotifyLimit(service_id, index, {50, deadband_none, 0});
+    if (bond_extra)
+        server.AddCharacteristic(&cached_uuid, &char_prop_read, ESP_GATT_PERM_READ, sizeof(value), sizeof(value), value);
+    server.SetBondStore(bond_store);
+}
+
+/// Server with a limited value (sent to subscribed clients only), \a extra adds another characteristic.
+static BLEServer* CreateBondServer(BLEBondStore& store, bool extra)
+{
+    bond_store = &store;
+    bond_extra = extra;
+    return CreateScenarioServer("Bonded", &bonded_uuid, &char_prop_read_notify, SetupBondServer);
+}
+
+/// Sends \a sample of the limited value to the subscribed clients, \returns the notifications received.
+static size_t SendSample(FakeBTStack& stack, ScenarioClient& client, uint16_t handle, uint16_t sample)
+{
+    size_t before = client.Count(handle);
+    pServer->UpdateValue(handle, sample);
+    RunEvents(stack, 100);
+    return client.Count(handle) - before;
+}
+
+/// Subscriptions of a bonded phone: written behind after BLE_BOND_SAVE_DELAY_MS, batched, saved
+/// at once on disconnect, restored on reconnect and after a restart without a descriptor write,
+/// dropped with Service Changed when the attribute tables changed, erased with the bond.
+static bool RunBondedSubscriptions(FakeBTStack& stack)
+{
+    BLEFileBondStore store;
+    ScenarioClient client;
+    StartScenario(stack, CreateBondServer(store, false), client);
+    uint16_t conn_id = ConnectPhone(stack);
+    uint16_t handle = stack.FindHandle(bonded_uuid);
+    Subscribe(stack, conn_id, handle);
+    Subscribe(stack, conn_id, stack.FindHandle(service_changed_uuid), true);
+    stack.Pair(conn_id);
+    stack.Pump();
+
+    // write-behind: one save and commit after the delay, however often the subscription changes
+    bool ok = true;
+    const uint8_t off[2] = {0, 0};
+    stack.Write(conn_id, stack.FindDescriptor(handle, ESP_GATT_UUID_CHAR_CLIENT_CONFIG), off, sizeof(off));
+    stack.Pump();
+    Subscribe(stack, conn_id, handle);
+    RunEvents(stack, BLE_BOND_SAVE_DELAY_MS - 100);
+    ok = Check("bond", "nothing saved before the delay", store.GetSaves() == 0) && ok;
+    RunEvents(stack, 200);
+    ok = Check("bond", "saved once after the delay", store.GetSaves() == 1 && store.GetCommits() == 1 && store.GetCount() == 1) && ok;
+
+    // reconnect: notifications flow without the phone writing the descriptor
+    stack.Disconnect(conn_id);
+    stack.Pump();
+    conn_id = ConnectPhone(stack);
+    ok = Check("bond", "subscription restored", pServer->IsSubscribed(conn_id, handle)
+        && SendSample(stack, client, handle, 1) == 1) && ok;
+
+    // a change saved at once when the phone disconnects
+    stack.Write(conn_id, stack.FindDescriptor(handle, ESP_GATT_UUID_CHAR_CLIENT_CONFIG), off, sizeof(off));
+    stack.Pump();
+    stack.Disconnect(conn_id);
+    stack.Pump();
+    RunEvents(stack, 10);
+    ok = Check("bond", "saved on disconnect", store.GetCommits() == 2) && ok;
+    conn_id = ConnectPhone(stack);
+    ok = Check("bond", "unsubscribed restored", !pServer->IsSubscribed(conn_id, handle)
+        && SendSample(stack, client, handle, 2) == 0) && ok;
+    Subscribe(stack, conn_id, handle);
+    stack.Disconnect(conn_id);
+    stack.Pump();
+    RunEvents(stack, 10);
+
+    // restart with the same tables: restored from the store
+    StartScenario(stack, CreateBondServer(store, false), client, true);
+    conn_id = ConnectPhone(stack);
+    ok = Check("bond", "restored after restart", SendSample(stack, client, handle, 3) == 1) && ok;
+    stack.Disconnect(conn_id);
+    stack.Pump();
+
+    // restart with other tables: nothing restored, Service Changed indicated by the stack
+    size_t changed = client.Count(FakeBTStack::service_changed_handle, true);
+    StartScenario(stack, CreateBondServer(store, true), client, true);
+    conn_id = ConnectPhone(stack);
+    ok = Check("bond", "hash mismatch", !pServer->IsSubscribed(conn_id, handle)
+        && SendSample(stack, client, handle, 4) == 0) && ok;
+    ok = Check("bond", "service changed", client.Count(FakeBTStack::service_changed_handle, true) == changed + 1) && ok;
+
+    // removing the bond erases the record
+    esp_bd_addr_t bda;
+    GetPhone(0, bda);
+    esp_ble_remove_bond_device(bda);
+    stack.Pump();
+    ok = Check("bond", "record erased", store.GetCount() == 0) && ok;
+
+    printf("bonds:           %s\n", ok ? "ok" : "FAILED");
+    return ok;
+}
+// -------------------------------------------------------------------------------------------------------------------
+static const uint16_t typed_samples_uuid = 0xfff7;
+static const uint16_t typed_count_uuid = 0xfff8;
+static BLECharacteristic<typed_samples_uuid, BLEVarArray<uint16_t, 8>, char_prop_read_notify> typed_samples;
+static BLECharacteristic<typed_count_uuid, uint32_t, char_prop_read> typed_count;
+
+/// Server with typed characteristics, the samples set before the attribute table goes to the stack.
+static BLEServer* CreateTypedServer(void)
+{
+    BLEServer* server = new BLEServer("Typed");
+    server->AddService(scenario_service_uuid);
+    typed_samples.Add(*server, "Samples");
+    typed_count.Add(*server);
+    const uint16_t samples[3] = {0x0102, 0x0304, 0x0506};
+    typed_samples.Set(samples, 3);
+    return server;
+}
+
+/// Sets the count after the server handed the attribute table to the stack, before it's created.
+static void OnTypedGATTEvent(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param)
+{
+    OnScenarioGATTEvent(event, gatts_if, param);
+    if (event == ESP_GATTS_REG_EVT)
+        typed_count.Set(0x01020304);
+}
+
+/// Typed characteristics: values set before the handles are known reach the stack, the variable
+/// length one with the length set instead of the initial length 0.
+static bool RunTypedValues(FakeBTStack& stack)
+{
+    ScenarioClient client;
+    StartScenario(stack, CreateTypedServer(), client, false, OnTypedGATTEvent);
+    uint16_t samples_handle = stack.FindHandle(typed_samples_uuid);
+    const std::vector<uint8_t> samples = {0x02, 0x01, 0x04, 0x03, 0x06, 0x05};
+    const std::vector<uint8_t>* value = stack.GetValue(samples_handle);
+    bool ok = Check("typed values", "set before registering", value && *value == samples);
+    const std::vector<uint8_t> count = {0x04, 0x03, 0x02, 0x01};
+    value = stack.GetValue(stack.FindHandle(typed_count_uuid));
+    ok = Check("typed values", "set while creating the table", value && *value == count) && ok;
+
+    const uint16_t sample = 0x0708;
+    ok = Check("typed values", "handle", typed_samples.GetHandle() == samples_handle) && ok;
+    ok = Check("typed values", "set after registering", typed_samples.Set(&sample, 1) == ESP_OK) && ok;
+    value = stack.GetValue(samples_handle);
+    ok = Check("typed values", "value after registering", value && *value == std::vector<uint8_t>({0x08, 0x07})) && ok;
+
+    printf("typed values:    %s\n", ok ? "ok" : "FAILED");
+    return ok;
+}
+// -------------------------------------------------------------------------------------------------------------------
+static const uint16_t reliable_uuid = 0xfff9;
+static const uint8_t reliable_properties = ESP_GATT_CHAR_PROP_BIT_NOTIFY | ESP_GATT_CHAR_PROP_BIT_INDICATE;
+
+/// Results of the reliable messages in the order they were done, by ID.
+static std::vector<std::pair<uint32_t, esp_err_t>> reliable_results;
+
+static void OnReliableDone(uint16_t conn_id, uint16_t handle, uint32_t id, esp_err_t result)
+{
+    reliable_results.push_back({id, result});
+}
+
+static void SetupReliableServer(BLEServer& server, uint8_t service_id, BLEService::size_type index)
+{
+    server.SetReliableHandler(OnReliableDone);
+}
+
+/// Whether the reliable messages done so far are \a expected.
+static bool ReliableResults(std::vector<std::pair<uint32_t, esp_err_t>> expected)
+{
+    return reliable_results == expected;
+}
+
+/// Reliable indications with a phone confirming them by hand, notifications of the same
+/// characteristic in between: only the confirmation of the indication counts, a late one
+/// after a timeout neither counts for the next message nor blocks the notifications.
+static bool RunReliableIndications(FakeBTStack& stack)
+{
+    ScenarioClient client;
+    reliable_results.clear();
+    StartScenario(stack, CreateScenarioServer("Reliable", &reliable_uuid, &reliable_properties, SetupReliableServer), client);
+    uint16_t conn_id = ConnectPhone(stack);
+    uint16_t handle = stack.FindHandle(reliable_uuid);
+    Subscribe(stack, conn_id, handle, true);
+    stack.SetAutoConfirm(false);
+
+    const uint8_t message = 0xa1;
+    const uint8_t sample = 0x55;
+    pServer->SendReliable(conn_id, handle, &message, 1, 1);
+    pServer->Notify(conn_id, handle, &sample, 1);
+    pServer->SendReliable(conn_id, handle, &message, 1, 2);
+    stack.Pump();
+    bool ok = Check("reliable", "nothing done before the confirmation", ReliableResults({}));
+    ok = Check("reliable", "notification waits for the indication", client.Count(handle, true) == 1 && client.Count(handle) == 0) && ok;
+
+    stack.ConfirmIndication(conn_id);
+    stack.Pump();
+    ok = Check("reliable", "confirmed", ReliableResults({{1, ESP_OK}})) && ok;
+    ok = Check("reliable", "notification and next indication sent", client.Count(handle) == 1 && client.Count(handle, true) == 2) && ok;
+
+    // the second one times out, its late confirmation is not the one of the third
+    RunEvents(stack, BLE_RELIABLE_TIMEOUT_MS + 100);
+    ok = Check("reliable", "timed out", ReliableResults({{1, ESP_OK}, {2, ESP_ERR_TIMEOUT}})) && ok;
+    pServer->SendReliable(conn_id, handle, &message, 1, 3);
+    pServer->Notify(conn_id, handle, &sample, 1);
+    stack.Pump();
+    stack.ConfirmIndication(conn_id);
+    stack.Pump();
+    ok = Check("reliable", "late confirmation ignored", ReliableResults({{1, ESP_OK}, {2, ESP_ERR_TIMEOUT}})
+        && client.Count(handle, true) == 3) && ok;
+    stack.ConfirmIndication(conn_id);
+    stack.Pump();
+    ok = Check("reliable", "confirmed after the late one", ReliableResults({{1, ESP_OK}, {2, ESP_ERR_TIMEOUT}, {3, ESP_OK}})
+        && client.Count(handle) == 2) && ok;
+    BLENotifyStats stats = pServer->GetNotifyStats(conn_id);
+    ok = Check("reliable", "statistics", stats.reliable_delivered == 2 && stats.reliable_failed == 1 && stats.depth == 0) && ok;
+
+    // disconnected with one indication unconfirmed and one queued
+    pServer->SendReliable(conn_id, handle, &message, 1, 4);
+    pServer->SendReliable(conn_id, handle, &message, 1, 5);
+    stack.Pump();
+    stack.Disconnect(conn_id);
+    stack.Pump();
+    ok = Check("reliable", "failed on disconnect", reliable_results.size() == 5
+        && reliable_results[3] == std::make_pair(4u, ESP_ERR_INVALID_STATE)
+        && reliable_results[4] == std::make_pair(5u, ESP_ERR_INVALID_STATE)) && ok;
+
+    conn_id = ConnectPhone(stack);
+    Subscribe(stack, conn_id, handle, true);
+    pServer->SendReliable(conn_id, handle, &message, 1, 6);
+    stack.Pump();
+    stack.ConfirmIndication(conn_id);
+    stack.Pump();
+    ok = Check("reliable", "confirmed after reconnect", reliable_results.size() == 6 && reliable_results[5] == std::make_pair(6u, ESP_OK)) && ok;
+    stack.SetAutoConfirm(true);
+
+    printf("reliable:        %s\n", ok ? "ok" : "FAILED");
+    return ok;
+}
+// -------------------------------------------------------------------------------------------------------------------
+static const uint16_t adaptive_uuid = 0xfffa;
+
+static void SetupAdaptiveServer(BLEServer& server, uint8_t service_id, BLEService::size_type index)
+{
+    server.SetAdaptiveProfiles(&ble_adaptive_default);
+}
+
+/// Whether the connection parameters requested last are the ones of \a profile.
+static bool Requested(FakeBTStack& stack, const BLEConnProfile& profile)
+{
+    const esp_ble_conn_update_params_t& params = stack.GetLastConnParams();
+    return params.min_int == profile.min_int && params.max_int == profile.max_int && params.latency == profile.latency;
+}
+
+/// Adaptive profiles (ble_adaptive_default): active when connected, idle after idle_ms, a burst of
+/// notifications active again, but not before the idle profile was kept for hold_ms.
+static bool RunAdaptiveProfiles(FakeBTStack& stack)
+{
+    const BLEAdaptiveProfiles& profiles = ble_adaptive_default;
+    ScenarioClient client;
+    StartScenario(stack, CreateScenarioServer("Adaptive", &adaptive_uuid, &char_prop_read_notify, SetupAdaptiveServer), client);
+    uint16_t conn_id = ConnectPhone(stack);
+    uint16_t handle = stack.FindHandle(adaptive_uuid);
+    bool ok = Check("adaptive", "active when connected", Requested(stack, *profiles.active));
+
+    RunEvents(stack, profiles.idle_ms - 100);
+    ok = Check("adaptive", "active until idle_ms", Requested(stack, *profiles.active)) && ok;
+    RunEvents(stack, 200);
+    ok = Check("adaptive", "idle", Requested(stack, *profiles.idle)) && ok;
+
+    // a burst right after going idle: busy, but the idle profile is held
+    const uint8_t sample[2] = {1, 2};
+    for (uint16_t i = 0; i < profiles.busy_notifications; ++i)
+        pServer->Notify(conn_id, handle, sample, sizeof(sample));
+    stack.Pump();
+    ok = Check("adaptive", "burst notified", client.Count(handle) == profiles.busy_notifications) && ok;
+    ok = Check("adaptive", "idle held after the burst", Requested(stack, *profiles.idle)) && ok;
+    RunEvents(stack, profiles.hold_ms - 300);
+    ok = Check("adaptive", "idle held for hold_ms", Requested(stack, *profiles.idle)) && ok;
+    RunEvents(stack, 200);
+    ok = Check("adaptive", "active after hold_ms", Requested(stack, *profiles.active)) && ok;
+
+    // notifications below busy_notifications per second don't keep it active
+    for (int second = 0; second < 4; ++second)
+    {
+        pServer->Notify(conn_id, handle, sample, sizeof(sample));
+        stack.Pump();
+        RunEvents(stack, 1000);
+    }
+    ok = Check("adaptive", "idle with few notifications", Requested(stack, *profiles.idle)) && ok;
+    stack.Disconnect(conn_id);
+    stack.Pump();
+
+    printf("adaptive:        %s\n", ok ? "ok" : "FAILED");
+    return ok;
+}
+// -------------------------------------------------------------------------------------------------------------------
+static const uint16_t profiled_uuid = 0xfffb;
+static uint32_t conn_updates = 0;
+
+static void OnConnUpdate(const BLEConnection& connection)
+{
+    ++conn_updates;
+}
+
+static void SetupProfiledServer(BLEServer& server, uint8_t service_id, BLEService::size_type index)
+{
+    server.SetDefaultProfile(&ble_profile_low_power);
+    server.SetStreamProfile(&ble_profile_low_latency);
+    server.SetConnectionUpdateHandler(OnConnUpdate);
+}
+
+/// Profiles chosen by the application: the default one when connected, ble_profile_bulk with its
+/// data length and PHY, the stream profile while streaming and the one before restored afterwards.
+/// A data length request of a phone disconnecting before the answer isn't credited to another one.
+static bool RunConnectionProfiles(FakeBTStack& stack)
+{
+    ScenarioClient client;
+    conn_updates = 0;
+    StartScenario(stack, CreateScenarioServer("Profiled", &profiled_uuid, &char_prop_read_notify, SetupProfiledServer), client);
+    uint16_t conn_id = ConnectPhone(stack);
+    uint16_t handle = stack.FindHandle(profiled_uuid);
+    bool ok = Check("profiles", "default when connected", Requested(stack, ble_profile_low_power));
+    const BLEConnection* connection = pServer->GetConnection(conn_id);
+    ok = Check("profiles", "granted", connection && connection->interval >= ble_profile_low_power.min_int
+        && connection->interval <= ble_profile_low_power.max_int
+        && connection->latency == ble_profile_low_power.latency && conn_updates == 1) && ok;
+
+    pServer->SetConnectionProfile(conn_id, &ble_profile_bulk);
+    stack.Pump();
+    connection = pServer->GetConnection(conn_id);
+    ok = Check("profiles", "bulk requested", Requested(stack, ble_profile_bulk) && connection->profile == &ble_profile_bulk) && ok;
+    ok = Check("profiles", "bulk data length", connection->tx_octets == ble_profile_bulk.tx_octets) && ok;
+    ok = Check("profiles", "bulk PHY", connection->tx_phy == ESP_BLE_GAP_PHY_2M && connection->rx_phy == ESP_BLE_GAP_PHY_2M) && ok;
+
+    // the stream profile while streaming, the default one of the second phone afterwards
+    uint16_t streaming = ConnectPhone(stack, 1);
+    Subscribe(stack, streaming, handle);
+    const uint8_t data[200] = {0};
+    ok = Check("profiles", "stream started", pServer->Stream(streaming, handle, data, sizeof(data)) == ESP_OK) && ok;
+    ok = Check("profiles", "stream profile", Requested(stack, ble_profile_low_latency)
+        && pServer->GetConnection(streaming)->profile == &ble_profile_low_latency) && ok;
+    for (int event = 0; event < 100 && pServer->IsStreaming(streaming); ++event)
+        RunEvents(stack, 10);
+    ok = Check("profiles", "restored after the stream", !pServer->IsStreaming(streaming)
+        && Requested(stack, ble_profile_low_power) && pServer->GetConnection(streaming)->profile == &ble_profile_low_power) && ok;
+
+    // the third phone disconnects before its data length request is answered
+    uint16_t dropped = ConnectPhone(stack, 2);
+    pServer->SetConnectionProfile(dropped, &ble_profile_bulk);
+    stack.Disconnect(dropped);
+    stack.Pump();
+    pServer->SetConnectionProfile(streaming, &ble_profile_bulk);
+    stack.Pump();
+    ok = Check("profiles", "data length of the right phone", pServer->GetConnection(streaming)->tx_octets == ble_profile_bulk.tx_octets) && ok;
+    stack.Disconnect(streaming);
+    stack.Disconnect(conn_id);
+    stack.Pump();
+
+    printf("profiles:        %s\n", ok ? "ok" : "FAILED");
+    return ok;
+}
+// -------------------------------------------------------------------------------------------------------------------
+static const uint16_t broadcast_uuid = 0xfffc;
+static const uint16_t broadcast_company = 0x02e5;
+/// Bytes of legacy advertising data.
+static const size_t adv_data_max = 31;
+
+static BLEServer* CreateBroadcastServer(void)
+{
+    static uint8_t value[2];
+    BLEServer* server = new BLEServer("Broadcasting Sensor");
+    server->AddService(scenario_service_uuid);
+    server->AddCharacteristic(&broadcast_uuid, &char_prop_read, ESP_GATT_PERM_READ, sizeof(value), sizeof(value), value);
+    return server;
+}
+
+/// AD types of the advertising data \a adv in order, empty if the AD structures don't fill it exactly.
+static std::vector<uint8_t> GetADTypes(const std::vector<uint8_t>& adv)
+{
+    std::vector<uint8_t> types;
+    size_t i = 0;
+    while (i < adv.size() && adv[i] && i + 1 + adv[i] <= adv.size())
+    {
+        types.push_back(adv[i + 1]);
+        i += 1 + adv[i];
+    }
+    return i == adv.size() ? types : std::vector<uint8_t>();
+}
+
+/// Data of the AD structure \a type of \a adv (empty if missing).
+static std::vector<uint8_t> GetAD(const std::vector<uint8_t>& adv, uint8_t type)
+{
+    for (size_t i = 0; i + 1 < adv.size() && adv[i]; i += 1 + adv[i])
+    {
+        if (adv[i + 1] == type)
+            return std::vector<uint8_t>(adv.begin() + i + 2, adv.begin() + std::min(adv.size(), i + 1 + adv[i]));
+    }
+    return std::vector<uint8_t>();
+}
+
+/// Broadcast data in the advertising data: the AD structures in order with the device name
+/// shortened to the room left, data longer than broadcast_max_data rejected, updates reaching
+/// the stack once per interval, the full name back after the broadcast stopped.
+static bool RunBroadcast(FakeBTStack& stack)
+{
+    ScenarioClient client;
+    StartScenario(stack, CreateBroadcastServer(), client);
+    const uint8_t sample[4] = {0x10, 0x20, 0x30, 0x40};
+    pServer->SetBroadcastData(sample, sizeof(sample));
+    pServer->StartBroadcast(broadcast_company, broadcast_manufacturer_data, 1000);
+    stack.Pump();
+
+    const std::vector<uint8_t>& adv = stack.GetAdvData();
+    const std::vector<uint8_t> name = GetAD(adv, 0x08);
+    bool ok = Check("broadcast", "AD structures", GetADTypes(adv) == std::vector<uint8_t>({0x01, 0x0a, 0x03, broadcast_manufacturer_data, 0x08})
+        && adv.size() <= adv_data_max);
+    ok = Check("broadcast", "company and data", GetAD(adv, broadcast_manufacturer_data)
+        == std::vector<uint8_t>({0xe5, 0x02, 0x10, 0x20, 0x30, 0x40})) && ok;
+    ok = Check("broadcast", "name shortened", adv.size() == adv_data_max
+        && std::string(name.begin(), name.end()) == "Broadcastin") && ok;
+
+    uint8_t data[broadcast_max_data + 1] = {0};
+    ok = Check("broadcast", "too long", pServer->SetBroadcastData(data, sizeof(data)) == ESP_ERR_INVALID_SIZE) && ok;
+
+    // two updates within the interval, the stack gets the last one once
+    uint64_t updates = stack.GetStats().adv_data_updates;
+    pServer->SetBroadcastData(data, broadcast_max_data - 1);
+    data[0] = 0x5a;
+    ok = Check("broadcast", "longest", pServer->SetBroadcastData(data, broadcast_max_data) == ESP_OK) && ok;
+    stack.Pump();
+    ok = Check("broadcast", "not before the interval", stack.GetStats().adv_data_updates == updates) && ok;
+    RunEvents(stack, 1100);
+    std::vector<uint8_t> expected = {0xe5, 0x02};
+    expected.insert(expected.end(), data, data + broadcast_max_data);
+    ok = Check("broadcast", "update reaches the stack", stack.GetStats().adv_data_updates == updates + 1
+        && GetAD(stack.GetAdvData(), broadcast_manufacturer_data) == expected) && ok;
+    ok = Check("broadcast", "name left out", GetADTypes(stack.GetAdvData())
+        == std::vector<uint8_t>({0x01, 0x0a, 0x03, broadcast_manufacturer_data})) && ok;
+
+    pServer->StopBroadcast();
+    stack.Pump();
+    const std::vector<uint8_t> full_name = GetAD(stack.GetAdvData(), 0x09);
+    ok = Check("broadcast", "stopped", GetADTypes(stack.GetAdvData()) == std::vector<uint8_t>({0x01, 0x0a, 0x03, 0x09})
+        && std::string(full_name.begin(), full_name.end()) == "Broadcasting Sensor") && ok;
+
+    printf("broadcast:       %s\n", ok ? "ok" : "FAILED");
+    return ok;
+}
+// -------------------------------------------------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+    uint64_t iterations = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1000000;
+    if (argc > 2)
+        esp_log_level_set("*", (esp_log_level_t)atoi(argv[2]));
+
+    FakeBTStack& stack = FakeBTStack::Instance();
+    CountingClient client;
+    stack.SetClient(&client);
+
+    app_main();
+    stack.Pump();
+
+    if (!stack.IsAdvertising())
+    {
+        fprintf(stderr, "Server is not advertising after registration.\n");
+        return 1;
+    }
+
+    const esp_bd_addr_t phone = {0x11, 0x22, 0x33, 0x44, 0x55, 0x66};
+    uint16_t conn_id = stack.Connect(phone);
+    stack.Pump();
+    stack.ExchangeMTU(conn_id, 185);
+    stack.Pump();
+
+    uint16_t rx_handle = stack.FindHandle(0xffe4);
+    uint16_t tx_handle = stack.FindHandle(0xffe9);
+    uint16_t rx_cccd = stack.FindDescriptor(rx_handle, ESP_GATT_UUID_CHAR_CLIENT_CONFIG);
+    if (!rx_handle || !tx_handle || !rx_cccd)
+    {
+        fprintf(stderr, "Example characteristics not found in the attribute database.\n");
+        return 1;
+    }
+
+    const uint8_t subscribe[2] = {0x01, 0x00};
+    stack.Write(conn_id, rx_cccd, subscribe, sizeof(subscribe));
+    stack.Pump();
+
+    const uint8_t command[3] = {0xAA, 0x01, 0x55};
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        stack.Write(conn_id, tx_handle, command, sizeof(command), false);
+        stack.Pump();
+    }
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    const FakeBTStack::Stats& stats = stack.GetStats();
+    printf("commands:        %llu\n", (unsigned long long)iterations);
+    printf("notifications:   %llu (%llu unexpected)\n", (unsigned long long)client.notifications, (unsigned long long)client.unexpected);
+    printf("gatts events:    %llu\n", (unsigned long long)stats.gatts_events);
+    printf("elapsed:         %.3f s\n", elapsed);
+    printf("round trips/s:   %.0f\n", elapsed > 0 ? iterations / elapsed : 0.0);
+    printf("ns/round trip:   %.1f\n", iterations ? elapsed * 1e9 / iterations : 0.0);
+
+    BLEMemoryUsage memory = BLEServer::GetMemoryUsage();
+    printf("server memory:   %zu bytes used, %zu high water, %zu reserved\n", memory.used, memory.high_water, memory.reserved);
+
+    bool ok = client.notifications == iterations && client.unexpected == 0;
+    stack.ResetStats();
+    ok = RunStream(stack, conn_id, rx_handle, 2000) && ok;
+    ok = RunLogStream(stack, conn_id, rx_handle, 30 * 1024) && ok;
+    ok = RunHandlerTask(stack, conn_id, tx_handle, 10000) && ok;
+    ok = RunLongWrites(stack) && ok;
+    ok = RunComputedValues(stack) && ok;
+    ok = RunLimitedValues(stack) && ok;
+    ok = RunGATTCaching(stack) && ok;
+    ok = RunBondedSubscriptions(stack) && ok;
+    ok = RunTypedValues(stack) && ok;
+    ok = RunReliableIndications(stack) && ok;
+    ok = RunAdaptiveProfiles(stack) && ok;
+    ok = RunConnectionProfiles(stack) && ok;
+    ok = RunBroadcast(stack) && ok;
+
+    delete pServer;
+    pServer = nullptr;
+    return ok ? 0 : 1;
+}
+// -------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,1644 @@
+# include "fake_bt_stack.h"
+# include <esp_gatt_common_api.h>
+# include <esp_timer.h>
+# include <cstring>
+# include <algorithm>
+// -------------------------------------------------------------------------------------------------------------------
+static const uint16_t gatt_uuid_pri_service = ESP_GATT_UUID_PRI_SERVICE;
+static const uint16_t gatt_uuid_sec_service = ESP_GATT_UUID_SEC_SERVICE;
+static const uint16_t gatt_uuid_char_declare = ESP_GATT_UUID_CHAR_DECLARE;
+static const uint16_t adv_data_max_length = 31;
+static const uint16_t data_length_max = 251;
+
+/// Attribute types of the Generic Attribute service of the stack, in the order of their handles from 1,
+/// the last four only with robust caching.
+static const uint16_t gatt_service_types[] = {
+    ESP_GATT_UUID_PRI_SERVICE, ESP_GATT_UUID_CHAR_DECLARE, ESP_GATT_UUID_GATT_SRV_CHGD, ESP_GATT_UUID_CHAR_CLIENT_CONFIG,
+    ESP_GATT_UUID_CHAR_DECLARE, 0x2B29, ESP_GATT_UUID_CHAR_DECLARE, 0x2B2A
+};
+/// ATT errors of robust caching.
+static const esp_gatt_status_t gatt_status_out_of_sync = (esp_gatt_status_t)0x12;
+static const esp_gatt_status_t gatt_status_value_not_allowed = (esp_gatt_status_t)0x13;
+// -------------------------------------------------------------------------------------------------------------------
+/// Timer of the esp_timer API.
+struct esp_timer
+{
+    esp_timer_cb_t callback;
+    void* arg;
+    bool active;
+    /// Period (us), 0 for one-shot timers.
+    uint64_t period;
+    /// Simulated time it fires next.
+    int64_t due;
+};
+// -------------------------------------------------------------------------------------------------------------------
+static uint16_t GetUUID16(const esp_bt_uuid_t& uuid)
+{
+    return uuid.len == ESP_UUID_LEN_16 ? uuid.uuid.uuid16 : 0;
+}
+// -------------------------------------------------------------------------------------------------------------------
+FakeBTStack& FakeBTStack::Instance()
+{
+    static FakeBTStack instance;
+    return instance;
+}
+// -------------------------------------------------------------------------------------------------------------------
+FakeBTStack::FakeBTStack()
+{
+    Reset();
+}
+// -------------------------------------------------------------------------------------------------------------------
+void FakeBTStack::Reset(const Config& config)
+{
+    auto lock = Lock();
+    m_config = config;
+    m_client = nullptr;
+    m_gatts_callback = nullptr;
+    m_gap_callback = nullptr;
+    m_apps.clear();
+    m_services.clear();
+    m_attributes.clear();
+    m_connections.assign(m_config.max_connections, Connection());
+    m_bonds.clear();
+    m_queue.clear();
+    m_queue_head = 0;
+    m_next_trans_id = 1;
+    m_time = 0;
+    m_local_mtu = ESP_GATT_DEF_BLE_MTU_SIZE;
+    m_advertising = false;
+    m_auto_confirm = true;
+    m_replay = false;
+    memset(&m_adv_params, 0, sizeof(m_adv_params));
+    m_adv_data.clear();
+    m_scan_rsp_data.clear();
+    m_device_name.assign(1, '\0');
+    memset(&m_last_conn_params, 0, sizeof(m_last_conn_params));
+    m_stats = Stats();
+}
+// -------------------------------------------------------------------------------------------------------------------
+void FakeBTStack::Restart(void)
+{
+    auto lock = Lock();
+    for (uint16_t conn_id = 0; conn_id < m_connections.size(); ++conn_id)
+    {
+        if (m_connections[conn_id].connected && m_connections[conn_id].bonded)
+            SaveBond(conn_id);
+    }
+    std::vector<Bond> bonds;
+    bonds.swap(m_bonds);
+    Reset(m_config);
+    m_bonds.swap(bonds);
+}
+// -------------------------------------------------------------------------------------------------------------------
+size_t FakeBTStack::Pump(void)
+{
+    size_t delivered = 0;
+    auto lock = Lock();
+    while (m_queue_head < m_queue.size())
+    {
+        // copy the event, delivering it may queue further events and so grow the queue
+        PendingEvent ev = m_queue[m_queue_head++];
+        // like the BTC task the callbacks run unlocked, other tasks may call the API meanwhile
+        lock.unlock();
+        Deliver(ev);
+        lock.lock();
+        ++delivered;
+    }
+    m_queue.clear();
+    m_queue_head = 0;
+    return delivered;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void FakeBTStack::DeliverGATTSEvent(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param)
+{
+    ++m_stats.gatts_events;
+    if (m_gatts_callback)
+        m_gatts_callback(event, gatts_if, param);
+}
+// -------------------------------------------------------------------------------------------------------------------
+void FakeBTStack::DeliverGAPEvent(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t* param)
+{
+    ++m_stats.gap_events;
+    if (m_gap_callback)
+        m_gap_callback(event, param);
+}
+// -------------------------------------------------------------------------------------------------------------------
+void FakeBTStack::SetTxBuffers(uint8_t tx_buffers, uint8_t packets_per_event)
+{
+    auto lock = Lock();
+    m_config.tx_buffers = tx_buffers;
+    m_config.packets_per_event = std::max((uint8_t)1, packets_per_event);
+}
+// -------------------------------------------------------------------------------------------------------------------
+void FakeBTStack::AdvanceTime(uint32_t us)
+{
+    auto lock = Lock();
+    int64_t end = m_time + us;
+    for (;;)
+    {
+        // the next connection event or timer in the order of their time, connection events
+        // first, so clients and timers see the time they happen at
+        int64_t due = end + 1;
+        uint16_t next_conn = invalid_conn_id;
+        for (uint16_t conn_id = 0; conn_id < m_connections.size(); ++conn_id)
+        {
+            const Connection& conn = m_connections[conn_id];
+            if (conn.connected && conn.next_event < due)
+            {
+                due = conn.next_event;
+                next_conn = conn_id;
+            }
+        }
+        esp_timer_handle_t next = nullptr;
+        for (esp_timer_handle_t timer : m_timers)
+        {
+            if (timer->active && timer->due < due)
+            {
+                due = timer->due;
+                next = timer;
+            }
+        }
+        if (due > end)
+            break;
+        m_time = std::max(m_time, due);
+
+        if (!next)
+        {
+            Connection& conn = m_connections[next_conn];
+            TransmitPackets(next_conn);
+            conn.next_event += std::max((uint16_t)1, conn.interval) * 1250;
+            continue;
+        }
+        if (next->period)
+            next->due += next->period;
+        else
+            next->active = false;
+        // the callback may stop or delete its timer
+        esp_timer_cb_t callback = next->callback;
+        void* arg = next->arg;
+        lock.unlock();
+        callback(arg);
+        lock.lock();
+    }
+    m_time = end;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void FakeBTStack::TransmitPackets(uint16_t conn_id)
+{
+    Connection& conn = m_connections[conn_id];
+    size_t count = std::min(conn.tx_queue.size(), (size_t)m_config.packets_per_event);
+    for (size_t i = 0; i < count; ++i)
+    {
+        const Packet& packet = conn.tx_queue[i];
+        ++m_stats.notifications;
+        if (m_client)
+            m_client->OnNotification(conn_id, packet.handle, packet.value.data(), (uint16_t)packet.value.size(), false);
+    }
+    conn.tx_queue.erase(conn.tx_queue.begin(), conn.tx_queue.begin() + count);
+
+    // like L2CAP the congestion ends when half of the buffers are free again
+    if (conn.congested && conn.tx_queue.size() <= m_config.tx_buffers / 2)
+    {
+        conn.congested = false;
+        esp_ble_gatts_cb_param_t param;
+        memset(&param, 0, sizeof(param));
+        param.congest.conn_id = conn_id;
+        param.congest.congested = false;
+        QueueForAllApps(ESP_GATTS_CONGEST_EVT, param);
+    }
+}
+// -------------------------------------------------------------------------------------------------------------------
+void FakeBTStack::Deliver(PendingEvent& ev)
+{
+    if (ev.is_gap)
+    {
+        ++m_stats.gap_events;
+        if (m_gap_callback)
+            m_gap_callback(ev.gap_event, &ev.gap_param);
+        return;
+    }
+
+    ++m_stats.gatts_events;
+    switch (ev.gatts_event)
+    {
+        case ESP_GATTS_WRITE_EVT:
+            ev.gatts_param.write.value = ev.payload;
+            break;
+        case ESP_GATTS_CONF_EVT:
+            ev.gatts_param.conf.value = ev.payload_len ? ev.payload : nullptr;
+            break;
+        case ESP_GATTS_CREAT_ATTR_TAB_EVT:
+            ev.gatts_param.add_attr_tab.handles = ev.handles;
+            break;
+        default:
+            break;
+    }
+    if (m_gatts_callback)
+        m_gatts_callback(ev.gatts_event, ev.gatts_if, &ev.gatts_param);
+}
+// -------------------------------------------------------------------------------------------------------------------
+FakeBTStack::PendingEvent& FakeBTStack::QueueGATTSEvent(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if)
+{
+    m_queue.emplace_back();
+    PendingEvent& ev = m_queue.back();
+    ev.is_gap = false;
+    ev.gatts_event = event;
+    ev.gatts_if = gatts_if;
+    ev.handles = nullptr;
+    ev.payload_len = 0;
+    memset(&ev.gatts_param, 0, sizeof(ev.gatts_param));
+    return ev;
+}
+// -------------------------------------------------------------------------------------------------------------------
+FakeBTStack::PendingEvent& FakeBTStack::QueueGAPEvent(esp_gap_ble_cb_event_t event)
+{
+    m_queue.emplace_back();
+    PendingEvent& ev = m_queue.back();
+    ev.is_gap = true;
+    ev.gap_event = event;
+    ev.handles = nullptr;
+    ev.payload_len = 0;
+    ev.conn_id = 0xffff;
+    memset(&ev.gap_param, 0, sizeof(ev.gap_param));
+    return ev;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void FakeBTStack::QueueForAllApps(esp_gatts_cb_event_t event, const esp_ble_gatts_cb_param_t& param)
+{
+    for (esp_gatt_if_t gatts_if : m_apps)
+    {
+        QueueGATTSEvent(event, gatts_if).gatts_param = param;
+    }
+}
+// -------------------------------------------------------------------------------------------------------------------
+FakeBTStack::Attribute* FakeBTStack::GetAttribute(uint16_t handle)
+{
+    if (handle < m_config.first_handle || handle - m_config.first_handle >= (int)m_attributes.size())
+        return nullptr;
+    return &m_attributes[handle - m_config.first_handle];
+}
+// -------------------------------------------------------------------------------------------------------------------
+const FakeBTStack::Attribute* FakeBTStack::GetAttribute(uint16_t handle) const
+{
+    return const_cast<FakeBTStack*>(this)->GetAttribute(handle);
+}
+// -------------------------------------------------------------------------------------------------------------------
+FakeBTStack::Connection* FakeBTStack::GetConnection(uint16_t conn_id)
+{
+    if (conn_id >= m_connections.size() || !m_connections[conn_id].connected)
+        return nullptr;
+    return &m_connections[conn_id];
+}
+// -------------------------------------------------------------------------------------------------------------------
+const FakeBTStack::Connection* FakeBTStack::GetConnection(uint16_t conn_id) const
+{
+    return const_cast<FakeBTStack*>(this)->GetConnection(conn_id);
+}
+// -------------------------------------------------------------------------------------------------------------------
+FakeBTStack::Connection* FakeBTStack::GetConnection(const esp_bd_addr_t bda, uint16_t* conn_id)
+{
+    for (uint16_t i = 0; i < m_connections.size(); ++i)
+    {
+        if (m_connections[i].connected && 0 == memcmp(m_connections[i].bda, bda, sizeof(esp_bd_addr_t)))
+        {
+            if (conn_id)
+                *conn_id = i;
+            return &m_connections[i];
+        }
+    }
+    return nullptr;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_gatt_if_t FakeBTStack::GetServiceInterface(uint16_t handle) const
+{
+    const Attribute* attr = GetAttribute(handle);
+    return attr ? m_services[attr->service].gatts_if : ESP_GATT_IF_NONE;
+}
+// -------------------------------------------------------------------------------------------------------------------
+// peer side
+// -------------------------------------------------------------------------------------------------------------------
+uint16_t FakeBTStack::Connect(const esp_bd_addr_t bda)
+{
+    auto lock = Lock();
+    if (!m_advertising)
+        return invalid_conn_id;
+
+    uint16_t conn_id = 0;
+    while (conn_id < m_connections.size() && m_connections[conn_id].connected)
+        ++conn_id;
+    if (conn_id == m_connections.size())
+        return invalid_conn_id;
+
+    Connection& conn = m_connections[conn_id];
+    conn = Connection();
+    conn.connected = true;
+    memcpy(conn.bda, bda, sizeof(esp_bd_addr_t));
+    conn.interval = m_config.conn_interval;
+    conn.next_event = m_time + conn.interval * 1250;
+    // a bonded client keeps the state of the Generic Attribute service, others start change-aware
+    Bond* bond = FindBond(bda);
+    if (bond)
+    {
+        conn.bonded = true;
+        conn.gatt = bond->gatt;
+        bond->gatt.service_changed_pending = false;
+    }
+
+    // the controller stops advertising as soon as a connection is established
+    m_advertising = false;
+
+    esp_ble_gatts_cb_param_t param;
+    memset(&param, 0, sizeof(param));
+    param.connect.conn_id = conn_id;
+    param.connect.link_role = 1; // slave
+    memcpy(param.connect.remote_bda, bda, sizeof(esp_bd_addr_t));
+    param.connect.conn_params.interval = m_config.conn_interval;
+    param.connect.conn_params.latency = 0;
+    param.connect.conn_params.timeout = 400;
+    QueueForAllApps(ESP_GATTS_CONNECT_EVT, param);
+    if (conn.gatt.service_changed_pending)
+    {
+        conn.gatt.service_changed_pending = false;
+        IndicateServiceChanged(conn_id);
+    }
+    return conn_id;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void FakeBTStack::Disconnect(uint16_t conn_id, esp_gatt_conn_reason_t reason)
+{
+    auto lock = Lock();
+    Connection* conn = GetConnection(conn_id);
+    if (!conn)
+        return;
+
+    esp_ble_gatts_cb_param_t param;
+    memset(&param, 0, sizeof(param));
+    param.disconnect.conn_id = conn_id;
+    memcpy(param.disconnect.remote_bda, conn->bda, sizeof(esp_bd_addr_t));
+    param.disconnect.reason = reason;
+    if (conn->bonded)
+        SaveBond(conn_id);
+    *conn = Connection();
+
+    // the controller doesn't complete a data length request of a dropped link
+    auto dropped = [conn_id](const PendingEvent& ev)
+        { return ev.is_gap && ev.gap_event == ESP_GAP_BLE_SET_PKT_LENGTH_COMPLETE_EVT && ev.conn_id == conn_id; };
+    m_queue.erase(std::remove_if(m_queue.begin() + m_queue_head, m_queue.end(), dropped), m_queue.end());
+    QueueForAllApps(ESP_GATTS_DISCONNECT_EVT, param);
+}
+// -------------------------------------------------------------------------------------------------------------------
+void FakeBTStack::Pair(uint16_t conn_id, bool success)
+{
+    auto lock = Lock();
+    Connection* conn = GetConnection(conn_id);
+    if (!conn)
+        return;
+
+    PendingEvent& ev = QueueGAPEvent(ESP_GAP_BLE_AUTH_CMPL_EVT);
+    esp_ble_auth_cmpl_t& auth = ev.gap_param.ble_security.auth_cmpl;
+    memcpy(auth.bd_addr, conn->bda, sizeof(esp_bd_addr_t));
+    auth.success = success;
+    auth.fail_reason = success ? 0 : 0x05;   // SMP pairing not supported
+    auth.addr_type = BLE_ADDR_TYPE_PUBLIC;
+    auth.dev_type = ESP_BT_DEVICE_TYPE_BLE;
+    if (success)
+    {
+        conn->bonded = true;
+        SaveBond(conn_id);
+    }
+}
+// -------------------------------------------------------------------------------------------------------------------
+void FakeBTStack::ExchangeMTU(uint16_t conn_id, uint16_t client_mtu)
+{
+    auto lock = Lock();
+    Connection* conn = GetConnection(conn_id);
+    if (!conn)
+        return;
+
+    conn->mtu = std::max((uint16_t)ESP_GATT_DEF_BLE_MTU_SIZE, std::min(client_mtu, m_local_mtu));
+
+    esp_ble_gatts_cb_param_t param;
+    memset(&param, 0, sizeof(param));
+    param.mtu.conn_id = conn_id;
+    param.mtu.mtu = conn->mtu;
+    QueueForAllApps(ESP_GATTS_MTU_EVT, param);
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_gatt_status_t FakeBTStack::Write(uint16_t conn_id, uint16_t handle, const uint8_t* data, uint16_t len, bool need_rsp)
+{
+    auto lock = Lock();
+    Connection* conn = GetConnection(conn_id);
+    if (!conn)
+        return ESP_GATT_ERROR;
+
+    ++m_stats.writes;
+
+    if (!CheckChangeAware(conn_id, handle, need_rsp, false))
+        return gatt_status_out_of_sync;
+    if (handle < m_config.first_handle)
+        return WriteGATTService(conn_id, handle, data, len, need_rsp);
+
+    Attribute* attr = GetAttribute(handle);
+    esp_gatt_status_t status = ESP_GATT_OK;
+    if (!attr || !m_services[attr->service].started)
+        status = ESP_GATT_INVALID_HANDLE;
+    else if (!(attr->perm & (ESP_GATT_PERM_WRITE | ESP_GATT_PERM_WRITE_ENCRYPTED | ESP_GATT_PERM_WRITE_ENC_MITM)))
+        status = ESP_GATT_WRITE_NOT_PERMIT;
+    else if (len > conn->mtu - 3)
+        status = ESP_GATT_INVALID_PDU;
+    else if (attr->auto_rsp == ESP_GATT_AUTO_RSP && len > attr->max_length)
+        status = ESP_GATT_INVALID_ATTR_LEN;
+
+    if (status != ESP_GATT_OK)
+    {
+        // a write command is never answered, not even with an error
+        if (need_rsp && m_client)
+            m_client->OnWriteResponse(conn_id, handle, status);
+        return status;
+    }
+
+    PendingEvent& ev = QueueGATTSEvent(ESP_GATTS_WRITE_EVT, m_services[attr->service].gatts_if);
+    esp_ble_gatts_cb_param_t::gatts_write_evt_param& write = ev.gatts_param.write;
+    write.conn_id = conn_id;
+    write.trans_id = m_next_trans_id++;
+    memcpy(write.bda, conn->bda, sizeof(esp_bd_addr_t));
+    write.handle = handle;
+    write.offset = 0;
+    write.need_rsp = need_rsp;
+    write.is_prep = false;
+    write.len = len;
+    memcpy(ev.payload, data, len);
+    ev.payload_len = len;
+
+    if (attr->auto_rsp == ESP_GATT_AUTO_RSP)
+    {
+        attr->value.assign(data, data + len);
+        if (need_rsp && m_client)
+            m_client->OnWriteResponse(conn_id, handle, ESP_GATT_OK);
+    }
+    else if (need_rsp)
+    {
+        conn->app_transactions.push_back({write.trans_id, handle, false});
+    }
+    return ESP_GATT_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_gatt_status_t FakeBTStack::PrepareWrite(uint16_t conn_id, uint16_t handle, uint16_t offset, const uint8_t* data, uint16_t len)
+{
+    auto lock = Lock();
+    Connection* conn = GetConnection(conn_id);
+    if (!conn)
+        return ESP_GATT_ERROR;
+    if (!CheckChangeAware(conn_id, handle, true, false))
+        return gatt_status_out_of_sync;
+
+    Attribute* attr = GetAttribute(handle);
+    esp_gatt_status_t status = ESP_GATT_OK;
+    if (!attr || !m_services[attr->service].started)
+        status = ESP_GATT_INVALID_HANDLE;
+    else if (!(attr->perm & (ESP_GATT_PERM_WRITE | ESP_GATT_PERM_WRITE_ENCRYPTED | ESP_GATT_PERM_WRITE_ENC_MITM)))
+        status = ESP_GATT_WRITE_NOT_PERMIT;
+    else if (len > conn->mtu - 5) // opcode, handle and offset
+        status = ESP_GATT_INVALID_PDU;
+
+    if (status != ESP_GATT_OK)
+    {
+        if (m_client)
+            m_client->OnWriteResponse(conn_id, handle, status);
+        return status;
+    }
+
+    PendingEvent& ev = QueueGATTSEvent(ESP_GATTS_WRITE_EVT, m_services[attr->service].gatts_if);
+    esp_ble_gatts_cb_param_t::gatts_write_evt_param& write = ev.gatts_param.write;
+    write.conn_id = conn_id;
+    write.trans_id = m_next_trans_id++;
+    memcpy(write.bda, conn->bda, sizeof(esp_bd_addr_t));
+    write.handle = handle;
+    write.offset = offset;
+    write.is_prep = true;
+    write.len = len;
+    memcpy(ev.payload, data, len);
+    ev.payload_len = len;
+
+    if (attr->auto_rsp == ESP_GATT_AUTO_RSP)
+    {
+        // queued and answered by the stack itself
+        write.need_rsp = false;
+        conn->prepared.push_back({handle, offset, std::vector<uint8_t>(data, data + len)});
+        if (m_client)
+            m_client->OnWriteResponse(conn_id, handle, ESP_GATT_OK);
+    }
+    else
+    {
+        write.need_rsp = true;
+        conn->app_transactions.push_back({write.trans_id, handle, false});
+    }
+    return ESP_GATT_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_gatt_status_t FakeBTStack::ExecuteWrite(uint16_t conn_id, bool exec)
+{
+    auto lock = Lock();
+    Connection* conn = GetConnection(conn_id);
+    if (!conn || m_apps.empty())
+        return ESP_GATT_ERROR;
+
+    PendingEvent& ev = QueueGATTSEvent(ESP_GATTS_EXEC_WRITE_EVT, m_apps.front());
+    esp_ble_gatts_cb_param_t::gatts_exec_write_evt_param& exec_write = ev.gatts_param.exec_write;
+    exec_write.conn_id = conn_id;
+    exec_write.trans_id = m_next_trans_id++;
+    memcpy(exec_write.bda, conn->bda, sizeof(esp_bd_addr_t));
+    exec_write.exec_write_flag = exec ? ESP_GATT_PREP_WRITE_EXEC : ESP_GATT_PREP_WRITE_CANCEL;
+
+    if (conn->prepared.empty())
+    {
+        // the prepared writes were handled by the application, so is the execute request
+        conn->app_transactions.push_back({exec_write.trans_id, 0, false});
+        return ESP_GATT_OK;
+    }
+
+    esp_gatt_status_t status = ESP_GATT_OK;
+    if (exec)
+    {
+        for (const PreparedWrite& pw : conn->prepared)
+        {
+            Attribute* attr = GetAttribute(pw.handle);
+            if (pw.offset + pw.value.size() > attr->max_length)
+            {
+                status = ESP_GATT_INVALID_ATTR_LEN;
+                break;
+            }
+            if (attr->value.size() < pw.offset + pw.value.size())
+                attr->value.resize(pw.offset + pw.value.size());
+            std::copy(pw.value.begin(), pw.value.end(), attr->value.begin() + pw.offset);
+        }
+    }
+    conn->prepared.clear();
+    if (m_client)
+        m_client->OnWriteResponse(conn_id, 0, status);
+    return status;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_gatt_status_t FakeBTStack::Read(uint16_t conn_id, uint16_t handle, uint16_t offset)
+{
+    auto lock = Lock();
+    Connection* conn = GetConnection(conn_id);
+    if (!conn)
+        return ESP_GATT_ERROR;
+
+    ++m_stats.reads;
+
+    if (!CheckChangeAware(conn_id, handle, true, true))
+        return gatt_status_out_of_sync;
+    if (handle < m_config.first_handle)
+        return ReadGATTService(conn_id, handle, offset);
+
+    Attribute* attr = GetAttribute(handle);
+    esp_gatt_status_t status = ESP_GATT_OK;
+    if (!attr || !m_services[attr->service].started)
+        status = ESP_GATT_INVALID_HANDLE;
+    else if (!(attr->perm & (ESP_GATT_PERM_READ | ESP_GATT_PERM_READ_ENCRYPTED | ESP_GATT_PERM_READ_ENC_MITM)))
+        status = ESP_GATT_READ_NOT_PERMIT;
+    else if (attr->auto_rsp == ESP_GATT_AUTO_RSP && offset > attr->value.size())
+        status = ESP_GATT_INVALID_OFFSET;
+
+    if (status != ESP_GATT_OK)
+    {
+        if (m_client)
+            m_client->OnReadResponse(conn_id, handle, status, nullptr, 0);
+        return status;
+    }
+
+    PendingEvent& ev = QueueGATTSEvent(ESP_GATTS_READ_EVT, m_services[attr->service].gatts_if);
+    esp_ble_gatts_cb_param_t::gatts_read_evt_param& read = ev.gatts_param.read;
+    read.conn_id = conn_id;
+    read.trans_id = m_next_trans_id++;
+    memcpy(read.bda, conn->bda, sizeof(esp_bd_addr_t));
+    read.handle = handle;
+    read.offset = offset;
+    read.is_long = offset > 0;
+
+    if (attr->auto_rsp == ESP_GATT_AUTO_RSP)
+    {
+        read.need_rsp = false;
+        uint16_t len = std::min((uint16_t)(attr->value.size() - offset), (uint16_t)(conn->mtu - 1));
+        if (m_client)
+            m_client->OnReadResponse(conn_id, handle, ESP_GATT_OK, attr->value.data() + offset, len);
+    }
+    else
+    {
+        read.need_rsp = true;
+        conn->app_transactions.push_back({read.trans_id, handle, true});
+    }
+    return ESP_GATT_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void FakeBTStack::ConfirmIndication(uint16_t conn_id)
+{
+    auto lock = Lock();
+    Connection* conn = GetConnection(conn_id);
+    if (!conn || conn->indications.empty())
+        return;
+
+    const Packet& ind = conn->indications.front();
+    if (ind.handle == service_changed_handle)
+    {
+        // the indication of the stack itself: the client knows the database changed
+        conn->gatt.change_state = change_aware;
+    }
+    else
+    {
+        PendingEvent& ev = QueueGATTSEvent(ESP_GATTS_CONF_EVT, GetServiceInterface(ind.handle));
+        ev.gatts_param.conf.status = ESP_GATT_OK;
+        ev.gatts_param.conf.conn_id = conn_id;
+        ev.gatts_param.conf.handle = ind.handle;
+        ev.gatts_param.conf.len = (uint16_t)ind.value.size();
+        memcpy(ev.payload, ind.value.data(), ind.value.size());
+        ev.payload_len = (uint16_t)ind.value.size();
+    }
+
+    conn->indications.erase(conn->indications.begin());
+    SendNextIndication(conn_id);
+}
+// -------------------------------------------------------------------------------------------------------------------
+void FakeBTStack::SendNextIndication(uint16_t conn_id)
+{
+    Connection* conn = GetConnection(conn_id);
+    if (!conn || conn->indications.empty())
+        return;
+
+    const Packet& ind = conn->indications.front();
+    ++m_stats.indications;
+    if (m_client)
+        m_client->OnNotification(conn_id, ind.handle, ind.value.data(), (uint16_t)ind.value.size(), true);
+    if (m_auto_confirm)
+        ConfirmIndication(conn_id);
+}
+// -------------------------------------------------------------------------------------------------------------------
+bool FakeBTStack::CheckChangeAware(uint16_t conn_id, uint16_t handle, bool need_rsp, bool is_read)
+{
+    GATTState& gatt = m_connections[conn_id].gatt;
+    if (gatt.change_state == change_aware)
+        return true;
+    if (need_rsp && gatt.change_state == change_aware_next)
+    {
+        gatt.change_state = change_aware;
+        return true;
+    }
+    // reading the Database Hash is how the client catches up
+    if (is_read && handle == database_hash_handle)
+        return true;
+
+    // commands are ignored, requests refused: the client is aware of the change with the next one
+    if (need_rsp)
+    {
+        gatt.change_state = change_aware_next;
+        if (m_client && is_read)
+            m_client->OnReadResponse(conn_id, handle, gatt_status_out_of_sync, nullptr, 0);
+        else if (m_client)
+            m_client->OnWriteResponse(conn_id, handle, gatt_status_out_of_sync);
+    }
+    return false;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_gatt_status_t FakeBTStack::ReadGATTService(uint16_t conn_id, uint16_t handle, uint16_t offset)
+{
+    Connection& conn = m_connections[conn_id];
+    uint8_t value[16];
+    uint16_t len = 0;
+    esp_gatt_status_t status = ESP_GATT_OK;
+    size_t count = m_config.robust_caching ? 8 : 4;
+    if (handle == service_changed_config_handle)
+    {
+        value[0] = (uint8_t)conn.gatt.service_changed_config;
+        value[1] = (uint8_t)(conn.gatt.service_changed_config >> 8);
+        len = 2;
+    }
+    else if (handle == client_features_handle && m_config.robust_caching)
+    {
+        value[0] = conn.gatt.client_features;
+        len = 1;
+    }
+    else if (handle == database_hash_handle && m_config.robust_caching)
+    {
+        GetDatabaseHash(value);
+        len = 16;
+        if (conn.gatt.change_state == change_unaware)
+            conn.gatt.change_state = change_aware_next;
+    }
+    else if (handle >= 1 && handle <= count)
+    {
+        // the declarations aren't simulated, Service Changed is indicated only
+        status = ESP_GATT_READ_NOT_PERMIT;
+    }
+    else
+    {
+        status = ESP_GATT_INVALID_HANDLE;
+    }
+    if (status == ESP_GATT_OK && offset > len)
+        status = ESP_GATT_INVALID_OFFSET;
+
+    if (m_client && status == ESP_GATT_OK)
+        m_client->OnReadResponse(conn_id, handle, status, value + offset, len - offset);
+    else if (m_client)
+        m_client->OnReadResponse(conn_id, handle, status, nullptr, 0);
+    return status;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_gatt_status_t FakeBTStack::WriteGATTService(uint16_t conn_id, uint16_t handle, const uint8_t* data, uint16_t len, bool need_rsp)
+{
+    Connection& conn = m_connections[conn_id];
+    esp_gatt_status_t status = ESP_GATT_OK;
+    size_t count = m_config.robust_caching ? 8 : 4;
+    if (handle == service_changed_config_handle)
+    {
+        if (len != 2)
+            status = ESP_GATT_INVALID_ATTR_LEN;
+        else
+            conn.gatt.service_changed_config = data[0] | (data[1] << 8);
+    }
+    else if (handle == client_features_handle && m_config.robust_caching)
+    {
+        // robust caching is the only feature, enabled features cannot be disabled again
+        uint8_t features = len ? data[0] & 0x01 : 0;
+        if (!len)
+            status = ESP_GATT_INVALID_ATTR_LEN;
+        else if (conn.gatt.client_features & ~features)
+            status = gatt_status_value_not_allowed;
+        else
+            conn.gatt.client_features = features;
+    }
+    else if (handle >= 1 && handle <= count)
+    {
+        status = ESP_GATT_WRITE_NOT_PERMIT;
+    }
+    else
+    {
+        status = ESP_GATT_INVALID_HANDLE;
+    }
+    if (status == ESP_GATT_OK && conn.bonded)
+        SaveBond(conn_id);
+
+    if (need_rsp && m_client)
+        m_client->OnWriteResponse(conn_id, handle, status);
+    return status;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void FakeBTStack::IndicateServiceChanged(uint16_t conn_id)
+{
+    Connection& conn = m_connections[conn_id];
+    if (m_config.robust_caching && (conn.gatt.client_features & 0x01))
+        conn.gatt.change_state = change_unaware;
+    if (!(conn.gatt.service_changed_config & 0x02))
+        return;
+
+    // bluedroid always indicates the whole handle range
+    conn.indications.push_back({service_changed_handle, {0x01, 0x00, 0xFF, 0xFF}});
+    if (conn.indications.size() == 1)
+        SendNextIndication(conn_id);
+}
+// -------------------------------------------------------------------------------------------------------------------
+FakeBTStack::Bond* FakeBTStack::FindBond(const esp_bd_addr_t bda)
+{
+    for (Bond& bond : m_bonds)
+    {
+        if (0 == memcmp(bond.bda, bda, sizeof(esp_bd_addr_t)))
+            return &bond;
+    }
+    return nullptr;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void FakeBTStack::SaveBond(uint16_t conn_id)
+{
+    const Connection& conn = m_connections[conn_id];
+    Bond* bond = FindBond(conn.bda);
+    if (!bond)
+    {
+        m_bonds.emplace_back();
+        bond = &m_bonds.back();
+        memcpy(bond->bda, conn.bda, sizeof(esp_bd_addr_t));
+    }
+    bond->gatt = conn.gatt;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void FakeBTStack::GetDatabaseHash(uint8_t hash[16]) const
+{
+    // stands in for the AES-CMAC of bluedroid: two FNV-1a hashes over handle, type and declaration
+    // values, it only has to change with the database
+    uint64_t lanes[2] = {0xcbf29ce484222325ull, 0x84222325cbf29ce4ull};
+    auto add = [&lanes](const uint8_t* data, size_t len)
+    {
+        for (uint64_t& lane : lanes)
+        {
+            for (size_t i = 0; i < len; ++i)
+                lane = (lane ^ data[i]) * 0x100000001b3ull;
+        }
+    };
+    size_t count = m_config.robust_caching ? 8 : 4;
+    for (size_t i = 0; i < count; ++i)
+    {
+        uint16_t handle = (uint16_t)(i + 1);
+        add((const uint8_t*)&handle, sizeof(handle));
+        add((const uint8_t*)&gatt_service_types[i], sizeof(gatt_service_types[i]));
+    }
+    for (size_t i = 0; i < m_attributes.size(); ++i)
+    {
+        const Attribute& attr = m_attributes[i];
+        uint16_t handle = (uint16_t)(m_config.first_handle + i);
+        add((const uint8_t*)&handle, sizeof(handle));
+        add((const uint8_t*)&attr.uuid.uuid, attr.uuid.len);
+        uint16_t type = GetUUID16(attr.uuid);
+        if (type == gatt_uuid_pri_service || type == gatt_uuid_sec_service || type == gatt_uuid_char_declare)
+            add(attr.value.data(), attr.value.size());
+    }
+    memcpy(hash, lanes, 16);
+}
+// -------------------------------------------------------------------------------------------------------------------
+// inspection
+// -------------------------------------------------------------------------------------------------------------------
+uint16_t FakeBTStack::FindHandle(uint16_t uuid, uint8_t nth) const
+{
+    auto lock = Lock();
+    size_t count = m_config.robust_caching ? 8 : 4;
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (gatt_service_types[i] == uuid && 0 == nth--)
+            return (uint16_t)(i + 1);
+    }
+    for (size_t i = 0; i < m_attributes.size(); ++i)
+    {
+        if (GetUUID16(m_attributes[i].uuid) == uuid && 0 == nth--)
+            return (uint16_t)(m_config.first_handle + i);
+    }
+    return 0;
+}
+// -------------------------------------------------------------------------------------------------------------------
+uint16_t FakeBTStack::FindDescriptor(uint16_t value_handle, uint16_t uuid) const
+{
+    auto lock = Lock();
+    if (value_handle == service_changed_handle && uuid == ESP_GATT_UUID_CHAR_CLIENT_CONFIG)
+        return service_changed_config_handle;
+    const Attribute* value = GetAttribute(value_handle);
+    if (!value)
+        return 0;
+
+    // descriptors follow the value up to the next declaration of the same service
+    for (uint16_t hdl = value_handle + 1; ; ++hdl)
+    {
+        const Attribute* attr = GetAttribute(hdl);
+        if (!attr || attr->service != value->service)
+            break;
+        uint16_t attr_uuid = GetUUID16(attr->uuid);
+        if (attr_uuid == gatt_uuid_char_declare)
+            break;
+        if (attr_uuid == uuid)
+            return hdl;
+    }
+    return 0;
+}
+// -------------------------------------------------------------------------------------------------------------------
+const std::vector<uint8_t>* FakeBTStack::GetValue(uint16_t handle) const
+{
+    auto lock = Lock();
+    const Attribute* attr = GetAttribute(handle);
+    return attr ? &attr->value : nullptr;
+}
+// -------------------------------------------------------------------------------------------------------------------
+uint16_t FakeBTStack::GetMTU(uint16_t conn_id) const
+{
+    auto lock = Lock();
+    const Connection* conn = GetConnection(conn_id);
+    return conn ? conn->mtu : 0;
+}
+// -------------------------------------------------------------------------------------------------------------------
+size_t FakeBTStack::GetTxQueued(uint16_t conn_id) const
+{
+    auto lock = Lock();
+    const Connection* conn = GetConnection(conn_id);
+    return conn ? conn->tx_queue.size() : 0;
+}
+// -------------------------------------------------------------------------------------------------------------------
+bool FakeBTStack::IsConnected(uint16_t conn_id) const
+{
+    auto lock = Lock();
+    return GetConnection(conn_id) != nullptr;
+}
+// -------------------------------------------------------------------------------------------------------------------
+bool FakeBTStack::IsChangeAware(uint16_t conn_id) const
+{
+    auto lock = Lock();
+    const Connection* conn = GetConnection(conn_id);
+    return conn && conn->gatt.change_state == change_aware;
+}
+// -------------------------------------------------------------------------------------------------------------------
+// stack side
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t FakeBTStack::RegisterGATTSCallback(esp_gatts_cb_t callback)
+{
+    auto lock = Lock();
+    m_gatts_callback = callback;
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t FakeBTStack::RegisterGAPCallback(esp_gap_ble_cb_t callback)
+{
+    auto lock = Lock();
+    m_gap_callback = callback;
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t FakeBTStack::AppRegister(uint16_t app_id)
+{
+    auto lock = Lock();
+    if (m_replay)
+        return ESP_OK;
+    // bluedroid hands out the interfaces starting at 3
+    esp_gatt_if_t gatts_if = (esp_gatt_if_t)(3 + m_apps.size());
+    m_apps.push_back(gatts_if);
+
+    PendingEvent& ev = QueueGATTSEvent(ESP_GATTS_REG_EVT, gatts_if);
+    ev.gatts_param.reg.status = ESP_GATT_OK;
+    ev.gatts_param.reg.app_id = app_id;
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t FakeBTStack::AppUnregister(esp_gatt_if_t gatts_if)
+{
+    auto lock = Lock();
+    if (m_replay)
+        return ESP_OK;
+    auto it = std::find(m_apps.begin(), m_apps.end(), gatts_if);
+    if (it == m_apps.end())
+        return ESP_ERR_INVALID_ARG;
+    m_apps.erase(it);
+    QueueGATTSEvent(ESP_GATTS_UNREG_EVT, gatts_if);
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t FakeBTStack::CreateAttributeTable(const esp_gatts_attr_db_t* db, esp_gatt_if_t gatts_if, uint8_t count, uint8_t inst_id)
+{
+    auto lock = Lock();
+    if (m_replay)
+        return ESP_OK;
+    if (!db || count == 0 || count > m_config.max_attributes_per_table)
+        return ESP_ERR_INVALID_ARG;
+
+    PendingEvent& ev = QueueGATTSEvent(ESP_GATTS_CREAT_ATTR_TAB_EVT, gatts_if);
+    esp_ble_gatts_cb_param_t::gatts_add_attr_tab_evt_param& tab = ev.gatts_param.add_attr_tab;
+    tab.svc_inst_id = inst_id;
+
+    const esp_attr_desc_t& svc = db[0].att_desc;
+    if (svc.uuid_length != ESP_UUID_LEN_16 || !svc.uuid_p || !svc.value ||
+        (0 != memcmp(svc.uuid_p, &gatt_uuid_pri_service, 2) && 0 != memcmp(svc.uuid_p, &gatt_uuid_sec_service, 2)))
+    {
+        tab.status = ESP_GATT_INVALID_PDU;
+        return ESP_OK;
+    }
+    tab.svc_uuid.len = svc.length;
+    memcpy(&tab.svc_uuid.uuid, svc.value, std::min((size_t)svc.length, sizeof(tab.svc_uuid.uuid)));
+
+    if (m_services.size() >= m_config.max_services ||
+        m_config.first_handle + m_attributes.size() + count > 0xFFFF)
+    {
+        tab.status = ESP_GATT_NO_RESOURCES;
+        return ESP_OK;
+    }
+
+    m_services.emplace_back();
+    Service& service = m_services.back();
+    service.gatts_if = gatts_if;
+    service.inst_id = inst_id;
+
+    for (uint8_t i = 0; i < count; ++i)
+    {
+        const esp_attr_desc_t& desc = db[i].att_desc;
+        Attribute attr;
+        memset(&attr.uuid, 0, sizeof(attr.uuid));
+        attr.uuid.len = desc.uuid_length;
+        memcpy(&attr.uuid.uuid, desc.uuid_p, std::min((size_t)desc.uuid_length, sizeof(attr.uuid.uuid)));
+        attr.perm = desc.perm;
+        attr.max_length = desc.max_length;
+        attr.auto_rsp = db[i].attr_control.auto_rsp;
+        attr.service = (uint8_t)(m_services.size() - 1);
+        // like bluedroid the stack keeps its own copy of the value
+        if (desc.value && desc.length)
+            attr.value.assign(desc.value, desc.value + std::min(desc.length, desc.max_length));
+
+        service.handles.push_back((uint16_t)(m_config.first_handle + m_attributes.size()));
+        m_attributes.push_back(attr);
+    }
+
+    tab.status = ESP_GATT_OK;
+    tab.num_handle = count;
+    ev.handles = service.handles.data();
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t FakeBTStack::StartService(uint16_t service_handle)
+{
+    auto lock = Lock();
+    if (m_replay)
+        return ESP_OK;
+    const Attribute* attr = GetAttribute(service_handle);
+    PendingEvent& ev = QueueGATTSEvent(ESP_GATTS_START_EVT, attr ? m_services[attr->service].gatts_if : ESP_GATT_IF_NONE);
+    ev.gatts_param.start.service_handle = service_handle;
+    if (!attr || m_services[attr->service].handles.front() != service_handle)
+    {
+        ev.gatts_param.start.status = ESP_GATT_INVALID_HANDLE;
+        return ESP_OK;
+    }
+    Service& service = m_services[attr->service];
+    ev.gatts_param.start.status = service.started ? ESP_GATT_SERVICE_STARTED : ESP_GATT_OK;
+    service.started = true;
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t FakeBTStack::StopService(uint16_t service_handle)
+{
+    auto lock = Lock();
+    if (m_replay)
+        return ESP_OK;
+    const Attribute* attr = GetAttribute(service_handle);
+    PendingEvent& ev = QueueGATTSEvent(ESP_GATTS_STOP_EVT, attr ? m_services[attr->service].gatts_if : ESP_GATT_IF_NONE);
+    ev.gatts_param.stop.service_handle = service_handle;
+    ev.gatts_param.stop.status = attr ? ESP_GATT_OK : ESP_GATT_INVALID_HANDLE;
+    if (attr)
+        m_services[attr->service].started = false;
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t FakeBTStack::SendIndicate(esp_gatt_if_t gatts_if, uint16_t conn_id, uint16_t handle, uint16_t len, const uint8_t* value, bool need_confirm)
+{
+    auto lock = Lock();
+    if (m_replay)
+        return ESP_OK;
+    if (len > 0 && !value)
+        return ESP_ERR_INVALID_ARG;
+
+    Connection* conn = GetConnection(conn_id);
+    const Attribute* attr = GetAttribute(handle);
+    if (!conn || !attr)
+    {
+        ++m_stats.failed_sends;
+        PendingEvent& ev = QueueGATTSEvent(ESP_GATTS_CONF_EVT, gatts_if);
+        ev.gatts_param.conf.status = ESP_GATT_ILLEGAL_PARAMETER;
+        ev.gatts_param.conf.conn_id = conn_id;
+        ev.gatts_param.conf.handle = handle;
+        return ESP_OK;
+    }
+
+    // the stack sends at most MTU - 3 bytes and silently drops the rest
+    if (len > conn->mtu - 3)
+    {
+        ++m_stats.truncated;
+        len = conn->mtu - 3;
+    }
+
+    if (need_confirm)
+    {
+        conn->indications.push_back({handle, std::vector<uint8_t>(value, value + len)});
+        if (conn->indications.size() == 1)
+            SendNextIndication(conn_id);
+        return ESP_OK;
+    }
+
+    esp_gatt_status_t status = ESP_GATT_OK;
+    if (!m_config.tx_buffers)
+    {
+        ++m_stats.notifications;
+        if (m_client)
+            m_client->OnNotification(conn_id, handle, value, len, false);
+    }
+    else if (conn->congested)
+    {
+        // L2CAP doesn't take any packet while congested, it is lost
+        ++m_stats.failed_sends;
+        ++m_stats.rejected;
+        status = ESP_GATT_INTERNAL_ERROR;
+    }
+    else
+    {
+        conn->tx_queue.push_back({handle, std::vector<uint8_t>(value, value + len)});
+        if (conn->tx_queue.size() >= m_config.tx_buffers)
+        {
+            // the packet is taken, but reported with the congestion status (after the congestion event)
+            conn->congested = true;
+            ++m_stats.congestions;
+            esp_ble_gatts_cb_param_t param;
+            memset(&param, 0, sizeof(param));
+            param.congest.conn_id = conn_id;
+            param.congest.congested = true;
+            QueueForAllApps(ESP_GATTS_CONGEST_EVT, param);
+            status = ESP_GATT_CONGESTED;
+        }
+    }
+
+    // bluedroid reports every notification handed to L2CAP with a confirmation event
+    PendingEvent& ev = QueueGATTSEvent(ESP_GATTS_CONF_EVT, gatts_if);
+    ev.gatts_param.conf.status = status;
+    ev.gatts_param.conf.conn_id = conn_id;
+    ev.gatts_param.conf.handle = handle;
+    ev.gatts_param.conf.len = len;
+    memcpy(ev.payload, value, len);
+    ev.payload_len = len;
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t FakeBTStack::SendServiceChange(esp_gatt_if_t gatts_if, const esp_bd_addr_t bda)
+{
+    auto lock = Lock();
+    if (m_replay)
+        return ESP_OK;
+    if (std::find(m_apps.begin(), m_apps.end(), gatts_if) == m_apps.end())
+        return ESP_ERR_INVALID_ARG;
+
+    // without an address to all connected clients, bonded ones get it when they connect again
+    for (uint16_t conn_id = 0; conn_id < m_connections.size(); ++conn_id)
+    {
+        Connection& conn = m_connections[conn_id];
+        if (!conn.connected || (bda && memcmp(conn.bda, bda, sizeof(esp_bd_addr_t))))
+            continue;
+        IndicateServiceChanged(conn_id);
+        if (conn.bonded)
+            SaveBond(conn_id);
+    }
+    for (Bond& bond : m_bonds)
+    {
+        if (GetConnection(bond.bda) || (bda && memcmp(bond.bda, bda, sizeof(esp_bd_addr_t))))
+            continue;
+        bond.gatt.service_changed_pending = true;
+        if (m_config.robust_caching && (bond.gatt.client_features & 0x01))
+            bond.gatt.change_state = change_unaware;
+    }
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t FakeBTStack::SendResponse(esp_gatt_if_t gatts_if, uint16_t conn_id, uint32_t trans_id, esp_gatt_status_t status, const esp_gatt_rsp_t* rsp)
+{
+    auto lock = Lock();
+    if (m_replay)
+        return ESP_OK;
+    Connection* conn = GetConnection(conn_id);
+    if (!conn)
+        return ESP_FAIL;
+
+    auto it = std::find_if(
+        conn->app_transactions.begin(), conn->app_transactions.end(),
+        [trans_id](const AppTransaction& t) { return t.trans_id == trans_id; }
+    );
+    if (it == conn->app_transactions.end())
+        return ESP_FAIL;
+
+    AppTransaction trans = *it;
+    conn->app_transactions.erase(it);
+
+    if (m_client)
+    {
+        if (trans.is_read)
+        {
+            uint16_t len = 0;
+            const uint8_t* value = nullptr;
+            if (status == ESP_GATT_OK && rsp)
+            {
+                len = std::min(rsp->attr_value.len, (uint16_t)(conn->mtu - 1));
+                value = rsp->attr_value.value;
+            }
+            m_client->OnReadResponse(conn_id, trans.handle, status, value, len);
+        }
+        else
+        {
+            m_client->OnWriteResponse(conn_id, trans.handle, status);
+        }
+    }
+
+    PendingEvent& ev = QueueGATTSEvent(ESP_GATTS_RESPONSE_EVT, gatts_if);
+    ev.gatts_param.rsp.status = ESP_GATT_OK;
+    ev.gatts_param.rsp.handle = trans.handle;
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t FakeBTStack::SetAttributeValue(uint16_t handle, uint16_t len, const uint8_t* value)
+{
+    auto lock = Lock();
+    if (m_replay)
+        return ESP_OK;
+    Attribute* attr = GetAttribute(handle);
+    PendingEvent& ev = QueueGATTSEvent(ESP_GATTS_SET_ATTR_VAL_EVT, GetServiceInterface(handle));
+    ev.gatts_param.set_attr_val.attr_handle = handle;
+    if (!attr)
+    {
+        ev.gatts_param.set_attr_val.status = ESP_GATT_INVALID_HANDLE;
+        return ESP_OK;
+    }
+    ev.gatts_param.set_attr_val.srvc_handle = m_services[attr->service].handles.front();
+    if (len > attr->max_length)
+    {
+        ev.gatts_param.set_attr_val.status = ESP_GATT_INVALID_ATTR_LEN;
+        return ESP_OK;
+    }
+    attr->value.assign(value, value + len);
+    ev.gatts_param.set_attr_val.status = ESP_GATT_OK;
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_gatt_status_t FakeBTStack::GetAttributeValue(uint16_t handle, uint16_t* len, const uint8_t** value)
+{
+    auto lock = Lock();
+    const Attribute* attr = GetAttribute(handle);
+    if (!attr || !len || !value)
+        return ESP_GATT_INVALID_HANDLE;
+    *len = (uint16_t)attr->value.size();
+    *value = attr->value.data();
+    return ESP_GATT_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t FakeBTStack::Close(esp_gatt_if_t gatts_if, uint16_t conn_id)
+{
+    auto lock = Lock();
+    if (m_replay)
+        return ESP_OK;
+    if (!GetConnection(conn_id))
+        return ESP_FAIL;
+    Disconnect(conn_id, ESP_GATT_CONN_TERMINATE_LOCAL_HOST);
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t FakeBTStack::RemoveBond(const esp_bd_addr_t bda)
+{
+    auto lock = Lock();
+    if (m_replay)
+        return ESP_OK;
+    // the fake stack keeps no keys, removing always succeeds
+    Bond* bond = FindBond(bda);
+    if (bond)
+        m_bonds.erase(m_bonds.begin() + (bond - m_bonds.data()));
+    uint16_t conn_id = invalid_conn_id;
+    if (Connection* conn = GetConnection(bda, &conn_id))
+        conn->bonded = false;
+    PendingEvent& ev = QueueGAPEvent(ESP_GAP_BLE_REMOVE_BOND_DEV_COMPLETE_EVT);
+    ev.gap_param.remove_bond_dev_cmpl.status = ESP_BT_STATUS_SUCCESS;
+    memcpy(ev.gap_param.remove_bond_dev_cmpl.bd_addr, bda, sizeof(esp_bd_addr_t));
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t FakeBTStack::SetLocalMTU(uint16_t mtu)
+{
+    auto lock = Lock();
+    if (mtu < ESP_GATT_DEF_BLE_MTU_SIZE || mtu > ESP_GATT_MAX_MTU_SIZE)
+        return ESP_ERR_INVALID_SIZE;
+    m_local_mtu = mtu;
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t FakeBTStack::StartAdvertising(const esp_ble_adv_params_t* params)
+{
+    auto lock = Lock();
+    if (m_replay)
+        return ESP_OK;
+    if (!params)
+        return ESP_ERR_INVALID_ARG;
+
+    m_adv_params = *params;
+    PendingEvent& ev = QueueGAPEvent(ESP_GAP_BLE_ADV_START_COMPLETE_EVT);
+    bool free_slot = std::any_of(m_connections.begin(), m_connections.end(), [](const Connection& c) { return !c.connected; });
+    if (m_adv_data.empty() || !free_slot)
+    {
+        ev.gap_param.adv_start_cmpl.status = ESP_BT_STATUS_FAIL;
+        return ESP_OK;
+    }
+    m_advertising = true;
+    ev.gap_param.adv_start_cmpl.status = ESP_BT_STATUS_SUCCESS;
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t FakeBTStack::StopAdvertising(void)
+{
+    auto lock = Lock();
+    if (m_replay)
+        return ESP_OK;
+    PendingEvent& ev = QueueGAPEvent(ESP_GAP_BLE_ADV_STOP_COMPLETE_EVT);
+    ev.gap_param.adv_stop_cmpl.status = m_advertising ? ESP_BT_STATUS_SUCCESS : ESP_BT_STATUS_FAIL;
+    m_advertising = false;
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t FakeBTStack::ConfigAdvData(const uint8_t* data, uint32_t len, bool scan_rsp)
+{
+    auto lock = Lock();
+    if (m_replay)
+        return ESP_OK;
+    if (!data || len > adv_data_max_length)
+        return ESP_ERR_INVALID_ARG;
+
+    PendingEvent& ev = QueueGAPEvent(
+        scan_rsp ? ESP_GAP_BLE_SCAN_RSP_DATA_RAW_SET_COMPLETE_EVT : ESP_GAP_BLE_ADV_DATA_RAW_SET_COMPLETE_EVT
+    );
+    // the status member is at the same place for both events
+    ev.gap_param.adv_data_raw_cmpl.status = ESP_BT_STATUS_SUCCESS;
+    (scan_rsp ? m_scan_rsp_data : m_adv_data).assign(data, data + len);
+    ++m_stats.adv_data_updates;
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t FakeBTStack::CreateTimer(const esp_timer_create_args_t* args, esp_timer_handle_t* timer)
+{
+    auto lock = Lock();
+    if (!args || !args->callback || !timer)
+        return ESP_ERR_INVALID_ARG;
+    *timer = new esp_timer{args->callback, args->arg, false, 0, 0};
+    m_timers.push_back(*timer);
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t FakeBTStack::StartTimer(esp_timer_handle_t timer, uint64_t us, bool periodic)
+{
+    auto lock = Lock();
+    if (!timer || (periodic && !us))
+        return ESP_ERR_INVALID_ARG;
+    if (timer->active)
+        return ESP_ERR_INVALID_STATE;
+    timer->active = true;
+    timer->period = periodic ? us : 0;
+    timer->due = m_time + (int64_t)us;
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t FakeBTStack::StopTimer(esp_timer_handle_t timer)
+{
+    auto lock = Lock();
+    if (!timer)
+        return ESP_ERR_INVALID_ARG;
+    if (!timer->active)
+        return ESP_ERR_INVALID_STATE;
+    timer->active = false;
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t FakeBTStack::DeleteTimer(esp_timer_handle_t timer)
+{
+    auto lock = Lock();
+    if (!timer)
+        return ESP_ERR_INVALID_ARG;
+    if (timer->active)
+        return ESP_ERR_INVALID_STATE;
+    m_timers.erase(std::remove(m_timers.begin(), m_timers.end(), timer), m_timers.end());
+    delete timer;
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t FakeBTStack::SetDeviceName(const char* name)
+{
+    auto lock = Lock();
+    if (!name || strlen(name) > 248)
+        return ESP_ERR_INVALID_ARG;
+    m_device_name.assign(name, name + strlen(name) + 1);
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t FakeBTStack::UpdateConnParams(const esp_ble_conn_update_params_t* params)
+{
+    auto lock = Lock();
+    if (m_replay)
+        return ESP_OK;
+    if (!params)
+        return ESP_ERR_INVALID_ARG;
+
+    m_last_conn_params = *params;
+
+    PendingEvent& ev = QueueGAPEvent(ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT);
+    esp_ble_gap_cb_param_t::ble_update_conn_params_evt_param& upd = ev.gap_param.update_conn_params;
+    memcpy(upd.bda, params->bda, sizeof(esp_bd_addr_t));
+    upd.min_int = params->min_int;
+    upd.max_int = params->max_int;
+    upd.latency = params->latency;
+    upd.timeout = params->timeout;
+
+    // the central picks the interval, the simulated one takes the lowest one it accepts
+    bool valid = params->min_int >= 6 && params->min_int <= params->max_int && params->max_int <= 3200 &&
+                 params->latency <= 499 && params->timeout >= 10 && params->timeout <= 3200;
+    if (!GetConnection(params->bda) || !valid)
+    {
+        upd.status = valid ? ESP_BT_STATUS_FAIL : ESP_BT_STATUS_PARM_INVALID;
+        return ESP_OK;
+    }
+    if (params->max_int < m_config.min_conn_interval)
+    {
+        upd.status = ESP_BT_STATUS_UNACCEPT_CONN_INTERVAL;
+        return ESP_OK;
+    }
+    upd.status = ESP_BT_STATUS_SUCCESS;
+    upd.conn_int = std::max(params->min_int, m_config.min_conn_interval);
+    GetConnection(params->bda)->interval = upd.conn_int;
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t FakeBTStack::SetPacketDataLength(const esp_bd_addr_t bda, uint16_t tx_len)
+{
+    auto lock = Lock();
+    if (m_replay)
+        return ESP_OK;
+    uint16_t conn_id = 0xffff;
+    Connection* connection = GetConnection(bda, &conn_id);
+    PendingEvent& ev = QueueGAPEvent(ESP_GAP_BLE_SET_PKT_LENGTH_COMPLETE_EVT);
+    ev.conn_id = conn_id;
+    if (!connection)
+    {
+        ev.gap_param.pkt_data_lenth_cmpl.status = ESP_BT_STATUS_FAIL;
+        return ESP_OK;
+    }
+    ev.gap_param.pkt_data_lenth_cmpl.status = ESP_BT_STATUS_SUCCESS;
+    ev.gap_param.pkt_data_lenth_cmpl.params.tx_len = std::min(tx_len, data_length_max);
+    ev.gap_param.pkt_data_lenth_cmpl.params.rx_len = data_length_max;
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t FakeBTStack::SetPreferredPHY(const esp_bd_addr_t bda, uint8_t tx_phy_mask, uint8_t rx_phy_mask)
+{
+    auto lock = Lock();
+    if (m_replay)
+        return ESP_OK;
+    Connection* connection = GetConnection(bda);
+    if (!connection)
+        return ESP_FAIL;
+
+    // 2M if both sides prefer it, otherwise the connection stays on 1M
+    auto select = [this](uint8_t mask) -> uint8_t {
+        return (m_config.phy_2m && (mask & ESP_BLE_GAP_PHY_2M_PREF_MASK)) ? ESP_BLE_GAP_PHY_2M : ESP_BLE_GAP_PHY_1M;
+    };
+    PendingEvent& ev = QueueGAPEvent(ESP_GAP_BLE_PHY_UPDATE_COMPLETE_EVT);
+    ev.gap_param.phy_update.status = ESP_BT_STATUS_SUCCESS;
+    memcpy(ev.gap_param.phy_update.bda, bda, sizeof(esp_bd_addr_t));
+    ev.gap_param.phy_update.tx_phy = select(tx_phy_mask);
+    ev.gap_param.phy_update.rx_phy = select(rx_phy_mask);
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t FakeBTStack::DisconnectAddress(const esp_bd_addr_t bda)
+{
+    auto lock = Lock();
+    if (m_replay)
+        return ESP_OK;
+    uint16_t conn_id = 0;
+    if (!GetConnection(bda, &conn_id))
+        return ESP_FAIL;
+    Disconnect(conn_id, ESP_GATT_CONN_TERMINATE_LOCAL_HOST);
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+// ESP-IDF API
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t esp_ble_gatts_register_callback(esp_gatts_cb_t callback)
+{
+    return FakeBTStack::Instance().RegisterGATTSCallback(callback);
+}
+
+esp_err_t esp_ble_gatts_app_register(uint16_t app_id)
+{
+    return FakeBTStack::Instance().AppRegister(app_id);
+}
+
+esp_err_t esp_ble_gatts_app_unregister(esp_gatt_if_t gatts_if)
+{
+    return FakeBTStack::Instance().AppUnregister(gatts_if);
+}
+
+esp_err_t esp_ble_gatts_create_attr_tab(const esp_gatts_attr_db_t *gatts_attr_db, esp_gatt_if_t gatts_if,
+                                        uint8_t max_nb_attr, uint8_t srvc_inst_id)
+{
+    return FakeBTStack::Instance().CreateAttributeTable(gatts_attr_db, gatts_if, max_nb_attr, srvc_inst_id);
+}
+
+esp_err_t esp_ble_gatts_start_service(uint16_t service_handle)
+{
+    return FakeBTStack::Instance().StartService(service_handle);
+}
+
+esp_err_t esp_ble_gatts_stop_service(uint16_t service_handle)
+{
+    return FakeBTStack::Instance().StopService(service_handle);
+}
+
+esp_err_t esp_ble_gatts_send_indicate(esp_gatt_if_t gatts_if, uint16_t conn_id, uint16_t attr_handle,
+                                      uint16_t value_len, uint8_t *value, bool need_confirm)
+{
+    return FakeBTStack::Instance().SendIndicate(gatts_if, conn_id, attr_handle, value_len, value, need_confirm);
+}
+
+esp_err_t esp_ble_gatts_send_service_change_indication(esp_gatt_if_t gatts_if, esp_bd_addr_t remote_bda)
+{
+    return FakeBTStack::Instance().SendServiceChange(gatts_if, remote_bda);
+}
+
+esp_err_t esp_ble_gatts_send_response(esp_gatt_if_t gatts_if, uint16_t conn_id, uint32_t trans_id,
+                                      esp_gatt_status_t status, esp_gatt_rsp_t *rsp)
+{
+    return FakeBTStack::Instance().SendResponse(gatts_if, conn_id, trans_id, status, rsp);
+}
+
+esp_err_t esp_ble_gatts_set_attr_value(uint16_t attr_handle, uint16_t length, const uint8_t *value)
+{
+    return FakeBTStack::Instance().SetAttributeValue(attr_handle, length, value);
+}
+
+esp_gatt_status_t esp_ble_gatts_get_attr_value(uint16_t attr_handle, uint16_t *length, const uint8_t **value)
+{
+    return FakeBTStack::Instance().GetAttributeValue(attr_handle, length, value);
+}
+
+esp_err_t esp_ble_gatts_close(esp_gatt_if_t gatts_if, uint16_t conn_id)
+{
+    return FakeBTStack::Instance().Close(gatts_if, conn_id);
+}
+
+esp_err_t esp_ble_gatt_set_local_mtu(uint16_t mtu)
+{
+    return FakeBTStack::Instance().SetLocalMTU(mtu);
+}
+
+esp_err_t esp_ble_gap_register_callback(esp_gap_ble_cb_t callback)
+{
+    return FakeBTStack::Instance().RegisterGAPCallback(callback);
+}
+
+esp_err_t esp_ble_gap_start_advertising(esp_ble_adv_params_t *adv_params)
+{
+    return FakeBTStack::Instance().StartAdvertising(adv_params);
+}
+
+esp_err_t esp_ble_gap_stop_advertising(void)
+{
+    return FakeBTStack::Instance().StopAdvertising();
+}
+
+esp_err_t esp_ble_gap_config_adv_data_raw(uint8_t *raw_data, uint32_t raw_data_len)
+{
+    return FakeBTStack::Instance().ConfigAdvData(raw_data, raw_data_len, false);
+}
+
+esp_err_t esp_ble_gap_config_scan_rsp_data_raw(uint8_t *raw_data, uint32_t raw_data_len)
+{
+    return FakeBTStack::Instance().ConfigAdvData(raw_data, raw_data_len, true);
+}
+
+esp_err_t esp_ble_gap_set_device_name(const char *name)
+{
+    return FakeBTStack::Instance().SetDeviceName(name);
+}
+
+esp_err_t esp_ble_gap_update_conn_params(esp_ble_conn_update_params_t *params)
+{
+    return FakeBTStack::Instance().UpdateConnParams(params);
+}
+
+esp_err_t esp_ble_gap_set_pkt_data_len(esp_bd_addr_t remote_device, uint16_t tx_data_length)
+{
+    return FakeBTStack::Instance().SetPacketDataLength(remote_device, tx_data_length);
+}
+
+esp_err_t esp_ble_gap_disconnect(esp_bd_addr_t remote_device)
+{
+    return FakeBTStack::Instance().DisconnectAddress(remote_device);
+}
+
+esp_err_t esp_ble_remove_bond_device(esp_bd_addr_t bd_addr)
+{
+    return FakeBTStack::Instance().RemoveBond(bd_addr);
+}
+
+esp_err_t esp_ble_gap_set_preferred_phy(esp_bd_addr_t bd_addr, esp_ble_gap_all_phys_t all_phys_mask,
+                                        esp_ble_gap_phy_mask_t tx_phy_mask, esp_ble_gap_phy_mask_t rx_phy_mask,
+                                        esp_ble_gap_prefer_phy_options_t phy_options)
+{
+    return FakeBTStack::Instance().SetPreferredPHY(bd_addr, tx_phy_mask, rx_phy_mask);
+}
+
+int64_t esp_timer_get_time(void)
+{
+    return FakeBTStack::Instance().GetTime();
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* create_args, esp_timer_handle_t* out_handle)
+{
+    return FakeBTStack::Instance().CreateTimer(create_args, out_handle);
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    return FakeBTStack::Instance().StartTimer(timer, timeout_us, false);
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period)
+{
+    return FakeBTStack::Instance().StartTimer(timer, period, true);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    return FakeBTStack::Instance().StopTimer(timer);
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+{
+    return FakeBTStack::Instance().DeleteTimer(timer);
+}
+// -------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,396 @@
+# pragma once
+// ------------------------------------------------------------------------------------------
+/*
+Fake bluedroid GATT server / GAP stack for host builds.
+
+Implements the esp_ble_gatts_* / esp_ble_gap_* functions declared in the host
+stand-in headers and plays the part of the peer devices (GATT clients).
+Like on the target, API calls never invoke the callbacks directly: every
+resulting event is queued and delivered by Pump(), which is the job of the
+BTC task on the ESP32. So the event order seen by the application is the
+same as on the target:
+
+    REG -> CREAT_ATTR_TAB -> START -> CONNECT -> MTU -> WRITE / READ / CONF ...
+
+The API may be called from other threads, the callbacks are delivered unlocked.
+
+Handles are allocated like bluedroid does it: the first application
+attribute gets handle 40 (the ones below belong to the GAP and GATT services
+of the stack itself), each attribute table occupies a contiguous range.
+
+The Generic Attribute service of the stack is simulated from handle 1:
+Service Changed with its client configuration and, with robust caching,
+Client Supported Features and Database Hash. Like bluedroid the stack answers
+them itself, keeps them with the bond and refuses the requests of
+change-unaware clients; the application never sees these attributes.
+*/
+// ------------------------------------------------------------------------------------------
+# include <esp_gatts_api.h>
+# include <esp_gap_ble_api.h>
+# include <esp_timer.h>
+# include <mutex>
+# include <vector>
+# include <cstddef>
+// ------------------------------------------------------------------------------------------
+class FakeBTStack
+{
+public:
+    /// Limits of the simulated stack (defaults like the ESP-IDF menuconfig defaults).
+    struct Config
+    {
+        /// First handle assigned to an application attribute.
+        uint16_t first_handle = 40;
+        /// Maximum number of attributes per table (CONFIG_BT_GATT_MAX_SR_ATTRIBUTES).
+        uint16_t max_attributes_per_table = 100;
+        /// Maximum number of attribute tables (GATT_MAX_SR_PROFILES).
+        uint8_t max_services = 8;
+        /// Maximum number of simultaneous connections (CONFIG_BT_ACL_CONNECTIONS).
+        uint8_t max_connections = 4;
+        /// Connection interval (1.25ms units) reported with the connect event.
+        uint16_t conn_interval = 24;
+        /// Controller TX buffers per connection. If 0, notifications are transmitted at once
+        /// and never congest, otherwise they are transmitted in the connection events
+        /// simulated by AdvanceTime() and the connection is congested while the buffers are full.
+        uint8_t tx_buffers = 0;
+        /// Packets transmitted per connection event (if tx_buffers is set).
+        uint8_t packets_per_event = 4;
+        /// Lowest connection interval (1.25ms units) the central accepts, updates with a
+        /// lower maximum are rejected (e.g. 12 for centrals limited to 15ms).
+        uint16_t min_conn_interval = 6;
+        /// Whether the central supports the 2M PHY.
+        bool phy_2m = true;
+        /// Whether the Generic Attribute service has Client Supported Features and Database Hash
+        /// and tracks change-unaware clients (CONFIG_BT_GATTS_ROBUST_CACHING_ENABLED).
+# ifdef CONFIG_BT_GATTS_ROBUST_CACHING_ENABLED
+        bool robust_caching = true;
+# else
+        bool robust_caching = false;
+# endif
+    };
+
+    /// Receives everything the simulated peers get from the server.
+    class Client
+    {
+    public:
+        virtual ~Client() {}
+        virtual void OnNotification(uint16_t conn_id, uint16_t handle, const uint8_t* value, uint16_t len, bool is_indication) {}
+        virtual void OnWriteResponse(uint16_t conn_id, uint16_t handle, esp_gatt_status_t status) {}
+        virtual void OnReadResponse(uint16_t conn_id, uint16_t handle, esp_gatt_status_t status, const uint8_t* value, uint16_t len) {}
+    };
+
+    /// Counters of the simulated stack.
+    struct Stats
+    {
+        uint64_t gatts_events = 0;
+        uint64_t gap_events = 0;
+        uint64_t notifications = 0;
+        uint64_t indications = 0;
+        uint64_t truncated = 0;
+        uint64_t failed_sends = 0;
+        /// Notifications rejected because the connection was congested (also counted as failed_sends).
+        uint64_t rejected = 0;
+        uint64_t congestions = 0;
+        uint64_t writes = 0;
+        uint64_t reads = 0;
+        /// Advertising data and scan responses set.
+        uint64_t adv_data_updates = 0;
+    };
+
+    static const uint16_t invalid_conn_id = 0xFFFF;
+
+    /// Handles of the Generic Attribute service of the stack (declarations in between).
+    static const uint16_t service_changed_handle = 3;
+    static const uint16_t service_changed_config_handle = 4;
+    static const uint16_t client_features_handle = 6;
+    static const uint16_t database_hash_handle = 8;
+
+    /// The single stack instance (there is only one controller).
+    static FakeBTStack& Instance();
+
+    /// Drops all state (apps, callbacks, database, connections and queued events).
+    void Reset(const Config& config);
+    void Reset(void) { Reset(Config()); }
+
+    /// Restarts the device: drops all state like Reset() with the current configuration, but
+    /// keeps the bonds (bluedroid keeps them in NVS).
+    void Restart(void);
+
+    /// Sets the observer receiving notifications and responses, may be \c nullptr.
+    void SetClient(Client* client) { m_client = client; }
+
+    /// Changes the TX buffer simulation, see Config::tx_buffers.
+    void SetTxBuffers(uint8_t tx_buffers, uint8_t packets_per_event);
+
+    /// Advances the simulated time by \a us microseconds, running the connection
+    /// events due meanwhile (transmitting buffered notifications) and calling the
+    /// callbacks of the esp_timer timers due (unlocked), all in order of their time.
+    /// The client and the timers see the time of their event in GetTime().
+    /// Queued events are not delivered, call Pump() afterwards.
+    void AdvanceTime(uint32_t us);
+
+    /// Simulated time in microseconds (returned by esp_timer_get_time()).
+    int64_t GetTime(void) const { return m_time; }
+
+    /// Delivers all queued events to the registered callbacks, including the
+    /// ones queued while delivering.
+    /// \returns Number of events delivered.
+    size_t Pump(void);
+
+    /// In replay mode the GATT server and GAP API calls of the application succeed without
+    /// doing anything: no events are queued and nothing reaches the peers, as the events
+    /// come from a recording instead (see DeliverGATTSEvent() and host/tools/ble_replay.cpp).
+    /// Reset() turns it off.
+    void SetReplay(bool replay) { m_replay = replay; }
+
+    /// Calls the registered callback with an event at once, like the BTC task does.
+    void DeliverGATTSEvent(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param);
+    void DeliverGAPEvent(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t* param);
+
+    // --- peer side ---------------------------------------------------------------------
+
+    /// A peer with address \a bda connects. Requires advertising to be active.
+    /// \returns Connection ID or \c invalid_conn_id
+    uint16_t Connect(const esp_bd_addr_t bda);
+
+    /// Peer \a conn_id terminates the connection.
+    void Disconnect(uint16_t conn_id, esp_gatt_conn_reason_t reason = ESP_GATT_CONN_TERMINATE_PEER_USER);
+
+    /// Peer \a conn_id completes pairing and bonding (ESP_GAP_BLE_AUTH_CMPL_EVT). The stack keeps
+    /// the state of its Generic Attribute service for the peer until RemoveBond().
+    void Pair(uint16_t conn_id, bool success = true);
+
+    /// Peer \a conn_id starts the MTU exchange offering \a client_mtu.
+    void ExchangeMTU(uint16_t conn_id, uint16_t client_mtu);
+
+    /// Peer writes \a len bytes of \a data to \a handle (write request if \a need_rsp, else write command).
+    esp_gatt_status_t Write(uint16_t conn_id, uint16_t handle, const uint8_t* data, uint16_t len, bool need_rsp = true);
+
+    /// Peer sends a prepare write request for \a handle at \a offset.
+    esp_gatt_status_t PrepareWrite(uint16_t conn_id, uint16_t handle, uint16_t offset, const uint8_t* data, uint16_t len);
+
+    /// Peer sends an execute write request (\a exec false cancels).
+    esp_gatt_status_t ExecuteWrite(uint16_t conn_id, bool exec = true);
+
+    /// Peer reads \a handle starting at \a offset (read blob request if \a offset > 0).
+    esp_gatt_status_t Read(uint16_t conn_id, uint16_t handle, uint16_t offset = 0);
+
+    /// Whether indications are confirmed by the peer automatically (default).
+    void SetAutoConfirm(bool auto_confirm) { m_auto_confirm = auto_confirm; }
+
+    /// Peer \a conn_id confirms the pending indication.
+    void ConfirmIndication(uint16_t conn_id);
+
+    // --- inspection --------------------------------------------------------------------
+
+    /// Handle of the \a nth attribute with 16 bit UUID \a uuid or 0, the attributes of the
+    /// Generic Attribute service of the stack included.
+    uint16_t FindHandle(uint16_t uuid, uint8_t nth = 0) const;
+
+    /// Handle of the descriptor \a uuid belonging to the characteristic value \a value_handle or 0.
+    uint16_t FindDescriptor(uint16_t value_handle, uint16_t uuid) const;
+
+    /// Current value of the attribute \a handle as stored in the stack.
+    const std::vector<uint8_t>* GetValue(uint16_t handle) const;
+
+    /// Negotiated MTU of \a conn_id (0 if not connected).
+    uint16_t GetMTU(uint16_t conn_id) const;
+
+    bool IsAdvertising(void) const { return m_advertising; }
+    bool IsConnected(uint16_t conn_id) const;
+    /// Whether \a conn_id knows the current database (robust caching, see Config::robust_caching).
+    bool IsChangeAware(uint16_t conn_id) const;
+    /// Number of notifications of \a conn_id waiting in the TX buffers.
+    size_t GetTxQueued(uint16_t conn_id) const;
+    const std::vector<uint8_t>& GetAdvData(void) const { return m_adv_data; }
+    const std::vector<uint8_t>& GetScanRspData(void) const { return m_scan_rsp_data; }
+    const char* GetDeviceName(void) const { return m_device_name.data(); }
+    const esp_ble_conn_update_params_t& GetLastConnParams(void) const { return m_last_conn_params; }
+    const Stats& GetStats(void) const { return m_stats; }
+    void ResetStats(void) { m_stats = Stats(); }
+
+    // --- stack side (called by the esp_* API implementation) ---------------------------
+
+    esp_err_t RegisterGATTSCallback(esp_gatts_cb_t callback);
+    esp_err_t RegisterGAPCallback(esp_gap_ble_cb_t callback);
+    esp_err_t AppRegister(uint16_t app_id);
+    esp_err_t AppUnregister(esp_gatt_if_t gatts_if);
+    esp_err_t CreateAttributeTable(const esp_gatts_attr_db_t* db, esp_gatt_if_t gatts_if, uint8_t count, uint8_t inst_id);
+    esp_err_t StartService(uint16_t service_handle);
+    esp_err_t StopService(uint16_t service_handle);
+    esp_err_t SendIndicate(esp_gatt_if_t gatts_if, uint16_t conn_id, uint16_t handle, uint16_t len, const uint8_t* value, bool need_confirm);
+    esp_err_t SendServiceChange(esp_gatt_if_t gatts_if, const esp_bd_addr_t bda);
+    esp_err_t SendResponse(esp_gatt_if_t gatts_if, uint16_t conn_id, uint32_t trans_id, esp_gatt_status_t status, const esp_gatt_rsp_t* rsp);
+    esp_err_t SetAttributeValue(uint16_t handle, uint16_t len, const uint8_t* value);
+    esp_gatt_status_t GetAttributeValue(uint16_t handle, uint16_t* len, const uint8_t** value);
+    esp_err_t Close(esp_gatt_if_t gatts_if, uint16_t conn_id);
+    esp_err_t SetLocalMTU(uint16_t mtu);
+
+    esp_err_t StartAdvertising(const esp_ble_adv_params_t* params);
+    esp_err_t StopAdvertising(void);
+    esp_err_t ConfigAdvData(const uint8_t* data, uint32_t len, bool scan_rsp);
+    esp_err_t SetDeviceName(const char* name);
+    esp_err_t UpdateConnParams(const esp_ble_conn_update_params_t* params);
+    esp_err_t SetPacketDataLength(const esp_bd_addr_t bda, uint16_t tx_len);
+    esp_err_t SetPreferredPHY(const esp_bd_addr_t bda, uint8_t tx_phy_mask, uint8_t rx_phy_mask);
+    esp_err_t DisconnectAddress(const esp_bd_addr_t bda);
+    esp_err_t RemoveBond(const esp_bd_addr_t bda);
+
+    esp_err_t CreateTimer(const esp_timer_create_args_t* args, esp_timer_handle_t* timer);
+    esp_err_t StartTimer(esp_timer_handle_t timer, uint64_t us, bool periodic);
+    esp_err_t StopTimer(esp_timer_handle_t timer);
+    esp_err_t DeleteTimer(esp_timer_handle_t timer);
+
+protected:
+    struct Attribute
+    {
+        esp_bt_uuid_t uuid;
+        uint16_t perm = 0;
+        uint16_t max_length = 0;
+        uint8_t auto_rsp = ESP_GATT_AUTO_RSP;
+        uint8_t service = 0;
+        std::vector<uint8_t> value;
+    };
+
+    struct Service
+    {
+        esp_gatt_if_t gatts_if = ESP_GATT_IF_NONE;
+        uint8_t inst_id = 0;
+        bool started = false;
+        std::vector<uint16_t> handles;
+    };
+
+    struct PreparedWrite
+    {
+        uint16_t handle;
+        uint16_t offset;
+        std::vector<uint8_t> value;
+    };
+
+    struct AppTransaction
+    {
+        uint32_t trans_id;
+        uint16_t handle;
+        bool is_read;
+    };
+
+    /// Value of an indication or notification on its way to the peer.
+    struct Packet
+    {
+        uint16_t handle;
+        std::vector<uint8_t> value;
+    };
+
+    /// Robust caching state of a client: aware of the database, unaware (its requests are refused
+    /// with Database Out Of Sync) or aware again with its next request.
+    static const uint8_t change_aware = 0;
+    static const uint8_t change_unaware = 1;
+    static const uint8_t change_aware_next = 2;
+
+    /// State of the Generic Attribute service the stack keeps per client, with the bond.
+    struct GATTState
+    {
+        uint16_t service_changed_config = 0;
+        uint8_t client_features = 0;
+        uint8_t change_state = change_aware;
+        /// The database changed while the bonded client was disconnected, Service Changed is indicated when it connects.
+        bool service_changed_pending = false;
+    };
+
+    struct Bond
+    {
+        esp_bd_addr_t bda;
+        GATTState gatt;
+    };
+
+    struct Connection
+    {
+        bool connected = false;
+        esp_bd_addr_t bda = {0};
+        uint16_t mtu = ESP_GATT_DEF_BLE_MTU_SIZE;
+        /// Indications waiting for the confirmation (front) and queued behind it.
+        std::vector<Packet> indications;
+        /// Notifications in the TX buffers of the controller (only if Config::tx_buffers is set).
+        std::vector<Packet> tx_queue;
+        /// The TX buffers are full, notifications are rejected until half of them are free again.
+        bool congested = false;
+        /// Connection interval (1.25ms units).
+        uint16_t interval = 0;
+        /// Simulated time (us) of the next connection event.
+        int64_t next_event = 0;
+        /// Queue of prepared writes for attributes answered by the stack.
+        std::vector<PreparedWrite> prepared;
+        /// Transactions waiting for a response of the application.
+        std::vector<AppTransaction> app_transactions;
+        GATTState gatt;
+        bool bonded = false;
+    };
+
+    struct PendingEvent
+    {
+        bool is_gap = false;
+        esp_gatt_if_t gatts_if = ESP_GATT_IF_NONE;
+        esp_gatts_cb_event_t gatts_event = ESP_GATTS_REG_EVT;
+        esp_gap_ble_cb_event_t gap_event = ESP_GAP_BLE_ADV_DATA_SET_COMPLETE_EVT;
+        esp_ble_gatts_cb_param_t gatts_param;
+        esp_ble_gap_cb_param_t gap_param;
+        /// Handles of an attribute table event (points into Service::handles).
+        uint16_t* handles = nullptr;
+        uint16_t payload_len = 0;
+        uint8_t payload[ESP_GATT_MAX_ATTR_LEN];
+        /// Connection of a data length completion (the event doesn't carry the address).
+        uint16_t conn_id = 0xffff;
+    };
+
+    Config m_config;
+    Client* m_client = nullptr;
+    esp_gatts_cb_t m_gatts_callback = nullptr;
+    esp_gap_ble_cb_t m_gap_callback = nullptr;
+    std::vector<esp_gatt_if_t> m_apps;
+    std::vector<Service> m_services;
+    std::vector<Attribute> m_attributes;      // index = handle - first_handle
+    std::vector<Connection> m_connections;    // index = conn_id
+    std::vector<Bond> m_bonds;
+    std::vector<PendingEvent> m_queue;
+    size_t m_queue_head = 0;
+    uint32_t m_next_trans_id = 1;
+    int64_t m_time = 0;
+    uint16_t m_local_mtu = ESP_GATT_DEF_BLE_MTU_SIZE;
+    bool m_advertising = false;
+    bool m_auto_confirm = true;
+    bool m_replay = false;
+    esp_ble_adv_params_t m_adv_params;
+    std::vector<uint8_t> m_adv_data;
+    std::vector<uint8_t> m_scan_rsp_data;
+    std::vector<char> m_device_name;
+    esp_ble_conn_update_params_t m_last_conn_params;
+    Stats m_stats;
+    /// Timers created with esp_timer_create(), kept by Reset() as they belong to the application.
+    std::vector<esp_timer_handle_t> m_timers;
+    /// Guards the state against API calls of other tasks (e.g. the handler task of BLEServer).
+    mutable std::recursive_mutex m_mutex;
+
+    FakeBTStack();
+
+    std::unique_lock<std::recursive_mutex> Lock(void) const { return std::unique_lock<std::recursive_mutex>(m_mutex); }
+
+    Attribute* GetAttribute(uint16_t handle);
+    const Attribute* GetAttribute(uint16_t handle) const;
+    Connection* GetConnection(uint16_t conn_id);
+    const Connection* GetConnection(uint16_t conn_id) const;
+    Connection* GetConnection(const esp_bd_addr_t bda, uint16_t* conn_id = nullptr);
+
+    PendingEvent& QueueGATTSEvent(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if);
+    PendingEvent& QueueGAPEvent(esp_gap_ble_cb_event_t event);
+    void QueueForAllApps(esp_gatts_cb_event_t event, const esp_ble_gatts_cb_param_t& param);
+    void Deliver(PendingEvent& ev);
+    void SendNextIndication(uint16_t conn_id);
+    bool CheckChangeAware(uint16_t conn_id, uint16_t handle, bool need_rsp, bool is_read);
+    esp_gatt_status_t ReadGATTService(uint16_t conn_id, uint16_t handle, uint16_t offset);
+    esp_gatt_status_t WriteGATTService(uint16_t conn_id, uint16_t handle, const uint8_t* data, uint16_t len, bool need_rsp);
+    void IndicateServiceChanged(uint16_t conn_id);
+    void SaveBond(uint16_t conn_id);
+    Bond* FindBond(const esp_bd_addr_t bda);
+    void GetDatabaseHash(uint8_t hash[16]) const;
+    void TransmitPackets(uint16_t conn_id);
+    esp_gatt_if_t GetServiceInterface(uint16_t handle) const;
+};
@@ -0,0 +1,67 @@
+# include "file_bond_store.h"
+# include <cstdio>
+# include <cstring>
+// -------------------------------------------------------------------------------------------------------------------
+BLEFileBondStore::BLEFileBondStore(const char* path)
+:m_path(path)
+{
+    FILE* file = m_path.empty() ? nullptr : fopen(m_path.c_str(), "rb");
+    if (!file)
+        return;
+    BLEBondRecord record;
+    while (fread(&record, sizeof(record), 1, file) == 1)
+        m_records.push_back(record);
+    fclose(file);
+}
+// -------------------------------------------------------------------------------------------------------------------
+BLEBondRecord* BLEFileBondStore::Find(const esp_bd_addr_t bda)
+{
+    for (BLEBondRecord& record : m_records)
+    {
+        if (memcmp(record.bda, bda, sizeof(esp_bd_addr_t)) == 0)
+            return &record;
+    }
+    return nullptr;
+}
+// -------------------------------------------------------------------------------------------------------------------
+bool BLEFileBondStore::Load(const esp_bd_addr_t bda, BLEBondRecord& record)
+{
+    const BLEBondRecord* found = Find(bda);
+    if (!found)
+        return false;
+    record = *found;
+    return true;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t BLEFileBondStore::Save(const BLEBondRecord& record)
+{
+    ++m_saves;
+    BLEBondRecord* found = Find(record.bda);
+    if (found)
+        *found = record;
+    else
+        m_records.push_back(record);
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t BLEFileBondStore::Erase(const esp_bd_addr_t bda)
+{
+    BLEBondRecord* found = Find(bda);
+    if (found)
+        m_records.erase(m_records.begin() + (found - m_records.data()));
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t BLEFileBondStore::Commit(void)
+{
+    ++m_commits;
+    if (m_path.empty())
+        return ESP_OK;
+    FILE* file = fopen(m_path.c_str(), "wb");
+    if (!file)
+        return ESP_FAIL;
+    size_t written = m_records.empty() ? 0 : fwrite(m_records.data(), sizeof(BLEBondRecord), m_records.size(), file);
+    bool ok = fclose(file) == 0 && written == m_records.size();
+    return ok ? ESP_OK : ESP_FAIL;
+}
+// -------------------------------------------------------------------------------------------------------------------
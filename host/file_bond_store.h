@@ -0,0 +1,40 @@
+# pragma once
+// ------------------------------------------------------------------------------------------
+/*
+Bond store of host builds: the records are kept in memory and written to a
+file with every commit, so a host program can "restart" the server and find
+the subscriptions of its bonded clients again (see BLEServer::SetBondStore()).
+The file holds the BLEBondRecord structures one after the other.
+*/
+// ------------------------------------------------------------------------------------------
+# include "ble_bond_store.h"
+# include <string>
+# include <vector>
+// ------------------------------------------------------------------------------------------
+class BLEFileBondStore : public BLEBondStore
+{
+public:
+    /// Reads the records of the file \a path (if it exists). An empty \a path keeps the
+    /// records in memory only.
+    explicit BLEFileBondStore(const char* path = "");
+
+    bool Load(const esp_bd_addr_t bda, BLEBondRecord& record) override;
+    esp_err_t Save(const BLEBondRecord& record) override;
+    esp_err_t Erase(const esp_bd_addr_t bda) override;
+    esp_err_t Commit(void) override;
+
+    /// Number of records stored.
+    size_t GetCount(void) const { return m_records.size(); }
+    /// Number of Save() calls and of commits writing the file (flash writes on the target).
+    size_t GetSaves(void) const { return m_saves; }
+    size_t GetCommits(void) const { return m_commits; }
+
+protected:
+    std::string m_path;
+    std::vector<BLEBondRecord> m_records;
+    size_t m_saves = 0;
+    size_t m_commits = 0;
+
+    BLEBondRecord* Find(const esp_bd_addr_t bda);
+};
+// ------------------------------------------------------------------------------------------
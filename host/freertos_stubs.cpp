@@ -0,0 +1,133 @@
+// -------------------------------------------------------------------------------------------------------------------
+/*
+Host implementation of the FreeRTOS API used by the library and the example:
+tasks are detached std::threads, task notifications a counter with a condition
+variable and recursive mutexes std::recursive_mutex.
+*/
+// -------------------------------------------------------------------------------------------------------------------
+# include <freertos/FreeRTOS.h>
+# include <freertos/task.h>
+# include <freertos/semphr.h>
+# include <chrono>
+# include <condition_variable>
+# include <mutex>
+# include <new>
+# include <thread>
+// -------------------------------------------------------------------------------------------------------------------
+struct HostTask
+{
+    TaskFunction_t func;
+    void* param;
+    std::mutex mutex;
+    std::condition_variable cv;
+    uint32_t notification = 0;
+};
+
+struct HostMutex
+{
+    std::recursive_mutex mutex;
+};
+static_assert(sizeof(HostMutex) <= sizeof(StaticSemaphore_t), "StaticSemaphore_t too small");
+static_assert(alignof(HostMutex) <= alignof(StaticSemaphore_t), "StaticSemaphore_t misaligned");
+
+static thread_local HostTask* current_task = nullptr;
+// -------------------------------------------------------------------------------------------------------------------
+void vTaskDelay(const TickType_t ticks)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ticks * portTICK_PERIOD_MS));
+}
+// -------------------------------------------------------------------------------------------------------------------
+BaseType_t xTaskCreatePinnedToCore(
+    TaskFunction_t task, const char* name, const uint32_t stack_depth, void* param,
+    UBaseType_t priority, TaskHandle_t* task_handle, const BaseType_t core
+)
+{
+    HostTask* host_task = new HostTask();
+    host_task->func = task;
+    host_task->param = param;
+    if (task_handle)
+        *task_handle = host_task;
+
+    std::thread([host_task]() {
+        current_task = host_task;
+        host_task->func(host_task->param);
+        current_task = nullptr;
+        delete host_task;
+    }).detach();
+    return pdPASS;
+}
+// -------------------------------------------------------------------------------------------------------------------
+TaskHandle_t xTaskCreateStaticPinnedToCore(
+    TaskFunction_t task, const char* name, const uint32_t stack_depth, void* param,
+    UBaseType_t priority, StackType_t* stack, StaticTask_t* task_buffer, const BaseType_t core
+)
+{
+    TaskHandle_t handle = nullptr;
+    xTaskCreatePinnedToCore(task, name, stack_depth, param, priority, &handle, core);
+    return handle;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void vTaskDelete(TaskHandle_t task)
+{
+    // threads cannot be killed, the task function returns right after deleting itself
+}
+// -------------------------------------------------------------------------------------------------------------------
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    // signalled with the lock held, the task may end and free its state right afterwards
+    std::lock_guard<std::mutex> lock(task->mutex);
+    ++task->notification;
+    task->cv.notify_one();
+    return pdPASS;
+}
+// -------------------------------------------------------------------------------------------------------------------
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+    HostTask* task = current_task;
+    if (!task)
+        return 0;
+
+    std::unique_lock<std::mutex> lock(task->mutex);
+    auto ready = [task]() { return task->notification != 0; };
+    if (ticks == portMAX_DELAY)
+        task->cv.wait(lock, ready);
+    else
+        task->cv.wait_for(lock, std::chrono::milliseconds(ticks * portTICK_PERIOD_MS), ready);
+
+    uint32_t value = task->notification;
+    if (value)
+        task->notification = clear ? 0 : value - 1;
+    return value;
+}
+// -------------------------------------------------------------------------------------------------------------------
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    return current_task;
+}
+// -------------------------------------------------------------------------------------------------------------------
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutexStatic(StaticSemaphore_t* buffer)
+{
+    return new (buffer) HostMutex();
+}
+// -------------------------------------------------------------------------------------------------------------------
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t mutex, TickType_t ticks)
+{
+    if (ticks == portMAX_DELAY)
+    {
+        mutex->mutex.lock();
+        return pdTRUE;
+    }
+    return mutex->mutex.try_lock() ? pdTRUE : pdFALSE;
+}
+// -------------------------------------------------------------------------------------------------------------------
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t mutex)
+{
+    mutex->mutex.unlock();
+    return pdTRUE;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void vSemaphoreDelete(SemaphoreHandle_t mutex)
+{
+    mutex->~HostMutex();
+}
+// -------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,36 @@
+# pragma once
+// ------------------------------------------------------------------------------------------
+/*
+Host stand-in for the ESP-IDF esp_bt.h header (controller setup).
+On the host the controller calls only track their state.
+*/
+// ------------------------------------------------------------------------------------------
+# include "esp_err.h"
+// ------------------------------------------------------------------------------------------
+# ifdef __cplusplus
+extern "C" {
+# endif
+// ------------------------------------------------------------------------------------------
+typedef enum {
+    ESP_BT_MODE_IDLE       = 0x00,
+    ESP_BT_MODE_BLE        = 0x01,
+    ESP_BT_MODE_CLASSIC_BT = 0x02,
+    ESP_BT_MODE_BTDM       = 0x03,
+} esp_bt_mode_t;
+
+/// Controller configuration, the host has nothing to configure.
+typedef struct {
+    uint8_t mode;
+} esp_bt_controller_config_t;
+
+# define BT_CONTROLLER_INIT_CONFIG_DEFAULT() { (uint8_t)ESP_BT_MODE_BLE }
+
+esp_err_t esp_bt_controller_mem_release(esp_bt_mode_t mode);
+
+esp_err_t esp_bt_controller_init(esp_bt_controller_config_t *cfg);
+
+esp_err_t esp_bt_controller_enable(esp_bt_mode_t mode);
+// ------------------------------------------------------------------------------------------
+# ifdef __cplusplus
+}
+# endif
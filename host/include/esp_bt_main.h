@@ -0,0 +1,19 @@
+# pragma once
+// ------------------------------------------------------------------------------------------
+/*
+Host stand-in for the ESP-IDF esp_bt_main.h header.
+*/
+// ------------------------------------------------------------------------------------------
+# include "esp_err.h"
+// ------------------------------------------------------------------------------------------
+# ifdef __cplusplus
+extern "C" {
+# endif
+// ------------------------------------------------------------------------------------------
+esp_err_t esp_bluedroid_init(void);
+
+esp_err_t esp_bluedroid_enable(void);
+// ------------------------------------------------------------------------------------------
+# ifdef __cplusplus
+}
+# endif
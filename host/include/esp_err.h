@@ -0,0 +1,50 @@
+# pragma once
+// ------------------------------------------------------------------------------------------
+/*
+Host stand-in for the ESP-IDF esp_err.h header.
+Only the parts used by this library and its example are declared here.
+*/
+// ------------------------------------------------------------------------------------------
+# include <stdint.h>
+# include <stdio.h>
+# include <stdlib.h>
+# include <assert.h>
+// ------------------------------------------------------------------------------------------
+# ifdef __cplusplus
+extern "C" {
+# endif
+// ------------------------------------------------------------------------------------------
+typedef int esp_err_t;
+
+# define ESP_OK                     0
+# define ESP_FAIL                   -1
+# define ESP_ERR_NO_MEM             0x101
+# define ESP_ERR_INVALID_ARG        0x102
+# define ESP_ERR_INVALID_STATE      0x103
+# define ESP_ERR_INVALID_SIZE       0x104
+# define ESP_ERR_NOT_FOUND          0x105
+# define ESP_ERR_NOT_SUPPORTED      0x106
+# define ESP_ERR_TIMEOUT            0x107
+
+# define ESP_ERR_NVS_BASE               0x1100
+# define ESP_ERR_NVS_NOT_FOUND          (ESP_ERR_NVS_BASE + 0x02)
+# define ESP_ERR_NVS_INVALID_HANDLE     (ESP_ERR_NVS_BASE + 0x07)
+# define ESP_ERR_NVS_INVALID_LENGTH     (ESP_ERR_NVS_BASE + 0x0c)
+# define ESP_ERR_NVS_NO_FREE_PAGES      (ESP_ERR_NVS_BASE + 0x0d)
+# define ESP_ERR_NVS_NEW_VERSION_FOUND  (ESP_ERR_NVS_BASE + 0x10)
+
+/// Returns a readable name for the error code \a code.
+const char* esp_err_to_name(esp_err_t code);
+// ------------------------------------------------------------------------------------------
+# ifdef __cplusplus
+}
+# endif
+// ------------------------------------------------------------------------------------------
+# define ESP_ERROR_CHECK(x) do {                                                        \
+        esp_err_t err_rc_ = (x);                                                        \
+        if (err_rc_ != ESP_OK) {                                                        \
+            fprintf(stderr, "ESP_ERROR_CHECK failed: %s (0x%x) at %s:%d\n",             \
+                    esp_err_to_name(err_rc_), err_rc_, __FILE__, __LINE__);             \
+            abort();                                                                    \
+        }                                                                               \
+    } while (0)
@@ -0,0 +1,223 @@
+# pragma once
+// ------------------------------------------------------------------------------------------
+/*
+Host stand-in for the ESP-IDF esp_gap_ble_api.h header (BLE GAP API).
+The functions are implemented by the fake bluedroid stack in fake_bt_stack.cpp.
+*/
+// ------------------------------------------------------------------------------------------
+# include "esp_bt_defs.h"
+// ------------------------------------------------------------------------------------------
+# ifdef __cplusplus
+extern "C" {
+# endif
+// ------------------------------------------------------------------------------------------
+/// GAP BLE callback events
+typedef enum {
+    ESP_GAP_BLE_ADV_DATA_SET_COMPLETE_EVT        = 0,
+    ESP_GAP_BLE_SCAN_RSP_DATA_SET_COMPLETE_EVT,
+    ESP_GAP_BLE_SCAN_PARAM_SET_COMPLETE_EVT,
+    ESP_GAP_BLE_SCAN_RESULT_EVT,
+    ESP_GAP_BLE_ADV_DATA_RAW_SET_COMPLETE_EVT,
+    ESP_GAP_BLE_SCAN_RSP_DATA_RAW_SET_COMPLETE_EVT,
+    ESP_GAP_BLE_ADV_START_COMPLETE_EVT,
+    ESP_GAP_BLE_SCAN_START_COMPLETE_EVT,
+    ESP_GAP_BLE_AUTH_CMPL_EVT                    = 8,
+    ESP_GAP_BLE_KEY_EVT,
+    ESP_GAP_BLE_SEC_REQ_EVT,
+    ESP_GAP_BLE_PASSKEY_NOTIF_EVT,
+    ESP_GAP_BLE_PASSKEY_REQ_EVT,
+    ESP_GAP_BLE_OOB_REQ_EVT,
+    ESP_GAP_BLE_LOCAL_IR_EVT,
+    ESP_GAP_BLE_LOCAL_ER_EVT,
+    ESP_GAP_BLE_NC_REQ_EVT,
+    ESP_GAP_BLE_ADV_STOP_COMPLETE_EVT,
+    ESP_GAP_BLE_SCAN_STOP_COMPLETE_EVT,
+    ESP_GAP_BLE_SET_STATIC_RAND_ADDR_EVT         = 19,
+    ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT,
+    ESP_GAP_BLE_SET_PKT_LENGTH_COMPLETE_EVT,
+    ESP_GAP_BLE_SET_LOCAL_PRIVACY_COMPLETE_EVT,
+    ESP_GAP_BLE_REMOVE_BOND_DEV_COMPLETE_EVT,
+    ESP_GAP_BLE_CLEAR_BOND_DEV_COMPLETE_EVT,
+    ESP_GAP_BLE_GET_BOND_DEV_COMPLETE_EVT,
+    ESP_GAP_BLE_READ_RSSI_COMPLETE_EVT,
+    ESP_GAP_BLE_UPDATE_WHITELIST_COMPLETE_EVT,
+    /* BLE 5.0 controllers (CONFIG_BT_BLE_50_FEATURES_SUPPORTED) */
+    ESP_GAP_BLE_PHY_UPDATE_COMPLETE_EVT          = 55,
+    ESP_GAP_BLE_EVT_MAX,
+} esp_gap_ble_cb_event_t;
+
+/// Advertising mode
+typedef enum {
+    ADV_TYPE_IND                = 0x00,
+    ADV_TYPE_DIRECT_IND_HIGH    = 0x01,
+    ADV_TYPE_SCAN_IND           = 0x02,
+    ADV_TYPE_NONCONN_IND        = 0x03,
+    ADV_TYPE_DIRECT_IND_LOW     = 0x04,
+} esp_ble_adv_type_t;
+
+/// Advertising channels
+typedef enum {
+    ADV_CHNL_37     = 0x01,
+    ADV_CHNL_38     = 0x02,
+    ADV_CHNL_39     = 0x04,
+    ADV_CHNL_ALL    = 0x07,
+} esp_ble_adv_channel_t;
+
+/// Advertising filter policy
+typedef enum {
+    ADV_FILTER_ALLOW_SCAN_ANY_CON_ANY  = 0x00,
+    ADV_FILTER_ALLOW_SCAN_WLST_CON_ANY,
+    ADV_FILTER_ALLOW_SCAN_ANY_CON_WLST,
+    ADV_FILTER_ALLOW_SCAN_WLST_CON_WLST,
+} esp_ble_adv_filter_t;
+
+/// Advertising parameters
+typedef struct {
+    uint16_t                adv_int_min;
+    uint16_t                adv_int_max;
+    esp_ble_adv_type_t      adv_type;
+    esp_ble_addr_type_t     own_addr_type;
+    esp_bd_addr_t           peer_addr;
+    esp_ble_addr_type_t     peer_addr_type;
+    esp_ble_adv_channel_t   channel_map;
+    esp_ble_adv_filter_t    adv_filter_policy;
+} esp_ble_adv_params_t;
+
+/// Connection update parameters
+typedef struct {
+    esp_bd_addr_t bda;
+    uint16_t min_int;
+    uint16_t max_int;
+    uint16_t latency;
+    uint16_t timeout;
+} esp_ble_conn_update_params_t;
+
+/// Data length of a connection
+typedef struct {
+    uint16_t rx_len;
+    uint16_t tx_len;
+} esp_ble_pkt_data_length_params_t;
+
+/// PHY preference masks of esp_ble_gap_set_preferred_phy()
+typedef uint8_t esp_ble_gap_phy_mask_t;
+# define ESP_BLE_GAP_PHY_1M_PREF_MASK        (1 << 0)
+# define ESP_BLE_GAP_PHY_2M_PREF_MASK        (1 << 1)
+# define ESP_BLE_GAP_PHY_CODED_PREF_MASK     (1 << 2)
+
+typedef uint8_t esp_ble_gap_all_phys_t;
+# define ESP_BLE_GAP_NO_PREFER_TRANSMIT_PHY  (1 << 0)
+# define ESP_BLE_GAP_NO_PREFER_RECEIVE_PHY   (1 << 1)
+
+typedef uint16_t esp_ble_gap_prefer_phy_options_t;
+# define ESP_BLE_GAP_PHY_OPTIONS_NO_PREF     0
+
+/// PHY of a connection reported by ESP_GAP_BLE_PHY_UPDATE_COMPLETE_EVT
+typedef uint8_t esp_ble_gap_phy_t;
+# define ESP_BLE_GAP_PHY_1M                  1
+# define ESP_BLE_GAP_PHY_2M                  2
+# define ESP_BLE_GAP_PHY_CODED               3
+
+/// Authentication complete data
+typedef struct {
+    esp_bd_addr_t         bd_addr;
+    bool                  key_present;
+    uint8_t               key[16];
+    uint8_t               key_type;
+    bool                  success;
+    uint8_t               fail_reason;
+    esp_ble_addr_type_t   addr_type;
+    esp_bt_dev_type_t     dev_type;
+    uint8_t               auth_mode;
+} esp_ble_auth_cmpl_t;
+
+/// Security events data
+typedef union {
+    esp_ble_auth_cmpl_t   auth_cmpl;
+} esp_ble_sec_t;
+
+/// GAP BLE callback parameters
+typedef union {
+    struct ble_adv_data_cmpl_evt_param {
+        esp_bt_status_t status;
+    } adv_data_cmpl;
+
+    struct ble_scan_rsp_data_cmpl_evt_param {
+        esp_bt_status_t status;
+    } scan_rsp_data_cmpl;
+
+    struct ble_adv_data_raw_cmpl_evt_param {
+        esp_bt_status_t status;
+    } adv_data_raw_cmpl;
+
+    struct ble_scan_rsp_data_raw_cmpl_evt_param {
+        esp_bt_status_t status;
+    } scan_rsp_data_raw_cmpl;
+
+    struct ble_adv_start_cmpl_evt_param {
+        esp_bt_status_t status;
+    } adv_start_cmpl;
+
+    struct ble_adv_stop_cmpl_evt_param {
+        esp_bt_status_t status;
+    } adv_stop_cmpl;
+
+    esp_ble_sec_t ble_security;
+
+    struct ble_update_conn_params_evt_param {
+        esp_bt_status_t status;
+        esp_bd_addr_t bda;
+        uint16_t min_int;
+        uint16_t max_int;
+        uint16_t latency;
+        uint16_t conn_int;
+        uint16_t timeout;
+    } update_conn_params;
+
+    struct ble_pkt_data_length_cmpl_evt_param {
+        esp_bt_status_t status;
+        esp_ble_pkt_data_length_params_t params;
+    } pkt_data_lenth_cmpl;
+
+    struct ble_phy_update_cmpl_param {
+        esp_bt_status_t status;
+        esp_bd_addr_t bda;
+        esp_ble_gap_phy_t tx_phy;
+        esp_ble_gap_phy_t rx_phy;
+    } phy_update;
+
+    struct ble_remove_bond_dev_cmpl_evt_param {
+        esp_bt_status_t status;
+        esp_bd_addr_t bd_addr;
+    } remove_bond_dev_cmpl;
+} esp_ble_gap_cb_param_t;
+
+/// GAP callback function type
+typedef void (* esp_gap_ble_cb_t)(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param);
+// ------------------------------------------------------------------------------------------
+esp_err_t esp_ble_gap_register_callback(esp_gap_ble_cb_t callback);
+
+esp_err_t esp_ble_gap_start_advertising(esp_ble_adv_params_t *adv_params);
+
+esp_err_t esp_ble_gap_stop_advertising(void);
+
+esp_err_t esp_ble_gap_config_adv_data_raw(uint8_t *raw_data, uint32_t raw_data_len);
+
+esp_err_t esp_ble_gap_config_scan_rsp_data_raw(uint8_t *raw_data, uint32_t raw_data_len);
+
+esp_err_t esp_ble_gap_set_device_name(const char *name);
+
+esp_err_t esp_ble_gap_update_conn_params(esp_ble_conn_update_params_t *params);
+
+esp_err_t esp_ble_gap_set_pkt_data_len(esp_bd_addr_t remote_device, uint16_t tx_data_length);
+
+esp_err_t esp_ble_gap_disconnect(esp_bd_addr_t remote_device);
+
+esp_err_t esp_ble_gap_set_preferred_phy(esp_bd_addr_t bd_addr, esp_ble_gap_all_phys_t all_phys_mask,
+                                        esp_ble_gap_phy_mask_t tx_phy_mask, esp_ble_gap_phy_mask_t rx_phy_mask,
+                                        esp_ble_gap_prefer_phy_options_t phy_options);
+
+esp_err_t esp_ble_remove_bond_device(esp_bd_addr_t bd_addr);
+// ------------------------------------------------------------------------------------------
+# ifdef __cplusplus
+}
+# endif
@@ -0,0 +1,18 @@
+# pragma once
+// ------------------------------------------------------------------------------------------
+/*
+Host stand-in for the ESP-IDF esp_gatt_common_api.h header.
+*/
+// ------------------------------------------------------------------------------------------
+# include "esp_gatt_defs.h"
+// ------------------------------------------------------------------------------------------
+# ifdef __cplusplus
+extern "C" {
+# endif
+// ------------------------------------------------------------------------------------------
+/// Sets the local MTU offered during the MTU exchange.
+esp_err_t esp_ble_gatt_set_local_mtu(uint16_t mtu);
+// ------------------------------------------------------------------------------------------
+# ifdef __cplusplus
+}
+# endif
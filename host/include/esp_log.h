@@ -0,0 +1,47 @@
+# pragma once
+// ------------------------------------------------------------------------------------------
+/*
+Host stand-in for the ESP-IDF esp_log.h header.
+Messages are written to stderr, filtered by the level set with esp_log_level_set().
+*/
+// ------------------------------------------------------------------------------------------
+# include "esp_err.h"
+// ------------------------------------------------------------------------------------------
+# ifdef __cplusplus
+extern "C" {
+# endif
+// ------------------------------------------------------------------------------------------
+typedef enum {
+    ESP_LOG_NONE,
+    ESP_LOG_ERROR,
+    ESP_LOG_WARN,
+    ESP_LOG_INFO,
+    ESP_LOG_DEBUG,
+    ESP_LOG_VERBOSE
+} esp_log_level_t;
+
+/// Sets the maximum level written for all tags ("*"), other tags are ignored on the host.
+void esp_log_level_set(const char* tag, esp_log_level_t level);
+
+/// Writes a formatted message if \a level is enabled.
+void esp_log_write(esp_log_level_t level, const char* tag, const char* format, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/// Writes \a buff_len bytes of \a buffer as hex dump if \a level is enabled.
+void esp_log_buffer_hexdump_internal(const char* tag, const void* buffer, uint16_t buff_len, esp_log_level_t level);
+
+/// Milliseconds since start of the process.
+uint32_t esp_log_timestamp(void);
+// ------------------------------------------------------------------------------------------
+# ifdef __cplusplus
+}
+# endif
+// ------------------------------------------------------------------------------------------
+# define ESP_LOGE(tag, format, ...) esp_log_write(ESP_LOG_ERROR,   tag, "E (%u) %s: " format "\n", esp_log_timestamp(), tag, ##__VA_ARGS__)
+# define ESP_LOGW(tag, format, ...) esp_log_write(ESP_LOG_WARN,    tag, "W (%u) %s: " format "\n", esp_log_timestamp(), tag, ##__VA_ARGS__)
+# define ESP_LOGI(tag, format, ...) esp_log_write(ESP_LOG_INFO,    tag, "I (%u) %s: " format "\n", esp_log_timestamp(), tag, ##__VA_ARGS__)
+# define ESP_LOGD(tag, format, ...) esp_log_write(ESP_LOG_DEBUG,   tag, "D (%u) %s: " format "\n", esp_log_timestamp(), tag, ##__VA_ARGS__)
+# define ESP_LOGV(tag, format, ...) esp_log_write(ESP_LOG_VERBOSE, tag, "V (%u) %s: " format "\n", esp_log_timestamp(), tag, ##__VA_ARGS__)
+
+# define ESP_LOG_BUFFER_HEXDUMP(tag, buffer, buff_len, level) \
+    esp_log_buffer_hexdump_internal(tag, buffer, buff_len, level)
@@ -0,0 +1,7 @@
+# pragma once
+// ------------------------------------------------------------------------------------------
+/*
+Host stand-in for the ESP-IDF esp_system.h header.
+*/
+// ------------------------------------------------------------------------------------------
+# include "esp_err.h"
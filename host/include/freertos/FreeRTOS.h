@@ -0,0 +1,20 @@
+# pragma once
+// ------------------------------------------------------------------------------------------
+/*
+Host stand-in for the FreeRTOS main header as shipped with ESP-IDF.
+*/
+// ------------------------------------------------------------------------------------------
+# include <stdint.h>
+# include <stddef.h>
+// ------------------------------------------------------------------------------------------
+typedef uint32_t TickType_t;
+typedef int32_t BaseType_t;
+typedef uint32_t UBaseType_t;
+
+# define pdFALSE            ((BaseType_t)0)
+# define pdTRUE             ((BaseType_t)1)
+# define pdPASS             pdTRUE
+# define pdFAIL             pdFALSE
+# define portMAX_DELAY      ((TickType_t)0xffffffffUL)
+# define portTICK_PERIOD_MS ((TickType_t)1)
+# define pdMS_TO_TICKS(ms)  ((TickType_t)(ms) / portTICK_PERIOD_MS)
@@ -0,0 +1,7 @@
+# pragma once
+// ------------------------------------------------------------------------------------------
+/*
+Host stand-in for the FreeRTOS event group API, not used by this library.
+*/
+// ------------------------------------------------------------------------------------------
+# include "FreeRTOS.h"
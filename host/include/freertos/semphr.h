@@ -0,0 +1,25 @@
+# pragma once
+// ------------------------------------------------------------------------------------------
+/*
+Host stand-in for the FreeRTOS semaphore API as shipped with ESP-IDF.
+Only recursive mutexes are provided, backed by std::recursive_mutex.
+*/
+// ------------------------------------------------------------------------------------------
+# include "FreeRTOS.h"
+// ------------------------------------------------------------------------------------------
+# ifdef __cplusplus
+extern "C" {
+# endif
+// ------------------------------------------------------------------------------------------
+typedef struct HostMutex* SemaphoreHandle_t;
+/// Storage of a mutex created by xSemaphoreCreateRecursiveMutexStatic().
+typedef union { long double align; uint8_t storage[64]; } StaticSemaphore_t;
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutexStatic(StaticSemaphore_t* buffer);
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t mutex, TickType_t ticks);
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t mutex);
+void vSemaphoreDelete(SemaphoreHandle_t mutex);
+// ------------------------------------------------------------------------------------------
+# ifdef __cplusplus
+}
+# endif
@@ -0,0 +1,54 @@
+# pragma once
+// ------------------------------------------------------------------------------------------
+/*
+Host stand-in for the FreeRTOS task API as shipped with ESP-IDF.
+Tasks are std::threads, priorities and cores are ignored.
+*/
+// ------------------------------------------------------------------------------------------
+# include "FreeRTOS.h"
+// ------------------------------------------------------------------------------------------
+# ifdef __cplusplus
+extern "C" {
+# endif
+// ------------------------------------------------------------------------------------------
+typedef struct HostTask* TaskHandle_t;
+typedef void (*TaskFunction_t)(void*);
+/// ESP-IDF: stack sizes are given in bytes.
+typedef uint8_t StackType_t;
+typedef struct { void* reserved; } StaticTask_t;
+
+# define tskNO_AFFINITY ((BaseType_t)0x7FFFFFFF)
+
+/// Sleeps the calling thread for \a ticks milliseconds.
+void vTaskDelay(const TickType_t ticks);
+
+/// Starts a thread running \a task(\a param), \a task_handle (optional) receives its handle.
+BaseType_t xTaskCreatePinnedToCore(
+    TaskFunction_t task, const char* name, const uint32_t stack_depth, void* param,
+    UBaseType_t priority, TaskHandle_t* task_handle, const BaseType_t core
+);
+
+/// Same as above, the stack and control block of the caller are not used on the host.
+TaskHandle_t xTaskCreateStaticPinnedToCore(
+    TaskFunction_t task, const char* name, const uint32_t stack_depth, void* param,
+    UBaseType_t priority, StackType_t* stack, StaticTask_t* task_buffer, const BaseType_t core
+);
+
+/// On the host a task can only delete itself (\a task \c NULL), the thread
+/// ends when the task function returns afterwards.
+void vTaskDelete(TaskHandle_t task);
+
+/// Increments the notification value of \a task.
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+
+/// Waits up to \a ticks for the notification value of the calling task to be non-zero,
+/// then clears it (\a clear) or decrements it.
+/// \returns The value before it was cleared / decremented.
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks);
+
+/// Handle of the calling task (\c NULL for threads not started by xTaskCreate*).
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+// ------------------------------------------------------------------------------------------
+# ifdef __cplusplus
+}
+# endif
@@ -0,0 +1,38 @@
+# pragma once
+// ------------------------------------------------------------------------------------------
+/*
+Host stand-in for the ESP-IDF nvs.h header.
+The host NVS keeps the blobs in memory for the lifetime of the process,
+so they survive servers being deleted and created again ("reboots").
+*/
+// ------------------------------------------------------------------------------------------
+# include "esp_err.h"
+# include <stddef.h>
+# include <stdint.h>
+// ------------------------------------------------------------------------------------------
+# ifdef __cplusplus
+extern "C" {
+# endif
+// ------------------------------------------------------------------------------------------
+typedef uint32_t nvs_handle_t;
+
+typedef enum {
+    NVS_READONLY,
+    NVS_READWRITE
+} nvs_open_mode_t;
+
+esp_err_t nvs_open(const char* name, nvs_open_mode_t open_mode, nvs_handle_t* out_handle);
+
+void nvs_close(nvs_handle_t handle);
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char* key, void* out_value, size_t* length);
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char* key, const void* value, size_t length);
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char* key);
+
+esp_err_t nvs_commit(nvs_handle_t handle);
+// ------------------------------------------------------------------------------------------
+# ifdef __cplusplus
+}
+# endif
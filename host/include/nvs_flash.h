@@ -0,0 +1,19 @@
+# pragma once
+// ------------------------------------------------------------------------------------------
+/*
+Host stand-in for the ESP-IDF nvs_flash.h header.
+*/
+// ------------------------------------------------------------------------------------------
+# include "esp_err.h"
+// ------------------------------------------------------------------------------------------
+# ifdef __cplusplus
+extern "C" {
+# endif
+// ------------------------------------------------------------------------------------------
+esp_err_t nvs_flash_init(void);
+
+esp_err_t nvs_flash_erase(void);
+// ------------------------------------------------------------------------------------------
+# ifdef __cplusplus
+}
+# endif
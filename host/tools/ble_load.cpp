@@ -0,0 +1,393 @@
+// -------------------------------------------------------------------------------------------------------------------
+/*
+Load generator for the command / notification path on the host: simulated
+clients connect to a BLEServer on the fake stack, each with its own MTU,
+subscribe to the reply characteristic and write framed commands at their
+own rate. Every command is answered with a notification, the tool reports
+the write-to-notification latency (p50 / p99 / p999), throughput and drops
+per client and overall:
+
+    ble_load [--clients N] [--rate R,...] [--mtu M,...] [--reply B,...] [--duration S]
+             [--interval I] [--tx-buffers T] [--packets P] [--jitter PERCENT] [--max-p99 US]
+
+Lists are assigned to the clients round robin (e.g. --mtu 23,185,247,517).
+The time is simulated: a command reaches the server when it's written, the
+reply leaves with the next connection event of its client (every I * 1.25ms,
+P packets per event, T controller buffers before the connection congests), so
+the latency is the queueing in the server and the controller. The wall clock
+time of the server is reported as host time per command. With --max-p99 the
+tool fails if the p99 latency of all replies exceeds the limit, to catch
+tail latency regressions in a build.
+
+Commands: header 0xAA, command 0x01, 4 bytes sequence number, 2 bytes reply
+length (little endian), footer 0x55. The reply starts with the sequence number
+and is filled up to the reply length (at most MTU - 3).
+*/
+// -------------------------------------------------------------------------------------------------------------------
+# include "fake_bt_stack.h"
+# include "ble_server.h"
+# include "ble_command.h"
+# include <esp_gatt_common_api.h>
+# include <algorithm>
+# include <chrono>
+# include <cstdio>
+# include <cstdlib>
+# include <cstring>
+# include <random>
+# include <vector>
+// -------------------------------------------------------------------------------------------------------------------
+static BLEServer* s_server = nullptr;
+
+static void OnGATTEvent(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param)
+{
+    s_server->HandleGATTEvent(event, gatts_if, param);
+}
+
+static void OnGAPEvent(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t* param)
+{
+    s_server->HandleGAPEvent(event, param);
+}
+// -------------------------------------------------------------------------------------------------------------------
+static const uint16_t service_uuid = 0xfff0;
+static const uint16_t tx_uuid = 0xfff1;
+static const uint16_t rx_uuid = 0xfff2;
+static uint8_t s_tx_value[20];
+static uint8_t s_rx_value[512];
+static uint8_t s_rx_config[2];
+
+/// Answers the sequence number, filled up to the requested length.
+static bool OnEcho(uint16_t conn_id, const uint8_t* request, uint16_t len, uint8_t* reply, uint16_t& reply_len)
+{
+    uint16_t requested = (uint16_t)(request[4] | (request[5] << 8));
+    reply_len = std::max<uint16_t>(4, std::min(requested, reply_len));
+    memcpy(reply, request, 4);
+    memset(reply + 4, 0x5A, reply_len - 4);
+    return true;
+}
+
+typedef BLECommandDispatcher<
+    BLEFrame<0xAA, 0x55>,
+    BLECommandTable<
+        BLECommand<0x01, OnEcho, 6, 6>
+    >
+> LoadCommands;
+// -------------------------------------------------------------------------------------------------------------------
+/// Settings of the run, see the usage above.
+struct LoadConfig
+{
+    uint8_t clients = 4;
+    std::vector<uint32_t> rates = {50};
+    std::vector<uint32_t> mtus = {23, 185, 247, 517};
+    std::vector<uint32_t> replies = {20};
+    uint32_t duration_s = 10;
+    uint16_t interval = 24;
+    uint8_t tx_buffers = 8;
+    uint8_t packets = 4;
+    uint32_t jitter = 20;
+    uint32_t max_p99_us = 0;
+};
+
+/// State and results of a simulated client.
+struct LoadClient
+{
+    uint16_t conn_id = FakeBTStack::invalid_conn_id;
+    uint16_t mtu = 0;
+    uint32_t rate = 0;
+    uint16_t reply_len = 0;
+    int64_t next_send = 0;
+    /// Send time of each command by sequence number, -1 once answered.
+    std::vector<int64_t> sent;
+    uint32_t replies = 0;
+    uint64_t reply_bytes = 0;
+    uint32_t unexpected = 0;
+    std::vector<uint32_t> latencies;
+};
+// -------------------------------------------------------------------------------------------------------------------
+/// Receives the replies of all clients.
+class LoadObserver : public FakeBTStack::Client
+{
+public:
+    LoadObserver(std::vector<LoadClient>& clients, uint16_t rx_handle) : m_clients(clients), m_rx_handle(rx_handle) {}
+
+    void OnNotification(uint16_t conn_id, uint16_t handle, const uint8_t* value, uint16_t len, bool is_indication) override
+    {
+        LoadClient* client = Find(conn_id);
+        if (!client || handle != m_rx_handle)
+            return;
+        uint32_t seq = len >= 4 ? (uint32_t)(value[0] | (value[1] << 8) | (value[2] << 16) | ((uint32_t)value[3] << 24)) : 0;
+        if (len < 4 || seq >= client->sent.size() || client->sent[seq] < 0)
+        {
+            ++client->unexpected;
+            return;
+        }
+        client->latencies.push_back((uint32_t)(FakeBTStack::Instance().GetTime() - client->sent[seq]));
+        client->sent[seq] = -1;
+        ++client->replies;
+        client->reply_bytes += len;
+    }
+
+protected:
+    std::vector<LoadClient>& m_clients;
+    uint16_t m_rx_handle;
+
+    LoadClient* Find(uint16_t conn_id)
+    {
+        for (LoadClient& client : m_clients)
+        {
+            if (client.conn_id == conn_id)
+                return &client;
+        }
+        return nullptr;
+    }
+};
+// -------------------------------------------------------------------------------------------------------------------
+/// Value at percentile \a p of the sorted \a values (nearest rank).
+static uint32_t GetPercentile(const std::vector<uint32_t>& values, double p)
+{
+    return values.empty() ? 0 : values[std::min(values.size() - 1, (size_t)(p * values.size()))];
+}
+// -------------------------------------------------------------------------------------------------------------------
+/// Parses a comma separated list of numbers.
+static bool ParseList(const char* text, std::vector<uint32_t>& values)
+{
+    values.clear();
+    while (*text)
+    {
+        char* end;
+        unsigned long value = strtoul(text, &end, 10);
+        if (end == text || value == 0 || (*end && *end != ','))
+            return false;
+        values.push_back((uint32_t)value);
+        text = *end ? end + 1 : end;
+    }
+    return !values.empty();
+}
+// -------------------------------------------------------------------------------------------------------------------
+static bool ParseArgs(int argc, char** argv, LoadConfig& config)
+{
+    for (int i = 1; i < argc; i += 2)
+    {
+        if (i + 1 >= argc)
+            return false;
+        const char* name = argv[i];
+        const char* value = argv[i + 1];
+        uint32_t number = (uint32_t)strtoul(value, nullptr, 10);
+        if (strcmp(name, "--clients") == 0)
+            config.clients = (uint8_t)std::min<uint32_t>(number, 255);
+        else if (strcmp(name, "--rate") == 0 && ParseList(value, config.rates))
+            continue;
+        else if (strcmp(name, "--mtu") == 0 && ParseList(value, config.mtus))
+            continue;
+        else if (strcmp(name, "--reply") == 0 && ParseList(value, config.replies))
+            continue;
+        else if (strcmp(name, "--duration") == 0)
+            config.duration_s = number;
+        else if (strcmp(name, "--interval") == 0)
+            config.interval = (uint16_t)number;
+        else if (strcmp(name, "--tx-buffers") == 0)
+            config.tx_buffers = (uint8_t)number;
+        else if (strcmp(name, "--packets") == 0)
+            config.packets = (uint8_t)number;
+        else if (strcmp(name, "--jitter") == 0)
+            config.jitter = std::min<uint32_t>(number, 100);
+        else if (strcmp(name, "--max-p99") == 0)
+            config.max_p99_us = number;
+        else
+            return false;
+    }
+    return config.clients > 0 && config.duration_s > 0 && config.interval >= 6 && config.packets > 0;
+}
+// -------------------------------------------------------------------------------------------------------------------
+/// Creates the server: a service with the command characteristic and the reply characteristic.
+static void StartServer(FakeBTStack& stack, const LoadConfig& config)
+{
+    FakeBTStack::Config stack_config;
+    stack_config.max_connections = config.clients;
+    stack_config.conn_interval = config.interval;
+    stack_config.min_conn_interval = config.interval;
+    stack_config.tx_buffers = config.tx_buffers;
+    stack_config.packets_per_event = config.packets;
+    stack.Reset(stack_config);
+
+    s_server = new BLEServer("load");
+    uint8_t svc_idx = s_server->AddService(service_uuid);
+    uint8_t tx_idx = s_server->AddCharacteristic(
+        &tx_uuid, &char_prop_write_norsp, ESP_GATT_PERM_WRITE, sizeof(s_tx_value), 0, s_tx_value
+    );
+    uint8_t rx_idx = s_server->AddCharacteristic(
+        &rx_uuid, &char_prop_notify, ESP_GATT_PERM_READ, sizeof(s_rx_value), 0, s_rx_value,
+        nullptr, nullptr, s_rx_config
+    );
+    s_server->SetEventHandler(svc_idx, tx_idx, LoadCommands::HandleEvent, evt_mask_write, svc_idx, rx_idx);
+
+    esp_ble_gatts_register_callback(OnGATTEvent);
+    esp_ble_gap_register_callback(OnGAPEvent);
+    esp_ble_gatt_set_local_mtu(517);
+    esp_ble_gatts_app_register(0x55);
+    stack.Pump();
+}
+// -------------------------------------------------------------------------------------------------------------------
+/// Connects the clients, one after the other as the server advertises again after each connection.
+static bool ConnectClients(FakeBTStack& stack, const LoadConfig& config, std::vector<LoadClient>& clients, uint16_t rx_cccd)
+{
+    for (uint8_t i = 0; i < config.clients; ++i)
+    {
+        LoadClient& client = clients[i];
+        const esp_bd_addr_t bda = {0x02, 0x00, 0x00, 0x00, 0x10, i};
+        client.conn_id = stack.Connect(bda);
+        stack.Pump();
+        if (client.conn_id == FakeBTStack::invalid_conn_id)
+        {
+            fprintf(stderr, "Client %d cannot connect (BLE_MAX_CONNECTIONS is %d).\n", i, BLE_MAX_CONNECTIONS);
+            return false;
+        }
+        stack.ExchangeMTU(client.conn_id, (uint16_t)config.mtus[i % config.mtus.size()]);
+        stack.Pump();
+        const uint8_t subscribe[2] = {0x01, 0x00};
+        stack.Write(client.conn_id, rx_cccd, subscribe, sizeof(subscribe));
+        stack.Pump();
+
+        client.mtu = stack.GetMTU(client.conn_id);
+        client.rate = config.rates[i % config.rates.size()];
+        client.reply_len = (uint16_t)std::min<uint32_t>(config.replies[i % config.replies.size()], client.mtu - 3);
+    }
+    return true;
+}
+// -------------------------------------------------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+    LoadConfig config;
+    if (!ParseArgs(argc, argv, config))
+    {
+        fprintf(
+            stderr,
+            "usage: %s [--clients N] [--rate R,...] [--mtu M,...] [--reply B,...] [--duration S]\n"
+            "          [--interval I] [--tx-buffers T] [--packets P] [--jitter PERCENT] [--max-p99 US]\n",
+            argv[0]
+        );
+        return 2;
+    }
+
+    FakeBTStack& stack = FakeBTStack::Instance();
+    StartServer(stack, config);
+    uint16_t tx_handle = stack.FindHandle(tx_uuid);
+    uint16_t rx_handle = stack.FindHandle(rx_uuid);
+    uint16_t rx_cccd = stack.FindDescriptor(rx_handle, ESP_GATT_UUID_CHAR_CLIENT_CONFIG);
+
+    std::vector<LoadClient> clients(config.clients);
+    LoadObserver observer(clients, rx_handle);
+    stack.SetClient(&observer);
+    if (!ConnectClients(stack, config, clients, rx_cccd))
+    {
+        delete s_server;
+        return 1;
+    }
+
+    // the clients start at random points within their first period, so they don't send in lockstep
+    std::mt19937 random(1);
+    int64_t start = stack.GetTime();
+    for (LoadClient& client : clients)
+        client.next_send = start + random() % (1000000 / client.rate);
+
+    double host_ns = 0;
+    int64_t end = start + (int64_t)config.duration_s * 1000000;
+    for (;;)
+    {
+        int64_t now = stack.GetTime();
+        int64_t next = end;
+        for (const LoadClient& client : clients)
+            next = std::min(next, client.next_send);
+        if (next >= end)
+            break;
+        stack.AdvanceTime((uint32_t)std::max<int64_t>(0, next - now));
+        auto host_start = std::chrono::steady_clock::now();
+        stack.Pump();
+
+        for (LoadClient& client : clients)
+        {
+            if (client.next_send > next)
+                continue;
+            uint32_t seq = (uint32_t)client.sent.size();
+            const uint8_t command[9] = {
+                0xAA, 0x01, (uint8_t)seq, (uint8_t)(seq >> 8), (uint8_t)(seq >> 16), (uint8_t)(seq >> 24),
+                (uint8_t)client.reply_len, (uint8_t)(client.reply_len >> 8), 0x55
+            };
+            client.sent.push_back(next);
+            stack.Write(client.conn_id, tx_handle, command, sizeof(command), false);
+            stack.Pump();
+
+            int64_t period = 1000000 / client.rate;
+            int64_t jitter = config.jitter ? (int64_t)(random() % (period * config.jitter / 100 + 1)) - period * config.jitter / 200 : 0;
+            client.next_send += std::max<int64_t>(1, period + jitter);
+        }
+        host_ns += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - host_start).count();
+    }
+
+    // replies still queued leave with the next connection events
+    for (int i = 0; i < 100; ++i)
+    {
+        stack.AdvanceTime(config.interval * 1250);
+        stack.Pump();
+    }
+
+    printf("%d clients, %u s, connection interval %.2f ms, %d tx buffers, %d packets per event\n\n",
+           config.clients, config.duration_s, config.interval * 1.25, config.tx_buffers, config.packets);
+    printf("%6s %5s %6s %6s %8s %8s %8s %8s %8s %8s %8s %9s\n",
+           "client", "mtu", "cmd/s", "reply", "sent", "replies", "dropped", "p50 us", "p99 us", "p999 us", "max us", "kB/s");
+
+    std::vector<uint32_t> all;
+    uint64_t sent = 0;
+    uint64_t replies = 0;
+    uint64_t reply_bytes = 0;
+    uint32_t unexpected = 0;
+    for (size_t i = 0; i < clients.size(); ++i)
+    {
+        LoadClient& client = clients[i];
+        std::sort(client.latencies.begin(), client.latencies.end());
+        printf("%6zu %5d %6u %6d %8zu %8u %8zu %8u %8u %8u %8u %9.1f\n",
+               i, client.mtu, client.rate, client.reply_len, client.sent.size(), client.replies,
+               client.sent.size() - client.replies,
+               GetPercentile(client.latencies, 0.5), GetPercentile(client.latencies, 0.99),
+               GetPercentile(client.latencies, 0.999), client.latencies.empty() ? 0 : client.latencies.back(),
+               client.reply_bytes / 1000.0 / config.duration_s);
+        all.insert(all.end(), client.latencies.begin(), client.latencies.end());
+        sent += client.sent.size();
+        replies += client.replies;
+        reply_bytes += client.reply_bytes;
+        unexpected += client.unexpected;
+    }
+    std::sort(all.begin(), all.end());
+    uint32_t p99 = GetPercentile(all, 0.99);
+
+    uint32_t queue_dropped = 0;
+    uint32_t congestions = 0;
+    for (const LoadClient& client : clients)
+    {
+        BLENotifyStats stats = s_server->GetNotifyStats(client.conn_id);
+        queue_dropped += stats.dropped;
+        congestions += stats.congestions;
+    }
+    const BLECommandStats& command_stats = LoadCommands::GetStats();
+
+    printf("\ncommands:        %llu sent, %llu answered, %llu dropped, %u unexpected replies\n",
+           (unsigned long long)sent, (unsigned long long)replies, (unsigned long long)(sent - replies), unexpected);
+    printf("latency:         p50 %u us, p99 %u us, p999 %u us, max %u us\n",
+           GetPercentile(all, 0.5), p99, GetPercentile(all, 0.999), all.empty() ? 0 : all.back());
+    printf("throughput:      %.0f replies/s, %.1f kB/s\n",
+           (double)replies / config.duration_s, reply_bytes / 1000.0 / config.duration_s);
+    printf("server:          %u replies dropped (queue full), %u congestions, %u bad frames\n",
+           queue_dropped, congestions, command_stats.bad_frames);
+    printf("host time:       %.0f ns/command\n", sent ? host_ns / sent : 0.0);
+
+    stack.SetClient(nullptr);
+    delete s_server;
+    s_server = nullptr;
+
+    if (config.max_p99_us && p99 > config.max_p99_us)
+    {
+        printf("\np99 latency %u us exceeds %u us\n", p99, config.max_p99_us);
+        return 1;
+    }
+    return 0;
+}
+// -------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,254 @@
+// -------------------------------------------------------------------------------------------------------------------
+/*
+Replays a recording of BLEServer::SetRecorder() (see ble_record.h) through the
+server of server_example.cpp on the host and reports its throughput:
+
+    ble_replay session.bler [repeat]
+
+The fake stack runs in replay mode: the events come from the recording only,
+the API calls of the server succeed without any effect. Events are delivered
+back-to-back as fast as possible, the simulated time advances by the recorded
+gaps so timers of the server fire like on the target. Reported are events per
+second and the time per event (overall and by event type), e.g. to compare a
+captured field session before and after a change:
+
+    perf stat ./ble_replay session.bler 100
+
+Without a device a session can be captured on the host as well, a simulated
+phone connecting and sending commands to server_example.cpp:
+
+    ble_replay --capture session.bler [commands]
+*/
+// -------------------------------------------------------------------------------------------------------------------
+# include "fake_bt_stack.h"
+# include "ble_server.h"
+# include <algorithm>
+# include <chrono>
+# include <cstdio>
+# include <cstdlib>
+# include <cstring>
+# include <vector>
+// -------------------------------------------------------------------------------------------------------------------
+extern "C" void app_main(void);
+extern BLEServer *pServer;
+// -------------------------------------------------------------------------------------------------------------------
+static const char* GetGATTSEventName(uint8_t event)
+{
+    static const char* names[] = {
+        "REG", "READ", "WRITE", "EXEC_WRITE", "MTU", "CONF", "UNREG", "CREATE", "ADD_INCL_SRVC",
+        "ADD_CHAR", "ADD_CHAR_DESCR", "DELETE", "START", "STOP", "CONNECT", "DISCONNECT", "OPEN",
+        "CANCEL_OPEN", "CLOSE", "LISTEN", "CONGEST", "RESPONSE", "CREAT_ATTR_TAB", "SET_ATTR_VAL",
+        "SEND_SERVICE_CHANGE"
+    };
+    return event < sizeof(names) / sizeof(names[0]) ? names[event] : "?";
+}
+// -------------------------------------------------------------------------------------------------------------------
+static const char* GetGAPEventName(uint8_t event)
+{
+    switch (event)
+    {
+        case ESP_GAP_BLE_ADV_DATA_RAW_SET_COMPLETE_EVT:      return "ADV_DATA_RAW_SET";
+        case ESP_GAP_BLE_SCAN_RSP_DATA_RAW_SET_COMPLETE_EVT: return "SCAN_RSP_DATA_RAW_SET";
+        case ESP_GAP_BLE_ADV_START_COMPLETE_EVT:             return "ADV_START";
+        case ESP_GAP_BLE_ADV_STOP_COMPLETE_EVT:              return "ADV_STOP";
+        case ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT:             return "UPDATE_CONN_PARAMS";
+        case ESP_GAP_BLE_SET_PKT_LENGTH_COMPLETE_EVT:        return "SET_PKT_LENGTH";
+        case ESP_GAP_BLE_PHY_UPDATE_COMPLETE_EVT:            return "PHY_UPDATE";
+        case ESP_GAP_BLE_AUTH_CMPL_EVT:                      return "AUTH_CMPL";
+        case ESP_GAP_BLE_REMOVE_BOND_DEV_COMPLETE_EVT:       return "REMOVE_BOND_DEV";
+        default:                                             return "?";
+    }
+}
+// -------------------------------------------------------------------------------------------------------------------
+/// Times of one event type.
+struct EventTimes
+{
+    uint64_t count = 0;
+    double total_ns = 0;
+    double max_ns = 0;
+};
+// -------------------------------------------------------------------------------------------------------------------
+static bool ReadFile(const char* path, std::vector<uint8_t>& data)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return false;
+    uint8_t buffer[4096];
+    size_t len;
+    while ((len = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        data.insert(data.end(), buffer, buffer + len);
+    fclose(file);
+    return true;
+}
+// -------------------------------------------------------------------------------------------------------------------
+/// Creates the server of server_example.cpp against the stack in replay mode.
+static void StartServer(FakeBTStack& stack)
+{
+    stack.Reset();
+    stack.SetReplay(true);
+    app_main();
+}
+// -------------------------------------------------------------------------------------------------------------------
+static void StopServer(void)
+{
+    delete pServer;
+    pServer = nullptr;
+}
+// -------------------------------------------------------------------------------------------------------------------
+static int Replay(const char* path, uint32_t repeat)
+{
+    std::vector<uint8_t> data;
+    if (!ReadFile(path, data))
+    {
+        fprintf(stderr, "Cannot read %s.\n", path);
+        return 1;
+    }
+    BLERecordReader reader(data.data(), data.size());
+    if (!reader.IsValid())
+    {
+        fprintf(stderr, "%s is no recording of version %d.\n", path, BLEEventRecorder::version);
+        return 1;
+    }
+
+    FakeBTStack& stack = FakeBTStack::Instance();
+    // GATT server events by id, GAP events follow at offset 256
+    std::vector<EventTimes> by_type(512);
+    std::vector<double> times;
+    BLERecordReader::Event* event = new BLERecordReader::Event;
+    double total_s = 0;
+
+    for (uint32_t run = 0; run < repeat; ++run)
+    {
+        StartServer(stack);
+        reader.Rewind();
+        while (reader.Next(*event))
+        {
+            stack.AdvanceTime(event->delta_us);
+            auto start = std::chrono::steady_clock::now();
+            if (event->is_gap)
+                stack.DeliverGAPEvent(event->gap_event, &event->gap_param);
+            else
+                stack.DeliverGATTSEvent(event->gatts_event, event->gatts_if, &event->gatts_param);
+            double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+            size_t type = event->is_gap ? 256 + (size_t)event->gap_event : (size_t)event->gatts_event;
+            EventTimes& entry = by_type[type];
+            ++entry.count;
+            entry.total_ns += ns;
+            entry.max_ns = std::max(entry.max_ns, ns);
+            times.push_back(ns);
+            total_s += ns * 1e-9;
+        }
+        StopServer();
+        if (reader.IsCorrupt())
+        {
+            fprintf(stderr, "%s is truncated or corrupt after %zu events.\n", path, times.size() / (run + 1));
+            delete event;
+            return 1;
+        }
+    }
+    delete event;
+
+    if (times.empty())
+    {
+        printf("no events recorded\n");
+        return 0;
+    }
+    std::sort(times.begin(), times.end());
+    auto percentile = [&times](double p) { return times[std::min(times.size() - 1, (size_t)(p * times.size()))]; };
+
+    printf("events:          %zu (%u runs)\n", times.size(), repeat);
+    printf("handler time:    %.3f s\n", total_s);
+    printf("events/s:        %.0f\n", total_s > 0 ? times.size() / total_s : 0.0);
+    printf("ns/event:        avg %.0f, p50 %.0f, p99 %.0f, max %.0f\n",
+           total_s * 1e9 / times.size(), percentile(0.5), percentile(0.99), times.back());
+    printf("\n%-28s %10s %10s %10s\n", "event", "count", "avg ns", "max ns");
+    for (size_t i = 0; i < by_type.size(); ++i)
+    {
+        const EventTimes& entry = by_type[i];
+        if (!entry.count)
+            continue;
+        char name[32];
+        snprintf(name, sizeof(name), "%s %s",
+                 i < 256 ? "GATT" : "GAP", i < 256 ? GetGATTSEventName((uint8_t)i) : GetGAPEventName((uint8_t)(i - 256)));
+        printf("%-28s %10llu %10.0f %10.0f\n", name, (unsigned long long)entry.count, entry.total_ns / entry.count, entry.max_ns);
+    }
+    return 0;
+}
+// -------------------------------------------------------------------------------------------------------------------
+static void WriteRecord(void* context, const uint8_t* data, size_t len)
+{
+    fwrite(data, 1, len, (FILE*)context);
+}
+// -------------------------------------------------------------------------------------------------------------------
+/// Records a session of a simulated phone: connect, MTU exchange, subscription,
+/// \a commands commands with 20ms between them, a few reads, disconnect.
+static int Capture(const char* path, uint32_t commands)
+{
+    FILE* file = fopen(path, "wb");
+    if (!file)
+    {
+        fprintf(stderr, "Cannot create %s.\n", path);
+        return 1;
+    }
+
+    FakeBTStack& stack = FakeBTStack::Instance();
+    stack.Reset();
+    app_main();
+    if (pServer->SetRecorder(WriteRecord, file) != ESP_OK)
+    {
+        fprintf(stderr, "The server is built without BLE_SERVER_RECORD.\n");
+        fclose(file);
+        return 1;
+    }
+    stack.Pump();
+
+    const esp_bd_addr_t phone = {0x11, 0x22, 0x33, 0x44, 0x55, 0x66};
+    uint16_t conn_id = stack.Connect(phone);
+    stack.Pump();
+    stack.ExchangeMTU(conn_id, 185);
+    stack.Pump();
+
+    uint16_t rx_handle = stack.FindHandle(0xffe4);
+    uint16_t tx_handle = stack.FindHandle(0xffe9);
+    uint16_t rx_cccd = stack.FindDescriptor(rx_handle, ESP_GATT_UUID_CHAR_CLIENT_CONFIG);
+    const uint8_t subscribe[2] = {0x01, 0x00};
+    stack.Write(conn_id, rx_cccd, subscribe, sizeof(subscribe));
+    stack.Pump();
+
+    const uint8_t hello[3] = {0xAA, 0x01, 0x55};
+    const uint8_t bye[3] = {0xAA, 0x02, 0x55};
+    for (uint32_t i = 0; i < commands; ++i)
+    {
+        stack.Write(conn_id, tx_handle, i % 4 ? hello : bye, sizeof(hello), false);
+        stack.Pump();
+        if (i % 16 == 0)
+        {
+            stack.Read(conn_id, rx_cccd);
+            stack.Pump();
+        }
+        stack.AdvanceTime(20000);
+        stack.Pump();
+    }
+    stack.Disconnect(conn_id);
+    stack.Pump();
+
+    pServer->SetRecorder(nullptr);
+    StopServer();
+    long size = ftell(file);
+    fclose(file);
+    printf("%s: %ld bytes\n", path, size);
+    return 0;
+}
+// -------------------------------------------------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+    if (argc > 2 && strcmp(argv[1], "--capture") == 0)
+        return Capture(argv[2], argc > 3 ? (uint32_t)strtoul(argv[3], nullptr, 10) : 1000);
+    if (argc > 1 && argv[1][0] != '-')
+        return Replay(argv[1], argc > 2 ? std::max(1ul, strtoul(argv[2], nullptr, 10)) : 1);
+
+    fprintf(stderr, "usage: %s RECORDING [REPEAT]\n       %s --capture RECORDING [COMMANDS]\n", argv[0], argv[0]);
+    return 2;
+}
+// -------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,126 @@
+#!/usr/bin/env python3
+"""
+Decodes the binary trace of a BLEServer built with BLE_SERVER_TRACE (see src/ble_trace.h)
+into readable lines.
+
+The input is either raw records (BLEServer::ReadTrace(), e.g. saved from a read of a
+diagnostics characteristic) or a console log holding the "BLETRACE <hex>" lines printed by
+BLEServer::PrintTrace(), other lines of the log are skipped.
+
+    ble_trace_decode.py monitor.log
+    ble_trace_decode.py --binary trace.bin
+    idf.py monitor | ble_trace_decode.py -
+"""
+import argparse
+import struct
+import sys
+
+RECORD = struct.Struct("<IBBBBHH8s")
+PREFIX = "BLETRACE "
+NO_CONN = 0xFF
+
+GATTS_EVENTS = [
+    "REG", "READ", "WRITE", "EXEC_WRITE", "MTU", "CONF", "UNREG", "CREATE", "ADD_INCL_SRVC",
+    "ADD_CHAR", "ADD_CHAR_DESCR", "DELETE", "START", "STOP", "CONNECT", "DISCONNECT", "OPEN",
+    "CANCEL_OPEN", "CLOSE", "LISTEN", "CONGEST", "RESPONSE", "CREAT_ATTR_TAB", "SET_ATTR_VAL",
+    "SEND_SERVICE_CHANGE",
+]
+
+GAP_EVENTS = {
+    0: "ADV_DATA_SET_COMPLETE", 1: "SCAN_RSP_DATA_SET_COMPLETE", 2: "SCAN_PARAM_SET_COMPLETE",
+    3: "SCAN_RESULT", 4: "ADV_DATA_RAW_SET_COMPLETE", 5: "SCAN_RSP_DATA_RAW_SET_COMPLETE",
+    6: "ADV_START_COMPLETE", 7: "SCAN_START_COMPLETE", 8: "AUTH_CMPL", 9: "KEY", 10: "SEC_REQ",
+    11: "PASSKEY_NOTIF", 12: "PASSKEY_REQ", 13: "OOB_REQ", 14: "LOCAL_IR", 15: "LOCAL_ER",
+    16: "NC_REQ", 17: "ADV_STOP_COMPLETE", 18: "SCAN_STOP_COMPLETE", 19: "SET_STATIC_RAND_ADDR",
+    20: "UPDATE_CONN_PARAMS", 21: "SET_PKT_LENGTH_COMPLETE", 22: "SET_LOCAL_PRIVACY_COMPLETE",
+    23: "REMOVE_BOND_DEV_COMPLETE", 24: "CLEAR_BOND_DEV_COMPLETE", 25: "GET_BOND_DEV_COMPLETE",
+    26: "READ_RSSI_COMPLETE", 27: "UPDATE_WHITELIST_COMPLETE", 55: "PHY_UPDATE_COMPLETE",
+}
+
+# meaning of the argument of GATT server events
+GATTS_ARGS = {
+    "READ": "offset", "WRITE": "len", "EXEC_WRITE": "exec", "MTU": "mtu", "CONF": "status",
+    "DISCONNECT": "reason", "CONGEST": "congested", "RESPONSE": "status",
+}
+
+
+def read_records(data, binary):
+    """Yields the raw records of a dump."""
+    if binary:
+        for offset in range(0, len(data) - RECORD.size + 1, RECORD.size):
+            yield data[offset:offset + RECORD.size]
+        return
+    for line in data.decode("utf-8", "replace").splitlines():
+        start = line.find(PREFIX)
+        if start < 0:
+            continue
+        try:
+            record = bytes.fromhex(line[start + len(PREFIX):].strip()[:2 * RECORD.size])
+        except ValueError:
+            continue
+        if len(record) == RECORD.size:
+            yield record
+
+
+def describe(kind, event, handle, arg, value):
+    """Text of a record without time and connection."""
+    if kind == 0:
+        name = GATTS_EVENTS[event] if event < len(GATTS_EVENTS) else "GATTS_%d" % event
+        text = "GATTS %s" % name
+        if handle:
+            text += " handle=%d" % handle
+        if name in GATTS_ARGS:
+            text += " %s=%d" % (GATTS_ARGS[name], arg)
+    elif kind == 1:
+        text = "GAP %s" % GAP_EVENTS.get(event, str(event))
+    elif kind == 2:
+        text = "%s handle=%d len=%d" % ("INDICATE" if event else "NOTIFY", handle, arg)
+    elif kind == 3:
+        text = "DROPPED handle=%d len=%d" % (handle, arg)
+    elif kind == 4:
+        text = "SEND_FAILED handle=%d error=0x%x" % (handle, arg)
+    elif kind == 5:
+        return "LOST %d records" % struct.unpack("<I", value[:4])[0]
+    else:
+        text = "KIND_%d id=%d handle=%d arg=%d" % (kind, event, handle, arg)
+    if value:
+        text += " [%s]" % value.hex(" ")
+    return text
+
+
+def decode(records):
+    """Yields the lines of the records, times relative to the first one."""
+    first = None
+    last = None
+    wraps = 0
+    for record in records:
+        time, kind, event, conn_id, data_len, handle, arg, data = RECORD.unpack(record)
+        # the 32 bit time wraps after 71 minutes
+        if last is not None and time < last:
+            wraps += 1
+        last = time
+        time += wraps << 32
+        if first is None:
+            first = time
+        conn = "  -" if conn_id == NO_CONN else "%3d" % conn_id
+        text = describe(kind, event, handle, arg, data[:min(data_len, len(data))])
+        yield "%12.3f ms conn %s  %s" % ((time - first) / 1000.0, conn, text)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("input", help="dump file, - for stdin")
+    parser.add_argument("--binary", action="store_true", help="input holds raw records instead of BLETRACE lines")
+    args = parser.parse_args()
+
+    if args.input == "-":
+        data = sys.stdin.buffer.read()
+    else:
+        with open(args.input, "rb") as f:
+            data = f.read()
+    for line in decode(read_records(data, args.binary)):
+        print(line)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,66 @@
+# include "ble_bond_store.h"
+# include <cstdio>
+# include <cstring>
+// -------------------------------------------------------------------------------------------------------------------
+/// NVS key of \a bda: 12 hex digits and the terminating zero (NVS keys have at most 15 characters).
+static void GetKey(const esp_bd_addr_t bda, char key[13])
+{
+    snprintf(key, 13, "%02x%02x%02x%02x%02x%02x", bda[0], bda[1], bda[2], bda[3], bda[4], bda[5]);
+}
+// -------------------------------------------------------------------------------------------------------------------
+BLENVSBondStore::~BLENVSBondStore()
+{
+    if (m_open)
+        nvs_close(m_handle);
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t BLENVSBondStore::Open(void)
+{
+    if (m_open)
+        return ESP_OK;
+    esp_err_t ec = nvs_open(m_name, NVS_READWRITE, &m_handle);
+    m_open = ec == ESP_OK;
+    return ec;
+}
+// -------------------------------------------------------------------------------------------------------------------
+bool BLENVSBondStore::Load(const esp_bd_addr_t bda, BLEBondRecord& record)
+{
+    if (Open() != ESP_OK)
+        return false;
+    char key[13];
+    GetKey(bda, key);
+    size_t len = sizeof(record);
+    // records of another layout (older firmware) are ignored
+    return nvs_get_blob(m_handle, key, &record, &len) == ESP_OK && len == sizeof(record)
+        && memcmp(record.bda, bda, sizeof(esp_bd_addr_t)) == 0;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t BLENVSBondStore::Save(const BLEBondRecord& record)
+{
+    esp_err_t ec = Open();
+    if (ec)
+        return ec;
+    char key[13];
+    GetKey(record.bda, key);
+    return nvs_set_blob(m_handle, key, &record, sizeof(record));
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t BLENVSBondStore::Erase(const esp_bd_addr_t bda)
+{
+    esp_err_t ec = Open();
+    if (ec)
+        return ec;
+    char key[13];
+    GetKey(bda, key);
+    ec = nvs_erase_key(m_handle, key);
+    return ec == ESP_ERR_NVS_NOT_FOUND ? ESP_OK : ec;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t BLENVSBondStore::Commit(void)
+{
+    esp_err_t ec = Open();
+    if (ec)
+        return ec;
+    return nvs_commit(m_handle);
+}
+// -------------------------------------------------------------------------------------------------------------------
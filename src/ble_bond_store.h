@@ -0,0 +1,85 @@
+# pragma once
+// ------------------------------------------------------------------------------------------
+/*
+Persistent subscriptions of bonded clients, see BLEServer::SetBondStore().
+
+The server keeps a BLEBondRecord per bonded client: the subscription bits of
+its client configuration descriptors (0x2902) and the hash of the attribute
+tables the bits belong to (BLEServer::GetDatabaseHash()). Client supported
+features and the Service Changed subscription belong to the Generic Attribute
+service of the stack, bluedroid keeps them with the bond itself. When the
+client connects again the record is loaded before any notification is sent,
+so notifications flow without the client writing the descriptors again.
+Changes are written behind, batched by the server.
+
+BLENVSBondStore keeps the records in NVS, one blob per client. Other storage
+(e.g. a file on the host, see host/file_bond_store.h) implements BLEBondStore.
+*/
+// ------------------------------------------------------------------------------------------
+# include "ble_config.h"
+# include "ble_cmac.h"
+# include <esp_bt_defs.h>
+# include <esp_err.h>
+# include <nvs.h>
+// ------------------------------------------------------------------------------------------
+/// Persistent state of a bonded client.
+struct BLEBondRecord
+{
+    /// Identity address of the client (the address bluedroid reports for a bonded client).
+    esp_bd_addr_t bda;
+    /// Subscriptions (BLEConnection::notify_bits and indicate_bits), only valid for the
+    /// attribute tables of \a database_hash.
+    uint32_t notify_bits;
+    uint32_t indicate_bits;
+    uint8_t database_hash[BLECMAC::block_size];
+};
+// ------------------------------------------------------------------------------------------
+/// Storage of the bond records. The server calls Load() when a client connects and
+/// Erase() and Commit() for ESP_GAP_BLE_REMOVE_BOND_DEV_COMPLETE_EVT on the BTC task, the
+/// batched Save() and Commit() (of changes and of disconnected clients) on the esp_timer
+/// task, and the last ones of changes not saved yet in the destructor of the server. All calls
+/// are made with the server lock held, so they never run concurrently.
+class BLEBondStore
+{
+public:
+    virtual ~BLEBondStore() {}
+
+    /// Loads the record of \a bda into \a record.
+    /// \returns \c false if there is none.
+    virtual bool Load(const esp_bd_addr_t bda, BLEBondRecord& record) = 0;
+
+    /// Stores \a record, replacing the one of the same address. Saves of a batch are
+    /// followed by one Commit().
+    virtual esp_err_t Save(const BLEBondRecord& record) = 0;
+
+    /// Removes the record of \a bda (\c ESP_OK if there is none).
+    virtual esp_err_t Erase(const esp_bd_addr_t bda) = 0;
+
+    /// Makes the changes since the last commit persistent.
+    virtual esp_err_t Commit(void) = 0;
+};
+// ------------------------------------------------------------------------------------------
+/// Keeps the bond records in the NVS namespace \a name, keyed by the address as 12 hex digits.
+/// nvs_flash_init() has to be called before.
+class BLENVSBondStore : public BLEBondStore
+{
+public:
+    explicit BLENVSBondStore(const char* name = "ble_bonds") : m_name(name) {}
+    ~BLENVSBondStore();
+    BLENVSBondStore(const BLENVSBondStore&) = delete;
+    BLENVSBondStore& operator=(const BLENVSBondStore&) = delete;
+
+    bool Load(const esp_bd_addr_t bda, BLEBondRecord& record) override;
+    esp_err_t Save(const BLEBondRecord& record) override;
+    esp_err_t Erase(const esp_bd_addr_t bda) override;
+    esp_err_t Commit(void) override;
+
+protected:
+    const char* m_name;
+    nvs_handle_t m_handle = 0;
+    bool m_open = false;
+
+    /// Opens the namespace on first use.
+    esp_err_t Open(void);
+};
+// ------------------------------------------------------------------------------------------
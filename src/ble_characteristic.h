@@ -0,0 +1,472 @@
+# pragma once
+// ------------------------------------------------------------------------------------------
+/*
+Typed characteristics (requires C++17).
+
+BLECharacteristic owns the storage of a value of type T and derives the maximum
+and initial length, the permissions and the configuration descriptor from T and
+the properties at compile time. Values are kept in their GATT representation
+(little endian), so nothing is serialized when they are read or notified.
+
+    T                           length              value
+    scalar (uint16_t, float..)  sizeof(T)           little endian
+    E[N]                        N * element         N elements
+    packed struct               sizeof(T)           the struct itself (alignment 1, no padding)
+    BLEVarArray<E, MAX>         0..MAX elements     variable length
+
+Elements are scalars or packed structs. Packed structs are accessed in place,
+their fields must be in the byte order of the target (little endian).
+
+    struct __attribute__((packed)) Cell { uint16_t millivolt; int8_t temperature; };
+
+    static BLECharacteristic<0x2A19, uint8_t, char_prop_read_notify> battery_level;
+    static BLECharacteristic<0xffe6, BLEVarArray<Cell, 16>, char_prop_notify> cells;
+    static BLECharacteristic<0xffe7, uint32_t, char_prop_write> interval;
+
+    server.AddService(0x180F);
+    battery_level.Add(server, "Battery");
+    cells.Add(server);
+    interval.Add(server, nullptr, OnIntervalEvent);
+
+    battery_level.Set(87);                          // answers reads, NotifyAll() sends it
+    cells.Notify(conn_id, cell_values, count);      // encoded straight into the notification queue
+
+    static void OnIntervalEvent(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param)
+    {
+        if (event != ESP_GATTS_WRITE_EVT)
+            return;
+        auto value = decltype(interval)::Written(param);  // view over the buffer of the stack
+        if (value.IsValid())
+            SetInterval(value.Get());
+    }
+
+Views (BLEValueView, BLEValueBuffer) check lengths once with IsValid() or the
+capacity and then read or write the elements in the buffer itself.
+*/
+// ------------------------------------------------------------------------------------------
+# include "ble_server.h"
+# include "ble_gatt_table.h"
+# include <algorithm>
+# include <cassert>
+# include <cstddef>
+# include <cstdint>
+# include <cstring>
+# include <type_traits>
+// ------------------------------------------------------------------------------------------
+/// 16 bit UUID with static storage.
+template <uint16_t UUID>
+inline constexpr uint16_t ble_uuid16_value = UUID;
+
+/// Permissions matching the characteristic properties: read if readable, write if writable.
+constexpr uint16_t BLEPermissions(uint8_t properties)
+{
+    return ((properties & ESP_GATT_CHAR_PROP_BIT_READ) ? ESP_GATT_PERM_READ : 0)
+        | ((properties & (ESP_GATT_CHAR_PROP_BIT_WRITE | ESP_GATT_CHAR_PROP_BIT_WRITE_NR)) ? ESP_GATT_PERM_WRITE : 0);
+}
+// ------------------------------------------------------------------------------------------
+/// Unsigned integer of \a SIZE bytes.
+template <size_t SIZE> struct BLEUnsigned;
+template <> struct BLEUnsigned<1> { typedef uint8_t type; };
+template <> struct BLEUnsigned<2> { typedef uint16_t type; };
+template <> struct BLEUnsigned<4> { typedef uint32_t type; };
+template <> struct BLEUnsigned<8> { typedef uint64_t type; };
+
+/// Element of a value: a scalar stored little endian or a packed struct accessed in place.
+template <class E, bool SCALAR = std::is_arithmetic<E>::value || std::is_enum<E>::value>
+struct BLEElement
+{
+    typedef typename BLEUnsigned<sizeof(E)>::type bits_type;
+
+    static constexpr bool is_scalar = true;
+    static constexpr uint16_t size = sizeof(E);
+
+    static E Get(const uint8_t* data)
+    {
+        // assembled byte by byte, the compiler makes a single load of it on little endian targets
+        bits_type bits = 0;
+        for (size_t i = 0; i < sizeof(E); ++i)
+            bits |= (bits_type)data[i] << (8 * i);
+        if constexpr (std::is_floating_point<E>::value)
+        {
+            E value;
+            memcpy(&value, &bits, sizeof(E));
+            return value;
+        }
+        else
+            return (E)bits;
+    }
+
+    static void Set(uint8_t* data, E value)
+    {
+        bits_type bits;
+        if constexpr (std::is_floating_point<E>::value)
+            memcpy(&bits, &value, sizeof(E));
+        else
+            bits = (bits_type)value;
+        for (size_t i = 0; i < sizeof(E); ++i)
+            data[i] = (uint8_t)(bits >> (8 * i));
+    }
+};
+
+template <class E>
+struct BLEElement<E, false>
+{
+    static_assert(std::is_class<E>::value && std::is_trivially_copyable<E>::value, "Value elements are scalars or plain structs.");
+    static_assert(alignof(E) == 1, "Structs of values must be packed, e.g. __attribute__((packed)).");
+    static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "Packed structs are accessed in place, GATT values are little endian.");
+
+    static constexpr bool is_scalar = false;
+    static constexpr uint16_t size = sizeof(E);
+
+    static const E& Get(const uint8_t* data) { return *reinterpret_cast<const E*>(data); }
+    static E& Ref(uint8_t* data) { return *reinterpret_cast<E*>(data); }
+    static void Set(uint8_t* data, const E& value) { Ref(data) = value; }
+};
+// ------------------------------------------------------------------------------------------
+/// Value type of 0 to \a MAX elements \a E (variable length), see BLECharacteristic.
+template <class E, uint16_t MAX>
+struct BLEVarArray
+{
+};
+
+/// Element type and count of a value type.
+template <class T>
+struct BLEValueTraits
+{
+    typedef T element_type;
+    static constexpr size_t min_count = 1;
+    static constexpr size_t max_count = 1;
+};
+
+template <class E, size_t N>
+struct BLEValueTraits<E[N]>
+{
+    typedef E element_type;
+    static constexpr size_t min_count = N;
+    static constexpr size_t max_count = N;
+};
+
+template <class E, uint16_t MAX>
+struct BLEValueTraits<BLEVarArray<E, MAX>>
+{
+    typedef E element_type;
+    static constexpr size_t min_count = 0;
+    static constexpr size_t max_count = MAX;
+};
+// ------------------------------------------------------------------------------------------
+/// Read-only view of a value of type \a T in a buffer, e.g. the value written by a client.
+template <class T>
+class BLEValueView
+{
+public:
+    typedef BLEValueTraits<T> traits;
+    typedef typename traits::element_type element_type;
+    typedef BLEElement<element_type> element;
+
+    BLEValueView(const uint8_t* data, uint16_t len) : m_data(data), m_len(len) {}
+
+    /// View of the value of a write event (ESP_GATTS_WRITE_EVT). Prepare writes are parts of a long value
+    /// and never valid.
+    static BLEValueView Written(const esp_ble_gatts_cb_param_t* param)
+    {
+        return param->write.is_prep ? BLEValueView(nullptr, 0) : BLEValueView(param->write.value, param->write.len);
+    }
+
+    /// Whether the length is a valid one of \a T (a whole number of elements within the bounds).
+    bool IsValid(void) const
+    {
+        return m_data && m_len % element::size == 0 && size() >= traits::min_count && size() <= traits::max_count;
+    }
+
+    /// Number of elements.
+    size_t size(void) const { return m_len / element::size; }
+
+    /// Length in bytes and the bytes themselves.
+    uint16_t GetLength(void) const { return m_len; }
+    const uint8_t* data(void) const { return m_data; }
+
+    /// Element \a i: the value of a scalar, a reference into the buffer for a packed struct.
+    decltype(auto) operator[](size_t i) const
+    {
+        assert(i < size());
+        return element::Get(m_data + i * element::size);
+    }
+
+    /// The first (or only) element.
+    decltype(auto) Get(void) const { return (*this)[0]; }
+
+    /// Fields of a packed struct.
+    const element_type* operator->(void) const
+    {
+        static_assert(!element::is_scalar, "Only structs have fields.");
+        return &Get();
+    }
+
+protected:
+    const uint8_t* m_data;
+    uint16_t m_len;
+};
+// ------------------------------------------------------------------------------------------
+/// Value of type \a T written in place into a buffer, e.g. the notification queue.
+/// Values of fixed length have it from the start, variable ones grow with Set() or Resize().
+template <class T>
+class BLEValueBuffer
+{
+public:
+    typedef BLEValueTraits<T> traits;
+    typedef typename traits::element_type element_type;
+    typedef BLEElement<element_type> element;
+
+    /// Buffer \a data of \a size bytes, it has to hold the minimum length of \a T.
+    BLEValueBuffer(uint8_t* data, uint16_t size)
+    :m_data(data)
+    ,m_capacity(std::min<size_t>(size / element::size, traits::max_count))
+    ,m_count(traits::min_count)
+    {
+        assert(m_capacity >= traits::min_count);
+    }
+
+    /// Number of elements and the maximum number fitting into the buffer.
+    size_t size(void) const { return m_count; }
+    size_t capacity(void) const { return m_capacity; }
+
+    /// Length in bytes.
+    uint16_t GetLength(void) const { return (uint16_t)(m_count * element::size); }
+    uint8_t* data(void) { return m_data; }
+
+    /// Sets the number of elements of a variable length value.
+    /// \returns \c false if \a count exceeds the capacity.
+    bool Resize(size_t count)
+    {
+        if (count < traits::min_count || count > m_capacity)
+            return false;
+        m_count = count;
+        return true;
+    }
+
+    /// Sets element \a i, growing a variable length value up to it.
+    /// \returns \c false if \a i exceeds the capacity.
+    bool Set(size_t i, const element_type& value)
+    {
+        if (i >= m_capacity)
+            return false;
+        element::Set(m_data + i * element::size, value);
+        if (i >= m_count)
+            m_count = i + 1;
+        return true;
+    }
+
+    /// Sets the first (or only) element.
+    bool Set(const element_type& value) { return Set(0, value); }
+
+    /// Element \a i of a value of packed structs, to write the fields in place.
+    element_type& operator[](size_t i)
+    {
+        static_assert(!element::is_scalar, "Scalars are written with Set().");
+        assert(i < m_count);
+        return element::Ref(m_data + i * element::size);
+    }
+
+    /// Fields of a packed struct.
+    element_type* operator->(void) { return &(*this)[0]; }
+
+protected:
+    uint8_t* m_data;
+    size_t m_capacity;
+    size_t m_count;
+};
+// ------------------------------------------------------------------------------------------
+/// Characteristic \a UUID with a value of type \a T (see above) and the properties \a PROPERTIES.
+/// Characteristics with notify or indicate get a configuration descriptor (0x2902) answered by the server.
+/// \tparam PERMISSIONS Permissions of the value, derived from the properties by default.
+template <uint16_t UUID, class T, uint8_t PROPERTIES, uint16_t PERMISSIONS = BLEPermissions(PROPERTIES)>
+class BLECharacteristic
+{
+public:
+    typedef BLEValueTraits<T> traits;
+    typedef typename traits::element_type element_type;
+    typedef BLEElement<element_type> element;
+    typedef BLEValueView<T> view_type;
+    typedef BLEValueBuffer<T> buffer_type;
+
+    /// Writes a value to be notified in place into \a value, see NotifyInPlace().
+    /// \returns \c false if nothing should be sent.
+    typedef bool (*build_func)(void* context, buffer_type& value);
+
+    static constexpr uint16_t uuid = UUID;
+    static constexpr uint8_t properties = PROPERTIES;
+    static constexpr uint16_t permissions = PERMISSIONS;
+    static constexpr uint16_t max_length = (uint16_t)(traits::max_count * element::size);
+    static constexpr uint16_t min_length = (uint16_t)(traits::min_count * element::size);
+    static constexpr bool has_config = (PROPERTIES & (ESP_GATT_CHAR_PROP_BIT_NOTIFY | ESP_GATT_CHAR_PROP_BIT_INDICATE)) != 0;
+
+    static_assert(max_length > 0 && max_length <= ESP_GATT_MAX_ATTR_LEN, "Invalid characteristic value size.");
+
+    BLECharacteristic() = default;
+    BLECharacteristic(const BLECharacteristic&) = delete;
+    BLECharacteristic& operator=(const BLECharacteristic&) = delete;
+
+    /// Adds the characteristic to the service added last to \a server, like BLEServer::AddCharacteristic().
+    /// The instance is referenced by the server, so it has to stay valid.
+    /// \returns ID of the characteristic value (or \c BLEService::npos in case of error)
+    BLEService::size_type Add(
+        BLEServer& server, const char* description = nullptr, BLEEventHandler on_event = BLEEventHandler(),
+        uint8_t response = ESP_GATT_AUTO_RSP, uint8_t event_mask = evt_mask_all
+    )
+    {
+        m_server = &server;
+        m_service_id = (uint8_t)(server.GetServiceCount() - 1);
+        m_handle = 0;
+        m_attribute_index = server.AddCharacteristic(
+            &ble_uuid16_value<UUID>, &ble_char_properties<PROPERTIES>, PERMISSIONS,
+            max_length, m_length, m_value, description, on_event,
+            has_config ? m_config : nullptr, response, event_mask
+        );
+        return m_attribute_index;
+    }
+
+    /// Handle of the value (0 until the attributes are registered).
+    uint16_t GetHandle(void)
+    {
+        if (!m_handle && m_server && m_attribute_index != BLEService::npos)
+            m_handle = m_server->GetHandle(m_service_id, m_attribute_index);
+        return m_handle;
+    }
+
+    /// ID of the characteristic value returned by Add().
+    BLEService::size_type GetIndex(void) const { return m_attribute_index; }
+
+    /// The value set last by the server (not the one written by clients, see Written()).
+    view_type GetValue(void) const { return view_type(m_value, m_length); }
+
+    /// The first (or only) element of the value.
+    decltype(auto) Get(void) const { return GetValue().Get(); }
+
+    /// Sets the value to \a value (one element), answering reads by the stack from now on.
+    /// Set before the attribute table is created, it's the initial value (see BLEServer::SetAttributeValue()).
+    esp_err_t Set(const element_type& value)
+    {
+        static_assert(traits::max_count == 1 || traits::min_count == 0, "Arrays are set with Set(values, count).");
+        element::Set(m_value, value);
+        m_length = element::size;
+        return Commit();
+    }
+
+    /// Sets the value to the \a count elements \a values.
+    /// \returns \c ESP_ERR_INVALID_SIZE if \a count is out of the bounds of \a T.
+    esp_err_t Set(const element_type* values, size_t count)
+    {
+        if (count < traits::min_count || count > traits::max_count)
+            return ESP_ERR_INVALID_SIZE;
+        for (size_t i = 0; i < count; ++i)
+            element::Set(m_value + i * element::size, values[i]);
+        m_length = (uint16_t)(count * element::size);
+        return Commit();
+    }
+
+    /// Sends the value set last to \a conn_id, see BLEServer::Notify().
+    esp_err_t Notify(uint16_t conn_id, bool need_confirm = false)
+    {
+        return GetHandle() ? m_server->Notify(conn_id, m_handle, m_value, m_length, need_confirm) : ESP_ERR_INVALID_STATE;
+    }
+
+    /// Sends \a value (one element) to \a conn_id, encoded directly into its notification queue.
+    /// The stored value is left unchanged.
+    esp_err_t Notify(uint16_t conn_id, const element_type& value, bool need_confirm = false)
+    {
+        static_assert(traits::max_count == 1 || traits::min_count == 0, "Arrays are notified with Notify(conn_id, values, count).");
+        Elements elements = {&value, 1};
+        return NotifyInPlace(conn_id, BuildElements, &elements, need_confirm);
+    }
+
+    /// Sends the \a count elements \a values to \a conn_id, encoded directly into its notification queue.
+    /// \returns \c ESP_ERR_INVALID_SIZE if \a count is out of the bounds of \a T or exceeds MTU - 3.
+    esp_err_t Notify(uint16_t conn_id, const element_type* values, size_t count, bool need_confirm = false)
+    {
+        if (count < traits::min_count || count > traits::max_count)
+            return ESP_ERR_INVALID_SIZE;
+        if (count * element::size > (size_t)(m_server ? m_server->GetMTU(conn_id) - 3 : 0))
+            return ESP_ERR_INVALID_SIZE;
+        Elements elements = {values, count};
+        return NotifyInPlace(conn_id, BuildElements, &elements, need_confirm);
+    }
+
+    /// Lets \a build with \a context write the value into the notification queue of \a conn_id,
+    /// see BLEServer::NotifyInPlace(). The buffer holds the value as far as MTU - 3 allows.
+    /// \returns \c ESP_ERR_INVALID_SIZE if the minimum length exceeds MTU - 3, otherwise as
+    ///     BLEServer::NotifyInPlace().
+    esp_err_t NotifyInPlace(uint16_t conn_id, build_func build, void* context, bool need_confirm = false)
+    {
+        if (!GetHandle())
+            return ESP_ERR_INVALID_STATE;
+        if (m_server->GetMTU(conn_id) - 3 < min_length)
+            return ESP_ERR_INVALID_SIZE;
+        Build typed = {build, context};
+        return m_server->NotifyInPlace(conn_id, m_handle, max_length, BuildValue, &typed, need_confirm);
+    }
+
+    /// Sends the value set last to all subscribed clients, see BLEServer::NotifyAll().
+    /// \returns Number of connections the value was queued for.
+    uint8_t NotifyAll(void)
+    {
+        return GetHandle() ? m_server->NotifyAll(m_handle, m_value, m_length) : 0;
+    }
+
+    /// View of the value written by a client in a write event of this characteristic, directly
+    /// over the buffer of the stack. Check IsValid() before reading it.
+    static view_type Written(const esp_ble_gatts_cb_param_t* param) { return view_type::Written(param); }
+
+protected:
+    /// Elements passed to BuildElements().
+    struct Elements
+    {
+        const element_type* values;
+        size_t count;
+    };
+
+    /// Typed build function passed to BuildValue().
+    struct Build
+    {
+        build_func func;
+        void* context;
+    };
+
+    BLEServer* m_server = nullptr;
+    uint8_t m_service_id = BLEService::npos;
+    BLEService::size_type m_attribute_index = BLEService::npos;
+    uint16_t m_handle = 0;
+    uint16_t m_length = min_length;
+    uint8_t m_value[max_length] = {};
+    uint8_t m_config[2] = {0, 0};
+
+    /// Hands the value to the stack, which answers reads with its own copy.
+    esp_err_t Commit(void)
+    {
+        if (GetHandle())
+            return esp_ble_gatts_set_attr_value(m_handle, m_length, m_value);
+        if (m_attribute_index == BLEService::npos)
+            return ESP_OK;  // the initial value passed to Add()
+        // the length of the attribute table, or the value as soon as the stack created it
+        return m_server->SetAttributeValue(m_service_id, m_attribute_index, m_length, m_value);
+    }
+
+    static bool BuildElements(void* context, buffer_type& value)
+    {
+        const Elements& elements = *(const Elements*)context;
+        value.Resize(elements.count);
+        for (size_t i = 0; i < elements.count; ++i)
+            value.Set(i, elements.values[i]);
+        return true;
+    }
+
+    static bool BuildValue(void* context, uint8_t* value, uint16_t& len)
+    {
+        const Build& typed = *(const Build*)context;
+        buffer_type buffer(value, len);
+        if (!typed.func(typed.context, buffer))
+            return false;
+        len = buffer.GetLength();
+        return true;
+    }
+};
+// ------------------------------------------------------------------------------------------
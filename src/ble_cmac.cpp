@@ -0,0 +1,134 @@
+# include "ble_cmac.h"
+# include <cstring>
+// -------------------------------------------------------------------------------------------------------------------
+static const uint8_t s_sbox[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+};
+// -------------------------------------------------------------------------------------------------------------------
+/// Multiplication by x in GF(2^8).
+static uint8_t XTime(uint8_t x)
+{
+    return (uint8_t)((x << 1) ^ ((x & 0x80) ? 0x1b : 0));
+}
+// -------------------------------------------------------------------------------------------------------------------
+/// Multiplication of the 128 bit string \a in by x in GF(2^128), the subkey derivation of RFC 4493.
+static void ShiftSubkey(const uint8_t in[BLECMAC::block_size], uint8_t out[BLECMAC::block_size])
+{
+    for (size_t i = 0; i < BLECMAC::block_size; ++i)
+        out[i] = (uint8_t)((in[i] << 1) | (i + 1 < BLECMAC::block_size ? in[i + 1] >> 7 : 0));
+    if (in[0] & 0x80)
+        out[BLECMAC::block_size - 1] ^= 0x87;
+}
+// -------------------------------------------------------------------------------------------------------------------
+BLECMAC::BLECMAC(const uint8_t key[block_size])
+{
+    // AES-128 key expansion, words of 4 bytes
+    memcpy(m_round_keys[0], key, block_size);
+    uint8_t rcon = 1;
+    for (size_t round = 1; round < 11; ++round)
+    {
+        const uint8_t* prev = m_round_keys[round - 1];
+        uint8_t* next = m_round_keys[round];
+        next[0] = prev[0] ^ s_sbox[prev[13]] ^ rcon;
+        next[1] = prev[1] ^ s_sbox[prev[14]];
+        next[2] = prev[2] ^ s_sbox[prev[15]];
+        next[3] = prev[3] ^ s_sbox[prev[12]];
+        for (size_t i = 4; i < block_size; ++i)
+            next[i] = prev[i] ^ next[i - 4];
+        rcon = XTime(rcon);
+    }
+    memset(m_state, 0, sizeof(m_state));
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLECMAC::Encrypt(uint8_t block[block_size]) const
+{
+    for (size_t i = 0; i < block_size; ++i)
+        block[i] ^= m_round_keys[0][i];
+
+    for (size_t round = 1; round < 11; ++round)
+    {
+        // SubBytes and ShiftRows, the state is stored column by column
+        uint8_t shifted[block_size];
+        for (size_t i = 0; i < block_size; ++i)
+            shifted[i] = s_sbox[block[(i + 4 * (i % 4)) % block_size]];
+
+        // MixColumns, except in the last round
+        if (round < 10)
+        {
+            for (size_t c = 0; c < block_size; c += 4)
+            {
+                uint8_t* col = shifted + c;
+                uint8_t all = col[0] ^ col[1] ^ col[2] ^ col[3];
+                uint8_t first = col[0];
+                col[0] ^= all ^ XTime(col[0] ^ col[1]);
+                col[1] ^= all ^ XTime(col[1] ^ col[2]);
+                col[2] ^= all ^ XTime(col[2] ^ col[3]);
+                col[3] ^= all ^ XTime(col[3] ^ first);
+            }
+        }
+
+        for (size_t i = 0; i < block_size; ++i)
+            block[i] = shifted[i] ^ m_round_keys[round][i];
+    }
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLECMAC::Update(const uint8_t* data, size_t len)
+{
+    while (len)
+    {
+        // a full block is only chained when more data follows, the last one is special
+        if (m_block_len == block_size)
+        {
+            for (size_t i = 0; i < block_size; ++i)
+                m_state[i] ^= m_block[i];
+            Encrypt(m_state);
+            m_block_len = 0;
+        }
+        size_t part = block_size - m_block_len;
+        if (part > len)
+            part = len;
+        memcpy(m_block + m_block_len, data, part);
+        m_block_len = (uint8_t)(m_block_len + part);
+        data += part;
+        len -= part;
+    }
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLECMAC::Finish(uint8_t mac[block_size])
+{
+    // subkeys K1 (complete last block) and K2 (padded last block)
+    uint8_t subkey[block_size] = {0};
+    Encrypt(subkey);
+    uint8_t k1[block_size];
+    ShiftSubkey(subkey, k1);
+    if (m_block_len == block_size)
+    {
+        memcpy(subkey, k1, block_size);
+    }
+    else
+    {
+        ShiftSubkey(k1, subkey);
+        m_block[m_block_len] = 0x80;
+        memset(m_block + m_block_len + 1, 0, block_size - m_block_len - 1);
+    }
+
+    for (size_t i = 0; i < block_size; ++i)
+        mac[i] = m_state[i] ^ m_block[i] ^ subkey[i];
+    Encrypt(mac);
+}
+// -------------------------------------------------------------------------------------------------------------------
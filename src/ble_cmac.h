@@ -0,0 +1,47 @@
+# pragma once
+// ------------------------------------------------------------------------------------------
+/*
+AES-CMAC (RFC 4493) as used by the Bluetooth Core specification, e.g. for the
+Database Hash characteristic of the Generic Attribute service (see
+BLEServer::GetDatabaseHash()).
+
+The message is passed in parts with Update(), so a hash over all attribute
+tables is computed without assembling them in a buffer. Small and slow on
+purpose: it runs once when the attribute tables are created, so it needs
+neither tables beyond the S-box nor a crypto library.
+
+    BLECMAC cmac(key);
+    cmac.Update(part1, len1);
+    cmac.Update(part2, len2);
+    cmac.Finish(mac);
+*/
+// ------------------------------------------------------------------------------------------
+# include <cstddef>
+# include <cstdint>
+// ------------------------------------------------------------------------------------------
+class BLECMAC
+{
+public:
+    static constexpr size_t block_size = 16;
+
+    /// Starts a MAC with the 128 bit \a key (big endian, as in RFC 4493).
+    explicit BLECMAC(const uint8_t key[block_size]);
+
+    /// Appends \a len bytes of \a data to the message.
+    void Update(const uint8_t* data, size_t len);
+
+    /// Writes the MAC (big endian) to \a mac, no more Update() afterwards.
+    void Finish(uint8_t mac[block_size]);
+
+protected:
+    /// Expanded AES-128 key.
+    uint8_t m_round_keys[11][block_size];
+    /// Chaining value (encrypted blocks so far).
+    uint8_t m_state[block_size];
+    /// Last block of the message so far, only processed when more data follows.
+    uint8_t m_block[block_size];
+    uint8_t m_block_len = 0;
+
+    void Encrypt(uint8_t block[block_size]) const;
+};
+// ------------------------------------------------------------------------------------------
@@ -0,0 +1,373 @@
+# pragma once
+// ------------------------------------------------------------------------------------------
+/*
+Table driven dispatcher of framed commands written to a characteristic (requires C++17).
+
+A frame consists of an optional header byte, the command id, an optional length
+byte, the payload, an optional CRC-8 and an optional footer byte:
+
+    [header] command [length] payload ... [crc] [footer]
+
+The commands are declared at compile time, the command id indexes a constant
+table of 256 bytes, so finding the handler takes the same time for 2 or 255
+commands. The handler reads the payload from the written value and writes its
+reply directly into the notification queue of the connection (see
+BLEServer::NotifyInPlace()), nothing is copied in between.
+
+    static bool OnHello(uint16_t conn_id, const uint8_t* request, uint16_t len, uint8_t* reply, uint16_t& reply_len)
+    {
+        reply_len = 5;
+        memcpy(reply, "Hello", reply_len);
+        return true;
+    }
+
+    typedef BLECommandDispatcher<
+        BLEFrame<0xAA, 0x55>,
+        BLECommandTable<
+            BLECommand<0x01, OnHello>,
+            BLECommand<0x02, OnBye>
+        >
+    > Commands;
+
+    server.AddCharacteristic(..., Commands::OnEvent);          // the write characteristic
+    Commands::Bind(&server, rx_svc_idx, rx_char_idx);          // the one notified with replies
+
+The state of a dispatcher is static, every BLECommandDispatcher type is one dispatcher.
+Bound with its context instead, the server and the reply handle come with each
+event, so the same dispatcher serves any number of servers:
+
+    server.SetEventHandler(tx_svc_idx, tx_char_idx, Commands::HandleEvent, evt_mask_write, rx_svc_idx, rx_char_idx);
+*/
+// ------------------------------------------------------------------------------------------
+# include "ble_server.h"
+# include <algorithm>
+# include <array>
+# include <cassert>
+# include <cstddef>
+# include <cstdint>
+// ------------------------------------------------------------------------------------------
+/// Frame flag: a byte with the length of the payload follows the command id.
+static const uint8_t frame_flag_length             = (1 << 0);
+/// Frame flag: a CRC-8 of command id, length and payload precedes the footer.
+static const uint8_t frame_flag_crc8               = (1 << 1);
+/// Frame flag: replies are framed as well, with the command id of the request.
+static const uint8_t frame_flag_reply              = (1 << 2);
+/// Header or footer of BLEFrame not used.
+static const int frame_none                        = -1;
+// ------------------------------------------------------------------------------------------
+/// CRC-8 lookup table (polynomial 0x07), built at compile time.
+inline constexpr std::array<uint8_t, 256> ble_crc8_table = [] {
+    std::array<uint8_t, 256> table = {};
+    for (int i = 0; i < 256; ++i)
+    {
+        uint8_t crc = (uint8_t)i;
+        for (int bit = 0; bit < 8; ++bit)
+            crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+        table[i] = crc;
+    }
+    return table;
+}();
+
+/// CRC-8 of \a len bytes at \a data.
+inline uint8_t BLECRC8(const uint8_t* data, size_t len, uint8_t crc = 0)
+{
+    while (len--)
+        crc = ble_crc8_table[crc ^ *data++];
+    return crc;
+}
+// ------------------------------------------------------------------------------------------
+/// Framing of commands and replies.
+/// \tparam HEADER First byte of a frame (or \c frame_none).
+/// \tparam FOOTER Last byte of a frame (or \c frame_none).
+/// \tparam FLAGS \c frame_flag_* bits.
+template <int HEADER = 0xAA, int FOOTER = 0x55, uint8_t FLAGS = 0>
+struct BLEFrame
+{
+    static_assert(HEADER >= frame_none && HEADER <= 0xFF, "Invalid frame header.");
+    static_assert(FOOTER >= frame_none && FOOTER <= 0xFF, "Invalid frame footer.");
+
+    static constexpr bool has_header = HEADER != frame_none;
+    static constexpr bool has_footer = FOOTER != frame_none;
+    static constexpr bool has_length = (FLAGS & frame_flag_length) != 0;
+    static constexpr bool has_crc = (FLAGS & frame_flag_crc8) != 0;
+
+    /// Bytes before and after the payload.
+    static constexpr uint16_t prefix = (has_header ? 1 : 0) + 1 + (has_length ? 1 : 0);
+    static constexpr uint16_t suffix = (has_crc ? 1 : 0) + (has_footer ? 1 : 0);
+
+    /// Same for replies, 0 if they are sent as they are.
+    static constexpr uint16_t reply_prefix = (FLAGS & frame_flag_reply) ? prefix : 0;
+    static constexpr uint16_t reply_suffix = (FLAGS & frame_flag_reply) ? suffix : 0;
+
+    /// Longest payload, limited by the length byte.
+    static constexpr uint16_t max_payload = has_length ? 0xFF : 0xFFFF;
+
+    /// Checks the frame of \a len bytes at \a data.
+    /// \returns \c false if it is malformed, otherwise \a command and the payload are set.
+    static bool Parse(const uint8_t* data, uint16_t len, uint8_t& command, const uint8_t*& payload, uint16_t& payload_len)
+    {
+        if (len < prefix + suffix)
+            return false;
+        if (has_header && data[0] != (uint8_t)HEADER)
+            return false;
+        if (has_footer && data[len - 1] != (uint8_t)FOOTER)
+            return false;
+
+        const uint8_t* body = has_header ? data + 1 : data;
+        command = body[0];
+        payload = data + prefix;
+        payload_len = len - prefix - suffix;
+        if (has_length && body[1] != payload_len)
+            return false;
+        if (has_crc && payload[payload_len] != BLECRC8(body, payload + payload_len - body))
+            return false;
+        return true;
+    }
+
+    /// Frames a reply to \a command, the \a payload_len bytes of the payload are at \a frame + reply_prefix.
+    static void FrameReply(uint8_t* frame, uint8_t command, uint16_t payload_len)
+    {
+        if constexpr ((FLAGS & frame_flag_reply) != 0)
+        {
+            uint8_t* body = frame;
+            if (has_header)
+                *body++ = (uint8_t)HEADER;
+            body[0] = command;
+            if (has_length)
+                body[1] = (uint8_t)payload_len;
+            uint8_t* end = frame + prefix + payload_len;
+            if (has_crc)
+            {
+                *end = BLECRC8(body, end - body);
+                ++end;
+            }
+            if (has_footer)
+                *end = (uint8_t)FOOTER;
+        }
+    }
+};
+// ------------------------------------------------------------------------------------------
+/// Type of command handler.
+/// \param request Payload of the command with \a len bytes.
+/// \param reply Space for the payload of the reply, \a reply_len is its size on entry (at least
+///     ESP_GATT_DEF_BLE_MTU_SIZE - 3 minus the framing) and has to be set to the length written.
+/// \returns \c false if there's no reply.
+/// Handlers are called with the server locked and must not send notifications to the
+/// connection themselves.
+typedef bool (*command_func)(uint16_t conn_id, const uint8_t* request, uint16_t len, uint8_t* reply, uint16_t& reply_len);
+
+/// Command \a ID handled by \a FUNC, accepted with a payload of \a MIN_LEN to \a MAX_LEN bytes.
+template <uint8_t ID, command_func FUNC, uint16_t MIN_LEN = 0, uint16_t MAX_LEN = 0xFFFF>
+struct BLECommand
+{
+    static_assert(FUNC != nullptr, "Command handler missing.");
+    static_assert(MIN_LEN <= MAX_LEN, "Invalid payload length range.");
+
+    static constexpr uint8_t id = ID;
+    static constexpr command_func func = FUNC;
+    static constexpr uint16_t min_len = MIN_LEN;
+    static constexpr uint16_t max_len = MAX_LEN;
+};
+
+/// Entry of BLECommandTable.
+struct BLECommandEntry
+{
+    command_func func;
+    uint16_t min_len;
+    uint16_t max_len;
+};
+
+/// Whether all of the \a N command \a ids differ.
+template <size_t N>
+constexpr bool BLECommandIdsUnique(const std::array<uint8_t, N>& ids)
+{
+    bool used[256] = {};
+    for (size_t i = 0; i < N; ++i)
+    {
+        if (used[ids[i]])
+            return false;
+        used[ids[i]] = true;
+    }
+    return true;
+}
+
+/// Index of each command id in the entries of BLECommandTable (0 if unknown).
+template <size_t N>
+constexpr std::array<uint8_t, 256> BLECommandIndex(const std::array<uint8_t, N>& ids)
+{
+    std::array<uint8_t, 256> index = {};
+    for (size_t i = 0; i < N; ++i)
+        index[ids[i]] = (uint8_t)(i + 1);
+    return index;
+}
+
+/// Compile-time table of up to 255 BLECommand types, placed in flash.
+template <class... COMMANDS>
+struct BLECommandTable
+{
+    static constexpr size_t count = sizeof...(COMMANDS);
+    static_assert(count > 0 && count < 256, "A command table has 1 to 255 commands.");
+
+    static constexpr std::array<uint8_t, count> ids = {{COMMANDS::id...}};
+    static_assert(BLECommandIdsUnique(ids), "Command ids must be unique.");
+
+    /// Entry 0 stands for unknown commands.
+    static constexpr std::array<BLECommandEntry, count + 1> entries = {{
+        {nullptr, 0, 0}, {COMMANDS::func, COMMANDS::min_len, COMMANDS::max_len}...
+    }};
+    static constexpr std::array<uint8_t, 256> index = BLECommandIndex(ids);
+
+    /// Entry of command \a id (with \c func = \c nullptr if unknown).
+    static const BLECommandEntry& Find(uint8_t id) { return entries[index[id]]; }
+};
+// ------------------------------------------------------------------------------------------
+/// Counters of a BLECommandDispatcher.
+struct BLECommandStats
+{
+    /// Commands a handler was called for (including unknown ones passed to the default handler).
+    uint32_t commands;
+    /// Replies queued.
+    uint32_t replies;
+    /// Writes with a wrong header, footer, length or CRC.
+    uint32_t bad_frames;
+    /// Commands not in the table.
+    uint32_t unknown;
+    /// Commands with a payload length out of range.
+    uint32_t bad_length;
+    /// Commands executed without room for a reply (notification queue full or client gone).
+    uint32_t dropped;
+};
+// ------------------------------------------------------------------------------------------
+/// Dispatches the commands written to a characteristic to the handlers of \a TABLE,
+/// replies are notified on the characteristic set with Bind().
+/// \tparam FRAME BLEFrame type.
+/// \tparam TABLE BLECommandTable type.
+/// \tparam UNKNOWN Optional handler of commands not in the table.
+template <class FRAME, class TABLE, command_func UNKNOWN = nullptr>
+class BLECommandDispatcher
+{
+public:
+    static_assert(FRAME::reply_prefix + FRAME::reply_suffix < ESP_GATT_DEF_BLE_MTU_SIZE - 3, "Reply framing too long.");
+
+    /// Sends the replies through \a server as notifications of attribute \a attribute_index of service
+    /// \a service_id. The handle is looked up with the first command, after the attributes are registered.
+    static void Bind(BLEServer* server, uint8_t service_id, uint8_t attribute_index)
+    {
+        m_server = server;
+        m_service_id = service_id;
+        m_attribute_index = attribute_index;
+        m_reply_handle = 0;
+    }
+
+    /// Sends the replies through \a server as notifications of \a reply_handle.
+    static void Bind(BLEServer* server, uint16_t reply_handle)
+    {
+        m_server = server;
+        m_service_id = BLEService::npos;
+        m_reply_handle = reply_handle;
+    }
+
+    /// Event handler of the write characteristic (see BLEServer::AddCharacteristic()).
+    static void OnEvent(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param)
+    {
+        if (event == ESP_GATTS_WRITE_EVT && !param->write.is_prep)
+            Dispatch(param->write.conn_id, param->write.value, param->write.len);
+    }
+
+    /// Event handler of the write characteristic with bound context (see BLEServer::SetEventHandler()),
+    /// replies are notified on BLEEventContext::reply_handle of BLEEventContext::server. Bind() is not needed.
+    static void HandleEvent(const BLEEventContext& context)
+    {
+        if (context.event == ESP_GATTS_WRITE_EVT && !context.param->write.is_prep)
+            Dispatch(context.server, context.reply_handle, context.conn_id, context.param->write.value, context.param->write.len);
+    }
+
+    /// Calls the handler of the command framed in the \a len bytes at \a data written by \a conn_id.
+    /// \returns \c false if the frame was rejected.
+    static bool Dispatch(uint16_t conn_id, const uint8_t* data, uint16_t len)
+    {
+        if (m_server && !m_reply_handle && m_service_id != BLEService::npos)
+            m_reply_handle = m_server->GetHandle(m_service_id, m_attribute_index);
+        return Dispatch(m_server, m_reply_handle, conn_id, data, len);
+    }
+
+    /// Like above, the reply is notified through \a server on \a reply_handle (none if 0).
+    static bool Dispatch(BLEServer* server, uint16_t reply_handle, uint16_t conn_id, const uint8_t* data, uint16_t len)
+    {
+        Request request;
+        request.conn_id = conn_id;
+        request.replied = false;
+        if (!FRAME::Parse(data, len, request.command, request.payload, request.len))
+        {
+            ++m_stats.bad_frames;
+            return false;
+        }
+
+        const BLECommandEntry& entry = TABLE::Find(request.command);
+        request.func = entry.func;
+        if (!request.func)
+        {
+            ++m_stats.unknown;
+            request.func = UNKNOWN;
+            if (!request.func)
+                return false;
+        }
+        else if (request.len < entry.min_len || request.len > entry.max_len)
+        {
+            ++m_stats.bad_length;
+            return false;
+        }
+        ++m_stats.commands;
+
+        if (server && reply_handle && server->NotifyInPlace(conn_id, reply_handle, ESP_GATT_MAX_ATTR_LEN, BuildReply, &request) == ESP_OK)
+        {
+            if (request.replied)
+                ++m_stats.replies;
+            return true;
+        }
+
+        // no room for the reply, the command is executed anyway
+        uint16_t reply_len = sizeof(m_discard) - FRAME::reply_prefix - FRAME::reply_suffix;
+        request.func(conn_id, request.payload, request.len, m_discard + FRAME::reply_prefix, reply_len);
+        ++m_stats.dropped;
+        return true;
+    }
+
+    static const BLECommandStats& GetStats(void) { return m_stats; }
+    static void ResetStats(void) { m_stats = BLECommandStats(); }
+
+protected:
+    /// Command passed to BuildReply().
+    struct Request
+    {
+        command_func func;
+        uint16_t conn_id;
+        uint8_t command;
+        const uint8_t* payload;
+        uint16_t len;
+        bool replied;
+    };
+
+    inline static BLEServer* m_server = nullptr;
+    inline static uint8_t m_service_id = BLEService::npos;
+    inline static uint8_t m_attribute_index = 0;
+    inline static uint16_t m_reply_handle = 0;
+    inline static BLECommandStats m_stats = BLECommandStats();
+    /// Reply space of commands whose reply cannot be queued.
+    inline static uint8_t m_discard[ESP_GATT_DEF_BLE_MTU_SIZE - 3];
+
+    /// Lets the handler write its reply into the notification queue.
+    static bool BuildReply(void* context, uint8_t* value, uint16_t& len)
+    {
+        Request& request = *(Request*)context;
+        uint16_t reply_len = std::min<uint16_t>(len - FRAME::reply_prefix - FRAME::reply_suffix, FRAME::max_payload);
+        if (!request.func(request.conn_id, request.payload, request.len, value + FRAME::reply_prefix, reply_len))
+            return false;
+        assert(reply_len <= len - FRAME::reply_prefix - FRAME::reply_suffix);
+        FRAME::FrameReply(value, request.command, reply_len);
+        len = reply_len + FRAME::reply_prefix + FRAME::reply_suffix;
+        request.replied = true;
+        return true;
+    }
+};
+// ------------------------------------------------------------------------------------------
@@ -0,0 +1,184 @@
+# pragma once
+// ------------------------------------------------------------------------------------------
+/*
+Build configuration of the BLE server library.
+Every value can be overridden by a compiler definition, e.g. in the CMakeLists.txt
+of the component:
+
+    target_compile_definitions(${COMPONENT_LIB} PUBLIC BLE_SERVER_STATIC_STORAGE BLE_MAX_SERVICES=4)
+*/
+// ------------------------------------------------------------------------------------------
+/// If defined, the server doesn't use the heap at all: services, attribute tables,
+/// handles, event handlers and the device name are kept in fixed-capacity storage
+/// inside the BLEServer instance, sized by the limits below.
+/// Otherwise standard containers are used and the limits are not checked, the containers grow.
+//# define BLE_SERVER_STATIC_STORAGE
+
+/// If defined, the server counts events per handle and measures the time spent in the
+/// event handlers and from a write to the reply, see BLEServer::GetInstrumentation().
+/// Cheap enough for release builds, it costs BLEInstrumentation (about 2 KB) of RAM.
+//# define BLE_SERVER_INSTRUMENTATION
+
+/// If defined, the server writes a binary record of every event and notification into
+/// a RAM ring instead of logging them, see BLEServer::ReadTrace() and host/tools/ble_trace_decode.py.
+/// A record costs a few stores, it takes BLE_TRACE_RING_SIZE * 20 bytes of RAM.
+//# define BLE_SERVER_TRACE
+
+/// If defined, every stack event passed to the server can be recorded in a compact binary
+/// format and replayed on the host, see BLEServer::SetRecorder() and host/tools/ble_replay.cpp.
+/// Costs a buffer of about 630 bytes and a check per event while not recording.
+//# define BLE_SERVER_RECORD
+// ------------------------------------------------------------------------------------------
+/// Maximum number of services (GATT_MAX_SR_PROFILES in bt_target.h).
+# ifndef BLE_MAX_SERVICES
+#  define BLE_MAX_SERVICES 8
+# endif
+
+/// Maximum number of attributes of a single service built with AddCharacteristic().
+# ifndef BLE_MAX_SERVICE_ATTRIBUTES
+#  define BLE_MAX_SERVICE_ATTRIBUTES 32
+# endif
+
+/// Maximum number of attributes with an event handler.
+# ifndef BLE_MAX_EVENT_HANDLERS
+#  define BLE_MAX_EVENT_HANDLERS 16
+# endif
+
+/// Bytes of the inline storage of an event handler (see BLEEventHandler): the captures of a
+/// lambda or the object of a member function, no allocation.
+# ifndef BLE_HANDLER_STORAGE_SIZE
+#  define BLE_HANDLER_STORAGE_SIZE 16
+# endif
+
+/// Maximum distance between the lowest and highest handle with an event handler.
+# ifndef BLE_MAX_HANDLE_RANGE
+#  define BLE_MAX_HANDLE_RANGE (BLE_MAX_SERVICES * BLE_MAX_SERVICE_ATTRIBUTES)
+# endif
+
+/// Maximum length of the device name (without terminating zero).
+# ifndef BLE_MAX_DEVICE_NAME
+#  define BLE_MAX_DEVICE_NAME 29
+# endif
+
+/// Number of handles counted one by one (from the lowest one of all services) with
+/// BLE_SERVER_INSTRUMENTATION, the counters of all others are summed up.
+# ifndef BLE_INSTRUMENTATION_HANDLES
+#  define BLE_INSTRUMENTATION_HANDLES 64
+# endif
+
+/// Buckets of the instrumentation histograms, the last one counts times above
+/// 2^(BLE_HISTOGRAM_BUCKETS - 1) us (32ms by default).
+# ifndef BLE_HISTOGRAM_BUCKETS
+#  define BLE_HISTOGRAM_BUCKETS 16
+# endif
+
+/// Records of the trace ring with BLE_SERVER_TRACE (a power of two), records arriving
+/// while it's full are counted as lost.
+# ifndef BLE_TRACE_RING_SIZE
+#  define BLE_TRACE_RING_SIZE 256
+# endif
+
+/// Maximum number of simultaneous connections (CONFIG_BT_ACL_CONNECTIONS).
+# ifndef BLE_MAX_CONNECTIONS
+#  define BLE_MAX_CONNECTIONS 4
+# endif
+
+/// Maximum number of client configuration descriptors (0x2902) of all services,
+/// the subscriptions of a connection are kept in 32 bit masks.
+# ifndef BLE_MAX_CONFIG_DESCRIPTORS
+#  define BLE_MAX_CONFIG_DESCRIPTORS 32
+# endif
+# if BLE_MAX_CONFIG_DESCRIPTORS > 32
+#  error "BLE_MAX_CONFIG_DESCRIPTORS must not exceed 32"
+# endif
+
+/// Maximum number of characteristics with a read provider (see BLEServer::AddCharacteristic()).
+# ifndef BLE_MAX_READ_PROVIDERS
+#  define BLE_MAX_READ_PROVIDERS 8
+# endif
+
+/// Time a value computed by a read provider answers the reads with an offset (the further
+/// parts of a long read) of the client it was computed for, at least its cache time.
+# ifndef BLE_READ_PROVIDER_HOLD_MS
+#  define BLE_READ_PROVIDER_HOLD_MS 1000
+# endif
+
+/// Maximum number of characteristics with limited notifications (see BLEServer::SetNotifyLimit())
+/// and the maximum length of their values.
+# ifndef BLE_MAX_NOTIFY_LIMITS
+#  define BLE_MAX_NOTIFY_LIMITS 4
+# endif
+# ifndef BLE_NOTIFY_LIMIT_VALUE_SIZE
+#  define BLE_NOTIFY_LIMIT_VALUE_SIZE 64
+# endif
+
+/// Bytes of the notification queue of each connection (see BLEServer::Notify()).
+/// Every queued notification takes its length plus 6 bytes.
+# ifndef BLE_NOTIFY_QUEUE_SIZE
+#  define BLE_NOTIFY_QUEUE_SIZE 1024
+# endif
+
+/// Maximum number of notifications handed to the stack and not confirmed yet per connection.
+/// Should not exceed the TX buffers of the controller, otherwise the stack rejects
+/// packets which then have to be sent again.
+# ifndef BLE_NOTIFY_WINDOW
+#  define BLE_NOTIFY_WINDOW 8
+# endif
+
+/// Messages of BLEServer::SendReliable() queued per connection and their maximum length.
+# ifndef BLE_RELIABLE_QUEUE_LENGTH
+#  define BLE_RELIABLE_QUEUE_LENGTH 4
+# endif
+# ifndef BLE_RELIABLE_VALUE_SIZE
+#  define BLE_RELIABLE_VALUE_SIZE 20
+# endif
+
+/// Reliable messages sent as notifications and not acknowledged yet per connection
+/// (see BLEServer::SetReliableAck()).
+# ifndef BLE_RELIABLE_WINDOW
+#  define BLE_RELIABLE_WINDOW 4
+# endif
+
+/// Time a reliable message waits for its confirmation or acknowledgement and the
+/// number of times it is sent again before it fails.
+# ifndef BLE_RELIABLE_TIMEOUT_MS
+#  define BLE_RELIABLE_TIMEOUT_MS 2000
+# endif
+# ifndef BLE_RELIABLE_RETRIES
+#  define BLE_RELIABLE_RETRIES 2
+# endif
+
+/// Number of buffers for long writes (prepare / execute write), a connection
+/// uses one from its first prepare write request until the execute write request.
+# ifndef BLE_PREPARE_BUFFERS
+#  define BLE_PREPARE_BUFFERS 2
+# endif
+
+/// Size of a long write buffer, the maximum length of a value written by a long write.
+# ifndef BLE_PREPARE_BUFFER_SIZE
+#  define BLE_PREPARE_BUFFER_SIZE 512
+# endif
+
+/// Bytes of the ring passing events to the handler task (see BLEServer::StartHandlerTask()),
+/// must be a power of two. Every event takes about 40 bytes plus the written value.
+# ifndef BLE_HANDLER_RING_SIZE
+#  define BLE_HANDLER_RING_SIZE 2048
+# endif
+
+/// Default stack size (bytes), priority and core of the handler task.
+# ifndef BLE_HANDLER_TASK_STACK_SIZE
+#  define BLE_HANDLER_TASK_STACK_SIZE 4096
+# endif
+# ifndef BLE_HANDLER_TASK_PRIORITY
+#  define BLE_HANDLER_TASK_PRIORITY 5
+# endif
+# ifndef BLE_HANDLER_TASK_CORE
+#  define BLE_HANDLER_TASK_CORE tskNO_AFFINITY
+# endif
+
+/// Delay (ms) before changed subscriptions of bonded clients are saved (see BLEServer::SetBondStore()),
+/// all changes meanwhile are saved together. A disconnect saves at once.
+# ifndef BLE_BOND_SAVE_DELAY_MS
+#  define BLE_BOND_SAVE_DELAY_MS 2000
+# endif
+// ------------------------------------------------------------------------------------------
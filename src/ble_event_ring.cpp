@@ -0,0 +1,114 @@
+# include "ble_event_ring.h"
+# include "ble_storage.h"
+# include <cstring>
+# include <cassert>
+// -------------------------------------------------------------------------------------------------------------------
+BLEEventRing::BLEEventRing()
+:m_head(0)
+,m_tail(0)
+,m_pushed(0)
+,m_popped(0)
+,m_max_used(0)
+{
+    BLEMemory::Reserve(sizeof(m_buffer));
+}
+// -------------------------------------------------------------------------------------------------------------------
+BLEEventRing::~BLEEventRing()
+{
+    BLEMemory::Unreserve(sizeof(m_buffer));
+}
+// -------------------------------------------------------------------------------------------------------------------
+size_t BLEEventRing::GetRecordSize(uint16_t len)
+{
+    // keep the following header aligned
+    const size_t align = alignof(Record);
+    return (sizeof(Record) + len + align - 1) & ~(align - 1);
+}
+// -------------------------------------------------------------------------------------------------------------------
+bool BLEEventRing::Push(const void* handler, esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, const esp_ble_gatts_cb_param_t& param)
+{
+    assert(handler);
+
+    const uint8_t* value = nullptr;
+    uint16_t len = 0;
+    if (event == ESP_GATTS_WRITE_EVT)
+    {
+        value = param.write.value;
+        len = param.write.len;
+    }
+    else if (event == ESP_GATTS_CONF_EVT && param.conf.value)
+    {
+        value = param.conf.value;
+        len = param.conf.len;
+    }
+
+    size_t size = GetRecordSize(len);
+    uint32_t tail = m_tail.load(std::memory_order_relaxed);
+    uint32_t head = m_head.load(std::memory_order_acquire);
+    size_t contiguous = capacity - (tail & (capacity - 1));
+    size_t padding = contiguous < size ? contiguous : 0;
+    if (size > capacity || capacity - (tail - head) < size + padding)
+        return false;
+
+    if (padding)
+    {
+        // the rest of the buffer is skipped, marked if there's room for a header
+        if (padding >= sizeof(Record))
+            GetRecord(tail)->handler = nullptr;
+        tail += (uint32_t)padding;
+    }
+
+    Record* record = GetRecord(tail);
+    record->handler = handler;
+    record->event = event;
+    record->gatts_if = gatts_if;
+    record->len = len;
+    record->size = (uint32_t)size;
+    record->param = param;
+    if (len)
+    {
+        uint8_t* copy = (uint8_t*)(record + 1);
+        memcpy(copy, value, len);
+        if (event == ESP_GATTS_WRITE_EVT)
+            record->param.write.value = copy;
+        else
+            record->param.conf.value = copy;
+    }
+
+    tail += (uint32_t)size;
+    m_tail.store(tail, std::memory_order_release);
+    m_pushed.fetch_add(1, std::memory_order_relaxed);
+
+    uint32_t used = tail - head;
+    if (used > m_max_used.load(std::memory_order_relaxed))
+        m_max_used.store(used, std::memory_order_relaxed);
+    return true;
+}
+// -------------------------------------------------------------------------------------------------------------------
+BLEEventRing::Record* BLEEventRing::Front(void)
+{
+    uint32_t head = m_head.load(std::memory_order_relaxed);
+    uint32_t tail = m_tail.load(std::memory_order_acquire);
+    if (head == tail)
+        return nullptr;
+
+    size_t contiguous = capacity - (head & (capacity - 1));
+    if (contiguous < sizeof(Record) || !GetRecord(head)->handler)
+    {
+        // skip the padding, a record follows at the beginning of the buffer
+        head += (uint32_t)contiguous;
+        m_head.store(head, std::memory_order_release);
+        assert(head != tail);
+    }
+    return GetRecord(head);
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEEventRing::Pop(void)
+{
+    uint32_t head = m_head.load(std::memory_order_relaxed);
+    Record* record = GetRecord(head);
+    assert(record->handler && head != m_tail.load(std::memory_order_relaxed));
+    m_head.store(head + record->size, std::memory_order_release);
+    m_popped.fetch_add(1, std::memory_order_relaxed);
+}
+// -------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,90 @@
+# pragma once
+// ------------------------------------------------------------------------------------------
+/*
+Lock-free single-producer / single-consumer ring of GATT events, used to hand
+events from the BTC task (producer) to the handler task (consumer) of BLEServer.
+
+Each record holds the handler to call (opaque to the ring), the event parameters and a copy of the
+value the parameters point to, so the event stays valid after the stack
+callback returned. Records never wrap around the end of the buffer: if a record
+doesn't fit into the rest of the buffer, the producer fills it with a padding
+record and continues at the beginning.
+
+    consumed       m_head                m_tail         free
+    ...          [ record | record | ... ]             ...
+
+m_head and m_tail count bytes and only grow, the position in the buffer is the
+count modulo the capacity (a power of two). Only the producer writes m_tail and
+only the consumer writes m_head, so no lock is needed.
+*/
+// ------------------------------------------------------------------------------------------
+# include "ble_config.h"
+# include <esp_gatts_api.h>
+# include <atomic>
+# include <cstddef>
+# include <cstdint>
+// ------------------------------------------------------------------------------------------
+class BLEEventRing
+{
+public:
+    /// Header of a queued event, the copied value follows.
+    struct Record
+    {
+        /// Handler to call, \c nullptr marks the padding at the end of the buffer
+        /// (if there's room for a header, otherwise the rest is skipped anyway).
+        const void* handler;
+        esp_gatts_cb_event_t event;
+        esp_gatt_if_t gatts_if;
+        /// Bytes of the copied value.
+        uint16_t len;
+        /// Bytes of the whole record including the header.
+        uint32_t size;
+        esp_ble_gatts_cb_param_t param;
+    };
+
+    BLEEventRing();
+    ~BLEEventRing();
+    BLEEventRing(const BLEEventRing&) = delete;
+    BLEEventRing& operator=(const BLEEventRing&) = delete;
+
+    /// Producer: appends the event with a copy of the value \a param points to
+    /// (written value or confirmed indication).
+    /// \returns \c false if there's not enough space left.
+    bool Push(const void* handler, esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, const esp_ble_gatts_cb_param_t& param);
+
+    /// Consumer: oldest event (or \c nullptr), valid until Pop().
+    Record* Front(void);
+
+    /// Consumer: removes the event returned by Front().
+    void Pop(void);
+
+    /// Number of events added / removed so far.
+    uint32_t GetPushedCount(void) const { return m_pushed.load(std::memory_order_relaxed); }
+    uint32_t GetPoppedCount(void) const { return m_popped.load(std::memory_order_relaxed); }
+
+    /// Number of queued events.
+    size_t GetCount(void) const { return m_pushed.load(std::memory_order_relaxed) - m_popped.load(std::memory_order_relaxed); }
+
+    /// Bytes occupied by the queued events (including padding).
+    size_t GetUsedBytes(void) const { return m_tail.load(std::memory_order_relaxed) - m_head.load(std::memory_order_relaxed); }
+
+    /// Highest number of bytes occupied so far.
+    size_t GetMaxUsedBytes(void) const { return m_max_used.load(std::memory_order_relaxed); }
+
+    static constexpr size_t capacity = BLE_HANDLER_RING_SIZE;
+    static_assert(capacity && (capacity & (capacity - 1)) == 0, "BLE_HANDLER_RING_SIZE must be a power of two");
+
+protected:
+    alignas(Record) uint8_t m_buffer[capacity];
+    /// Bytes consumed (written by the consumer only).
+    std::atomic<uint32_t> m_head;
+    /// Bytes produced (written by the producer only).
+    std::atomic<uint32_t> m_tail;
+    std::atomic<uint32_t> m_pushed;
+    std::atomic<uint32_t> m_popped;
+    std::atomic<uint32_t> m_max_used;
+
+    static size_t GetRecordSize(uint16_t len);
+    Record* GetRecord(uint32_t count) { return (Record*)(m_buffer + (count & (capacity - 1))); }
+};
+// ------------------------------------------------------------------------------------------
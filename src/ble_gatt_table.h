@@ -0,0 +1,266 @@
+# pragma once
+// ------------------------------------------------------------------------------------------
+/*
+Compile-time GATT attribute tables (requires C++17).
+
+A service is declared as a type listing its characteristics and their
+descriptors. The attribute table is a constexpr array placed in flash (.rodata),
+registering it with BLEServer::AddService<>() costs a single
+esp_ble_gatts_create_attr_tab() call without any heap allocation.
+Attribute indices are constants of the table type, asking for a characteristic
+or descriptor which doesn't exist fails to compile.
+
+    static uint8_t v_rx[20], v_rx_config[2];
+    static constexpr uint8_t rx_name[] = "RX-Channel";  // uint8_t, not char!
+
+    typedef BLEServiceTable<0xffe0,
+        BLEChar<0xffe4, char_prop_notify, ESP_GATT_PERM_READ, v_rx>,
+        BLEConfigDescr<v_rx_config>,
+        BLENameDescr<rx_name>
+    > RxService;
+
+    uint8_t rx_svc_idx = server.AddService<RxService>();
+    uint16_t hdl = server.GetHandle(rx_svc_idx, RxService::ValueIndex<0>());
+
+Descriptors always belong to the characteristic declared before them.
+*/
+// ------------------------------------------------------------------------------------------
+# include <esp_gatt_defs.h>
+# include <esp_gatts_api.h>
+# include <array>
+# include <cstddef>
+# include <cstdint>
+// ------------------------------------------------------------------------------------------
+/// Little endian representation of a 16 bit UUID with static storage.
+template <uint16_t UUID>
+inline constexpr uint8_t ble_uuid16[2] = {(uint8_t)(UUID & 0xFF), (uint8_t)(UUID >> 8)};
+
+/// Characteristic properties with static storage.
+template <uint8_t PROPERTIES>
+inline constexpr uint8_t ble_char_properties = PROPERTIES;
+// ------------------------------------------------------------------------------------------
+/// Characteristic declaration (0x2803) followed by its value.
+/// \tparam UUID 16 bit UUID of the value.
+/// \tparam PROPERTIES Property flags (e.g. \c char_prop_read_notify).
+/// \tparam PERMISSIONS Permissions for value access (R, W, R+W).
+/// \tparam VALUE Static \c uint8_t array holding the value, its size is the maximum length.
+/// \tparam RESPONSE \c ESP_GATT_AUTO_RSP or \c ESP_GATT_RSP_BY_APP
+/// \tparam LENGTH Initial length of the value.
+template <uint16_t UUID, uint8_t PROPERTIES, uint16_t PERMISSIONS, auto& VALUE,
+          uint8_t RESPONSE = ESP_GATT_AUTO_RSP, uint16_t LENGTH = 0>
+struct BLEChar
+{
+    static_assert(sizeof(VALUE[0]) == 1, "Characteristic value must be an uint8_t array.");
+    static_assert(sizeof(VALUE) > 0 && sizeof(VALUE) <= ESP_GATT_MAX_ATTR_LEN, "Invalid characteristic value size.");
+    static_assert(LENGTH <= sizeof(VALUE), "Initial length exceeds the value size.");
+
+    static constexpr bool is_characteristic = true;
+    static constexpr uint8_t properties = PROPERTIES;
+    static constexpr uint8_t count = 2;
+
+    template <class TABLE>
+    static constexpr void Append(TABLE& table, size_t& pos)
+    {
+        table[pos++] = {
+            {ESP_GATT_AUTO_RSP},
+            {
+                ESP_UUID_LEN_16, const_cast<uint8_t*>(ble_uuid16<ESP_GATT_UUID_CHAR_DECLARE>), ESP_GATT_PERM_READ,
+                sizeof(uint8_t), sizeof(uint8_t), const_cast<uint8_t*>(&ble_char_properties<PROPERTIES>)
+            }
+        };
+        table[pos++] = {
+            {RESPONSE},
+            {
+                ESP_UUID_LEN_16, const_cast<uint8_t*>(ble_uuid16<UUID>), PERMISSIONS,
+                (uint16_t)sizeof(VALUE), LENGTH, &VALUE[0]
+            }
+        };
+    }
+};
+// ------------------------------------------------------------------------------------------
+/// Client characteristic configuration descriptor (0x2902), required for notifications and indications.
+/// \tparam CONFIG Static \c uint8_t[2] holding the initial configuration.
+/// \tparam RESPONSE \c ESP_GATT_RSP_BY_APP: BLEServer answers with the subscription of each connection,
+///     \c ESP_GATT_AUTO_RSP: the stack keeps one value in \a CONFIG for all connections.
+template <auto& CONFIG, uint8_t RESPONSE = ESP_GATT_RSP_BY_APP>
+struct BLEConfigDescr
+{
+    static_assert(sizeof(CONFIG) == 2 && sizeof(CONFIG[0]) == 1, "Configuration value must be an uint8_t[2].");
+
+    static constexpr bool is_characteristic = false;
+    static constexpr bool is_config = true;
+    static constexpr uint8_t count = 1;
+
+    template <class TABLE>
+    static constexpr void Append(TABLE& table, size_t& pos)
+    {
+        table[pos++] = {
+            {RESPONSE},
+            {
+                ESP_UUID_LEN_16, const_cast<uint8_t*>(ble_uuid16<ESP_GATT_UUID_CHAR_CLIENT_CONFIG>),
+                ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE, 2, 2, &CONFIG[0]
+            }
+        };
+    }
+};
+// ------------------------------------------------------------------------------------------
+/// Characteristic user description (0x2901).
+/// \tparam TEXT Static constexpr \c uint8_t array initialized by a string literal.
+template <auto& TEXT>
+struct BLENameDescr
+{
+    static_assert(sizeof(TEXT[0]) == 1, "Description must be an uint8_t array.");
+    static_assert(sizeof(TEXT) > 1, "Description must not be empty.");
+
+    static constexpr bool is_characteristic = false;
+    static constexpr bool is_config = false;
+    static constexpr uint8_t count = 1;
+
+    template <class TABLE>
+    static constexpr void Append(TABLE& table, size_t& pos)
+    {
+        // without the terminating zero
+        table[pos++] = {
+            {ESP_GATT_AUTO_RSP},
+            {
+                ESP_UUID_LEN_16, const_cast<uint8_t*>(ble_uuid16<ESP_GATT_UUID_CHAR_DESCRIPTION>), ESP_GATT_PERM_READ,
+                (uint16_t)(sizeof(TEXT) - 1), (uint16_t)(sizeof(TEXT) - 1), const_cast<uint8_t*>(&TEXT[0])
+            }
+        };
+    }
+};
+// ------------------------------------------------------------------------------------------
+/// Primary service \a UUID with the characteristics and descriptors \a ITEMS.
+template <uint16_t UUID, class... ITEMS>
+class BLEServiceTable
+{
+protected:
+    static constexpr size_t item_count = sizeof...(ITEMS);
+    static constexpr bool item_is_char[item_count + 1] = {ITEMS::is_characteristic..., false};
+    static constexpr uint8_t item_size[item_count + 1] = {ITEMS::count..., 0};
+
+    template <class ITEM>
+    static constexpr bool IsConfig(void)
+    {
+        if constexpr (ITEM::is_characteristic)
+            return false;
+        else
+            return ITEM::is_config;
+    }
+    static constexpr bool item_is_config[item_count + 1] = {IsConfig<ITEMS>()..., false};
+
+    template <class ITEM>
+    static constexpr uint8_t Properties(void)
+    {
+        if constexpr (ITEM::is_characteristic)
+            return ITEM::properties;
+        else
+            return 0;
+    }
+    static constexpr uint8_t item_properties[item_count + 1] = {Properties<ITEMS>()..., 0};
+
+    static constexpr size_t CountCharacteristics(void)
+    {
+        size_t n = 0;
+        for (size_t i = 0; i < item_count; ++i)
+            n += item_is_char[i] ? 1 : 0;
+        return n;
+    }
+
+    /// Item position of characteristic \a n.
+    static constexpr size_t CharacteristicItem(size_t n)
+    {
+        for (size_t i = 0; i < item_count; ++i)
+        {
+            if (item_is_char[i] && n-- == 0)
+                return i;
+        }
+        return item_count;
+    }
+
+    /// Attribute index of the first attribute of item \a item.
+    static constexpr size_t ItemIndex(size_t item)
+    {
+        size_t index = 1; // service declaration
+        for (size_t i = 0; i < item; ++i)
+            index += item_size[i];
+        return index;
+    }
+
+    /// Item position of the configuration descriptor of characteristic \a n (or \c item_count).
+    static constexpr size_t ConfigItem(size_t n)
+    {
+        for (size_t i = CharacteristicItem(n) + 1; i < item_count && !item_is_char[i]; ++i)
+        {
+            if (item_is_config[i])
+                return i;
+        }
+        return item_count;
+    }
+
+    static constexpr bool ConfigsValid(void)
+    {
+        uint8_t props = 0;
+        for (size_t i = 0; i < item_count; ++i)
+        {
+            if (item_is_char[i])
+                props = item_properties[i];
+            else if (item_is_config[i] && !(props & (ESP_GATT_CHAR_PROP_BIT_NOTIFY | ESP_GATT_CHAR_PROP_BIT_INDICATE)))
+                return false;
+        }
+        return true;
+    }
+
+    static constexpr size_t total_count = ItemIndex(item_count);
+
+    static_assert(item_count > 0 && item_is_char[0], "A service table has to start with a characteristic.");
+    static_assert(total_count <= 0xFF, "Too many attributes for one service table.");
+    static_assert(ConfigsValid(), "Configuration descriptor added to a characteristic without notify or indicate property.");
+
+    static constexpr std::array<esp_gatts_attr_db_t, total_count> Build(void)
+    {
+        std::array<esp_gatts_attr_db_t, total_count> table{};
+        size_t pos = 0;
+        table[pos++] = {
+            {ESP_GATT_AUTO_RSP},
+            {
+                ESP_UUID_LEN_16, const_cast<uint8_t*>(ble_uuid16<ESP_GATT_UUID_PRI_SERVICE>), ESP_GATT_PERM_READ,
+                sizeof(uint16_t), sizeof(uint16_t), const_cast<uint8_t*>(ble_uuid16<UUID>)
+            }
+        };
+        (ITEMS::Append(table, pos), ...);
+        return table;
+    }
+
+public:
+    /// UUID of the service.
+    static constexpr uint16_t uuid = UUID;
+
+    /// Number of attributes in the table.
+    static constexpr uint8_t count = (uint8_t)total_count;
+
+    /// Number of characteristics in the table.
+    static constexpr size_t characteristics = CountCharacteristics();
+
+    /// The attribute table itself.
+    static constexpr std::array<esp_gatts_attr_db_t, total_count> table = Build();
+
+    /// Attribute index of the value of characteristic \a N (counting from 0 in order of declaration).
+    /// This is what BLEServer::AddCharacteristic() returns for it.
+    template <size_t N>
+    static constexpr uint8_t ValueIndex(void)
+    {
+        static_assert(N < characteristics, "Service table has no characteristic with this number.");
+        return (uint8_t)(ItemIndex(CharacteristicItem(N)) + 1);
+    }
+
+    /// Attribute index of the configuration descriptor (0x2902) of characteristic \a N.
+    template <size_t N>
+    static constexpr uint8_t ConfigIndex(void)
+    {
+        static_assert(N < characteristics, "Service table has no characteristic with this number.");
+        static_assert(ConfigItem(N) < item_count, "Characteristic has no configuration descriptor.");
+        return (uint8_t)ItemIndex(ConfigItem(N));
+    }
+};
+// ------------------------------------------------------------------------------------------
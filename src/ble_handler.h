@@ -0,0 +1,122 @@
+# pragma once
+// ------------------------------------------------------------------------------------------
+/*
+Event handlers of attributes (see BLEServer::SetEventHandler()) with bound context.
+
+A handler is a plain function with the parameters of the stack callback, a
+lambda or a member function of an object. Lambdas and objects are kept in
+BLE_HANDLER_STORAGE_SIZE bytes of inline storage, nothing is allocated, so
+they may only capture pointers and values (trivially copyable).
+
+    class Sensor
+    {
+    public:
+        void OnEvent(const BLEEventContext& context);
+    };
+
+    server.SetEventHandler(svc, idx, BLEEventHandler::Bind<&Sensor::OnEvent>(&sensor));
+    server.SetEventHandler(svc, idx, [&sensor](const BLEEventContext& context) { ... });
+
+The handler gets a BLEEventContext: the server, the event, the connection and
+the handles of the attribute and of the reply attribute bound with it, both
+resolved once when the attribute tables are created.
+*/
+// ------------------------------------------------------------------------------------------
+# include "ble_config.h"
+# include <esp_gatts_api.h>
+# include <cstddef>
+# include <cstdint>
+# include <new>
+# include <type_traits>
+// ------------------------------------------------------------------------------------------
+class BLEServer;
+struct BLEConnection;
+
+/// Type of handler function for read access to an attribute.
+/// Params are interface number and read parameter.
+typedef void (*event_handler_func)(esp_gatts_cb_event_t, esp_gatt_if_t, esp_ble_gatts_cb_param_t*);
+
+/// Type of function writing a notification in place, see BLEServer::NotifyInPlace().
+/// \a len is the space at \a value on entry and has to be set to the length written.
+/// \returns \c false if nothing should be sent.
+typedef bool (*notify_build_func)(void* context, uint8_t* value, uint16_t& len);
+// ------------------------------------------------------------------------------------------
+/// Event passed to a BLEEventHandler.
+struct BLEEventContext
+{
+    /// Connection id of events without one (ESP_GATTS_RESPONSE_EVT).
+    static const uint16_t no_connection = 0xFFFF;
+
+    BLEServer* server;
+    esp_gatts_cb_event_t event;
+    esp_gatt_if_t gatts_if;
+    esp_ble_gatts_cb_param_t* param;
+    /// Connection of the event (or \c no_connection) and its state (or \c nullptr).
+    uint16_t conn_id;
+    const BLEConnection* connection;
+    /// Handle of the attribute of the event.
+    uint16_t handle;
+    /// Handle of the attribute bound for replies (0 if none), see BLEServer::SetEventHandler().
+    uint16_t reply_handle;
+
+    /// Sends \a len bytes of \a value as notification of the reply attribute to the connection
+    /// of the event, see BLEServer::Notify().
+    esp_err_t Reply(const uint8_t* value, uint16_t len, bool need_confirm = false) const;
+
+    /// Lets \a build write the reply directly into the notification queue, see BLEServer::NotifyInPlace().
+    esp_err_t ReplyInPlace(uint16_t max_len, notify_build_func build, void* context, bool need_confirm = false) const;
+};
+// ------------------------------------------------------------------------------------------
+/// Callable event handler with inline storage.
+class BLEEventHandler
+{
+public:
+    static constexpr size_t storage_size = BLE_HANDLER_STORAGE_SIZE;
+
+    BLEEventHandler() = default;
+
+    /// Plain function getting the parameters of the stack callback (\c nullptr for none).
+    BLEEventHandler(event_handler_func func)
+    {
+        if (func)
+            Store([func](const BLEEventContext& context) { func(context.event, context.gatts_if, context.param); });
+    }
+
+    /// Function or callable object (e.g. a lambda) taking a \c const BLEEventContext&.
+    template <class F, class = typename std::enable_if<std::is_invocable<const F&, const BLEEventContext&>::value>::type>
+    BLEEventHandler(F func)
+    {
+        Store(func);
+    }
+
+    /// Member function \a METHOD (taking a \c const BLEEventContext&) of \a object.
+    template <auto METHOD, class C>
+    static BLEEventHandler Bind(C* object)
+    {
+        return BLEEventHandler([object](const BLEEventContext& context) { (object->*METHOD)(context); });
+    }
+
+    explicit operator bool(void) const { return m_invoke != nullptr; }
+
+    void operator()(const BLEEventContext& context) const { m_invoke(m_storage, context); }
+
+protected:
+    typedef void (*invoke_func)(const void* storage, const BLEEventContext& context);
+
+    invoke_func m_invoke = nullptr;
+    alignas(std::max_align_t) uint8_t m_storage[storage_size] = {};
+
+    template <class F>
+    void Store(const F& func)
+    {
+        static_assert(sizeof(F) <= storage_size, "Handler exceeds BLE_HANDLER_STORAGE_SIZE, capture a pointer to its state.");
+        static_assert(alignof(F) <= alignof(std::max_align_t), "Handler alignment not supported.");
+        static_assert(
+            std::is_trivially_copyable<F>::value && std::is_trivially_destructible<F>::value,
+            "Handlers are copied as bytes, capture pointers and values only."
+        );
+        new (m_storage) F(func);
+        m_invoke = [](const void* storage, const BLEEventContext& context) { (*static_cast<const F*>(storage))(context); };
+    }
+};
+// ------------------------------------------------------------------------------------------
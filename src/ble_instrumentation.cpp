@@ -0,0 +1,136 @@
+# include "ble_instrumentation.h"
+# include <cstring>
+# include <algorithm>
+// -------------------------------------------------------------------------------------------------------------------
+uint8_t BLEHistogram::GetBucket(uint32_t us)
+{
+    if (!us)
+        return 0;
+    uint8_t bucket = (uint8_t)(31 - __builtin_clz(us));
+    return bucket < buckets ? bucket : buckets - 1;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEHistogram::Add(uint32_t us)
+{
+    ++counts[GetBucket(us)];
+    ++count;
+    total_us += us;
+    if (us > max_us)
+        max_us = us;
+}
+// -------------------------------------------------------------------------------------------------------------------
+uint32_t BLEHistogram::GetPercentile(uint8_t percent) const
+{
+    if (!count)
+        return 0;
+    uint64_t needed = ((uint64_t)count * percent + 99) / 100;
+    uint64_t seen = 0;
+    for (uint8_t i = 0; i < buckets - 1; ++i)
+    {
+        seen += counts[i];
+        if (seen >= needed)
+            return std::min(((uint32_t)2 << i) - 1, max_us);
+    }
+    return max_us;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEInstrumentation::Reset(void)
+{
+    uint16_t base = handle_base;
+    memset(this, 0, sizeof(*this));
+    handle_base = base;
+}
+// -------------------------------------------------------------------------------------------------------------------
+BLEHandleCounters& BLEInstrumentation::GetCounters(uint16_t handle)
+{
+    // handles below the base wrap around and so are out of range, too
+    uint16_t index = handle - handle_base;
+    return index < BLE_INSTRUMENTATION_HANDLES ? handles[index] : other_handles;
+}
+// -------------------------------------------------------------------------------------------------------------------
+const BLEHandleCounters& BLEInstrumentation::GetCounters(uint16_t handle) const
+{
+    uint16_t index = handle - handle_base;
+    return index < BLE_INSTRUMENTATION_HANDLES ? handles[index] : other_handles;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEInstrumentation::AddHandlerTime(uint16_t handle, uint32_t us)
+{
+    handler_time.Add(us);
+    BLEHandleCounters& counters = GetCounters(handle);
+    ++counters.handler_calls;
+    counters.handler_us += us;
+    if (us > counters.handler_max_us)
+        counters.handler_max_us = us;
+}
+// -------------------------------------------------------------------------------------------------------------------
+static uint8_t* Put16(uint8_t* out, uint16_t value)
+{
+    out[0] = (uint8_t)value;
+    out[1] = (uint8_t)(value >> 8);
+    return out + 2;
+}
+// -------------------------------------------------------------------------------------------------------------------
+static uint8_t* Put32(uint8_t* out, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i)
+        out[i] = (uint8_t)(value >> (8 * i));
+    return out + 4;
+}
+// -------------------------------------------------------------------------------------------------------------------
+static uint8_t* PutHistogram(uint8_t* out, const BLEHistogram& histogram)
+{
+    out = Put32(out, histogram.count);
+    out = Put32(out, histogram.max_us);
+    for (uint8_t i = 0; i < BLEHistogram::buckets; ++i)
+        out = Put32(out, histogram.counts[i]);
+    return out;
+}
+// -------------------------------------------------------------------------------------------------------------------
+size_t BLEInstrumentation::Serialize(uint8_t* buffer, size_t size) const
+{
+    if (size < header_size)
+        return 0;
+
+    // most active handles first, as many as fit
+    uint16_t order[BLE_INSTRUMENTATION_HANDLES];
+    uint16_t active = 0;
+    for (uint16_t i = 0; i < BLE_INSTRUMENTATION_HANDLES; ++i)
+    {
+        if (handles[i].GetActivity() || handles[i].handler_calls)
+            order[active++] = i;
+    }
+    std::sort(order, order + active, [this](uint16_t a, uint16_t b) {
+        return handles[a].GetActivity() > handles[b].GetActivity();
+    });
+    active = (uint16_t)std::min<size_t>(active, (size - header_size) / handle_size);
+
+    uint32_t gatts_events = 0;
+    for (uint32_t count : events)
+        gatts_events += count;
+
+    uint8_t* out = buffer;
+    *out++ = version;
+    *out++ = BLEHistogram::buckets;
+    out = Put16(out, active);
+    out = Put32(out, gatts_events);
+    out = Put32(out, gap_events);
+    out = Put32(out, congestions);
+    out = Put32(out, failed_sends);
+    out = Put32(out, retransmitted);
+    out = Put32(out, dropped);
+    out = PutHistogram(out, handler_time);
+    out = PutHistogram(out, turnaround);
+    for (uint16_t i = 0; i < active; ++i)
+    {
+        const BLEHandleCounters& counters = handles[order[i]];
+        out = Put16(out, (uint16_t)(handle_base + order[i]));
+        out = Put32(out, counters.reads);
+        out = Put32(out, counters.writes);
+        out = Put32(out, counters.notifications);
+        out = Put32(out, counters.handler_calls);
+        out = Put32(out, counters.handler_max_us);
+    }
+    return out - buffer;
+}
+// -------------------------------------------------------------------------------------------------------------------
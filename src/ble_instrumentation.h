@@ -0,0 +1,118 @@
+# pragma once
+// ------------------------------------------------------------------------------------------
+/*
+Counters and latency histograms of a BLEServer, compiled in with
+BLE_SERVER_INSTRUMENTATION (see ble_config.h).
+
+Recording an event costs a few increments, times are taken with
+esp_timer_get_time() and sorted into histograms with power-of-two buckets,
+so it can stay enabled in release builds. BLEServer::GetInstrumentation()
+copies a snapshot, BLEInstrumentation::Serialize() packs it for reading it
+over a characteristic:
+
+    offset  size  content (little endian)
+    0       1     format version (1)
+    1       1     buckets per histogram (B)
+    2       2     handle entries following the histograms (N)
+    4       24    GATT events, GAP events, congestions, failed sends, retransmissions, dropped notifications (u32 each)
+    28      8+4B  handler time: count, max us, bucket counts (u32 each)
+    ...     8+4B  write to notification turnaround, same layout
+    ...     22*N  handle, reads, writes, notifications, handler calls, max handler us
+                  (u16 + 5 * u32), most active handles first
+*/
+// ------------------------------------------------------------------------------------------
+# include "ble_config.h"
+# include <esp_gatts_api.h>
+# include <cstddef>
+# include <cstdint>
+// ------------------------------------------------------------------------------------------
+/// Histogram of times in microseconds: bucket n counts times from 2^n to 2^(n+1) - 1 us
+/// (bucket 0 also 0 us), the last one all longer times.
+struct BLEHistogram
+{
+    static constexpr uint8_t buckets = BLE_HISTOGRAM_BUCKETS;
+
+    uint32_t counts[buckets];
+    uint32_t count;
+    uint32_t max_us;
+    uint64_t total_us;
+
+    void Add(uint32_t us);
+
+    /// Bucket counting \a us.
+    static uint8_t GetBucket(uint32_t us);
+
+    /// Upper bound (us) of the bucket reaching \a percent of all times (0 if empty).
+    uint32_t GetPercentile(uint8_t percent) const;
+
+    /// Average time (us).
+    uint32_t GetAverage(void) const { return count ? (uint32_t)(total_us / count) : 0; }
+};
+// ------------------------------------------------------------------------------------------
+/// Counters of an attribute handle.
+struct BLEHandleCounters
+{
+    /// Read and write events (including long writes).
+    uint32_t reads;
+    uint32_t writes;
+    /// Notifications and indications queued by Notify() and NotifyInPlace().
+    uint32_t notifications;
+    /// Event handler calls, their total and longest time.
+    uint32_t handler_calls;
+    uint32_t handler_us;
+    uint32_t handler_max_us;
+
+    uint32_t GetActivity(void) const { return reads + writes + notifications; }
+};
+// ------------------------------------------------------------------------------------------
+/// Snapshot of the instrumentation of a server, see BLEServer::GetInstrumentation().
+struct BLEInstrumentation
+{
+    /// Number of entries of \c events, the last one counts all higher event numbers.
+    static constexpr uint8_t event_types = 32;
+    /// Serialize() format version.
+    static constexpr uint8_t version = 1;
+
+    /// GATT server events by esp_gatts_cb_event_t.
+    uint32_t events[event_types];
+    uint32_t gap_events;
+    /// Time spent in the event handlers.
+    BLEHistogram handler_time;
+    /// Time from a write of a client to the next notification queued for its connection.
+    BLEHistogram turnaround;
+    /// Summed over all connections, see BLENotifyStats.
+    uint32_t congestions;
+    uint32_t failed_sends;
+    uint32_t retransmitted;
+    uint32_t dropped;
+    /// Handle of handles[0], the lowest handle of all services.
+    uint16_t handle_base;
+    /// Counters of the handles handle_base .. handle_base + BLE_INSTRUMENTATION_HANDLES - 1.
+    BLEHandleCounters handles[BLE_INSTRUMENTATION_HANDLES];
+    /// Counters of all handles out of this range.
+    BLEHandleCounters other_handles;
+
+    BLEInstrumentation() : handle_base(0) { Reset(); }
+
+    /// Clears all counters, keeps handle_base.
+    void Reset(void);
+
+    /// Counters of \a handle (or other_handles).
+    BLEHandleCounters& GetCounters(uint16_t handle);
+    const BLEHandleCounters& GetCounters(uint16_t handle) const;
+
+    void CountEvent(esp_gatts_cb_event_t event) { ++events[event < event_types ? event : event_types - 1]; }
+    void CountRead(uint16_t handle) { ++GetCounters(handle).reads; }
+    void CountWrite(uint16_t handle) { ++GetCounters(handle).writes; }
+    void CountNotification(uint16_t handle) { ++GetCounters(handle).notifications; }
+    void AddHandlerTime(uint16_t handle, uint32_t us);
+
+    /// Packs the snapshot into \a buffer (layout above), with as many handles as fit into \a size.
+    /// \returns Bytes written (0 if \a size is too small even without handles).
+    size_t Serialize(uint8_t* buffer, size_t size) const;
+
+    /// Bytes of Serialize() without handles, and per handle.
+    static constexpr size_t header_size = 4 + 6 * 4 + 2 * (8 + 4 * BLEHistogram::buckets);
+    static constexpr size_t handle_size = 2 + 5 * 4;
+};
+// ------------------------------------------------------------------------------------------
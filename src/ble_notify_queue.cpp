@@ -0,0 +1,169 @@
+# include "ble_notify_queue.h"
+# include "ble_storage.h"
+# include <cstring>
+# include <cassert>
+// -------------------------------------------------------------------------------------------------------------------
+BLENotifyQueue::BLENotifyQueue()
+{
+    BLEMemory::Reserve(sizeof(m_buffer));
+}
+// -------------------------------------------------------------------------------------------------------------------
+BLENotifyQueue::~BLENotifyQueue()
+{
+    Clear();
+    BLEMemory::Unreserve(sizeof(m_buffer));
+}
+// -------------------------------------------------------------------------------------------------------------------
+size_t BLENotifyQueue::GetRecordSize(uint16_t len)
+{
+    // keep the following header aligned
+    const size_t align = alignof(Record);
+    return (sizeof(Record) + len + align - 1) & ~(align - 1);
+}
+// -------------------------------------------------------------------------------------------------------------------
+size_t BLENotifyQueue::GetRecordSize(size_t pos) const
+{
+    return GetRecordSize(GetRecord(pos)->len);
+}
+// -------------------------------------------------------------------------------------------------------------------
+const BLENotifyQueue::Record* BLENotifyQueue::GetRecord(size_t pos) const
+{
+    return (const Record*)(m_buffer + pos);
+}
+// -------------------------------------------------------------------------------------------------------------------
+bool BLENotifyQueue::Push(uint16_t handle, const uint8_t* value, uint16_t len, bool need_confirm, uint8_t tag)
+{
+    uint8_t* copy = Reserve(handle, len, need_confirm, tag);
+    if (!copy)
+        return false;
+    if (len)
+        memcpy(copy, value, len);
+    Commit(len);
+    return true;
+}
+// -------------------------------------------------------------------------------------------------------------------
+uint8_t* BLENotifyQueue::Reserve(uint16_t handle, uint16_t max_len, bool need_confirm, uint8_t tag)
+{
+    assert(m_reserved == capacity);
+    size_t size = GetRecordSize(max_len);
+    if (size > capacity)
+        return nullptr;
+
+    if (m_count == 0)
+        Clear();
+
+    // the wrap around is done by Commit(), a cancelled reservation leaves no trace
+    size_t pos = 0;
+    bool wraps = false;
+    if (!m_wrapped)
+    {
+        if (capacity - m_tail >= size)
+            pos = m_tail;
+        else if (m_head >= size)
+            wraps = true;
+        else
+            return nullptr;
+    }
+    else if (m_head - m_tail >= size)
+    {
+        pos = m_tail;
+    }
+    else
+    {
+        return nullptr;
+    }
+
+    Record* record = (Record*)(m_buffer + pos);
+    record->handle = handle;
+    record->len = max_len;
+    record->need_confirm = need_confirm ? 1 : 0;
+    record->tag = tag;
+    m_reserved = pos;
+    m_reserved_wraps = wraps;
+    return (uint8_t*)(record + 1);
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLENotifyQueue::Commit(uint16_t len)
+{
+    assert(m_reserved != capacity);
+    Record* record = (Record*)(m_buffer + m_reserved);
+    assert(len <= record->len);
+    record->len = len;
+
+    if (m_reserved_wraps)
+    {
+        // continue at the beginning
+        if (m_send == m_tail)
+            m_send = 0;
+        m_wrap = m_tail;
+        m_wrapped = true;
+    }
+
+    size_t size = GetRecordSize(len);
+    m_tail = m_reserved + size;
+    m_reserved = capacity;
+    ++m_count;
+    ++m_unsent;
+    m_used += size;
+    BLEMemory::Acquire(size);
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLENotifyQueue::Cancel(void)
+{
+    m_reserved = capacity;
+}
+// -------------------------------------------------------------------------------------------------------------------
+const BLENotifyQueue::Record* BLENotifyQueue::GetNextUnsent(void) const
+{
+    return m_unsent ? GetRecord(m_send) : nullptr;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLENotifyQueue::MarkSent(void)
+{
+    assert(m_unsent);
+    m_send += GetRecordSize(m_send);
+    if (m_wrapped && m_send == m_wrap)
+        m_send = 0;
+    --m_unsent;
+}
+// -------------------------------------------------------------------------------------------------------------------
+const BLENotifyQueue::Record* BLENotifyQueue::GetOldestSent(void) const
+{
+    return GetSentCount() ? GetRecord(m_head) : nullptr;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLENotifyQueue::PopSent(void)
+{
+    assert(GetSentCount());
+    size_t size = GetRecordSize(m_head);
+    m_head += size;
+    if (m_wrapped && m_head == m_wrap)
+    {
+        m_head = 0;
+        m_wrap = capacity;
+        m_wrapped = false;
+    }
+    --m_count;
+    m_used -= size;
+    BLEMemory::Release(size);
+
+    if (m_count == 0)
+        Clear();
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLENotifyQueue::Rewind(void)
+{
+    m_send = m_head;
+    m_unsent = m_count;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLENotifyQueue::Clear(void)
+{
+    BLEMemory::Release(m_used);
+    m_head = m_send = m_tail = 0;
+    m_wrap = capacity;
+    m_wrapped = false;
+    m_count = m_unsent = m_used = 0;
+    m_reserved = capacity;
+}
+// -------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,111 @@
+# pragma once
+// ------------------------------------------------------------------------------------------
+/*
+Bounded queue of notifications / indications of a single connection.
+
+Notifications are copied into a ring buffer of BLE_NOTIFY_QUEUE_SIZE bytes and
+stay there until the stack confirmed them (ESP_GATTS_CONF_EVT), so a packet
+rejected because of congestion can be sent again. Records never wrap around
+the end of the buffer, the value of a record is always contiguous and can be
+handed to esp_ble_gatts_send_indicate() directly.
+
+    oldest unconfirmed      next to send             free
+    v                       v                        v
+    [ sent | sent | sent  | unsent | unsent        ] ...
+    m_head                  m_send                   m_tail
+*/
+// ------------------------------------------------------------------------------------------
+# include "ble_config.h"
+# include <cstddef>
+# include <cstdint>
+// ------------------------------------------------------------------------------------------
+class BLENotifyQueue
+{
+public:
+    /// Header of a queued notification, the value follows.
+    struct Record
+    {
+        uint16_t handle;
+        uint16_t len;
+        uint8_t need_confirm;
+        /// Tag of the sender (0 by default), e.g. to tell its confirmations apart.
+        uint8_t tag;
+
+        const uint8_t* GetValue(void) const { return (const uint8_t*)(this + 1); }
+    };
+
+    BLENotifyQueue();
+    ~BLENotifyQueue();
+    BLENotifyQueue(const BLENotifyQueue&) = delete;
+    BLENotifyQueue& operator=(const BLENotifyQueue&) = delete;
+
+    /// Appends a copy of \a value with \a len bytes, the record gets \a tag.
+    /// \returns \c false if there's not enough space left.
+    bool Push(uint16_t handle, const uint8_t* value, uint16_t len, bool need_confirm, uint8_t tag = 0);
+
+    /// Reserves a record for up to \a max_len bytes, so the value can be written in place.
+    /// Nothing is queued until Commit() is called, Cancel() drops the reservation.
+    /// \returns Pointer to the value of the record or \c nullptr if there's not enough space left.
+    uint8_t* Reserve(uint16_t handle, uint16_t max_len, bool need_confirm, uint8_t tag = 0);
+
+    /// Queues the reserved record with the first \a len bytes of its value.
+    void Commit(uint16_t len);
+
+    /// Drops the reserved record.
+    void Cancel(void);
+
+    /// Next record not handed to the stack yet (or \c nullptr).
+    const Record* GetNextUnsent(void) const;
+
+    /// Marks the record returned by GetNextUnsent() as sent.
+    void MarkSent(void);
+
+    /// Oldest record sent and not confirmed yet (or \c nullptr).
+    const Record* GetOldestSent(void) const;
+
+    /// Removes the oldest sent record.
+    void PopSent(void);
+
+    /// Marks all sent records as unsent again, so they are sent once more.
+    void Rewind(void);
+
+    /// Drops all records.
+    void Clear(void);
+
+    /// Number of records (sent and unsent).
+    size_t GetCount(void) const { return m_count; }
+
+    /// Number of records sent and not confirmed yet.
+    size_t GetSentCount(void) const { return m_count - m_unsent; }
+
+    /// Number of records not sent yet.
+    size_t GetUnsentCount(void) const { return m_unsent; }
+
+    /// Bytes occupied by the records.
+    size_t GetUsedBytes(void) const { return m_used; }
+
+    static constexpr size_t capacity = BLE_NOTIFY_QUEUE_SIZE;
+
+protected:
+    alignas(Record) uint8_t m_buffer[capacity];
+    /// Position of the oldest record.
+    size_t m_head = 0;
+    /// Position of the next record to send.
+    size_t m_send = 0;
+    /// Position of the next record to add.
+    size_t m_tail = 0;
+    /// End of the records at the end of the buffer if new ones continue at the beginning.
+    size_t m_wrap = capacity;
+    bool m_wrapped = false;
+    size_t m_count = 0;
+    size_t m_unsent = 0;
+    size_t m_used = 0;
+    /// Position of the reserved record (or \c capacity) and whether it starts a new round.
+    size_t m_reserved = capacity;
+    bool m_reserved_wraps = false;
+
+    static size_t GetRecordSize(uint16_t len);
+    size_t GetRecordSize(size_t pos) const;
+    const Record* GetRecord(size_t pos) const;
+};
+// ------------------------------------------------------------------------------------------
@@ -0,0 +1,393 @@
+# include "ble_record.h"
+# include <esp_timer.h>
+# include <cstring>
+# include <algorithm>
+// -------------------------------------------------------------------------------------------------------------------
+static const uint8_t file_magic[4] = {'B', 'L', 'E', 'R'};
+// -------------------------------------------------------------------------------------------------------------------
+/// Packs fields into a record, see TransferGATTSParam().
+class FieldWriter
+{
+public:
+    FieldWriter(uint8_t* out) : m_out(out), m_size(0) {}
+
+    template <class T> void U8(const T& field) { m_out[m_size++] = (uint8_t)field; }
+    template <class T> void U16(const T& field) { Put((uint32_t)field, 2); }
+    template <class T> void U32(const T& field) { Put((uint32_t)field, 4); }
+
+    void Bytes(const void* field, size_t len)
+    {
+        memcpy(m_out + m_size, field, len);
+        m_size += len;
+    }
+
+    /// Length (u16) and \a len bytes of \a value.
+    void Value(const uint8_t* value, uint16_t len)
+    {
+        len = value ? std::min<uint16_t>(len, ESP_GATT_MAX_ATTR_LEN) : 0;
+        U16(len);
+        if (len)
+            Bytes(value, len);
+    }
+
+    /// Length (u16), whether a value follows (u8) and \a len bytes of \a value if so.
+    void OptionalValue(const uint8_t* value, uint16_t len)
+    {
+        U16(len);
+        U8(value != nullptr);
+        if (value)
+            Bytes(value, std::min<uint16_t>(len, ESP_GATT_MAX_ATTR_LEN));
+    }
+
+    /// Count (u16) and \a count handles (u16 each).
+    void Handles(const uint16_t* handles, uint16_t count)
+    {
+        count = handles ? std::min<uint16_t>(count, 255) : 0;
+        U16(count);
+        for (uint16_t i = 0; i < count; ++i)
+            U16(handles[i]);
+    }
+
+    size_t GetSize(void) const { return m_size; }
+
+protected:
+    uint8_t* m_out;
+    size_t m_size;
+
+    void Put(uint32_t value, size_t len)
+    {
+        for (size_t i = 0; i < len; ++i)
+            m_out[m_size++] = (uint8_t)(value >> (8 * i));
+    }
+};
+// -------------------------------------------------------------------------------------------------------------------
+/// Unpacks the fields of a record into an event, see TransferGATTSParam().
+class FieldReader
+{
+public:
+    FieldReader(const uint8_t* in, size_t size, BLERecordReader::Event& event)
+    : m_in(in), m_size(size), m_pos(0), m_ok(true), m_event(event) {}
+
+    template <class T> void U8(T& field) { field = (T)Get(1); }
+    template <class T> void U16(T& field) { field = (T)Get(2); }
+    template <class T> void U32(T& field) { field = (T)Get(4); }
+
+    void Bytes(void* field, size_t len)
+    {
+        if (Take(len))
+            memcpy(field, m_in + m_pos - len, len);
+        else
+            memset(field, 0, len);
+    }
+
+    void Value(uint8_t*& value, uint16_t& len)
+    {
+        U16(len);
+        len = std::min<uint16_t>(len, ESP_GATT_MAX_ATTR_LEN);
+        Bytes(m_event.value, len);
+        value = m_event.value;
+    }
+
+    void OptionalValue(uint8_t*& value, uint16_t& len)
+    {
+        bool has_value;
+        U16(len);
+        U8(has_value);
+        if (has_value)
+            Bytes(m_event.value, std::min<uint16_t>(len, ESP_GATT_MAX_ATTR_LEN));
+        value = has_value ? m_event.value : nullptr;
+    }
+
+    void Handles(uint16_t*& handles, uint16_t& count)
+    {
+        U16(count);
+        count = std::min<uint16_t>(count, 255);
+        for (uint16_t i = 0; i < count; ++i)
+            U16(m_event.handles[i]);
+        handles = m_event.handles;
+    }
+
+    /// Whether all fields were complete.
+    bool IsComplete(void) const { return m_ok; }
+
+protected:
+    const uint8_t* m_in;
+    size_t m_size;
+    size_t m_pos;
+    bool m_ok;
+    BLERecordReader::Event& m_event;
+
+    bool Take(size_t len)
+    {
+        if (m_size - m_pos < len)
+        {
+            m_ok = false;
+            return false;
+        }
+        m_pos += len;
+        return true;
+    }
+
+    uint32_t Get(size_t len)
+    {
+        if (!Take(len))
+            return 0;
+        uint32_t value = 0;
+        for (size_t i = 0; i < len; ++i)
+            value |= (uint32_t)m_in[m_pos - len + i] << (8 * i);
+        return value;
+    }
+};
+// -------------------------------------------------------------------------------------------------------------------
+/// Writes (FieldWriter) or reads (FieldReader) the parameters of a GATT server event, so both
+/// directions use the same layout. \a PARAM is const for writing.
+template <class IO, class PARAM>
+static void TransferGATTSParam(IO& io, esp_gatts_cb_event_t event, PARAM& param)
+{
+    switch (event)
+    {
+        case ESP_GATTS_REG_EVT:
+            io.U8(param.reg.status);
+            io.U16(param.reg.app_id);
+            break;
+        case ESP_GATTS_READ_EVT:
+            io.U16(param.read.conn_id);
+            io.U32(param.read.trans_id);
+            io.Bytes(param.read.bda, sizeof(esp_bd_addr_t));
+            io.U16(param.read.handle);
+            io.U16(param.read.offset);
+            io.U8(param.read.is_long);
+            io.U8(param.read.need_rsp);
+            break;
+        case ESP_GATTS_WRITE_EVT:
+            io.U16(param.write.conn_id);
+            io.U32(param.write.trans_id);
+            io.Bytes(param.write.bda, sizeof(esp_bd_addr_t));
+            io.U16(param.write.handle);
+            io.U16(param.write.offset);
+            io.U8(param.write.need_rsp);
+            io.U8(param.write.is_prep);
+            io.Value(param.write.value, param.write.len);
+            break;
+        case ESP_GATTS_EXEC_WRITE_EVT:
+            io.U16(param.exec_write.conn_id);
+            io.U32(param.exec_write.trans_id);
+            io.Bytes(param.exec_write.bda, sizeof(esp_bd_addr_t));
+            io.U8(param.exec_write.exec_write_flag);
+            break;
+        case ESP_GATTS_MTU_EVT:
+            io.U16(param.mtu.conn_id);
+            io.U16(param.mtu.mtu);
+            break;
+        case ESP_GATTS_CONF_EVT:
+            io.U8(param.conf.status);
+            io.U16(param.conf.conn_id);
+            io.U16(param.conf.handle);
+            io.OptionalValue(param.conf.value, param.conf.len);
+            break;
+        case ESP_GATTS_START_EVT:
+            io.U8(param.start.status);
+            io.U16(param.start.service_handle);
+            break;
+        case ESP_GATTS_STOP_EVT:
+            io.U8(param.stop.status);
+            io.U16(param.stop.service_handle);
+            break;
+        case ESP_GATTS_CONNECT_EVT:
+            io.U16(param.connect.conn_id);
+            io.U8(param.connect.link_role);
+            io.Bytes(param.connect.remote_bda, sizeof(esp_bd_addr_t));
+            io.U16(param.connect.conn_params.interval);
+            io.U16(param.connect.conn_params.latency);
+            io.U16(param.connect.conn_params.timeout);
+            break;
+        case ESP_GATTS_DISCONNECT_EVT:
+            io.U16(param.disconnect.conn_id);
+            io.Bytes(param.disconnect.remote_bda, sizeof(esp_bd_addr_t));
+            io.U16(param.disconnect.reason);
+            break;
+        case ESP_GATTS_CONGEST_EVT:
+            io.U16(param.congest.conn_id);
+            io.U8(param.congest.congested);
+            break;
+        case ESP_GATTS_RESPONSE_EVT:
+            io.U8(param.rsp.status);
+            io.U16(param.rsp.handle);
+            break;
+        case ESP_GATTS_CREAT_ATTR_TAB_EVT:
+            io.U8(param.add_attr_tab.status);
+            // packed struct of the same layout on all targets
+            io.Bytes(&param.add_attr_tab.svc_uuid, sizeof(esp_bt_uuid_t));
+            io.U8(param.add_attr_tab.svc_inst_id);
+            io.Handles(param.add_attr_tab.handles, param.add_attr_tab.num_handle);
+            break;
+        case ESP_GATTS_SET_ATTR_VAL_EVT:
+            io.U16(param.set_attr_val.srvc_handle);
+            io.U16(param.set_attr_val.attr_handle);
+            io.U8(param.set_attr_val.status);
+            break;
+        default:
+            break;
+    }
+}
+// -------------------------------------------------------------------------------------------------------------------
+/// Writes or reads the parameters of a GAP event, see TransferGATTSParam().
+template <class IO, class PARAM>
+static void TransferGAPParam(IO& io, esp_gap_ble_cb_event_t event, PARAM& param)
+{
+    switch (event)
+    {
+        case ESP_GAP_BLE_ADV_DATA_RAW_SET_COMPLETE_EVT:
+            io.U8(param.adv_data_raw_cmpl.status);
+            break;
+        case ESP_GAP_BLE_SCAN_RSP_DATA_RAW_SET_COMPLETE_EVT:
+            io.U8(param.scan_rsp_data_raw_cmpl.status);
+            break;
+        case ESP_GAP_BLE_ADV_START_COMPLETE_EVT:
+            io.U8(param.adv_start_cmpl.status);
+            break;
+        case ESP_GAP_BLE_ADV_STOP_COMPLETE_EVT:
+            io.U8(param.adv_stop_cmpl.status);
+            break;
+        case ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT:
+            io.U8(param.update_conn_params.status);
+            io.Bytes(param.update_conn_params.bda, sizeof(esp_bd_addr_t));
+            io.U16(param.update_conn_params.min_int);
+            io.U16(param.update_conn_params.max_int);
+            io.U16(param.update_conn_params.latency);
+            io.U16(param.update_conn_params.conn_int);
+            io.U16(param.update_conn_params.timeout);
+            break;
+        case ESP_GAP_BLE_SET_PKT_LENGTH_COMPLETE_EVT:
+            io.U8(param.pkt_data_lenth_cmpl.status);
+            io.U16(param.pkt_data_lenth_cmpl.params.rx_len);
+            io.U16(param.pkt_data_lenth_cmpl.params.tx_len);
+            break;
+# ifdef CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+        case ESP_GAP_BLE_PHY_UPDATE_COMPLETE_EVT:
+            io.U8(param.phy_update.status);
+            io.Bytes(param.phy_update.bda, sizeof(esp_bd_addr_t));
+            io.U8(param.phy_update.tx_phy);
+            io.U8(param.phy_update.rx_phy);
+            break;
+# endif
+        case ESP_GAP_BLE_AUTH_CMPL_EVT:
+            io.Bytes(param.ble_security.auth_cmpl.bd_addr, sizeof(esp_bd_addr_t));
+            io.U8(param.ble_security.auth_cmpl.success);
+            io.U8(param.ble_security.auth_cmpl.fail_reason);
+            io.U8(param.ble_security.auth_cmpl.addr_type);
+            break;
+        case ESP_GAP_BLE_REMOVE_BOND_DEV_COMPLETE_EVT:
+            io.U8(param.remove_bond_dev_cmpl.status);
+            io.Bytes(param.remove_bond_dev_cmpl.bd_addr, sizeof(esp_bd_addr_t));
+            break;
+        default:
+            break;
+    }
+}
+// -------------------------------------------------------------------------------------------------------------------
+// -------------------------------------------------------------------------------------------------------------------
+void BLEEventRecorder::Start(record_write_func write, void* context)
+{
+    m_write = write;
+    m_context = context;
+    m_count = 0;
+    m_time = esp_timer_get_time();
+    if (!m_write)
+        return;
+
+    uint8_t header[file_header_size] = {0};
+    memcpy(header, file_magic, sizeof(file_magic));
+    header[sizeof(file_magic)] = version;
+    m_write(m_context, header, sizeof(header));
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEEventRecorder::Write(uint8_t kind, uint8_t event, uint8_t gatts_if, size_t size)
+{
+    int64_t now = esp_timer_get_time();
+    uint32_t delta = (uint32_t)std::min<int64_t>(now - m_time, UINT32_MAX);
+    m_time = now;
+
+    m_buffer[0] = kind;
+    m_buffer[1] = event;
+    m_buffer[2] = gatts_if;
+    m_buffer[3] = 0;
+    for (int i = 0; i < 4; ++i)
+        m_buffer[4 + i] = (uint8_t)(delta >> (8 * i));
+    m_buffer[8] = (uint8_t)size;
+    m_buffer[9] = (uint8_t)(size >> 8);
+
+    m_write(m_context, m_buffer, header_size + size);
+    ++m_count;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEEventRecorder::AddGATTSEvent(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, const esp_ble_gatts_cb_param_t& param)
+{
+    if (!m_write)
+        return;
+    FieldWriter writer(m_buffer + header_size);
+    TransferGATTSParam(writer, event, param);
+    Write(kind_gatts, (uint8_t)event, gatts_if, writer.GetSize());
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEEventRecorder::AddGAPEvent(esp_gap_ble_cb_event_t event, const esp_ble_gap_cb_param_t& param)
+{
+    if (!m_write)
+        return;
+    FieldWriter writer(m_buffer + header_size);
+    TransferGAPParam(writer, event, param);
+    Write(kind_gap, (uint8_t)event, ESP_GATT_IF_NONE, writer.GetSize());
+}
+// -------------------------------------------------------------------------------------------------------------------
+// -------------------------------------------------------------------------------------------------------------------
+BLERecordReader::BLERecordReader(const uint8_t* data, size_t len)
+:m_data(data)
+,m_len(len)
+,m_pos(BLEEventRecorder::file_header_size)
+,m_corrupt(false)
+{
+    m_valid = len >= BLEEventRecorder::file_header_size
+        && memcmp(data, file_magic, sizeof(file_magic)) == 0
+        && data[sizeof(file_magic)] == BLEEventRecorder::version;
+}
+// -------------------------------------------------------------------------------------------------------------------
+bool BLERecordReader::Next(Event& event)
+{
+    if (!m_valid || m_corrupt || m_pos == m_len)
+        return false;
+
+    const uint8_t* record = m_data + m_pos;
+    size_t size = m_len - m_pos < BLEEventRecorder::header_size ? 0 : record[8] | (record[9] << 8);
+    if (m_len - m_pos < BLEEventRecorder::header_size || m_len - m_pos - BLEEventRecorder::header_size < size)
+    {
+        m_corrupt = true;
+        return false;
+    }
+
+    memset(&event.gatts_param, 0, sizeof(event.gatts_param));
+    memset(&event.gap_param, 0, sizeof(event.gap_param));
+    event.is_gap = record[0] == BLEEventRecorder::kind_gap;
+    event.gatts_if = record[2];
+    event.delta_us = record[4] | (record[5] << 8) | (record[6] << 16) | ((uint32_t)record[7] << 24);
+
+    // fields added by later versions are skipped, missing ones are an error
+    FieldReader reader(record + BLEEventRecorder::header_size, size, event);
+    if (event.is_gap)
+    {
+        event.gap_event = (esp_gap_ble_cb_event_t)record[1];
+        TransferGAPParam(reader, event.gap_event, event.gap_param);
+    }
+    else
+    {
+        event.gatts_event = (esp_gatts_cb_event_t)record[1];
+        TransferGATTSParam(reader, event.gatts_event, event.gatts_param);
+    }
+    if (!reader.IsComplete())
+    {
+        m_corrupt = true;
+        return false;
+    }
+    m_pos += BLEEventRecorder::header_size + size;
+    return true;
+}
+// -------------------------------------------------------------------------------------------------------------------
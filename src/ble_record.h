@@ -0,0 +1,119 @@
+# pragma once
+// ------------------------------------------------------------------------------------------
+/*
+Recording of the stack events handled by a BLEServer, compiled in with
+BLE_SERVER_RECORD (see ble_config.h).
+
+BLEServer::SetRecorder() passes every GATT server and GAP event entering
+HandleGATTEvent() / HandleGAPEvent() as one binary record to a function,
+e.g. appending it to a file or sending it over the UART. The host tool
+ble_replay (host/tools/ble_replay.cpp) feeds a recording back through the
+server of server_example.cpp, so a session captured in the field becomes a
+repeatable benchmark.
+
+A recording starts with the 8 bytes "BLER", version, 0, 0, 0 followed by the
+records, all little endian:
+
+    offset  size  content
+    0       1     kind (0 GATT server event, 1 GAP event)
+    1       1     event id (esp_gatts_cb_event_t or esp_gap_ble_cb_event_t)
+    2       1     gatts_if (0xFF for GAP events)
+    3       1     0
+    4       4     time since the previous record (us)
+    8       2     bytes of the event parameters following (N)
+    10      N     event parameters
+
+The parameters are packed field by field in the order of their declaration,
+without padding and with written values and attribute table handles inline,
+so recordings of an ESP32 can be read on a 64 bit host. Events the server
+doesn't evaluate are recorded without parameters.
+*/
+// ------------------------------------------------------------------------------------------
+# include "ble_config.h"
+# include <esp_gatts_api.h>
+# include <esp_gap_ble_api.h>
+# include <cstddef>
+# include <cstdint>
+// ------------------------------------------------------------------------------------------
+/// Type of function receiving the records, see BLEServer::SetRecorder().
+/// Called on the BTC task with the server locked, so it should only copy the record.
+typedef void (*record_write_func)(void* context, const uint8_t* data, size_t len);
+// ------------------------------------------------------------------------------------------
+class BLEEventRecorder
+{
+public:
+    static constexpr uint8_t version = 2;
+    static constexpr uint8_t kind_gatts = 0;
+    static constexpr uint8_t kind_gap = 1;
+    static constexpr size_t file_header_size = 8;
+    static constexpr size_t header_size = 10;
+    /// Largest record: a written value of ESP_GATT_MAX_ATTR_LEN bytes, attribute tables
+    /// have at most 255 handles.
+    static constexpr size_t max_size = header_size + 20 + ESP_GATT_MAX_ATTR_LEN;
+
+    /// Starts recording to \a write (or stops with \c nullptr), a new recording starts with the file header.
+    void Start(record_write_func write, void* context);
+
+    bool IsRecording(void) const { return m_write != nullptr; }
+
+    /// Records written since Start().
+    uint32_t GetCount(void) const { return m_count; }
+
+    void AddGATTSEvent(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, const esp_ble_gatts_cb_param_t& param);
+    void AddGAPEvent(esp_gap_ble_cb_event_t event, const esp_ble_gap_cb_param_t& param);
+
+protected:
+    record_write_func m_write = nullptr;
+    void* m_context = nullptr;
+    uint32_t m_count = 0;
+    /// Time (us) of the previous record.
+    int64_t m_time = 0;
+    uint8_t m_buffer[max_size];
+
+    /// Fills in the header of the record in m_buffer with \a size bytes of parameters and writes it.
+    void Write(uint8_t kind, uint8_t event, uint8_t gatts_if, size_t size);
+};
+// ------------------------------------------------------------------------------------------
+/// Decodes a recording of BLEEventRecorder, e.g. read from a file (see host/tools/ble_replay.cpp).
+class BLERecordReader
+{
+public:
+    /// A decoded event, the pointers of the parameters point into the event itself.
+    struct Event
+    {
+        bool is_gap;
+        uint8_t gatts_if;
+        esp_gatts_cb_event_t gatts_event;
+        esp_gap_ble_cb_event_t gap_event;
+        /// Time since the previous event (us).
+        uint32_t delta_us;
+        esp_ble_gatts_cb_param_t gatts_param;
+        esp_ble_gap_cb_param_t gap_param;
+        uint8_t value[ESP_GATT_MAX_ATTR_LEN];
+        uint16_t handles[255];
+    };
+
+    /// \a data holds the whole recording including the file header and must stay valid.
+    BLERecordReader(const uint8_t* data, size_t len);
+
+    /// Whether the recording starts with a valid file header.
+    bool IsValid(void) const { return m_valid; }
+
+    /// Whether reading stopped at a truncated or malformed record.
+    bool IsCorrupt(void) const { return m_corrupt; }
+
+    /// Decodes the next record into \a event.
+    /// \returns \c false at the end of the recording or at a corrupt record.
+    bool Next(Event& event);
+
+    /// Starts again with the first record.
+    void Rewind(void) { m_pos = BLEEventRecorder::file_header_size; m_corrupt = false; }
+
+protected:
+    const uint8_t* m_data;
+    size_t m_len;
+    size_t m_pos;
+    bool m_valid;
+    bool m_corrupt;
+};
+// ------------------------------------------------------------------------------------------
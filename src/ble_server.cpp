@@ -1,6 +1,8 @@
 # include "ble_server.h"
 # include <esp_log.h>
+# include <esp_timer.h>
 # include <cstring>
+# include <algorithm>
 # include "main.h"
 // -------------------------------------------------------------------------------------------------------------------
 //# define BUILD_WITH_LOGS
@@ -18,24 +20,71 @@
 #  define LOGE(...) {}
 #  define LOGDUMP(...) {}
 # endif
+
+# ifdef BLE_SERVER_INSTRUMENTATION
+#  define INSTRUMENT(...) m_instrumentation.__VA_ARGS__
+# else
+#  define INSTRUMENT(...) {}
+# endif
+
+# ifdef BLE_SERVER_TRACE
+#  define TRACE(...) m_trace.__VA_ARGS__
+# else
+#  define TRACE(...) {}
+# endif
+
+# ifdef BLE_SERVER_RECORD
+#  define RECORD(...) m_recorder.__VA_ARGS__
+# else
+#  define RECORD(...) {}
+# endif
 // -------------------------------------------------------------------------------------------------------------------
 const uint8_t ADV_CONFIG_FLAG = (1 << 0);
 const uint8_t SCAN_RSP_CONFIG_FLAG = (1 << 1);
+const uint8_t ADV_DATA_MAX_LEN = 31;
+// -------------------------------------------------------------------------------------------------------------------
+/// Holds the recursive mutex of a server for the current scope.
+class BLELock
+{
+public:
+    explicit BLELock(SemaphoreHandle_t mutex) : m_mutex(mutex) { xSemaphoreTakeRecursive(m_mutex, portMAX_DELAY); }
+    ~BLELock() { xSemaphoreGiveRecursive(m_mutex); }
+    BLELock(const BLELock&) = delete;
+    BLELock& operator=(const BLELock&) = delete;
+private:
+    SemaphoreHandle_t m_mutex;
+};
+// -------------------------------------------------------------------------------------------------------------------
+/// Attribute handle of an event passed to the event handlers.
+static uint16_t GetEventHandle(esp_gatts_cb_event_t event, const esp_ble_gatts_cb_param_t& param)
+{
+    switch (event)
+    {
+        case ESP_GATTS_READ_EVT:     return param.read.handle;
+        case ESP_GATTS_WRITE_EVT:    return param.write.handle;
+        case ESP_GATTS_CONF_EVT:     return param.conf.handle;
+        case ESP_GATTS_RESPONSE_EVT: return param.rsp.handle;
+        default:                     return 0;
+    }
+}
 // -------------------------------------------------------------------------------------------------------------------
-#define SVCID_FROM_KEY(key) ((key >> 8) & 0x7F)
-#define IDX_FROM_KEY(key) (key & 0xFF)
-uint16_t CreateHandlerKey(uint8_t service_id, uint8_t idx)
+/// Connection of an event passed to the event handlers (BLEEventContext::no_connection if none).
+static uint16_t GetEventConnection(esp_gatts_cb_event_t event, const esp_ble_gatts_cb_param_t& param)
 {
-    uint16_t key = (service_id << 8) | idx;
-    assert((key & 0x8000) == 0); // first bit should not be set
-    // setting the first allows us to use both handles and this
-    // key type to be used within the same map, because neither
-    // an attribute handle nor a service id 
-    // will exceed this value (currently)
-    key |= 0x8000;
-    return key;
+    switch (event)
+    {
+        case ESP_GATTS_READ_EVT:     return param.read.conn_id;
+        case ESP_GATTS_WRITE_EVT:    return param.write.conn_id;
+        case ESP_GATTS_CONF_EVT:     return param.conf.conn_id;
+        default:                     return BLEEventContext::no_connection;
+    }
 }
 // -------------------------------------------------------------------------------------------------------------------
+std::atomic<size_t> BLEMemory::s_used(0);
+std::atomic<size_t> BLEMemory::s_high_water(0);
+std::atomic<size_t> BLEMemory::s_reserved(0);
+// -------------------------------------------------------------------------------------------------------------------
+// -------------------------------------------------------------------------------------------------------------------
 BLEService::BLEService(uint16_t uuid, uint8_t service_id)
 : m_uuid(uuid)
 , m_service_id(service_id)
@@ -48,11 +97,25 @@ BLEService::BLEService(uint16_t uuid, uint8_t service_id)
     );
 }
 // -------------------------------------------------------------------------------------------------------------------
+BLEService::BLEService(const esp_gatts_attr_db_t* attributes, uint8_t count, uint8_t service_id)
+: m_uuid(0)
+, m_service_id(service_id)
+, m_const_db(attributes)
+, m_const_count(count)
+{
+    assert(attributes && count);
+    const esp_attr_desc_t& svc = attributes[0].att_desc;
+    assert(svc.uuid_length == ESP_UUID_LEN_16 && svc.uuid_p[0] == (primary_service_uuid & 0xFF) && svc.uuid_p[1] == (primary_service_uuid >> 8));
+    assert(svc.length == sizeof(uint16_t));
+    m_uuid = (uint16_t)(svc.value[0] | (svc.value[1] << 8));
+}
+// -------------------------------------------------------------------------------------------------------------------
 void BLEService::RegisterAttributes(esp_gatt_if_t gatts_if)
 {
     uint8_t count = GetCount();
     LOGI("SVC", "Adding %d attributes for service %d with uuid=%04x", count, m_service_id, m_uuid);
-    esp_err_t ec = esp_ble_gatts_create_attr_tab(m_gatt_db.data(), gatts_if, count, m_service_id);
+    m_registered = true;
+    esp_err_t ec = esp_ble_gatts_create_attr_tab(GetAttributes(), gatts_if, count, m_service_id);
     if (ec)
         LOGE(
             "SVC", "Adding attribute table for service %d with uuid=%04x failed, error code=%d",
@@ -62,6 +125,16 @@ void BLEService::RegisterAttributes(esp_gatt_if_t gatts_if)
 // -------------------------------------------------------------------------------------------------------------------
 BLEService::size_type BLEService::AddAttributeDB(const esp_gatts_attr_db_t& attr)
 {
+    if (m_const_db)
+    {
+        LOGE("SVC", "Cannot add attributes to the constant table of service %d with uuid=%04x", m_service_id, m_uuid);
+        return npos;
+    }
+    if (BLEIsFull(m_gatt_db))
+    {
+        LOGE("SVC", "Cannot add more than %d attributes to service %d, see BLE_MAX_SERVICE_ATTRIBUTES", BLE_MAX_SERVICE_ATTRIBUTES, m_service_id);
+        return npos;
+    }
     size_t result = m_gatt_db.size();
     m_gatt_db.push_back(attr);
     return result;
@@ -88,7 +161,7 @@ BLEService::size_type BLEService::AddNameDescription(const char* description)
     });
 }
 // -------------------------------------------------------------------------------------------------------------------
-BLEService::size_type BLEService::AddConfigDescription(uint8_t *config_descr)
+BLEService::size_type BLEService::AddConfigDescription(uint8_t *config_descr, uint8_t response)
 {
     assert(config_descr);
     LOGD(
@@ -99,7 +172,7 @@ BLEService::size_type BLEService::AddConfigDescription(uint8_t *config_descr)
     return AddAttribute({
         ESP_UUID_LEN_16, (uint8_t*)&character_client_config_uuid,
         ESP_GATT_PERM_READ|ESP_GATT_PERM_WRITE, 2, 2, config_descr
-    });
+    }, response);
 }
 // -------------------------------------------------------------------------------------------------------------------
 BLEService::size_type BLEService::AddCharacteristic(
@@ -137,46 +210,197 @@ void BLEService::SetHandles(uint16_t* handles, uint8_t count)
 {
     assert (count == GetCount());
     m_handles.resize(count);
+    if (m_handles.size() != count)
+    {
+        LOGE("SVC", "Cannot store %d handles for service %d, see BLE_MAX_SERVICE_ATTRIBUTES", count, m_service_id);
+        m_handles.clear();
+        return;
+    }
     memcpy(m_handles.data(), handles, count * sizeof(uint16_t));
+
+    // values set while the stack was creating the table
+    for (size_type index : m_changed)
+    {
+        const esp_attr_desc_t& desc = m_gatt_db[index].att_desc;
+        esp_err_t ec = esp_ble_gatts_set_attr_value(m_handles[index], desc.length, desc.value);
+        if (ec)
+            LOGE("SVC", "Setting value of handle %d failed, error code=%d", m_handles[index], ec);
+    }
+    m_changed.clear();
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t BLEService::SetValue(size_type index, uint16_t length, const uint8_t* value)
+{
+    if (index >= GetCount())
+        return ESP_ERR_INVALID_ARG;
+    if (length > GetAttributes()[index].att_desc.max_length)
+        return ESP_ERR_INVALID_SIZE;
+    if (HasHandles())
+        return esp_ble_gatts_set_attr_value(m_handles[index], length, value);
+    if (m_const_db)
+        return ESP_ERR_NOT_SUPPORTED;
+
+    esp_attr_desc_t& desc = m_gatt_db[index].att_desc;
+    if (desc.value != value)
+        memmove(desc.value, value, length);
+    desc.length = length;
+    if (m_registered && std::find(m_changed.begin(), m_changed.end(), index) == m_changed.end())
+        m_changed.push_back(index);
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+# ifndef BLE_SERVER_STATIC_STORAGE
+/// Wraps \a service allocated by BLECountingAllocator into a shared pointer,
+/// so both the instance and the control block are accounted in BLEMemory.
+static BLEService::ptr WrapService(BLEService* service)
+{
+    return BLEService::ptr(
+        service,
+        [](BLEService* p)
+        {
+            p->~BLEService();
+            BLECountingAllocator<BLEService>().deallocate(p, 1);
+        },
+        BLECountingAllocator<BLEService>()
+    );
 }
 // -------------------------------------------------------------------------------------------------------------------
 BLEService::ptr BLEService::Create(uint16_t uuid, uint8_t service_id)
 {
-    return ptr(new BLEService(uuid, service_id));
+    return WrapService(new (BLECountingAllocator<BLEService>().allocate(1)) BLEService(uuid, service_id));
+}
+// -------------------------------------------------------------------------------------------------------------------
+BLEService::ptr BLEService::Create(const esp_gatts_attr_db_t* attributes, uint8_t count, uint8_t service_id)
+{
+    return WrapService(new (BLECountingAllocator<BLEService>().allocate(1)) BLEService(attributes, count, service_id));
 }
+# endif
 // -------------------------------------------------------------------------------------------------------------------
 // -------------------------------------------------------------------------------------------------------------------
 // -------------------------------------------------------------------------------------------------------------------
 BLEServer::BLEServer(const char* device_name, uint16_t mtu)
 :m_device_name(device_name)
 ,m_mtu(mtu)
+,m_adv_params(default_adv_params)
 {
+    m_lock = xSemaphoreCreateRecursiveMutexStatic(&m_lock_buffer);
+    memset(m_prepare_owner, BLE_MAX_CONNECTIONS, sizeof(m_prepare_owner));
+    BLEMemory::Reserve(sizeof(m_prepare_pool));
 }
 // -------------------------------------------------------------------------------------------------------------------
-uint8_t BLEServer::AddService(uint16_t uuid)
+BLEServer::~BLEServer()
 {
-    LOGI(m_device_name.c_str(), "Adding service %04x.", uuid);
-    uint8_t service_id = (uint8_t)m_services.size();
-    if (service_id > 32) // GATT_MAX_SR_PROFILES)
+    StopHandlerTask();
+    if (m_broadcast_timer)
+    {
+        esp_timer_stop(m_broadcast_timer);
+        esp_timer_delete(m_broadcast_timer);
+    }
+    if (m_flush_timer)
+    {
+        esp_timer_stop(m_flush_timer);
+        esp_timer_delete(m_flush_timer);
+    }
+    if (m_reliable_timer)
+    {
+        esp_timer_stop(m_reliable_timer);
+        esp_timer_delete(m_reliable_timer);
+    }
+    if (m_adaptive_timer)
+    {
+        esp_timer_stop(m_adaptive_timer);
+        esp_timer_delete(m_adaptive_timer);
+    }
+    if (m_bond_timer)
+    {
+        {
+            // changes waiting for the timer are not lost, saved with the lock like the timer does
+            BLELock lock(m_lock);
+            esp_timer_stop(m_bond_timer);
+            m_bond_closed = true;
+            if (m_bond_due >= 0)
+                SaveBonds();
+        }
+        // a callback started before the stop finds nothing to do, it leaves before the lock is deleted
+        while (m_bond_callbacks.load())
+            vTaskDelay(1);
+        esp_timer_delete(m_bond_timer);
+    }
+    for (uint16_t conn_id = 0; conn_id < BLE_MAX_CONNECTIONS; ++conn_id)
+        ReleasePrepareBuffer(conn_id);
+    BLEMemory::Unreserve(sizeof(m_prepare_pool));
+# ifdef BLE_SERVER_STATIC_STORAGE
+    for (BLEService::ptr service : m_services)
+        service->~BLEService();
+# endif
+    vSemaphoreDelete(m_lock);
+}
+// -------------------------------------------------------------------------------------------------------------------
+bool BLEServer::CanAddService(void) const
+{
+    if (m_services.size() >= BLE_MAX_SERVICES || BLEIsFull(m_services))
     {
         LOGE(
             m_device_name.c_str(),
-            "Cannot add more then %d services! Change GATT_MAX_SR_PROFILES in bt_target.h to be able to add more services.",
-            32
+            "Cannot add more then %d services! Change GATT_MAX_SR_PROFILES in bt_target.h and BLE_MAX_SERVICES to be able to add more services.",
+            BLE_MAX_SERVICES
         );
+        return false;
     }
+    return true;
+}
+// -------------------------------------------------------------------------------------------------------------------
+uint8_t BLEServer::AddService(uint16_t uuid)
+{
+    LOGI(m_device_name.c_str(), "Adding service %04x.", uuid);
+    if (!CanAddService())
+        return BLEService::npos;
+
+    uint8_t service_id = (uint8_t)m_services.size();
+# ifdef BLE_SERVER_STATIC_STORAGE
+    m_services.push_back(new (m_service_storage[service_id]) BLEService(uuid, service_id));
+# else
     m_services.push_back(BLEService::Create(uuid, service_id));
+# endif
+    return service_id;
+}
+// -------------------------------------------------------------------------------------------------------------------
+uint8_t BLEServer::AddService(const esp_gatts_attr_db_t* attributes, uint8_t count)
+{
+    if (!CanAddService())
+        return BLEService::npos;
+
+    uint8_t service_id = (uint8_t)m_services.size();
+# ifdef BLE_SERVER_STATIC_STORAGE
+    m_services.push_back(new (m_service_storage[service_id]) BLEService(attributes, count, service_id));
+# else
+    m_services.push_back(BLEService::Create(attributes, count, service_id));
+# endif
+    LOGI(m_device_name.c_str(), "Adding service %04x with constant table of %d attributes.", m_services.back()->GetUUID(), count);
     return service_id;
 }
 // -------------------------------------------------------------------------------------------------------------------
+esp_err_t BLEServer::EnableGATTCaching(void)
+{
+# ifdef CONFIG_BT_GATTS_ROBUST_CACHING_ENABLED
+    BLELock lock(m_lock);
+    m_gatt_caching = true;
+    return ESP_OK;
+# else
+    LOGE(m_device_name.c_str(), "GATT caching needs CONFIG_BT_GATTS_ROBUST_CACHING_ENABLED.");
+    return ESP_ERR_NOT_SUPPORTED;
+# endif
+}
+// -------------------------------------------------------------------------------------------------------------------
 BLEService::size_type BLEServer::AddCharacteristic(
         const uint16_t* uuid, const uint8_t* properties,
         uint16_t permissions,
         uint16_t max_length, uint16_t length, uint8_t* value,
         const char* description,
-        event_handler_func on_event,
+        BLEEventHandler on_event,
         uint8_t* config_descr,
-        uint8_t response
+        uint8_t response,
+        uint8_t event_mask
 )
 {
     if (m_services.empty())
@@ -190,7 +414,9 @@ BLEService::size_type BLEServer::AddCharacteristic(
         uuid, properties, permissions, max_length, length, value, response
     );
 
-    BLEService::size_type idx_config_descr = config_descr ? service->AddConfigDescription(config_descr) : BLEService::npos;
+    // answered by the server, so every client reads its own subscription
+    BLEService::size_type idx_config_descr =
+        config_descr ? service->AddConfigDescription(config_descr, ESP_GATT_RSP_BY_APP) : BLEService::npos;
 
     if (description)
     {
@@ -201,35 +427,114 @@ BLEService::size_type BLEServer::AddCharacteristic(
     {
         if (idx_attr != BLEService::npos)
         {
-            m_event_handlers[CreateHandlerKey(service_id, idx_attr)] = on_event;
+            SetEventHandler(service_id, idx_attr, on_event, event_mask);
         }
         if (idx_config_descr != BLEService::npos)
         {
-            m_event_handlers[CreateHandlerKey(service_id, idx_config_descr)] = on_event;
+            SetEventHandler(service_id, idx_config_descr, on_event, event_mask);
         }
     }
 
     return idx_attr;
 }
 // -------------------------------------------------------------------------------------------------------------------
+BLEService::size_type BLEServer::AddCharacteristic(
+        const uint16_t* uuid, const uint8_t* properties,
+        uint16_t permissions,
+        uint16_t max_length, uint8_t* value,
+        read_provider_func provider,
+        uint32_t cache_ms,
+        const char* description,
+        BLEEventHandler on_event,
+        uint8_t* config_descr,
+        uint8_t event_mask
+)
+{
+    assert(provider && value);
+    BLEService::size_type idx_attr = AddCharacteristic(
+        uuid, properties, permissions, max_length, 0, value,
+        description, on_event, config_descr, ESP_GATT_RSP_BY_APP, event_mask
+    );
+    if (idx_attr != BLEService::npos)
+        SetReadProvider((uint8_t)m_services.size() - 1, idx_attr, value, max_length, provider, cache_ms);
+    return idx_attr;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::SetReadProvider(
+    uint8_t service_id, BLEService::size_type attribute_index,
+    uint8_t* value, uint16_t max_length, read_provider_func provider, uint32_t cache_ms
+)
+{
+    assert(service_id < m_services.size());
+    assert(provider && value);
+
+    if (BLEIsFull(m_read_providers))
+    {
+        LOGE(m_device_name.c_str(), "Cannot add more than %d read providers, see BLE_MAX_READ_PROVIDERS", BLE_MAX_READ_PROVIDERS);
+        return;
+    }
+    m_read_providers.push_back({service_id, attribute_index, 0, provider, cache_ms * 1000, value, max_length, 0, -1, 0});
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::SetEventHandler(
+    uint8_t service_id, BLEService::size_type attribute_index,
+    BLEEventHandler on_event, uint8_t event_mask,
+    uint8_t reply_service_id, BLEService::size_type reply_index
+)
+{
+    assert(service_id < m_services.size());
+    assert(reply_service_id == BLEService::npos || reply_service_id < m_services.size());
+    assert(m_handlers.empty()); // dispatch table already built, the ring refers to the entries
+
+    for (EventHandler& entry : m_event_handlers)
+    {
+        if (entry.service_id == service_id && entry.attribute_index == attribute_index)
+        {
+            entry.handler = on_event;
+            entry.event_mask = event_mask;
+            entry.reply_service_id = reply_service_id;
+            entry.reply_index = reply_index;
+            return;
+        }
+    }
+    if (BLEIsFull(m_event_handlers))
+    {
+        LOGE(m_device_name.c_str(), "Cannot add more than %d event handlers, see BLE_MAX_EVENT_HANDLERS", BLE_MAX_EVENT_HANDLERS);
+        return;
+    }
+    m_event_handlers.push_back({service_id, attribute_index, event_mask, reply_service_id, reply_index, 0, on_event});
+}
+// -------------------------------------------------------------------------------------------------------------------
 uint16_t BLEServer::GetHandle(uint8_t service_id, uint8_t attribute_index)
 {
     if (service_id < m_services.size())
     {
-        return m_services[service_id]->GetHandle(attribute_index);
+        return m_services[service_id]->HasHandles() ? m_services[service_id]->GetHandle(attribute_index) : 0;
     }
     assert(false);
     return 0;
 }
 // -------------------------------------------------------------------------------------------------------------------
-uint8_t* CreatePassiveAdvertisingData(uint16_t uuid, uint8_t& required_bytes, const std::string& device_name)
+esp_err_t BLEServer::SetAttributeValue(uint8_t service_id, BLEService::size_type attribute_index, uint16_t length, const uint8_t* value)
+{
+    BLELock lock(m_lock);
+    if (service_id >= m_services.size())
+        return ESP_ERR_INVALID_ARG;
+    return m_services[service_id]->SetValue(attribute_index, length, value);
+}
+// -------------------------------------------------------------------------------------------------------------------
+uint8_t CreatePassiveAdvertisingData(uint16_t uuid, const char* device_name, const uint8_t* broadcast, uint8_t broadcast_size, uint8_t* raw_adv_data)
 {
-    required_bytes = 12; // flags = 3, tx power = 3, len + type of Primary UUID = 4, len + type for device_name = 2
-    uint8_t dn_size = std::min((uint8_t)device_name.size(), (uint8_t)(31 - required_bytes));
-    required_bytes += dn_size;
+    uint8_t required_bytes = 10 + broadcast_size; // flags = 3, tx power = 3, len + type of Primary UUID = 4, broadcast data
+    assert(required_bytes <= ADV_DATA_MAX_LEN);
+    // the device name gets the room left (len + type = 2), it's left out if not a character fits
+    size_t name_length = strlen(device_name);
+    uint8_t room = ADV_DATA_MAX_LEN - required_bytes;
+    uint8_t dn_size = room > 2 ? (uint8_t)std::min(name_length, (size_t)(room - 2)) : 0;
+    bool with_name = room >= 2 && (dn_size || !name_length);
+    if (with_name)
+        required_bytes += 2 + dn_size;
     uint8_t i = 0;
-    uint8_t *raw_adv_data = (uint8_t*)malloc(required_bytes);
-    LOGI(device_name.c_str(), "Allocated %d bytes for advertisment data.", required_bytes);
     // flags (3 Byte): 0x02 0x02 FLAGS
     raw_adv_data[i++] = 0x02; raw_adv_data[i++] = 0x01; raw_adv_data[i++] = 0x06; 
     // tx power (3 Byte): 0x02 0x0a TX-VALUE
@@ -238,31 +543,34 @@ uint8_t* CreatePassiveAdvertisingData(uint16_t uuid, uint8_t& required_bytes, co
     raw_adv_data[i++] = 0x03; raw_adv_data[i++] = 0x03;
     raw_adv_data[i++] = (uint8_t)uuid & 0xFF; // LO-Byte
     raw_adv_data[i++] = (uint8_t)(uuid >> 8) & 0xFF; // HI-Byte
+    // broadcast data (complete AD structure)
+    if (broadcast_size)
+    {
+        memcpy(raw_adv_data + i, broadcast, broadcast_size);
+        i += broadcast_size;
+    }
     // device name
-    raw_adv_data[i++] = dn_size + 1;
-    raw_adv_data[i++] = dn_size == device_name.size() ? 0x09 : 0x08; // 9 = full length device name, 8 = shortened device name
-    for (uint8_t j = 0; j < dn_size; ++j)
+    if (with_name)
     {
-        if (j == device_name.size())
-            break;
-        raw_adv_data[i++] = device_name[j];
+        raw_adv_data[i++] = dn_size + 1;
+        raw_adv_data[i++] = dn_size == name_length ? 0x09 : 0x08; // 9 = full length device name, 8 = shortened device name
+        memcpy(raw_adv_data + i, device_name, dn_size);
+        i += dn_size;
     }
     assert(i == required_bytes);
-    return raw_adv_data;
+    return required_bytes;
 }
 // -------------------------------------------------------------------------------------------------------------------
-uint8_t* CreateScanAdvertisingData(const ServiceVector& services, uint8_t& required_bytes)
+uint8_t CreateScanAdvertisingData(const ServiceVector& services, uint8_t* raw_adv_data)
 {
     assert(services.size() > 1);
     uint8_t uuid_cnt = (uint8_t)services.size() - 1;
 
-    required_bytes = 2; // len + type of Secondary UUIDs = 2
+    uint8_t required_bytes = 2; // len + type of Secondary UUIDs = 2
     uuid_cnt = std::min((uint8_t)14, uuid_cnt);
     required_bytes += uuid_cnt * 2;
 
     uint8_t i = 0;
-    uint8_t *raw_adv_data = (uint8_t*)malloc(required_bytes);
-    LOGI("SVC", "Allocated %d bytes for active scan advertisment data.", required_bytes);
     // list of uuids
     raw_adv_data[i++] = 1 + 2 * uuid_cnt; // length bit, 1=flag + 2 byte per UUID
     raw_adv_data[i++] = 0x03; // flag
@@ -273,33 +581,78 @@ uint8_t* CreateScanAdvertisingData(const ServiceVector& services, uint8_t& requi
         raw_adv_data[i++] = (uint8_t)uuid & 0xFF; // LO-Byte
         raw_adv_data[i++] = (uint8_t)(uuid >> 8) & 0xFF; // HI-Byte
     }
-    return raw_adv_data;
+    return required_bytes;
 }
 // -------------------------------------------------------------------------------------------------------------------
 void BLEServer::HandleGATTEvent(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param)
 {
-    LOGI(m_device_name.c_str(), "GATT profile event=%d, gatts_if=%d", event, gatts_if);
+    BLELock lock(m_lock);
+    RECORD(AddGATTSEvent(event, gatts_if, *param));
     if (gatts_if == m_gatts_if || gatts_if == ESP_GATT_IF_NONE || event == ESP_GATTS_REG_EVT)
     {
+        TRACE(AddGATTSEvent(event, *param));
+        INSTRUMENT(CountEvent(event));
         switch (event)
         {
             case ESP_GATTS_CREAT_ATTR_TAB_EVT:
                 OnAttributesTableCreated(param);
                 break;
             case ESP_GATTS_CONF_EVT:
+                OnNotifyConfirm(param);
+                OnEvent(event, gatts_if, param);
+                break;
             case ESP_GATTS_RESPONSE_EVT:
+                OnEvent(event, gatts_if, param);
+                break;
             case ESP_GATTS_READ_EVT:
-            case ESP_GATTS_WRITE_EVT:
+                if (param->read.conn_id < BLE_MAX_CONNECTIONS)
+                {
+                    ++m_connections[param->read.conn_id].reads;
+                    NoteTraffic(m_connections[param->read.conn_id], true);
+                }
+                INSTRUMENT(CountRead(param->read.handle));
+                // answered by the server, a handler must not respond a second time
+                if (OnConfigRead(gatts_if, param) || OnProviderRead(gatts_if, param))
+                    break;
                 OnEvent(event, gatts_if, param);
                 break;
+            case ESP_GATTS_WRITE_EVT:
+                if (param->write.conn_id < BLE_MAX_CONNECTIONS)
+                {
+                    ++m_connections[param->write.conn_id].writes;
+                    NoteTraffic(m_connections[param->write.conn_id], true);
+                }
+# ifdef BLE_SERVER_INSTRUMENTATION
+                m_instrumentation.CountWrite(param->write.handle);
+                if (param->write.conn_id < BLE_MAX_CONNECTIONS)
+                    m_connections[param->write.conn_id].write_time = esp_timer_get_time();
+# endif
+                if (param->write.is_prep)
+                {
+                    OnPrepareWrite(gatts_if, param);
+                }
+                else
+                {
+                    OnConfigWrite(gatts_if, param);
+                    OnEvent(event, gatts_if, param);
+                }
+                break;
+            case ESP_GATTS_EXEC_WRITE_EVT:
+                OnExecWrite(gatts_if, param);
+                break;
             case ESP_GATTS_MTU_EVT:
-                m_mtu = param->mtu.mtu; 
+                m_mtu = param->mtu.mtu;
+                if (param->mtu.conn_id < BLE_MAX_CONNECTIONS)
+                    m_connections[param->mtu.conn_id].mtu = param->mtu.mtu;
                 break;
             case ESP_GATTS_CONNECT_EVT:
                 OnConnect(param);
                 break;
             case ESP_GATTS_DISCONNECT_EVT:
-                esp_ble_gap_start_advertising(&adv_params);
+                OnDisconnect(param);
+                break;
+            case ESP_GATTS_CONGEST_EVT:
+                OnCongest(param);
                 break;
             case ESP_GATTS_REG_EVT:
                 LOGI(m_device_name.c_str(), "ESP_GATTS_REG_EVT, gatts_if = %d", gatts_if);
@@ -313,14 +666,12 @@ void BLEServer::HandleGATTEvent(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_
                 LOGI(m_device_name.c_str(), "ESP_GATTS_UNREG_EVT, gatts_if = %d", gatts_if);
                 m_gatts_if = ESP_GATT_IF_NONE;
                 break;
-            case ESP_GATTS_EXEC_WRITE_EVT:
             case ESP_GATTS_START_EVT:
             case ESP_GATTS_STOP_EVT:
             case ESP_GATTS_OPEN_EVT:
             case ESP_GATTS_CANCEL_OPEN_EVT:
             case ESP_GATTS_CLOSE_EVT:
             case ESP_GATTS_LISTEN_EVT:
-            case ESP_GATTS_CONGEST_EVT:
             case ESP_GATTS_DELETE_EVT:
             default:
                 break;
@@ -330,12 +681,6 @@ void BLEServer::HandleGATTEvent(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_
 // -------------------------------------------------------------------------------------------------------------------
 void BLEServer::OnAttributesTableCreated(esp_ble_gatts_cb_param_t *param)
 {
-    if (param->add_attr_tab.status != ESP_GATT_OK)
-    {
-        LOGE(m_device_name.c_str(), "Attribute table creation failed, error code=0x%x", param->add_attr_tab.status);
-        return;
-    }
-
     uint8_t service_id = param->add_attr_tab.svc_inst_id;
     if (service_id >= m_services.size())
     {
@@ -343,145 +688,2209 @@ void BLEServer::OnAttributesTableCreated(esp_ble_gatts_cb_param_t *param)
         return;
     }
 
-    BLEService::ptr service = m_services[service_id];
-    
-    if (param->add_attr_tab.num_handle != service->GetCount())
+    // the dispatch table is built as soon as all tables are answered, even if one of them failed
+    ++m_tables_created;
+
+    if (param->add_attr_tab.status != ESP_GATT_OK)
     {
-        LOGE(
-            m_device_name.c_str(),
-            "Attribute table created abnormally for service %d, got %d handles, expected %d",
-            service_id, param->add_attr_tab.num_handle, service->GetCount()
-        );
-        return;
+        LOGE(m_device_name.c_str(), "Attribute table creation failed, error code=0x%x", param->add_attr_tab.status);
     }
-
-    service->SetHandles(param->add_attr_tab.handles, param->add_attr_tab.num_handle);
-
-    LOGI(m_device_name.c_str(), "Attribute table successfully created for service %d, handles=%d", service_id, param->add_attr_tab.num_handle);
-
-    for (uint16_t i = 0; i < param->add_attr_tab.num_handle; ++i)
+    else
     {
-        uint16_t map_index = CreateHandlerKey(service_id, i);
-        uint16_t hdl = param->add_attr_tab.handles[i];
-        
-        
-        auto it = m_event_handlers.find(map_index);
-        if (it != m_event_handlers.end())
+        BLEService::ptr service = m_services[service_id];
+
+        if (param->add_attr_tab.num_handle != service->GetCount())
+        {
+            LOGE(
+                m_device_name.c_str(),
+                "Attribute table created abnormally for service %d, got %d handles, expected %d",
+                service_id, param->add_attr_tab.num_handle, service->GetCount()
+            );
+        }
+        else
         {
-            // yes, remove the old index and store it with handle as key
+            service->SetHandles(param->add_attr_tab.handles, param->add_attr_tab.num_handle);
+            if (service->HasHandles())
+                AddConfigDescriptors(*service);
+
+            LOGI(m_device_name.c_str(), "Attribute table successfully created for service %d, handles=%d", service_id, param->add_attr_tab.num_handle);
 
-            LOGI(m_device_name.c_str(), "Exchanged event handler for service %d / attribute %d by handle %d", service_id, i, hdl);
-            m_event_handlers[hdl] = it->second;
-            m_event_handlers.erase(it);
+            // at least start the service
+            LOGI(m_device_name.c_str(), "Starting service %d with uuid=%04x", service_id, service->GetUUID());
+            esp_ble_gatts_start_service(*param->add_attr_tab.handles);
         }
     }
 
-    // at least start the service
-    LOGI(m_device_name.c_str(), "Starting service %d with uuid=%04x", service_id, service->GetUUID());
-    esp_ble_gatts_start_service(*param->add_attr_tab.handles);
+    if (m_tables_created == m_services.size())
+    {
+        BuildHandlerTable();
+        // only needed to tell clients about changed attribute tables
+        if (m_gatt_caching || m_bond_store)
+            ComputeDatabaseHash();
+    }
 }
 // -------------------------------------------------------------------------------------------------------------------
-void BLEServer::OnRegisterAttributes(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param)
+void BLEServer::AddConfigDescriptors(const BLEService& service)
 {
-    esp_err_t ec = esp_ble_gap_set_device_name(m_device_name.c_str());
-    if (ec)
-        LOGE(m_device_name.c_str(), "Setting device name failed, error code=%d", ec);
-    
-    if (m_services.empty())
+    const esp_gatts_attr_db_t* db = service.GetAttributes();
+    uint16_t value_handle = 0;
+    for (BLEService::size_type i = 0; i < service.GetCount(); ++i)
     {
-        LOGE(m_device_name.c_str(), "No services registered!");
-        return;
+        const esp_attr_desc_t& desc = db[i].att_desc;
+        if (desc.uuid_length != ESP_UUID_LEN_16)
+            continue;
+        uint16_t uuid = desc.uuid_p[0] | (desc.uuid_p[1] << 8);
+        if (uuid == ESP_GATT_UUID_CHAR_DECLARE && i + 1 < service.GetCount())
+        {
+            value_handle = service.m_handles[i + 1];
+        }
+        else if (uuid == ESP_GATT_UUID_CHAR_CLIENT_CONFIG)
+        {
+            if (m_configs.size() >= BLE_MAX_CONFIG_DESCRIPTORS || BLEIsFull(m_configs))
+            {
+                LOGE(
+                    m_device_name.c_str(), "More than %d configuration descriptors, subscriptions of handle %d not tracked",
+                    BLE_MAX_CONFIG_DESCRIPTORS, service.m_handles[i]
+                );
+                continue;
+            }
+            m_configs.push_back({service.m_handles[i], value_handle, db[i].attr_control.auto_rsp == ESP_GATT_RSP_BY_APP});
+        }
     }
-
-    uint8_t adv_data_size = 0;
-    uint8_t* raw_adv_data = CreatePassiveAdvertisingData(m_services[0]->GetUUID(), adv_data_size, m_device_name);
-    assert(raw_adv_data);
-    assert(adv_data_size);
-
-    LOGI(m_device_name.c_str(), "Advertisment (passive) with size %u created:", adv_data_size);
-    LOGDUMP(m_device_name.c_str(), raw_adv_data, adv_data_size, ESP_LOG_DEBUG);
-
-    ec = esp_ble_gap_config_adv_data_raw(raw_adv_data, adv_data_size);
-    if (ec)
-        LOGE(m_device_name.c_str(), "Failed to set advertisment data config, error code=%d", ec);
-    free(raw_adv_data);
-
-    m_adv_config_done |= ADV_CONFIG_FLAG;
-
-    if (m_services.size() > 1)
+}
+// -------------------------------------------------------------------------------------------------------------------
+size_t BLEServer::FindConfig(uint16_t handle) const
+{
+    for (size_t i = 0; i < m_configs.size(); ++i)
     {
-        adv_data_size = 0;
-        uint8_t *raw_adv_scan_data = CreateScanAdvertisingData(m_services, adv_data_size);
-        assert(raw_adv_scan_data);
-        assert(adv_data_size);
-
-        LOGD(m_device_name.c_str(), "Advertisment (scan response) with size %u created:", adv_data_size);
-        LOGDUMP(m_device_name.c_str(), raw_adv_scan_data, adv_data_size, ESP_LOG_DEBUG);
-
-        ec = esp_ble_gap_config_scan_rsp_data_raw(raw_adv_scan_data, adv_data_size);
-        if (ec)
-            LOGE(m_device_name.c_str(), "Failed to set scan response data config, error code=%d", ec);
-
-        m_adv_config_done |= SCAN_RSP_CONFIG_FLAG;
-        free(raw_adv_scan_data);
+        if (m_configs[i].handle == handle)
+            return i;
     }
+    return m_configs.size();
+}
+// -------------------------------------------------------------------------------------------------------------------
+bool BLEServer::OnConfigRead(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param)
+{
+    esp_ble_gatts_cb_param_t::gatts_read_evt_param& read = param->read;
+    size_t index = FindConfig(read.handle);
+    if (index == m_configs.size() || !m_configs[index].by_app || !read.need_rsp || read.conn_id >= BLE_MAX_CONNECTIONS)
+        return false;
 
-    for (auto service:m_services)
-    {
-        service->RegisterAttributes(gatts_if);
-    }
+    const Connection& connection = m_connections[read.conn_id];
+    uint16_t bits = ((connection.notify_bits >> index) & 1) | (((connection.indicate_bits >> index) & 1) << 1);
+    uint8_t value[2] = {(uint8_t)bits, 0};
+    SendReadResponse(gatts_if, read, value, sizeof(value));
+    return true;
 }
 // -------------------------------------------------------------------------------------------------------------------
-void BLEServer::OnConnect(esp_ble_gatts_cb_param_t* param)
+void BLEServer::SendReadResponse(
+    esp_gatt_if_t gatts_if, const esp_ble_gatts_cb_param_t::gatts_read_evt_param& read, const uint8_t* value, uint16_t len
+)
 {
-    LOGI(m_device_name.c_str(), "New device connected, conn_id=%d:", param->connect.conn_id);
-    LOGDUMP(m_device_name.c_str(), param->connect.remote_bda, sizeof(param->connect.remote_bda), ESP_LOG_DEBUG);
-    esp_ble_conn_update_params_t conn_params;
-    memcpy(conn_params.bda, param->connect.remote_bda, sizeof(esp_bd_addr_t));
-    conn_params.latency = 0;
-    conn_params.max_int = 0x20;    // max_int = 0x20*1.25ms = 40ms
-    conn_params.min_int = 0x10;    // min_int = 0x10*1.25ms = 20ms
-    conn_params.timeout = 400;    // timeout = 400*10ms = 4000ms
-    //start sent the update connection parameters to the peer device.
-    esp_ble_gap_update_conn_params(&conn_params);
+    esp_gatt_status_t status = read.offset > len ? ESP_GATT_INVALID_OFFSET : ESP_GATT_OK;
+    memset(&m_rsp, 0, sizeof(m_rsp));
+    m_rsp.attr_value.handle = read.handle;
+    m_rsp.attr_value.offset = read.offset;
+    if (status == ESP_GATT_OK)
+    {
+        m_rsp.attr_value.len = (uint16_t)(len - read.offset);
+        memcpy(m_rsp.attr_value.value, value + read.offset, m_rsp.attr_value.len);
+    }
+    esp_err_t ec = esp_ble_gatts_send_response(gatts_if, read.conn_id, read.trans_id, status, &m_rsp);
+    if (ec)
+        LOGE(m_device_name.c_str(), "Sending read response for handle %d failed, error code=%d", read.handle, ec);
 }
 // -------------------------------------------------------------------------------------------------------------------
-void BLEServer::OnEvent(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param)
+bool BLEServer::OnProviderRead(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param)
 {
-    uint16_t handle = 0;
-    switch (event)
+    esp_ble_gatts_cb_param_t::gatts_read_evt_param& read = param->read;
+    if (!read.need_rsp)
+        return false;
+    ReadProvider* provider = nullptr;
+    for (ReadProvider& entry : m_read_providers)
     {
-        case ESP_GATTS_READ_EVT:
-            handle = param->read.handle;
-            break;
-        case ESP_GATTS_WRITE_EVT:
-            handle = param->write.handle;
-            LOGI(m_device_name.c_str(), "Received from peer:");
-            LOGDUMP(m_device_name.c_str(), param->write.value, param->write.len, ESP_LOG_INFO);
-            break;
-        case ESP_GATTS_CONF_EVT:
-            handle = param->conf.handle;
-            break;
-        case ESP_GATTS_RESPONSE_EVT:
-            handle = param->rsp.handle;
+        if (entry.handle == read.handle)
+        {
+            provider = &entry;
             break;
-        default:
-            return;
+        }
     }
+    if (!provider)
+        return false;
 
-    assert(handle);
-
-    LOGI(m_device_name.c_str(), "OnEvent %d for handle=%d.", event, handle);
-
-    auto itp = m_event_handlers.find(handle);
-    if (itp != m_event_handlers.end())
+    // the value is computed for a client, it answers only its reads
+    int64_t now = esp_timer_get_time();
+    int64_t age = provider->computed >= 0 && provider->conn_id == read.conn_id ? now - provider->computed : -1;
+    esp_gatt_status_t status = ESP_GATT_OK;
+    if (read.offset)
     {
-        LOGI(m_device_name.c_str(), "Calling event handler for handle = %d", handle);
-        itp->second(event, gatts_if, param);
+        // reads with an offset continue reading the value computed before, never a newer one
+        if (age < 0 || age >= std::max<int64_t>(provider->cache_us, (int64_t)BLE_READ_PROVIDER_HOLD_MS * 1000))
+            status = gatt_status_value_changed;
     }
-}
+    else if (age < 0 || age >= provider->cache_us)
+    {
+        uint16_t len = provider->max_length;
+        status = provider->func(read.conn_id, read.handle, provider->value, len);
+        provider->length = std::min(len, provider->max_length);
+        provider->computed = status == ESP_GATT_OK ? now : -1;
+        provider->conn_id = read.conn_id;
+    }
+    if (status == ESP_GATT_OK && read.offset > provider->length)
+        status = ESP_GATT_INVALID_OFFSET;
+
+    memset(&m_rsp, 0, sizeof(m_rsp));
+    m_rsp.attr_value.handle = read.handle;
+    m_rsp.attr_value.offset = read.offset;
+    if (status == ESP_GATT_OK)
+    {
+        uint16_t mtu = read.conn_id < BLE_MAX_CONNECTIONS ? m_connections[read.conn_id].mtu : m_mtu;
+        m_rsp.attr_value.len = std::min((uint16_t)(provider->length - read.offset), (uint16_t)(mtu - 1));
+        memcpy(m_rsp.attr_value.value, provider->value + read.offset, m_rsp.attr_value.len);
+    }
+    esp_err_t ec = esp_ble_gatts_send_response(gatts_if, read.conn_id, read.trans_id, status, &m_rsp);
+    if (ec)
+        LOGE(m_device_name.c_str(), "Sending read response for handle %d failed, error code=%d", read.handle, ec);
+    return true;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::OnConfigWrite(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param)
+{
+    esp_ble_gatts_cb_param_t::gatts_write_evt_param& write = param->write;
+    size_t index = FindConfig(write.handle);
+    if (index == m_configs.size() || write.conn_id >= BLE_MAX_CONNECTIONS)
+        return;
+
+    esp_gatt_status_t status = ESP_GATT_OK;
+    if (write.len != 2 || write.offset != 0)
+    {
+        status = write.offset ? ESP_GATT_INVALID_OFFSET : ESP_GATT_INVALID_ATTR_LEN;
+    }
+    else
+    {
+        Connection& connection = m_connections[write.conn_id];
+        uint32_t bit = (uint32_t)1 << index;
+        connection.notify_bits = (write.value[0] & 0x01) ? (connection.notify_bits | bit) : (connection.notify_bits & ~bit);
+        connection.indicate_bits = (write.value[0] & 0x02) ? (connection.indicate_bits | bit) : (connection.indicate_bits & ~bit);
+        LOGI(
+            m_device_name.c_str(), "conn_id=%d %s notifications, %s indications for handle %d",
+            write.conn_id, (write.value[0] & 0x01) ? "enabled" : "disabled",
+            (write.value[0] & 0x02) ? "enabled" : "disabled", m_configs[index].value_handle
+        );
+        MarkBondDirty(connection);
+    }
+
+    if (m_configs[index].by_app && write.need_rsp)
+    {
+        esp_err_t ec = esp_ble_gatts_send_response(gatts_if, write.conn_id, write.trans_id, status, nullptr);
+        if (ec)
+            LOGE(m_device_name.c_str(), "Sending configuration write response failed, error code=%d", ec);
+    }
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::ComputeDatabaseHash(void)
+{
+    // Core 5.1 Vol 3 Part G 7.3: AES-CMAC with a zero key over the handle, type and value of the service,
+    // include and characteristic declarations and extended properties, and over the handle and type
+    // of the other descriptors known by GATT, in the order of the handles. Unlike the Database Hash
+    // of the stack it covers the tables of the server only, not the GAP and GATT services.
+    const uint8_t key[BLECMAC::block_size] = {0};
+    BLECMAC cmac(key);
+
+    // the services in the order of their handles
+    uint16_t last_handle = 0;
+    for (size_t n = 0; n < m_services.size(); ++n)
+    {
+        const BLEService* service = nullptr;
+        for (const BLEService::ptr& candidate : m_services)
+        {
+            if (candidate->HasHandles() && candidate->m_handles[0] > last_handle
+                && (!service || candidate->m_handles[0] < service->m_handles[0]))
+                service = &*candidate;
+        }
+        if (!service)
+            break;
+        last_handle = service->m_handles[0];
+
+        const esp_gatts_attr_db_t* db = service->GetAttributes();
+        for (BLEService::size_type i = 0; i < service->GetCount(); ++i)
+        {
+            const esp_attr_desc_t& desc = db[i].att_desc;
+            if (desc.uuid_length != ESP_UUID_LEN_16)
+                continue;
+            uint16_t type = desc.uuid_p[0] | (desc.uuid_p[1] << 8);
+            uint16_t handle = service->m_handles[i];
+            uint8_t header[4] = {(uint8_t)handle, (uint8_t)(handle >> 8), desc.uuid_p[0], desc.uuid_p[1]};
+            switch (type)
+            {
+                case ESP_GATT_UUID_PRI_SERVICE:
+                case ESP_GATT_UUID_SEC_SERVICE:
+                case ESP_GATT_UUID_INCLUDE_SERVICE:
+                case ESP_GATT_UUID_CHAR_EXT_PROP:
+                    cmac.Update(header, sizeof(header));
+                    cmac.Update(desc.value, desc.length);
+                    break;
+                case ESP_GATT_UUID_CHAR_DECLARE:
+                    cmac.Update(header, sizeof(header));
+                    // the stack completes the declaration with the handle and the UUID of the value
+                    cmac.Update(desc.value, 1);
+                    if (i + 1 < service->GetCount())
+                    {
+                        uint16_t value_handle = service->m_handles[i + 1];
+                        uint8_t handle_bytes[2] = {(uint8_t)value_handle, (uint8_t)(value_handle >> 8)};
+                        cmac.Update(handle_bytes, sizeof(handle_bytes));
+                        cmac.Update(db[i + 1].att_desc.uuid_p, db[i + 1].att_desc.uuid_length);
+                    }
+                    break;
+                case ESP_GATT_UUID_CHAR_DESCRIPTION:
+                case ESP_GATT_UUID_CHAR_CLIENT_CONFIG:
+                case ESP_GATT_UUID_CHAR_SRVR_CONFIG:
+                case ESP_GATT_UUID_CHAR_PRESENT_FORMAT:
+                case ESP_GATT_UUID_CHAR_AGG_FORMAT:
+                    cmac.Update(header, sizeof(header));
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+
+    // the MAC is big endian, characteristic values are little endian
+    uint8_t mac[BLECMAC::block_size];
+    cmac.Finish(mac);
+    for (size_t i = 0; i < sizeof(m_database_hash); ++i)
+        m_database_hash[i] = mac[sizeof(mac) - 1 - i];
+    m_database_hash_valid = true;
+    LOGI(m_device_name.c_str(), "Database hash computed");
+    LOGDUMP(m_device_name.c_str(), m_database_hash, sizeof(m_database_hash), ESP_LOG_DEBUG);
+}
+// -------------------------------------------------------------------------------------------------------------------
+bool BLEServer::GetDatabaseHash(uint8_t hash[database_hash_size]) const
+{
+    BLELock lock(m_lock);
+    if (!m_database_hash_valid)
+        return false;
+    memcpy(hash, m_database_hash, sizeof(m_database_hash));
+    return true;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t BLEServer::SendServiceChanged(uint16_t conn_id)
+{
+    BLELock lock(m_lock);
+    if (conn_id >= BLE_MAX_CONNECTIONS || !m_connections[conn_id].connected)
+        return ESP_ERR_INVALID_STATE;
+
+    // the Generic Attribute service is the stack's: it indicates Service Changed if the client
+    // subscribed and, with robust caching, refuses the requests of the client until it is change-aware
+    esp_err_t ec = esp_ble_gatts_send_service_change_indication(m_gatts_if, m_connections[conn_id].bda);
+    if (ec)
+        LOGE(m_device_name.c_str(), "Sending service changed to conn_id=%d failed, error code=%d", conn_id, ec);
+    return ec;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::SetBondStore(BLEBondStore* store)
+{
+    BLELock lock(m_lock);
+    m_bond_store = store;
+    // the records keep the hash to tell whether the subscriptions still match the attribute tables
+    if (store && !m_database_hash_valid && !m_services.empty() && m_tables_created == m_services.size())
+        ComputeDatabaseHash();
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::GetBondRecord(const Connection& connection, BLEBondRecord& record) const
+{
+    memset(&record, 0, sizeof(record));
+    memcpy(record.bda, connection.bda, sizeof(esp_bd_addr_t));
+    record.notify_bits = connection.notify_bits;
+    record.indicate_bits = connection.indicate_bits;
+    memcpy(record.database_hash, m_database_hash, sizeof(record.database_hash));
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::RestoreBond(Connection& connection)
+{
+    // a record waiting to be saved is newer than the one in the store
+    BLEBondRecord record;
+    bool found = false;
+    for (uint8_t n = 0; n < m_bond_pending_count && !found; ++n)
+    {
+        if (memcmp(m_bond_pending[n].bda, connection.bda, sizeof(esp_bd_addr_t)) == 0)
+        {
+            record = m_bond_pending[n];
+            found = true;
+        }
+    }
+    if (!found && (!m_bond_store || !m_bond_store->Load(connection.bda, record)))
+        return;
+
+    connection.bonded = true;
+    uint32_t mask = m_configs.size() < 32 ? ((uint32_t)1 << m_configs.size()) - 1 : ~(uint32_t)0;
+    if (memcmp(record.database_hash, m_database_hash, sizeof(m_database_hash)) == 0)
+    {
+        connection.notify_bits = record.notify_bits & mask;
+        connection.indicate_bits = record.indicate_bits & mask;
+        LOGI(m_device_name.c_str(), "conn_id=%d bonded, subscriptions restored", connection.conn_id);
+        return;
+    }
+
+    // the bits belong to other attribute tables, the client has to discover and subscribe again
+    LOGI(m_device_name.c_str(), "conn_id=%d bonded, attribute tables changed", connection.conn_id);
+    MarkBondDirty(connection);
+    SendServiceChanged(connection.conn_id);
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::OnAuthComplete(esp_ble_gap_cb_param_t* param)
+{
+    const esp_ble_auth_cmpl_t& auth = param->ble_security.auth_cmpl;
+    Connection* connection = FindConnection(auth.bd_addr);
+    if (!auth.success || !connection || connection->bonded)
+        return;
+
+    // a new bond, the subscriptions written before pairing are kept
+    connection->bonded = true;
+    MarkBondDirty(*connection);
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::OnRemoveBond(esp_ble_gap_cb_param_t* param)
+{
+    if (param->remove_bond_dev_cmpl.status != ESP_BT_STATUS_SUCCESS)
+        return;
+    const uint8_t* bda = param->remove_bond_dev_cmpl.bd_addr;
+    Connection* connection = FindConnection(bda);
+    if (connection)
+        connection->bonded = connection->bond_dirty = false;
+    for (uint8_t n = 0; n < m_bond_pending_count; ++n)
+    {
+        if (memcmp(m_bond_pending[n].bda, bda, sizeof(esp_bd_addr_t)) == 0)
+        {
+            m_bond_pending[n] = m_bond_pending[--m_bond_pending_count];
+            break;
+        }
+    }
+    if (!m_bond_store)
+        return;
+    esp_err_t ec = m_bond_store->Erase(bda);
+    if (!ec)
+        ec = m_bond_store->Commit();
+    if (ec)
+        LOGE(m_device_name.c_str(), "Erasing bond record failed, error code=%d", ec);
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::MarkBondDirty(Connection& connection)
+{
+    if (!connection.bonded || !m_bond_store)
+        return;
+    connection.bond_dirty = true;
+    ScheduleBondSave(BLE_BOND_SAVE_DELAY_MS);
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::ScheduleBondSave(uint32_t delay_ms)
+{
+    int64_t now = esp_timer_get_time();
+    int64_t due = now + (int64_t)delay_ms * 1000;
+    if (m_bond_due >= 0 && m_bond_due <= due)
+        return;
+
+    if (!m_bond_timer)
+    {
+        esp_timer_create_args_t args = {};
+        args.callback = OnBondTimer;
+        args.arg = this;
+        args.dispatch_method = ESP_TIMER_TASK;
+        args.name = "ble_bond";
+        esp_err_t ec = esp_timer_create(&args, &m_bond_timer);
+        if (ec)
+        {
+            LOGE(m_device_name.c_str(), "Creating bond timer failed, error code=%d", ec);
+            m_bond_timer = nullptr;
+            return;
+        }
+    }
+    else if (m_bond_due >= 0)
+        esp_timer_stop(m_bond_timer);
+
+    m_bond_due = due;
+    esp_timer_start_once(m_bond_timer, (uint64_t)(due - now));
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::OnBondTimer(void* arg)
+{
+    BLEServer* server = (BLEServer*)arg;
+    ++server->m_bond_callbacks;
+    {
+        BLELock lock(server->m_lock);
+        if (!server->m_bond_closed)
+            server->SaveBonds();
+    }
+    --server->m_bond_callbacks;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::SaveBonds(void)
+{
+    m_bond_due = -1;
+    if (!m_bond_store)
+        return;
+
+    // the changed records of connected and disconnected clients, one commit for all
+    esp_err_t ec = ESP_OK;
+    size_t saved = 0;
+    for (Connection& connection : m_connections)
+    {
+        if (!connection.connected || !connection.bond_dirty)
+            continue;
+        BLEBondRecord record;
+        GetBondRecord(connection, record);
+        if (!ec)
+            ec = m_bond_store->Save(record);
+        connection.bond_dirty = false;
+        ++saved;
+    }
+    for (uint8_t n = 0; n < m_bond_pending_count; ++n)
+    {
+        if (!ec)
+            ec = m_bond_store->Save(m_bond_pending[n]);
+        ++saved;
+    }
+    m_bond_pending_count = 0;
+    if (!ec && saved)
+        ec = m_bond_store->Commit();
+    if (ec)
+    {
+        LOGE(m_device_name.c_str(), "Saving bond records failed, error code=%d", ec);
+    }
+    else
+    {
+        LOGD(m_device_name.c_str(), "%d bond records saved", (int)saved);
+    }
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::BuildHandlerTable(void)
+{
+    uint16_t min_handle = 0xFFFF;
+    uint16_t max_handle = 0;
+    for (EventHandler& entry : m_event_handlers)
+    {
+        // resolved once, so handlers get it without a lookup
+        if (entry.reply_service_id != BLEService::npos && m_services[entry.reply_service_id]->HasHandles())
+            entry.reply_handle = m_services[entry.reply_service_id]->GetHandle(entry.reply_index);
+        if (!entry.handler || !m_services[entry.service_id]->HasHandles())
+            continue;
+        uint16_t hdl = m_services[entry.service_id]->GetHandle(entry.attribute_index);
+        min_handle = std::min(min_handle, hdl);
+        max_handle = std::max(max_handle, hdl);
+    }
+
+    m_handlers.clear();
+    m_handler_base = 0;
+
+# ifdef BLE_SERVER_INSTRUMENTATION
+    // counters are indexed from the lowest handle of all services
+    uint16_t first_handle = 0xFFFF;
+    for (const BLEService::ptr& service : m_services)
+    {
+        if (service->HasHandles())
+            first_handle = std::min(first_handle, service->GetHandle(0));
+    }
+    m_instrumentation.handle_base = first_handle;
+# endif
+
+# ifdef BLE_SERVER_STATIC_STORAGE
+    if (min_handle <= max_handle && max_handle - min_handle >= BLE_MAX_HANDLE_RANGE)
+    {
+        LOGE(
+            m_device_name.c_str(), "Handles %d..%d with event handlers exceed BLE_MAX_HANDLE_RANGE (%d), no handlers called",
+            min_handle, max_handle, BLE_MAX_HANDLE_RANGE
+        );
+        max_handle = 0;
+    }
+# endif
+
+    if (min_handle <= max_handle)
+    {
+        m_handler_base = min_handle;
+        m_handlers.assign(max_handle - min_handle + 1, HandlerEntry{0, 0});
+
+        for (size_t i = 0; i < m_event_handlers.size(); ++i)
+        {
+            const EventHandler& entry = m_event_handlers[i];
+            if (!entry.handler || !m_services[entry.service_id]->HasHandles())
+                continue;
+            uint16_t hdl = m_services[entry.service_id]->GetHandle(entry.attribute_index);
+            LOGI(
+                m_device_name.c_str(), "Event handler for service %d / attribute %d bound to handle %d",
+                entry.service_id, entry.attribute_index, hdl
+            );
+            m_handlers[hdl - m_handler_base] = {(uint8_t)(i + 1), entry.event_mask};
+        }
+    }
+
+    LOGI(m_device_name.c_str(), "Dispatch table built for handles %d..%d", m_handler_base, (int)(m_handler_base + m_handlers.size()));
+
+    for (ReadProvider& provider : m_read_providers)
+    {
+        if (m_services[provider.service_id]->HasHandles())
+            provider.handle = m_services[provider.service_id]->GetHandle(provider.attribute_index);
+    }
+    for (LimitedValue& entry : m_limited_values)
+    {
+        if (m_services[entry.service_id]->HasHandles())
+            entry.handle = m_services[entry.service_id]->GetHandle(entry.attribute_index);
+    }
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::OnRegisterAttributes(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param)
+{
+    esp_err_t ec = esp_ble_gap_set_device_name(m_device_name.c_str());
+    if (ec)
+        LOGE(m_device_name.c_str(), "Setting device name failed, error code=%d", ec);
+    
+    if (m_services.empty())
+    {
+        LOGE(m_device_name.c_str(), "No services registered!");
+        return;
+    }
+
+    ConfigAdvertisingData();
+
+    if (m_services.size() > 1)
+    {
+        uint8_t raw_adv_scan_data[ADV_DATA_MAX_LEN];
+        uint8_t adv_data_size = CreateScanAdvertisingData(m_services, raw_adv_scan_data);
+        assert(adv_data_size);
+
+        LOGD(m_device_name.c_str(), "Advertisment (scan response) with size %u created:", adv_data_size);
+        LOGDUMP(m_device_name.c_str(), raw_adv_scan_data, adv_data_size, ESP_LOG_DEBUG);
+
+        ec = esp_ble_gap_config_scan_rsp_data_raw(raw_adv_scan_data, adv_data_size);
+        if (ec)
+            LOGE(m_device_name.c_str(), "Failed to set scan response data config, error code=%d", ec);
+
+        m_adv_config_done |= SCAN_RSP_CONFIG_FLAG;
+    }
+
+    for (auto service:m_services)
+    {
+        service->RegisterAttributes(gatts_if);
+    }
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::ConfigAdvertisingData(void)
+{
+    // broadcast data as AD structure: len, type, company identifier or service UUID, data
+    uint8_t broadcast[broadcast_max_data + 4];
+    uint8_t broadcast_size = 0;
+    if (m_broadcast_type)
+    {
+        broadcast[0] = m_broadcast_len + 3;
+        broadcast[1] = m_broadcast_type;
+        broadcast[2] = (uint8_t)m_broadcast_id & 0xFF; // LO-Byte
+        broadcast[3] = (uint8_t)(m_broadcast_id >> 8) & 0xFF; // HI-Byte
+        memcpy(broadcast + 4, m_broadcast_data, m_broadcast_len);
+        broadcast_size = m_broadcast_len + 4;
+    }
+    m_broadcast_changed = false;
+
+    // the stack copies the advertising data, so it can live on the stack
+    uint8_t raw_adv_data[ADV_DATA_MAX_LEN];
+    uint8_t adv_data_size = CreatePassiveAdvertisingData(
+        m_services[0]->GetUUID(), m_device_name.c_str(), broadcast, broadcast_size, raw_adv_data
+    );
+    assert(adv_data_size);
+
+    LOGD(m_device_name.c_str(), "Advertisment (passive) with size %u created:", adv_data_size);
+    LOGDUMP(m_device_name.c_str(), raw_adv_data, adv_data_size, ESP_LOG_DEBUG);
+
+    esp_err_t ec = esp_ble_gap_config_adv_data_raw(raw_adv_data, adv_data_size);
+    if (ec)
+    {
+        LOGE(m_device_name.c_str(), "Failed to set advertisment data config, error code=%d", ec);
+        return;
+    }
+    m_adv_config_done |= ADV_CONFIG_FLAG;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::OnBroadcastTimer(void* arg)
+{
+    BLEServer* server = (BLEServer*)arg;
+    BLELock lock(server->m_lock);
+    server->UpdateBroadcast();
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::UpdateBroadcast(void)
+{
+    // before the attributes are registered the data goes with the first advertising data,
+    // while an update is pending the next one waits for the next period
+    if (!m_broadcast_changed || m_gatts_if == ESP_GATT_IF_NONE || m_services.empty() || (m_adv_config_done & ADV_CONFIG_FLAG))
+        return;
+    ConfigAdvertisingData();
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t BLEServer::StartBroadcast(uint16_t id, uint8_t type, uint32_t interval_ms)
+{
+    if ((type != broadcast_manufacturer_data && type != broadcast_service_data) || !interval_ms)
+        return ESP_ERR_INVALID_ARG;
+
+    BLELock lock(m_lock);
+    if (!m_broadcast_timer)
+    {
+        esp_timer_create_args_t args = {};
+        args.callback = OnBroadcastTimer;
+        args.arg = this;
+        args.dispatch_method = ESP_TIMER_TASK;
+        args.name = "ble_broadcast";
+        args.skip_unhandled_events = true;
+        esp_err_t ec = esp_timer_create(&args, &m_broadcast_timer);
+        if (ec)
+        {
+            LOGE(m_device_name.c_str(), "Creating broadcast timer failed, error code=%d", ec);
+            m_broadcast_timer = nullptr;
+            return ec;
+        }
+    }
+    else if (m_broadcast_type)
+        esp_timer_stop(m_broadcast_timer);
+
+    m_broadcast_type = type;
+    m_broadcast_id = id;
+    m_broadcast_changed = true;
+    UpdateBroadcast();
+    return esp_timer_start_periodic(m_broadcast_timer, (uint64_t)interval_ms * 1000);
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::StopBroadcast(void)
+{
+    BLELock lock(m_lock);
+    if (!m_broadcast_type)
+        return;
+    esp_timer_stop(m_broadcast_timer);
+    m_broadcast_type = 0;
+    // if an update is pending, the data is removed as soon as it's done
+    m_broadcast_changed = true;
+    UpdateBroadcast();
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t BLEServer::SetBroadcastData(const void* data, uint8_t len)
+{
+    if (len > broadcast_max_data || (len && !data))
+        return ESP_ERR_INVALID_SIZE;
+
+    BLELock lock(m_lock);
+    if (len != m_broadcast_len || (len && memcmp(m_broadcast_data, data, len)))
+    {
+        if (len)
+            memcpy(m_broadcast_data, data, len);
+        m_broadcast_len = len;
+        m_broadcast_changed = true;
+    }
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::OnConnect(esp_ble_gatts_cb_param_t* param)
+{
+    LOGI(m_device_name.c_str(), "New device connected, conn_id=%d:", param->connect.conn_id);
+    LOGDUMP(m_device_name.c_str(), param->connect.remote_bda, sizeof(param->connect.remote_bda), ESP_LOG_DEBUG);
+
+    // the controller stops advertising as soon as a connection is established
+    m_advertising = false;
+
+    uint16_t conn_id = param->connect.conn_id;
+    if (conn_id >= BLE_MAX_CONNECTIONS)
+    {
+        LOGE(m_device_name.c_str(), "Connection id %d exceeds BLE_MAX_CONNECTIONS, cannot send notifications", conn_id);
+        return;
+    }
+    ReleasePrepareBuffer(conn_id);
+    m_connections[conn_id].prepare.stack_prepared = false;
+
+    Connection& channel = m_connections[conn_id];
+    static_cast<BLEConnection&>(channel) = BLEConnection();
+    channel.connected = true;
+    channel.conn_id = conn_id;
+    memcpy(channel.bda, param->connect.remote_bda, sizeof(esp_bd_addr_t));
+    channel.interval = param->connect.conn_params.interval;
+    channel.latency = param->connect.conn_params.latency;
+    channel.timeout = param->connect.conn_params.timeout;
+    channel.queue.Clear();
+    channel.congested = false;
+    channel.stale = 0;
+    channel.reliable = ReliableState();
+    channel.adaptive = AdaptiveState();
+    channel.stream_restore = nullptr;
+# ifdef BLE_SERVER_INSTRUMENTATION
+    channel.write_time = -1;
+# endif
+    channel.bond_dirty = false;
+    channel.limited_pending = false;
+    for (LimitedValue& entry : m_limited_values)
+        entry.pending &= ~(1 << conn_id);
+    ResetNotifyStats(conn_id);
+
+    // subscriptions of a bonded client, before anything is notified
+    RestoreBond(channel);
+
+    // connection parameters the client is asked for, adaptive connections start busy (discovery)
+    if (m_adaptive)
+    {
+        int64_t now = esp_timer_get_time();
+        channel.adaptive.enabled = true;
+        channel.adaptive.active = true;
+        channel.adaptive.last_busy = now;
+        channel.adaptive.last_request = now;
+        ApplyProfile(channel, m_adaptive->active);
+        ScheduleAdaptiveTimer(AdaptProfile(channel, now));
+    }
+    else
+        ApplyProfile(channel, m_default_profile);
+
+    // keep advertising while there are free connection slots
+    StartAdvertising();
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::OnDisconnect(esp_ble_gatts_cb_param_t* param)
+{
+    uint16_t conn_id = param->disconnect.conn_id;
+    LOGI(m_device_name.c_str(), "Device disconnected, conn_id=%d, reason=0x%x", conn_id, param->disconnect.reason);
+    if (conn_id < BLE_MAX_CONNECTIONS)
+    {
+        Connection& channel = m_connections[conn_id];
+        if (channel.queue.GetCount())
+            LOGW(m_device_name.c_str(), "%d queued notifications for conn_id=%d dropped", (int)channel.queue.GetCount(), conn_id);
+        channel.queue.Clear();
+        if (channel.bond_dirty)
+        {
+            // saved at once, the pending record answers a reconnect until then
+            uint8_t n = 0;
+            while (n < m_bond_pending_count && memcmp(m_bond_pending[n].bda, channel.bda, sizeof(esp_bd_addr_t)))
+                ++n;
+            if (n < BLE_MAX_CONNECTIONS)
+            {
+                GetBondRecord(channel, m_bond_pending[n]);
+                if (n == m_bond_pending_count)
+                    ++m_bond_pending_count;
+            }
+            else
+            {
+                LOGE(m_device_name.c_str(), "No room for the bond record of conn_id=%d, changes lost", conn_id);
+            }
+            channel.bond_dirty = false;
+            ScheduleBondSave(0);
+        }
+        channel.connected = false;
+        channel.notify_bits = channel.indicate_bits = 0;
+        if (channel.stream.IsActive())
+            FinishStream(conn_id, ESP_ERR_INVALID_STATE);
+        while (channel.reliable.count)
+            FinishReliable(conn_id, ESP_ERR_INVALID_STATE);
+        channel.reliable = ReliableState();
+        ReleasePrepareBuffer(conn_id);
+
+        // the controller doesn't answer data length requests of a dropped link,
+        // the next answer must not be credited to the connection in the slot
+        uint8_t kept = 0;
+        for (uint8_t n = 0; n < m_data_length_count; ++n)
+        {
+            if (m_data_length_pending[n] != conn_id)
+                m_data_length_pending[kept++] = m_data_length_pending[n];
+        }
+        m_data_length_count = kept;
+    }
+    StartAdvertising();
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::OnCongest(esp_ble_gatts_cb_param_t* param)
+{
+    uint16_t conn_id = param->congest.conn_id;
+    if (conn_id >= BLE_MAX_CONNECTIONS)
+        return;
+
+    Connection& channel = m_connections[conn_id];
+    if (param->congest.congested)
+    {
+        if (!channel.congested)
+        {
+            ++channel.stats.congestions;
+            INSTRUMENT(congestions++);
+            NoteTraffic(channel, true);
+        }
+        channel.congested = true;
+    }
+    else
+    {
+        channel.congested = false;
+        FlushNotifications(conn_id);
+    }
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::OnNotifyConfirm(esp_ble_gatts_cb_param_t* param)
+{
+    uint16_t conn_id = param->conf.conn_id;
+    if (conn_id >= BLE_MAX_CONNECTIONS)
+        return;
+
+    Connection& channel = m_connections[conn_id];
+    if (channel.stale)
+    {
+        // confirmation of a packet sent behind a rejected one, it is in the queue again
+        --channel.stale;
+        return;
+    }
+
+    if (channel.stream.in_flight)
+    {
+        OnStreamConfirm(conn_id, param);
+        return;
+    }
+
+    const BLENotifyQueue::Record* record = channel.queue.GetOldestSent();
+    if (!record || record->handle != param->conf.handle)
+        return; // not sent by Notify()
+    bool reliable = record->tag == reliable_tag;
+
+    switch (param->conf.status)
+    {
+        case ESP_GATT_CONGESTED:
+            // accepted, but the stack won't take more until it reports the end of the congestion
+            if (!channel.congested)
+            {
+                ++channel.stats.congestions;
+                INSTRUMENT(congestions++);
+                NoteTraffic(channel, true);
+            }
+            channel.congested = true;
+            // fall through
+        case ESP_GATT_OK:
+            ++channel.stats.sent;
+            channel.queue.PopSent();
+            if (reliable)
+                OnReliableConfirm(conn_id, true);
+            break;
+        default:
+            if (channel.congested)
+            {
+                // rejected because of the congestion: send it and everything behind it again,
+                // the confirmations of the packets behind it are still to come
+                channel.stale = (uint8_t)(channel.queue.GetSentCount() - 1);
+                channel.stats.retransmitted += channel.queue.GetSentCount();
+                INSTRUMENT(retransmitted += (uint32_t)channel.queue.GetSentCount());
+                channel.queue.Rewind();
+            }
+            else
+            {
+                LOGE(
+                    m_device_name.c_str(), "Notification for handle %d to conn_id=%d failed, status=0x%x",
+                    param->conf.handle, conn_id, param->conf.status
+                );
+                ++channel.stats.failed;
+                INSTRUMENT(failed_sends++);
+                channel.queue.PopSent();
+                if (reliable)
+                    OnReliableConfirm(conn_id, false);
+            }
+            break;
+    }
+
+    // room in the queue for the limited values it couldn't take
+    if (channel.limited_pending)
+        RequeueLimitedValues(conn_id);
+    FlushNotifications(conn_id);
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::FlushNotifications(uint16_t conn_id)
+{
+    Connection& channel = m_connections[conn_id];
+
+    // Packets are sent in batches: the confirmations only tell that the stack took a packet,
+    // a congestion is reported with the confirmation of the packet causing it. Sending more
+    // before the whole batch is confirmed would run into the congestion.
+    if (channel.congested || channel.queue.GetSentCount() || channel.stream.in_flight)
+        return;
+
+    // queued notifications go first, the stream continues when they are done
+    if (!channel.queue.GetUnsentCount())
+    {
+        if (channel.stream.IsActive())
+            SendStreamFragments(conn_id);
+        return;
+    }
+
+    while (!channel.congested && channel.queue.GetSentCount() < BLE_NOTIFY_WINDOW)
+    {
+        const BLENotifyQueue::Record* record = channel.queue.GetNextUnsent();
+        if (!record)
+            break;
+
+        esp_err_t ec = esp_ble_gatts_send_indicate(
+            m_gatts_if, conn_id, record->handle, record->len, (uint8_t*)record->GetValue(), record->need_confirm
+        );
+        if (ec)
+        {
+            LOGE(m_device_name.c_str(), "Sending notification for handle %d failed, error code=%d", record->handle, ec);
+            TRACE(Add(trace_send_failed, record->need_confirm, conn_id, record->handle, (uint16_t)ec));
+            if (channel.queue.GetSentCount())
+                break; // try again with the next confirmation
+            ++channel.stats.failed;
+            INSTRUMENT(failed_sends++);
+            bool reliable = record->tag == reliable_tag;
+            channel.queue.MarkSent();
+            channel.queue.PopSent();
+            if (reliable)
+            {
+                // no confirmation comes, the message may be queued again meanwhile
+                OnReliableConfirm(conn_id, false);
+                FlushNotifications(conn_id);
+                return;
+            }
+            continue;
+        }
+        channel.queue.MarkSent();
+
+        // the confirmation of an indication comes with the response of the client, the ones
+        // of notifications sent behind it would come first
+        if (record->need_confirm)
+            break;
+    }
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t BLEServer::Stream(
+    uint16_t conn_id, uint16_t handle, const BLEStreamBuffer* parts, uint8_t count,
+    uint8_t flags, stream_done_func on_done
+)
+{
+    BLELock lock(m_lock);
+    if (conn_id >= BLE_MAX_CONNECTIONS || !m_connections[conn_id].connected || m_connections[conn_id].stream.IsActive())
+        return ESP_ERR_INVALID_STATE;
+    if (!parts || !count)
+        return ESP_ERR_INVALID_ARG;
+
+    uint16_t mtu = m_connections[conn_id].mtu;
+    uint16_t header = (flags & stream_flag_header) ? stream_header_size : 0;
+    if (mtu - 3 <= header)
+        return ESP_ERR_INVALID_SIZE;
+    uint16_t payload = (uint16_t)std::min(mtu - 3, (int)sizeof(m_fragment)) - header;
+
+    size_t total = 0;
+    for (uint8_t i = 0; i < count; ++i)
+    {
+        if (parts[i].len && !parts[i].data)
+            return ESP_ERR_INVALID_ARG;
+        total += parts[i].len;
+    }
+    // without a header an empty stream would be nothing at all
+    if (!total && !header)
+        return ESP_ERR_INVALID_SIZE;
+
+    Connection& channel = m_connections[conn_id];
+    StreamState& stream = channel.stream;
+    stream = StreamState();
+    stream.parts = parts;
+    stream.part_count = count;
+    stream.handle = handle;
+    stream.flags = flags;
+    stream.payload = payload;
+    stream.total = total;
+    stream.fragments = total ? (uint32_t)((total + payload - 1) / payload) : 1;
+    stream.on_done = on_done;
+
+    LOGI(
+        m_device_name.c_str(), "Streaming %d bytes in %d fragments to conn_id=%d, handle=%d",
+        (int)total, (int)stream.fragments, conn_id, handle
+    );
+    if (m_stream_profile && channel.profile != m_stream_profile)
+    {
+        channel.stream_restore = channel.profile;
+        ApplyProfile(channel, m_stream_profile);
+    }
+    else
+        NoteTraffic(channel, true);
+    FlushNotifications(conn_id);
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t BLEServer::Stream(
+    uint16_t conn_id, uint16_t handle, const uint8_t* data, size_t len,
+    uint8_t flags, stream_done_func on_done
+)
+{
+    BLELock lock(m_lock);
+    if (conn_id >= BLE_MAX_CONNECTIONS || !m_connections[conn_id].connected || m_connections[conn_id].stream.IsActive())
+        return ESP_ERR_INVALID_STATE;
+
+    // the single buffer is moved into the state, so the caller only has to keep the data
+    BLEStreamBuffer single = {data, len};
+    esp_err_t ec = Stream(conn_id, handle, &single, 1, flags, on_done);
+    StreamState& stream = m_connections[conn_id].stream;
+    if (ec == ESP_OK && stream.parts == &single)
+    {
+        stream.single = single;
+        stream.parts = &stream.single;
+    }
+    return ec;
+}
+// -------------------------------------------------------------------------------------------------------------------
+bool BLEServer::IsStreaming(uint16_t conn_id) const
+{
+    BLELock lock(m_lock);
+    return conn_id < BLE_MAX_CONNECTIONS && m_connections[conn_id].stream.IsActive();
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t BLEServer::SendReliable(uint16_t conn_id, uint16_t handle, const uint8_t* value, uint16_t len, uint32_t id)
+{
+    BLELock lock(m_lock);
+    if (conn_id >= BLE_MAX_CONNECTIONS || !m_connections[conn_id].connected)
+        return ESP_ERR_INVALID_STATE;
+    if (len && !value)
+        return ESP_ERR_INVALID_ARG;
+
+    bool notify = false;
+    bool indicate = false;
+    GetSubscription(conn_id, handle, notify, indicate);
+    bool ack = notify && m_reliable_ack;
+    if (!ack && !indicate)
+        return ESP_ERR_INVALID_STATE;
+
+    Connection& channel = m_connections[conn_id];
+    if (len > BLE_RELIABLE_VALUE_SIZE || len + (ack ? 1 : 0) > channel.mtu - 3)
+        return ESP_ERR_INVALID_SIZE;
+
+    ReliableState& reliable = channel.reliable;
+    if (reliable.count == BLE_RELIABLE_QUEUE_LENGTH)
+    {
+        LOGW(m_device_name.c_str(), "Reliable queue of conn_id=%d full, message for handle %d rejected", conn_id, handle);
+        return ESP_ERR_NO_MEM;
+    }
+    ReliableMessage& message = reliable.Get(reliable.count++);
+    message.id = id;
+    message.deadline = 0;
+    message.handle = handle;
+    message.len = len;
+    message.ack = ack;
+    message.queued = false;
+    message.seq = 0;
+    message.retries = 0;
+    if (len)
+        memcpy(message.value, value, len);
+
+    FlushReliable(conn_id);
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::SetReliableHandler(reliable_done_func on_done)
+{
+    BLELock lock(m_lock);
+    m_reliable_done = on_done;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::SetReliableAck(uint8_t service_id, BLEService::size_type attribute_index)
+{
+    m_reliable_ack = true;
+    SetEventHandler(
+        service_id, attribute_index,
+        [this](const BLEEventContext& context)
+        {
+            const auto& write = context.param->write;
+            if (context.event == ESP_GATTS_WRITE_EVT && !write.is_prep && write.len >= 1)
+                AckReliable(context.conn_id, write.value[0]);
+        },
+        evt_mask_write
+    );
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::AckReliable(uint16_t conn_id, uint8_t seq)
+{
+    BLELock lock(m_lock);
+    if (conn_id >= BLE_MAX_CONNECTIONS || !m_connections[conn_id].connected)
+        return;
+
+    // acknowledges every message up to seq, ones outside the window are old or duplicates
+    ReliableState& reliable = m_connections[conn_id].reliable;
+    if (!reliable.sent || !reliable.Get(0).ack)
+        return;
+    uint8_t acked = (uint8_t)(seq - reliable.Get(0).seq) + 1;
+    if (acked > reliable.sent)
+        return;
+    while (acked--)
+        FinishReliable(conn_id, ESP_OK);
+    FlushReliable(conn_id);
+}
+// -------------------------------------------------------------------------------------------------------------------
+uint8_t BLEServer::GetReliableCount(uint16_t conn_id) const
+{
+    BLELock lock(m_lock);
+    return conn_id < BLE_MAX_CONNECTIONS ? m_connections[conn_id].reliable.count : 0;
+}
+// -------------------------------------------------------------------------------------------------------------------
+bool BLEServer::GetSubscription(uint16_t conn_id, uint16_t handle, bool& notify, bool& indicate) const
+{
+    size_t index = 0;
+    while (index < m_configs.size() && m_configs[index].value_handle != handle)
+        ++index;
+    if (index == m_configs.size())
+        return false;
+
+    uint32_t bit = (uint32_t)1 << index;
+    notify = (m_connections[conn_id].notify_bits & bit) != 0;
+    indicate = (m_connections[conn_id].indicate_bits & bit) != 0;
+    return true;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::FlushReliable(uint16_t conn_id)
+{
+    ReliableState& reliable = m_connections[conn_id].reliable;
+    while (reliable.sent < reliable.count)
+    {
+        // an indication goes alone (the stack takes one at a time), notifications up to the window
+        ReliableMessage& message = reliable.Get(reliable.sent);
+        if (reliable.sent && (!message.ack || !reliable.Get(0).ack || reliable.sent >= BLE_RELIABLE_WINDOW))
+            break;
+        if (message.ack)
+            message.seq = reliable.next_seq++;
+        ++reliable.sent;
+        SendReliableMessage(conn_id, message);
+    }
+    ScheduleReliableTimer();
+}
+// -------------------------------------------------------------------------------------------------------------------
+bool BLEServer::SendReliableMessage(uint16_t conn_id, ReliableMessage& message)
+{
+    // sent again with the timeout if it fails
+    message.deadline = esp_timer_get_time() + (int64_t)BLE_RELIABLE_TIMEOUT_MS * 1000;
+    if (message.ack)
+    {
+        uint8_t value[BLE_RELIABLE_VALUE_SIZE + 1];
+        value[0] = message.seq;
+        memcpy(value + 1, message.value, message.len);
+        return Notify(conn_id, message.handle, value, message.len + 1) == ESP_OK;
+    }
+
+    // queued with a tag, so its confirmation is told apart from the ones of notifications
+    esp_err_t ec = QueueNotification(conn_id, message.handle, message.value, message.len, true, reliable_tag);
+    if (ec)
+    {
+        LOGE(m_device_name.c_str(), "Queueing indication for handle %d failed, error code=%d", message.handle, ec);
+    }
+    message.queued = ec == ESP_OK;
+    if (message.queued)
+        FlushNotifications(conn_id);
+    return message.queued;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::OnReliableConfirm(uint16_t conn_id, bool delivered)
+{
+    Connection& channel = m_connections[conn_id];
+    ReliableState& reliable = channel.reliable;
+    if (reliable.late)
+    {
+        // the indications of messages that timed out were queued before the current one
+        --reliable.late;
+        return;
+    }
+    if (!reliable.sent)
+        return;
+    ReliableMessage& message = reliable.Get(0);
+    if (message.ack || !message.queued)
+        return;
+
+    message.queued = false;
+    if (delivered)
+        FinishReliable(conn_id, ESP_OK);
+    else if (message.retries < BLE_RELIABLE_RETRIES)
+    {
+        ++message.retries;
+        ++channel.stats.reliable_retried;
+        SendReliableMessage(conn_id, message);
+    }
+    else
+        FinishReliable(conn_id, ESP_FAIL);
+    FlushReliable(conn_id);
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::FinishReliable(uint16_t conn_id, esp_err_t result)
+{
+    Connection& channel = m_connections[conn_id];
+    ReliableState& reliable = channel.reliable;
+    const ReliableMessage& message = reliable.Get(0);
+    uint16_t handle = message.handle;
+    uint32_t id = message.id;
+    reliable.head = (uint8_t)((reliable.head + 1) % BLE_RELIABLE_QUEUE_LENGTH);
+    --reliable.count;
+    if (reliable.sent)
+        --reliable.sent;
+
+    if (result == ESP_OK)
+        ++channel.stats.reliable_delivered;
+    else
+    {
+        ++channel.stats.reliable_failed;
+        LOGW(m_device_name.c_str(), "Reliable message %u for handle %d to conn_id=%d failed, result=%d", (unsigned)id, handle, conn_id, result);
+    }
+    if (m_reliable_done)
+        m_reliable_done(conn_id, handle, id, result);
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::ScheduleReliableTimer(void)
+{
+    // messages are sent in order, the oldest one of each connection times out first
+    int64_t due = -1;
+    for (Connection& channel : m_connections)
+    {
+        if (channel.connected && channel.reliable.sent && (due < 0 || channel.reliable.Get(0).deadline < due))
+            due = channel.reliable.Get(0).deadline;
+    }
+    if (due < 0 || (m_reliable_due >= 0 && m_reliable_due <= due))
+        return;
+
+    if (!m_reliable_timer)
+    {
+        esp_timer_create_args_t args = {};
+        args.callback = OnReliableTimer;
+        args.arg = this;
+        args.dispatch_method = ESP_TIMER_TASK;
+        args.name = "ble_reliable";
+        esp_err_t ec = esp_timer_create(&args, &m_reliable_timer);
+        if (ec)
+        {
+            LOGE(m_device_name.c_str(), "Creating reliable timer failed, error code=%d", ec);
+            m_reliable_timer = nullptr;
+            return;
+        }
+    }
+    else if (m_reliable_due >= 0)
+        esp_timer_stop(m_reliable_timer);
+
+    int64_t now = esp_timer_get_time();
+    m_reliable_due = std::max(due, now);
+    esp_timer_start_once(m_reliable_timer, (uint64_t)(m_reliable_due - now));
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::OnReliableTimer(void* arg)
+{
+    BLEServer* server = (BLEServer*)arg;
+    BLELock lock(server->m_lock);
+    server->CheckReliableTimeouts();
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::CheckReliableTimeouts(void)
+{
+    m_reliable_due = -1;
+    int64_t now = esp_timer_get_time();
+    for (uint16_t conn_id = 0; conn_id < BLE_MAX_CONNECTIONS; ++conn_id)
+    {
+        Connection& channel = m_connections[conn_id];
+        ReliableState& reliable = channel.reliable;
+        if (!channel.connected || !reliable.sent || reliable.Get(0).deadline > now)
+            continue;
+
+        ReliableMessage& message = reliable.Get(0);
+        if (!message.ack && message.queued)
+        {
+            // the stack keeps the indication until the client confirms it, the queue goes on
+            ++reliable.late;
+            FinishReliable(conn_id, ESP_ERR_TIMEOUT);
+        }
+        else if (message.retries < BLE_RELIABLE_RETRIES)
+        {
+            // the unacknowledged ones are sent again from the oldest on
+            for (uint8_t i = 0; i < reliable.sent; ++i)
+            {
+                ReliableMessage& resend = reliable.Get(i);
+                ++resend.retries;
+                ++channel.stats.reliable_retried;
+                SendReliableMessage(conn_id, resend);
+            }
+        }
+        else
+            FinishReliable(conn_id, ESP_ERR_TIMEOUT);
+        FlushReliable(conn_id);
+    }
+    ScheduleReliableTimer();
+}
+// -------------------------------------------------------------------------------------------------------------------
+const uint8_t* BLEServer::GetStreamFragment(StreamState& stream, uint32_t index, uint16_t& len)
+{
+    size_t offset = (size_t)index * stream.payload;
+    len = (uint16_t)std::min((size_t)stream.payload, stream.total - offset);
+
+    // fragments are read in order, except after a rejection
+    if (offset < stream.cursor_offset)
+    {
+        stream.cursor_part = 0;
+        stream.cursor_offset = 0;
+    }
+    while (stream.cursor_part < stream.part_count && offset >= stream.cursor_offset + stream.parts[stream.cursor_part].len)
+    {
+        stream.cursor_offset += stream.parts[stream.cursor_part].len;
+        ++stream.cursor_part;
+    }
+
+    size_t part_offset = offset - stream.cursor_offset;
+    bool header = stream.flags & stream_flag_header;
+    if (!header && stream.cursor_part < stream.part_count && part_offset + len <= stream.parts[stream.cursor_part].len)
+    {
+        // within a single buffer, the stack copies it anyway
+        return stream.parts[stream.cursor_part].data + part_offset;
+    }
+
+    uint8_t* dest = m_fragment;
+    if (header)
+    {
+        *dest++ = (index == 0 ? stream_frame_start : 0) | (index + 1 == stream.fragments ? stream_frame_end : 0);
+        *dest++ = (uint8_t)index;
+    }
+    uint16_t remaining = len;
+    for (uint8_t part = stream.cursor_part; remaining && part < stream.part_count; ++part)
+    {
+        uint16_t n = (uint16_t)std::min((size_t)remaining, stream.parts[part].len - part_offset);
+        memcpy(dest, stream.parts[part].data + part_offset, n);
+        dest += n;
+        remaining -= n;
+        part_offset = 0;
+    }
+    len = (uint16_t)(dest - m_fragment);
+    return m_fragment;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::SendStreamFragments(uint16_t conn_id)
+{
+    Connection& channel = m_connections[conn_id];
+    StreamState& stream = channel.stream;
+    while (stream.in_flight < BLE_NOTIFY_WINDOW && stream.next < stream.fragments)
+    {
+        uint16_t len = 0;
+        const uint8_t* fragment = GetStreamFragment(stream, stream.next, len);
+        esp_err_t ec = esp_ble_gatts_send_indicate(m_gatts_if, conn_id, stream.handle, len, (uint8_t*)fragment, false);
+        if (ec)
+        {
+            LOGE(m_device_name.c_str(), "Sending stream fragment %d failed, error code=%d", (int)stream.next, ec);
+            if (!stream.in_flight)
+                FinishStream(conn_id, ec);
+            break; // else try again with the next confirmation
+        }
+        ++stream.in_flight;
+        ++stream.next;
+    }
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::OnStreamConfirm(uint16_t conn_id, esp_ble_gatts_cb_param_t* param)
+{
+    Connection& channel = m_connections[conn_id];
+    StreamState& stream = channel.stream;
+    if (param->conf.handle != stream.handle)
+        return;
+
+    --stream.in_flight;
+    switch (param->conf.status)
+    {
+        case ESP_GATT_CONGESTED:
+            if (!channel.congested)
+            {
+                ++channel.stats.congestions;
+                INSTRUMENT(congestions++);
+                NoteTraffic(channel, true);
+            }
+            channel.congested = true;
+            // fall through
+        case ESP_GATT_OK:
+            ++channel.stats.sent;
+            ++stream.confirmed;
+            break;
+        default:
+            if (channel.congested)
+            {
+                // continue with the rejected fragment as soon as the congestion is over
+                channel.stale = stream.in_flight;
+                channel.stats.retransmitted += stream.in_flight + 1;
+                INSTRUMENT(retransmitted += stream.in_flight + 1);
+                stream.in_flight = 0;
+                stream.next = stream.confirmed;
+            }
+            else
+            {
+                LOGE(
+                    m_device_name.c_str(), "Stream fragment %d to conn_id=%d failed, status=0x%x",
+                    (int)stream.confirmed, conn_id, param->conf.status
+                );
+                ++channel.stats.failed;
+                INSTRUMENT(failed_sends++);
+                channel.stale = stream.in_flight;
+                FinishStream(conn_id, ESP_FAIL);
+                return;
+            }
+            break;
+    }
+
+    if (stream.confirmed == stream.fragments)
+        FinishStream(conn_id, ESP_OK);
+    FlushNotifications(conn_id);
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::FinishStream(uint16_t conn_id, esp_err_t result)
+{
+    Connection& channel = m_connections[conn_id];
+    StreamState& stream = channel.stream;
+    LOGI(m_device_name.c_str(), "Stream to conn_id=%d done, result=%d", conn_id, result);
+    stream_done_func on_done = stream.on_done;
+    stream = StreamState();
+    const BLEConnProfile* restore = channel.stream_restore;
+    channel.stream_restore = nullptr;
+    if (on_done)
+        on_done(conn_id, result);
+
+    // a stream started by on_done keeps the stream profile
+    if (stream.IsActive())
+        channel.stream_restore = restore;
+    else if (restore && channel.connected)
+        ApplyProfile(channel, restore);
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t BLEServer::Notify(uint16_t conn_id, uint16_t handle, const uint8_t* value, uint16_t len, bool need_confirm)
+{
+    BLELock lock(m_lock);
+    esp_err_t ec = QueueNotification(conn_id, handle, value, len, need_confirm);
+    if (ec == ESP_OK)
+        FlushNotifications(conn_id);
+    return ec;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t BLEServer::QueueNotification(uint16_t conn_id, uint16_t handle, const uint8_t* value, uint16_t len, bool need_confirm, uint8_t tag)
+{
+    if (conn_id >= BLE_MAX_CONNECTIONS || !m_connections[conn_id].connected)
+        return ESP_ERR_INVALID_STATE;
+    if (len > m_connections[conn_id].mtu - 3 || (len && !value))
+        return ESP_ERR_INVALID_SIZE;
+
+    Connection& channel = m_connections[conn_id];
+    if (!channel.queue.Push(handle, value, len, need_confirm, tag))
+    {
+        ++channel.stats.dropped;
+        INSTRUMENT(dropped++);
+        TRACE(Add(trace_dropped, need_confirm, conn_id, handle, len));
+        return ESP_ERR_NO_MEM;
+    }
+    CountNotification(channel, handle);
+    TRACE(Add(trace_notify, need_confirm, conn_id, handle, len, value, len));
+    if (channel.queue.GetCount() > channel.stats.max_depth)
+        channel.stats.max_depth = (uint16_t)channel.queue.GetCount();
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t BLEServer::NotifyInPlace(
+    uint16_t conn_id, uint16_t handle, uint16_t max_len,
+    notify_build_func build, void* context, bool need_confirm
+)
+{
+    assert(build);
+    BLELock lock(m_lock);
+    if (conn_id >= BLE_MAX_CONNECTIONS || !m_connections[conn_id].connected)
+        return ESP_ERR_INVALID_STATE;
+
+    Connection& channel = m_connections[conn_id];
+    uint16_t len = std::min<uint16_t>(max_len, channel.mtu - 3);
+    uint8_t* value = channel.queue.Reserve(handle, len, need_confirm);
+    if (!value)
+    {
+        ++channel.stats.dropped;
+        INSTRUMENT(dropped++);
+        TRACE(Add(trace_dropped, need_confirm, conn_id, handle, len));
+        return ESP_ERR_NO_MEM;
+    }
+    if (!build(context, value, len))
+    {
+        channel.queue.Cancel();
+        return ESP_OK;
+    }
+    TRACE(Add(trace_notify, need_confirm, conn_id, handle, len, value, len));
+    channel.queue.Commit(len);
+    CountNotification(channel, handle);
+    if (channel.queue.GetCount() > channel.stats.max_depth)
+        channel.stats.max_depth = (uint16_t)channel.queue.GetCount();
+
+    FlushNotifications(conn_id);
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::CountNotification(Connection& channel, uint16_t handle)
+{
+# ifdef BLE_SERVER_INSTRUMENTATION
+    m_instrumentation.CountNotification(handle);
+    if (channel.write_time >= 0)
+    {
+        m_instrumentation.turnaround.Add((uint32_t)(esp_timer_get_time() - channel.write_time));
+        channel.write_time = -1;
+    }
+# endif
+    NoteTraffic(channel, false);
+}
+// -------------------------------------------------------------------------------------------------------------------
+uint8_t BLEServer::NotifyAll(uint16_t handle, const uint8_t* value, uint16_t len)
+{
+    BLELock lock(m_lock);
+    size_t index = 0;
+    while (index < m_configs.size() && m_configs[index].value_handle != handle)
+        ++index;
+    if (index == m_configs.size())
+        return 0;
+
+    uint32_t bit = (uint32_t)1 << index;
+    uint8_t count = 0;
+    for (uint16_t conn_id = 0; conn_id < BLE_MAX_CONNECTIONS; ++conn_id)
+    {
+        const Connection& connection = m_connections[conn_id];
+        if (!connection.connected || !((connection.notify_bits | connection.indicate_bits) & bit))
+            continue;
+        bool need_confirm = !(connection.notify_bits & bit);
+        if (Notify(conn_id, handle, value, len, need_confirm) == ESP_OK)
+            ++count;
+    }
+    return count;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::SetNotifyLimit(uint8_t service_id, BLEService::size_type attribute_index, const BLENotifyLimit& limit)
+{
+    assert(service_id < m_services.size());
+    assert(limit.deadband_type <= deadband_s32);
+
+    if (BLEIsFull(m_limited_values))
+    {
+        LOGE(m_device_name.c_str(), "Cannot limit more than %d values, see BLE_MAX_NOTIFY_LIMITS", BLE_MAX_NOTIFY_LIMITS);
+        return;
+    }
+    LimitedValue entry = {};
+    entry.service_id = service_id;
+    entry.attribute_index = attribute_index;
+    entry.limit = limit;
+    entry.flushed = -1;
+    m_limited_values.push_back(entry);
+}
+// -------------------------------------------------------------------------------------------------------------------
+BLEServer::LimitedValue* BLEServer::FindLimitedValue(uint16_t handle)
+{
+    for (LimitedValue& entry : m_limited_values)
+    {
+        if (entry.handle == handle && handle)
+            return &entry;
+    }
+    return nullptr;
+}
+// -------------------------------------------------------------------------------------------------------------------
+/// Element \a index of \a value of \a type (see BLENotifyLimit).
+static int64_t GetElement(uint8_t type, const uint8_t* value, uint16_t index)
+{
+    switch (type)
+    {
+        case deadband_s8:
+            return (int8_t)value[index];
+        case deadband_u16:
+        case deadband_s16:
+        {
+            uint16_t element = (uint16_t)(value[2 * index] | (value[2 * index + 1] << 8));
+            return type == deadband_s16 ? (int64_t)(int16_t)element : (int64_t)element;
+        }
+        case deadband_u32:
+        case deadband_s32:
+        {
+            const uint8_t* p = value + 4 * index;
+            uint32_t element = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+            return type == deadband_s32 ? (int64_t)(int32_t)element : (int64_t)element;
+        }
+        default:
+            return value[index];
+    }
+}
+// -------------------------------------------------------------------------------------------------------------------
+/// Whether \a value differs from \a sent, the value notified last, beyond the deadband of \a limit.
+static bool ExceedsDeadband(const BLENotifyLimit& limit, const uint8_t* value, uint16_t len, const uint8_t* sent, uint16_t sent_len)
+{
+    if (len != sent_len)
+        return true;
+    if (limit.deadband_type == deadband_none)
+        return len && memcmp(value, sent, len) != 0;
+
+    static const uint8_t sizes[] = {1, 1, 1, 2, 2, 4, 4};
+    uint16_t count = len / sizes[limit.deadband_type];
+    for (uint16_t i = 0; i < count; ++i)
+    {
+        int64_t delta = GetElement(limit.deadband_type, value, i) - GetElement(limit.deadband_type, sent, i);
+        if ((delta < 0 ? -delta : delta) > (int64_t)limit.deadband)
+            return true;
+    }
+    // trailing bytes not forming an element
+    uint16_t rest = count * sizes[limit.deadband_type];
+    return memcmp(value + rest, sent + rest, len - rest) != 0;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t BLEServer::UpdateValue(uint16_t handle, const uint8_t* value, uint16_t len)
+{
+    if (len > BLE_NOTIFY_LIMIT_VALUE_SIZE || (len && !value))
+        return ESP_ERR_INVALID_SIZE;
+
+    BLELock lock(m_lock);
+    LimitedValue* entry = FindLimitedValue(handle);
+    if (!entry)
+        return ESP_ERR_NOT_FOUND;
+
+    if (len)
+        memcpy(entry->value, value, len);
+    entry->length = len;
+    // a value changing back within the deadband before it's flushed needs no notification anymore
+    entry->dirty = ExceedsDeadband(entry->limit, entry->value, len, entry->sent, entry->sent_length);
+    if (entry->dirty)
+        ScheduleFlush();
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::ScheduleFlush(void)
+{
+    // the earliest time a dirty value may be flushed
+    int64_t due = -1;
+    for (const LimitedValue& entry : m_limited_values)
+    {
+        if (!entry.dirty)
+            continue;
+        int64_t entry_due = entry.flushed < 0 ? 0 : entry.flushed + (int64_t)entry.limit.min_interval_ms * 1000;
+        if (due < 0 || entry_due < due)
+            due = entry_due;
+    }
+    if (due < 0 || (m_flush_due >= 0 && m_flush_due <= due))
+        return;
+
+    if (!m_flush_timer)
+    {
+        esp_timer_create_args_t args = {};
+        args.callback = OnFlushTimer;
+        args.arg = this;
+        args.dispatch_method = ESP_TIMER_TASK;
+        args.name = "ble_flush";
+        esp_err_t ec = esp_timer_create(&args, &m_flush_timer);
+        if (ec)
+        {
+            LOGE(m_device_name.c_str(), "Creating flush timer failed, error code=%d", ec);
+            m_flush_timer = nullptr;
+            return;
+        }
+    }
+    else if (m_flush_due >= 0)
+        esp_timer_stop(m_flush_timer);
+
+    // values due now are flushed by the timer task as well, coalescing the updates of a burst
+    int64_t now = esp_timer_get_time();
+    m_flush_due = std::max(due, now);
+    esp_timer_start_once(m_flush_timer, (uint64_t)(m_flush_due - now));
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::OnFlushTimer(void* arg)
+{
+    BLEServer* server = (BLEServer*)arg;
+    BLELock lock(server->m_lock);
+    server->FlushLimitedValues();
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::FlushLimitedValues(void)
+{
+    m_flush_due = -1;
+    int64_t now = esp_timer_get_time();
+    bool queued[BLE_MAX_CONNECTIONS] = {};
+
+    for (LimitedValue& entry : m_limited_values)
+    {
+        if (!entry.dirty || (entry.flushed >= 0 && now - entry.flushed < (int64_t)entry.limit.min_interval_ms * 1000))
+            continue;
+
+        size_t index = 0;
+        while (index < m_configs.size() && m_configs[index].value_handle != entry.handle)
+            ++index;
+        uint32_t bit = index < m_configs.size() ? (uint32_t)1 << index : 0;
+
+        for (uint16_t conn_id = 0; conn_id < BLE_MAX_CONNECTIONS; ++conn_id)
+        {
+            const Connection& connection = m_connections[conn_id];
+            if (!connection.connected || !((connection.notify_bits | connection.indicate_bits) & bit))
+                continue;
+            bool need_confirm = !(connection.notify_bits & bit);
+            if (QueueNotification(conn_id, entry.handle, entry.value, entry.length, need_confirm) == ESP_OK)
+            {
+                queued[conn_id] = true;
+                entry.pending &= ~(1 << conn_id);
+            }
+            else
+            {
+                // the latest value is sent when the queue has room again
+                entry.pending |= 1 << conn_id;
+                m_connections[conn_id].limited_pending = true;
+            }
+        }
+
+        esp_err_t ec = esp_ble_gatts_set_attr_value(entry.handle, entry.length, entry.value);
+        if (ec)
+            LOGE(m_device_name.c_str(), "Setting value of handle %d failed, error code=%d", entry.handle, ec);
+
+        memcpy(entry.sent, entry.value, entry.length);
+        entry.sent_length = entry.length;
+        entry.dirty = false;
+        entry.flushed = now;
+    }
+
+    // all values due go to the stack together, one pass per connection
+    for (uint16_t conn_id = 0; conn_id < BLE_MAX_CONNECTIONS; ++conn_id)
+    {
+        if (queued[conn_id])
+            FlushNotifications(conn_id);
+    }
+    ScheduleFlush();
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::RequeueLimitedValues(uint16_t conn_id)
+{
+    Connection& channel = m_connections[conn_id];
+    channel.limited_pending = false;
+    uint16_t bit = 1 << conn_id;
+    for (LimitedValue& entry : m_limited_values)
+    {
+        // a dirty value goes to every connection with the next flush anyway
+        if (!(entry.pending & bit) || entry.dirty)
+            continue;
+        bool notify = false;
+        bool indicate = false;
+        GetSubscription(conn_id, entry.handle, notify, indicate);
+        if (notify || indicate)
+        {
+            if (QueueNotification(conn_id, entry.handle, entry.sent, entry.sent_length, !notify) != ESP_OK)
+            {
+                channel.limited_pending = true;
+                return;
+            }
+        }
+        entry.pending &= ~bit;
+    }
+}
+// -------------------------------------------------------------------------------------------------------------------
+uint16_t BLEServer::GetMTU(uint16_t conn_id) const
+{
+    BLELock lock(m_lock);
+    return GetConnection(conn_id) ? m_connections[conn_id].mtu : (uint16_t)ESP_GATT_DEF_BLE_MTU_SIZE;
+}
+// -------------------------------------------------------------------------------------------------------------------
+const BLEConnection* BLEServer::GetConnection(uint16_t conn_id) const
+{
+    if (conn_id >= BLE_MAX_CONNECTIONS || !m_connections[conn_id].connected)
+        return nullptr;
+    return &m_connections[conn_id];
+}
+// -------------------------------------------------------------------------------------------------------------------
+uint8_t BLEServer::GetConnectionCount(void) const
+{
+    BLELock lock(m_lock);
+    uint8_t count = 0;
+    for (const Connection& connection : m_connections)
+    {
+        if (connection.connected)
+            ++count;
+    }
+    return count;
+}
+// -------------------------------------------------------------------------------------------------------------------
+bool BLEServer::IsSubscribed(uint16_t conn_id, uint16_t handle) const
+{
+    BLELock lock(m_lock);
+    const BLEConnection* connection = GetConnection(conn_id);
+    if (!connection)
+        return false;
+    for (size_t i = 0; i < m_configs.size(); ++i)
+    {
+        if (m_configs[i].value_handle == handle)
+            return ((connection->notify_bits | connection->indicate_bits) >> i) & 1;
+    }
+    return false;
+}
+// -------------------------------------------------------------------------------------------------------------------
+BLENotifyStats BLEServer::GetNotifyStats(uint16_t conn_id) const
+{
+    BLELock lock(m_lock);
+    if (conn_id >= BLE_MAX_CONNECTIONS)
+        return BLENotifyStats();
+
+    const Connection& channel = m_connections[conn_id];
+    BLENotifyStats stats = channel.stats;
+    stats.depth = (uint16_t)channel.queue.GetCount();
+    stats.congested = channel.congested;
+    int64_t elapsed = esp_timer_get_time() - channel.stats_start;
+    stats.rate = elapsed > 0 ? (float)(stats.sent * 1e6 / elapsed) : 0.0f;
+    return stats;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::ResetNotifyStats(uint16_t conn_id)
+{
+    BLELock lock(m_lock);
+    if (conn_id >= BLE_MAX_CONNECTIONS)
+        return;
+
+    Connection& channel = m_connections[conn_id];
+    channel.stats = BLENotifyStats();
+    channel.stats.max_depth = (uint16_t)channel.queue.GetCount();
+    channel.stats_start = esp_timer_get_time();
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::OnEvent(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param)
+{
+    uint16_t handle = 0;
+    uint8_t mask = 0;
+    switch (event)
+    {
+        case ESP_GATTS_READ_EVT:
+            handle = param->read.handle;
+            mask = evt_mask_read;
+            break;
+        case ESP_GATTS_WRITE_EVT:
+            handle = param->write.handle;
+            mask = evt_mask_write;
+            break;
+        case ESP_GATTS_CONF_EVT:
+            handle = param->conf.handle;
+            mask = evt_mask_conf;
+            break;
+        case ESP_GATTS_RESPONSE_EVT:
+            handle = param->rsp.handle;
+            mask = evt_mask_response;
+            break;
+        default:
+            return;
+    }
+
+    // handles below the base wrap around and so are out of range, too
+    uint16_t index = handle - m_handler_base;
+    if (index < m_handlers.size())
+    {
+        const HandlerEntry& entry = m_handlers[index];
+        if (entry.event_mask & mask)
+        {
+            const EventHandler& handler = m_event_handlers[entry.handler - 1];
+            if (m_handler_task)
+            {
+                // also while the task is stopping, it handles everything queued before it ends
+                if (m_event_ring.Push(&handler, event, gatts_if, *param))
+                    xTaskNotifyGive(m_handler_task);
+                else
+                {
+                    // not called here, the task may be calling a handler and has older events
+                    LOGW(m_device_name.c_str(), "Handler ring full, event %d for handle=%d dropped", event, handle);
+                    m_handler_dropped.fetch_add(1, std::memory_order_relaxed);
+                }
+                return;
+            }
+# ifdef BLE_SERVER_INSTRUMENTATION
+            int64_t start = esp_timer_get_time();
+            CallHandler(handler, handle, event, gatts_if, param);
+            m_instrumentation.AddHandlerTime(handle, (uint32_t)(esp_timer_get_time() - start));
+# else
+            CallHandler(handler, handle, event, gatts_if, param);
+# endif
+        }
+    }
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::CallHandler(
+    const EventHandler& entry, uint16_t handle,
+    esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param
+)
+{
+    uint16_t conn_id = GetEventConnection(event, *param);
+    BLEEventContext context = {
+        this, event, gatts_if, param, conn_id,
+        conn_id < BLE_MAX_CONNECTIONS ? &m_connections[conn_id] : nullptr,
+        handle, entry.reply_handle
+    };
+    entry.handler(context);
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t BLEServer::StartHandlerTask(UBaseType_t priority, BaseType_t core)
+{
+    BLELock lock(m_lock);
+    if (m_handler_task || m_handler_running)
+        return ESP_ERR_INVALID_STATE;
+
+    m_handler_stop = false;
+    m_handler_running = true;
+# ifdef BLE_SERVER_STATIC_STORAGE
+    m_handler_task = xTaskCreateStaticPinnedToCore(
+        HandlerTask, "ble_handlers", BLE_HANDLER_TASK_STACK_SIZE, this, priority, m_handler_stack, &m_handler_tcb, core
+    );
+# else
+    if (pdPASS != xTaskCreatePinnedToCore(HandlerTask, "ble_handlers", BLE_HANDLER_TASK_STACK_SIZE, this, priority, &m_handler_task, core))
+        m_handler_task = nullptr;
+# endif
+    if (!m_handler_task)
+    {
+        LOGE(m_device_name.c_str(), "Creating the handler task failed");
+        m_handler_running = false;
+        return ESP_ERR_NO_MEM;
+    }
+    LOGI(m_device_name.c_str(), "Handler task started, priority=%d, core=%d", (int)priority, (int)core);
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::StopHandlerTask(void)
+{
+    {
+        BLELock lock(m_lock);
+        if (!m_handler_task)
+            return;
+        m_handler_stop = true;
+        xTaskNotifyGive(m_handler_task);
+    }
+
+    // not waiting with the lock held, the handlers may need it
+    while (m_handler_running)
+        vTaskDelay(1);
+    LOGI(m_device_name.c_str(), "Handler task stopped");
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::HandlerTask(void* arg)
+{
+    static_cast<BLEServer*>(arg)->RunHandlers();
+    vTaskDelete(NULL);
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::RunHandlers(void)
+{
+    for (;;)
+    {
+        BLEEventRing::Record* record;
+        while ((record = m_event_ring.Front()) != nullptr)
+        {
+            const EventHandler& handler = *static_cast<const EventHandler*>(record->handler);
+            uint16_t handle = GetEventHandle(record->event, record->param);
+# ifdef BLE_SERVER_INSTRUMENTATION
+            int64_t start = esp_timer_get_time();
+            CallHandler(handler, handle, record->event, record->gatts_if, &record->param);
+            uint32_t us = (uint32_t)(esp_timer_get_time() - start);
+            {
+                BLELock lock(m_lock);
+                m_instrumentation.AddHandlerTime(handle, us);
+            }
+# else
+            CallHandler(handler, handle, record->event, record->gatts_if, &record->param);
+# endif
+            m_event_ring.Pop();
+        }
+        if (m_handler_stop)
+        {
+            // events are queued with the lock held, so none arrives after the ring was found empty
+            BLELock lock(m_lock);
+            if (!m_event_ring.Front())
+            {
+                m_handler_task = nullptr;
+                break;
+            }
+            continue;
+        }
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+    // the server may be destroyed as soon as this is cleared
+    m_handler_running = false;
+}
+// -------------------------------------------------------------------------------------------------------------------
+bool BLEServer::GetInstrumentation(BLEInstrumentation& snapshot) const
+{
+# ifdef BLE_SERVER_INSTRUMENTATION
+    BLELock lock(m_lock);
+    snapshot = m_instrumentation;
+    return true;
+# else
+    return false;
+# endif
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::ResetInstrumentation(void)
+{
+    BLELock lock(m_lock);
+    INSTRUMENT(Reset());
+}
+// -------------------------------------------------------------------------------------------------------------------
+size_t BLEServer::ReadTrace(uint8_t* buffer, size_t size)
+{
+# ifdef BLE_SERVER_TRACE
+    return m_trace.Read(buffer, size);
+# else
+    return 0;
+# endif
+}
+// -------------------------------------------------------------------------------------------------------------------
+size_t BLEServer::PrintTrace(void)
+{
+# ifdef BLE_SERVER_TRACE
+    return m_trace.Print();
+# else
+    return 0;
+# endif
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t BLEServer::SetRecorder(record_write_func write, void* context)
+{
+# ifdef BLE_SERVER_RECORD
+    BLELock lock(m_lock);
+    m_recorder.Start(write, context);
+    return ESP_OK;
+# else
+    return ESP_ERR_NOT_SUPPORTED;
+# endif
+}
+// -------------------------------------------------------------------------------------------------------------------
+BLEHandlerStats BLEServer::GetHandlerStats(void) const
+{
+    BLEHandlerStats stats;
+    stats.running = m_handler_running;
+    stats.queued = m_event_ring.GetPushedCount();
+    stats.dispatched = m_event_ring.GetPoppedCount();
+    stats.dropped = m_handler_dropped.load(std::memory_order_relaxed);
+    stats.pending = (uint16_t)m_event_ring.GetCount();
+    stats.used = (uint16_t)m_event_ring.GetUsedBytes();
+    stats.max_used = (uint16_t)m_event_ring.GetMaxUsedBytes();
+    stats.capacity = (uint16_t)BLEEventRing::capacity;
+    return stats;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::OnPrepareWrite(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param)
+{
+    esp_ble_gatts_cb_param_t::gatts_write_evt_param& write = param->write;
+    if (!write.need_rsp || write.conn_id >= BLE_MAX_CONNECTIONS)
+    {
+        // queued and answered by the stack (ESP_GATT_AUTO_RSP), the handler sees every part
+        if (write.conn_id < BLE_MAX_CONNECTIONS)
+            m_connections[write.conn_id].prepare.stack_prepared = true;
+        OnEvent(ESP_GATTS_WRITE_EVT, gatts_if, param);
+        return;
+    }
+
+    PrepareState& prepare = m_connections[write.conn_id].prepare;
+    esp_gatt_status_t status = ESP_GATT_OK;
+    if (prepare.buffer == PrepareState::no_buffer)
+    {
+        for (uint8_t i = 0; i < BLE_PREPARE_BUFFERS; ++i)
+        {
+            if (m_prepare_owner[i] == BLE_MAX_CONNECTIONS)
+            {
+                m_prepare_owner[i] = (uint8_t)write.conn_id;
+                prepare.buffer = i;
+                prepare.handle = write.handle;
+                prepare.len = 0;
+                prepare.max_len = std::min<uint16_t>(GetMaxLength(write.handle), BLE_PREPARE_BUFFER_SIZE);
+                prepare.status = ESP_GATT_OK;
+                BLEMemory::Acquire(BLE_PREPARE_BUFFER_SIZE);
+                break;
+            }
+        }
+        if (prepare.buffer == PrepareState::no_buffer)
+            status = ESP_GATT_PREPARE_Q_FULL;
+    }
+    else if (prepare.handle != write.handle)
+    {
+        // a long write of several attributes at once isn't supported
+        status = ESP_GATT_PREPARE_Q_FULL;
+    }
+
+    if (status == ESP_GATT_OK && prepare.status == ESP_GATT_OK)
+    {
+        // offset and length errors are reported with the execute write response (Core spec Vol 3, Part F, 3.4.6.1)
+        if (write.offset > prepare.len)
+            prepare.status = ESP_GATT_INVALID_OFFSET;
+        else if (write.offset + write.len > prepare.max_len)
+            prepare.status = ESP_GATT_INVALID_ATTR_LEN;
+        else
+        {
+            memcpy(m_prepare_pool[prepare.buffer] + write.offset, write.value, write.len);
+            prepare.len = std::max(prepare.len, (uint16_t)(write.offset + write.len));
+        }
+    }
+
+    // the response echoes the request
+    esp_gatt_value_t& rsp = m_rsp.attr_value;
+    rsp.handle = write.handle;
+    rsp.offset = write.offset;
+    rsp.len = write.len;
+    rsp.auth_req = ESP_GATT_AUTH_REQ_NONE;
+    memcpy(rsp.value, write.value, write.len);
+    esp_err_t ec = esp_ble_gatts_send_response(gatts_if, write.conn_id, write.trans_id, status, &m_rsp);
+    if (ec)
+        LOGE(m_device_name.c_str(), "Sending prepare write response failed, error code=%d", ec);
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::OnExecWrite(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param)
+{
+    esp_ble_gatts_cb_param_t::gatts_exec_write_evt_param& exec = param->exec_write;
+    if (exec.conn_id >= BLE_MAX_CONNECTIONS)
+        return;
+
+    PrepareState& prepare = m_connections[exec.conn_id].prepare;
+    if (prepare.buffer == PrepareState::no_buffer && prepare.stack_prepared)
+    {
+        // answered by the stack
+        prepare.stack_prepared = false;
+        return;
+    }
+
+    // a cancelled long write is answered OK, whatever failed before
+    esp_gatt_status_t status = exec.exec_write_flag == ESP_GATT_PREP_WRITE_EXEC ? prepare.status : ESP_GATT_OK;
+    if (prepare.buffer != PrepareState::no_buffer && exec.exec_write_flag == ESP_GATT_PREP_WRITE_EXEC && status == ESP_GATT_OK)
+    {
+        LOGI(m_device_name.c_str(), "Long write of %d bytes to handle %d executed", prepare.len, prepare.handle);
+
+        // a single write event with the whole value
+        esp_ble_gatts_cb_param_t write_param;
+        memset(&write_param, 0, sizeof(write_param));
+        esp_ble_gatts_cb_param_t::gatts_write_evt_param& write = write_param.write;
+        write.conn_id = exec.conn_id;
+        write.trans_id = exec.trans_id;
+        memcpy(write.bda, exec.bda, sizeof(esp_bd_addr_t));
+        write.handle = prepare.handle;
+        write.offset = 0;
+        write.need_rsp = false;
+        write.is_prep = false;
+        write.len = prepare.len;
+        write.value = m_prepare_pool[prepare.buffer];
+        OnEvent(ESP_GATTS_WRITE_EVT, gatts_if, &write_param);
+    }
+    else if (status != ESP_GATT_OK)
+    {
+        LOGW(m_device_name.c_str(), "Long write to handle %d failed, status=0x%x", prepare.handle, status);
+    }
+
+    ReleasePrepareBuffer(exec.conn_id);
+    prepare.stack_prepared = false;
+
+    esp_err_t ec = esp_ble_gatts_send_response(gatts_if, exec.conn_id, exec.trans_id, status, nullptr);
+    if (ec)
+        LOGE(m_device_name.c_str(), "Sending execute write response failed, error code=%d", ec);
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::ReleasePrepareBuffer(uint16_t conn_id)
+{
+    PrepareState& prepare = m_connections[conn_id].prepare;
+    if (prepare.buffer != PrepareState::no_buffer)
+    {
+        m_prepare_owner[prepare.buffer] = BLE_MAX_CONNECTIONS;
+        BLEMemory::Release(BLE_PREPARE_BUFFER_SIZE);
+    }
+    prepare.buffer = PrepareState::no_buffer;
+    prepare.len = 0;
+    prepare.max_len = 0;
+    prepare.status = ESP_GATT_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+uint16_t BLEServer::GetMaxLength(uint16_t handle)
+{
+    for (const BLEService::ptr& service : m_services)
+    {
+        if (!service->HasHandles())
+            continue;
+        const esp_gatts_attr_db_t* attributes = service->GetAttributes();
+        for (BLEService::size_type i = 0; i < service->GetCount(); ++i)
+        {
+            if (service->GetHandle(i) == handle)
+                return attributes[i].att_desc.max_length;
+        }
+    }
+    return 0;
+}
 // -------------------------------------------------------------------------------------------------------------------
-esp_ble_adv_params_t BLEServer::adv_params = {
+const esp_ble_adv_params_t BLEServer::default_adv_params = {
     .adv_int_min         = 0x20,
     .adv_int_max         = 0x40,
     .adv_type            = ADV_TYPE_IND,
@@ -492,17 +2901,297 @@ esp_ble_adv_params_t BLEServer::adv_params = {
     .adv_filter_policy   = ADV_FILTER_ALLOW_SCAN_ANY_CON_ANY,
 };
 // -------------------------------------------------------------------------------------------------------------------
+void BLEServer::SetAdvertisingParams(const esp_ble_adv_params_t& params)
+{
+    BLELock lock(m_lock);
+    m_adv_params = params;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::StartAdvertising(void)
+{
+    // advertising data still pending, advertising starts when it's set
+    if (m_advertising || m_adv_config_done)
+        return;
+    if (GetConnectionCount() >= BLE_MAX_CONNECTIONS)
+    {
+        LOGI(m_device_name.c_str(), "All %d connections in use, advertising paused", BLE_MAX_CONNECTIONS);
+        return;
+    }
+    esp_err_t ec = esp_ble_gap_start_advertising(&m_adv_params);
+    if (ec)
+    {
+        LOGE(m_device_name.c_str(), "Starting advertising failed, error code=%d", ec);
+        return;
+    }
+    m_advertising = true;
+}
+// -------------------------------------------------------------------------------------------------------------------
+BLEServer::Connection* BLEServer::FindConnection(const esp_bd_addr_t bda)
+{
+    for (Connection& connection : m_connections)
+    {
+        if (connection.connected && 0 == memcmp(connection.bda, bda, sizeof(esp_bd_addr_t)))
+            return &connection;
+    }
+    return nullptr;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::OnUpdateConnParams(esp_ble_gap_cb_param_t* param)
+{
+    Connection* connection = FindConnection(param->update_conn_params.bda);
+    if (!connection)
+        return;
+    connection->update_status = param->update_conn_params.status;
+    if (param->update_conn_params.status == ESP_BT_STATUS_SUCCESS)
+    {
+        connection->interval = param->update_conn_params.conn_int;
+        connection->latency = param->update_conn_params.latency;
+        connection->timeout = param->update_conn_params.timeout;
+    }
+    if (m_on_conn_update)
+        m_on_conn_update(*connection);
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::OnDataLength(esp_ble_gap_cb_param_t* param)
+{
+    if (!m_data_length_count)
+        return;
+    uint8_t conn_id = m_data_length_pending[0];
+    --m_data_length_count;
+    memmove(m_data_length_pending, m_data_length_pending + 1, m_data_length_count);
+
+    Connection& connection = m_connections[conn_id];
+    if (!connection.connected)
+        return;
+    if (param->pkt_data_lenth_cmpl.status == ESP_BT_STATUS_SUCCESS)
+        connection.tx_octets = param->pkt_data_lenth_cmpl.params.tx_len;
+    if (m_on_conn_update)
+        m_on_conn_update(connection);
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::OnPHYUpdate(esp_ble_gap_cb_param_t* param)
+{
+# ifdef CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+    Connection* connection = FindConnection(param->phy_update.bda);
+    if (!connection)
+        return;
+    if (param->phy_update.status == ESP_BT_STATUS_SUCCESS)
+    {
+        connection->tx_phy = param->phy_update.tx_phy;
+        connection->rx_phy = param->phy_update.rx_phy;
+    }
+    if (m_on_conn_update)
+        m_on_conn_update(*connection);
+# endif
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t BLEServer::ApplyProfile(Connection& connection, const BLEConnProfile* profile)
+{
+    assert(profile);
+    LOGI(m_device_name.c_str(), "Requesting profile %s for conn_id=%d", profile->name, connection.conn_id);
+    connection.profile = profile;
+    ++connection.profile_requests;
+
+    esp_ble_conn_update_params_t conn_params;
+    memcpy(conn_params.bda, connection.bda, sizeof(esp_bd_addr_t));
+    conn_params.min_int = profile->min_int;
+    conn_params.max_int = profile->max_int;
+    conn_params.latency = profile->latency;
+    conn_params.timeout = profile->timeout;
+    esp_err_t ec = esp_ble_gap_update_conn_params(&conn_params);
+    if (ec != ESP_OK)
+    {
+        LOGE(m_device_name.c_str(), "Updating connection params failed, error code=%d", ec);
+        return ec;
+    }
+
+    if (profile->tx_octets && profile->tx_octets != connection.tx_octets)
+    {
+        if (m_data_length_count >= BLE_MAX_CONNECTIONS)
+        {
+            LOGW(m_device_name.c_str(), "Too many data length requests pending, conn_id=%d keeps %d bytes", connection.conn_id, connection.tx_octets);
+        }
+        else if ((ec = esp_ble_gap_set_pkt_data_len(connection.bda, profile->tx_octets)) != ESP_OK)
+        {
+            LOGE(m_device_name.c_str(), "Setting data length failed, error code=%d", ec);
+            return ec;
+        }
+        else
+            m_data_length_pending[m_data_length_count++] = (uint8_t)connection.conn_id;
+    }
+
+# ifdef CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+    // the PHY preference bits are the ones of the PHY numbers minus one
+    if (profile->phy_mask && !(profile->phy_mask & (1 << (connection.tx_phy - 1))))
+    {
+        ec = esp_ble_gap_set_preferred_phy(
+            connection.bda, 0, profile->phy_mask, profile->phy_mask, ESP_BLE_GAP_PHY_OPTIONS_NO_PREF
+        );
+        if (ec != ESP_OK)
+        {
+            LOGE(m_device_name.c_str(), "Setting preferred PHY failed, error code=%d", ec);
+            return ec;
+        }
+    }
+# endif
+    return ESP_OK;
+}
+// -------------------------------------------------------------------------------------------------------------------
+esp_err_t BLEServer::SetConnectionProfile(uint16_t conn_id, const BLEConnProfile* profile)
+{
+    BLELock lock(m_lock);
+    if (!profile)
+        return ESP_ERR_INVALID_ARG;
+    if (conn_id >= BLE_MAX_CONNECTIONS || !m_connections[conn_id].connected)
+        return ESP_ERR_INVALID_STATE;
+    // an explicit choice is kept after a stream and by the adaptive profiles
+    m_connections[conn_id].stream_restore = nullptr;
+    m_connections[conn_id].adaptive.enabled = false;
+    return ApplyProfile(m_connections[conn_id], profile);
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::SetDefaultProfile(const BLEConnProfile* profile)
+{
+    BLELock lock(m_lock);
+    m_default_profile = profile ? profile : &ble_profile_default;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::SetStreamProfile(const BLEConnProfile* profile)
+{
+    BLELock lock(m_lock);
+    m_stream_profile = profile;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::SetAdaptiveProfiles(const BLEAdaptiveProfiles* profiles)
+{
+    assert(!profiles || (profiles->active && profiles->idle && profiles->idle_ms));
+    BLELock lock(m_lock);
+    m_adaptive = profiles;
+    int64_t now = esp_timer_get_time();
+    for (Connection& channel : m_connections)
+    {
+        channel.adaptive = AdaptiveState();
+        if (!profiles || !channel.connected)
+            continue;
+        // connected clients start busy, like new ones
+        channel.adaptive.enabled = true;
+        channel.adaptive.active = channel.profile == profiles->active;
+        channel.adaptive.last_busy = now;
+        ScheduleAdaptiveTimer(AdaptProfile(channel, now));
+    }
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::NoteTraffic(Connection& channel, bool busy)
+{
+    if (!m_adaptive || !channel.adaptive.enabled)
+        return;
+
+    AdaptiveState& adaptive = channel.adaptive;
+    int64_t now = esp_timer_get_time();
+    if (!busy)
+    {
+        if (now - adaptive.window_start >= 1000000)
+        {
+            adaptive.window_start = now;
+            adaptive.notifications = 0;
+        }
+        if (adaptive.notifications < m_adaptive->busy_notifications)
+            ++adaptive.notifications;
+        if (!m_adaptive->busy_notifications || adaptive.notifications < m_adaptive->busy_notifications)
+            return;
+    }
+    adaptive.last_busy = now;
+    // a busy connection is checked by the timer when it's due to go idle
+    if (!adaptive.active)
+        ScheduleAdaptiveTimer(AdaptProfile(channel, now));
+}
+// -------------------------------------------------------------------------------------------------------------------
+int64_t BLEServer::AdaptProfile(Connection& channel, int64_t now)
+{
+    AdaptiveState& adaptive = channel.adaptive;
+    if (!channel.connected || !adaptive.enabled)
+        return -1;
+
+    int64_t idle_at = adaptive.last_busy + (int64_t)m_adaptive->idle_ms * 1000;
+    if (channel.stream_restore)
+        return std::max(idle_at, now + (int64_t)m_adaptive->idle_ms * 1000);
+
+    bool active = now < idle_at;
+    if (active != adaptive.active)
+    {
+        int64_t allowed = adaptive.last_request + (int64_t)m_adaptive->hold_ms * 1000;
+        if (adaptive.last_request >= 0 && now < allowed)
+            return allowed;
+        adaptive.active = active;
+        adaptive.last_request = now;
+        ApplyProfile(channel, active ? m_adaptive->active : m_adaptive->idle);
+    }
+    return active ? idle_at : -1;
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::ScheduleAdaptiveTimer(int64_t due)
+{
+    if (due < 0 || (m_adaptive_due >= 0 && m_adaptive_due <= due))
+        return;
+
+    if (!m_adaptive_timer)
+    {
+        esp_timer_create_args_t args = {};
+        args.callback = OnAdaptiveTimer;
+        args.arg = this;
+        args.dispatch_method = ESP_TIMER_TASK;
+        args.name = "ble_adaptive";
+        esp_err_t ec = esp_timer_create(&args, &m_adaptive_timer);
+        if (ec)
+        {
+            LOGE(m_device_name.c_str(), "Creating adaptive profile timer failed, error code=%d", ec);
+            m_adaptive_timer = nullptr;
+            return;
+        }
+    }
+    else if (m_adaptive_due >= 0)
+        esp_timer_stop(m_adaptive_timer);
+
+    int64_t now = esp_timer_get_time();
+    m_adaptive_due = std::max(due, now);
+    esp_timer_start_once(m_adaptive_timer, (uint64_t)(m_adaptive_due - now));
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::OnAdaptiveTimer(void* arg)
+{
+    BLEServer* server = (BLEServer*)arg;
+    BLELock lock(server->m_lock);
+    server->m_adaptive_due = -1;
+    if (!server->m_adaptive)
+        return;
+    int64_t now = esp_timer_get_time();
+    for (Connection& channel : server->m_connections)
+        server->ScheduleAdaptiveTimer(server->AdaptProfile(channel, now));
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLEServer::SetConnectionUpdateHandler(conn_update_func on_update)
+{
+    BLELock lock(m_lock);
+    m_on_conn_update = on_update;
+}
+// -------------------------------------------------------------------------------------------------------------------
 void BLEServer::HandleGAPEvent(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param)
 {
-    LOGI(m_device_name.c_str(), "GAPEvent=%d", event);
+    BLELock lock(m_lock);
+    RECORD(AddGAPEvent(event, *param));
+    TRACE(AddGAPEvent(event));
+    INSTRUMENT(gap_events++);
     switch (event)
     {
         case ESP_GAP_BLE_ADV_DATA_RAW_SET_COMPLETE_EVT:
             m_adv_config_done &= (~ADV_CONFIG_FLAG);
+            // broadcast stopped during the update
+            if (m_broadcast_changed && !m_broadcast_type)
+                UpdateBroadcast();
             if (m_adv_config_done == 0)
             {
                 LOGI(m_device_name.c_str(), "Start advertising");
-                esp_ble_gap_start_advertising(&adv_params);
+                StartAdvertising();
             }
             break;
         case ESP_GAP_BLE_SCAN_RSP_DATA_RAW_SET_COMPLETE_EVT:
@@ -510,13 +3199,14 @@ void BLEServer::HandleGAPEvent(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_para
             if (m_adv_config_done == 0)
             {
                 LOGI(m_device_name.c_str(), "Start advertising (scan response)");
-                esp_ble_gap_start_advertising(&adv_params);
+                StartAdvertising();
             }
             break;
         case ESP_GAP_BLE_ADV_START_COMPLETE_EVT:
             /* advertising start complete event to indicate advertising start successfully or failed */
             if (param->adv_start_cmpl.status != ESP_BT_STATUS_SUCCESS) {
                 LOGE(m_device_name.c_str(), "Advertising start failed.");
+                m_advertising = false;
             }else{
                 LOGI(m_device_name.c_str(), "Advertising successfully started.");
             }
@@ -527,6 +3217,7 @@ void BLEServer::HandleGAPEvent(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_para
             }
             else {
                 LOGI(m_device_name.c_str(), "Stop adv successfully\n");
+                m_advertising = false;
             }
             break;
         case ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT:
@@ -537,6 +3228,31 @@ void BLEServer::HandleGAPEvent(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_para
                   param->update_conn_params.conn_int,
                   param->update_conn_params.latency,
                   param->update_conn_params.timeout);
+            OnUpdateConnParams(param);
+            break;
+        case ESP_GAP_BLE_SET_PKT_LENGTH_COMPLETE_EVT:
+            LOGI(m_device_name.c_str(), "data length status = %d, rx_len = %d, tx_len = %d",
+                  param->pkt_data_lenth_cmpl.status,
+                  param->pkt_data_lenth_cmpl.params.rx_len,
+                  param->pkt_data_lenth_cmpl.params.tx_len);
+            OnDataLength(param);
+            break;
+# ifdef CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+        case ESP_GAP_BLE_PHY_UPDATE_COMPLETE_EVT:
+            LOGI(m_device_name.c_str(), "PHY update status = %d, tx_phy = %d, rx_phy = %d",
+                  param->phy_update.status, param->phy_update.tx_phy, param->phy_update.rx_phy);
+            OnPHYUpdate(param);
+            break;
+# endif
+        case ESP_GAP_BLE_AUTH_CMPL_EVT:
+            LOGI(m_device_name.c_str(), "authentication %s, reason = 0x%x",
+                  param->ble_security.auth_cmpl.success ? "complete" : "failed",
+                  param->ble_security.auth_cmpl.fail_reason);
+            OnAuthComplete(param);
+            break;
+        case ESP_GAP_BLE_REMOVE_BOND_DEV_COMPLETE_EVT:
+            LOGI(m_device_name.c_str(), "remove bond status = %d", param->remove_bond_dev_cmpl.status);
+            OnRemoveBond(param);
             break;
         default:
             break;
@@ -7,10 +7,22 @@ Lightweight C++ BLE Server implementation for use in ESP-IDF Projects.
 # include <esp_gatt_defs.h>
 # include <esp_gap_ble_api.h>
 # include <esp_gatts_api.h>
-# include <vector>
-# include <map>
+# include <esp_timer.h>
+# include "ble_storage.h"
+# include "ble_notify_queue.h"
+# include "ble_event_ring.h"
+# include "ble_instrumentation.h"
+# include "ble_trace.h"
+# include "ble_record.h"
+# include "ble_cmac.h"
+# include "ble_bond_store.h"
+# include "ble_handler.h"
+# include <freertos/FreeRTOS.h>
+# include <freertos/task.h>
+# include <freertos/semphr.h>
+# include <atomic>
 # include <memory>
-# include <string>
+# include <type_traits>
 // ------------------------------------------------------------------------------------------
 static const uint16_t primary_service_uuid         = ESP_GATT_UUID_PRI_SERVICE;
 static const uint16_t character_declaration_uuid   = ESP_GATT_UUID_CHAR_DECLARE;
@@ -23,19 +35,51 @@ static const uint8_t char_prop_read_write          = ESP_GATT_CHAR_PROP_BIT_READ
 static const uint8_t char_prop_read_notify         = ESP_GATT_CHAR_PROP_BIT_READ | ESP_GATT_CHAR_PROP_BIT_NOTIFY;
 static const uint8_t char_prop_read_write_notify   = ESP_GATT_CHAR_PROP_BIT_WRITE | ESP_GATT_CHAR_PROP_BIT_READ | ESP_GATT_CHAR_PROP_BIT_NOTIFY;
 static const uint8_t char_prop_write_norsp         = ESP_GATT_CHAR_PROP_BIT_WRITE|ESP_GATT_CHAR_PROP_BIT_WRITE_NR;
+static const uint8_t char_prop_indicate            = ESP_GATT_CHAR_PROP_BIT_INDICATE;
 // ------------------------------------------------------------------------------------------
-typedef std::vector<esp_gatts_attr_db_t> AttrVector;
+/// Generic Attribute service of the stack and its characteristics, see BLEServer::EnableGATTCaching().
+static const uint16_t gatt_service_uuid            = 0x1801;
+static const uint16_t service_changed_uuid         = ESP_GATT_UUID_GATT_SRV_CHGD;
+static const uint16_t client_features_uuid         = 0x2B29;
+static const uint16_t database_hash_uuid           = 0x2B2A;
+
+/// Client supported features bit enabling robust caching (the only feature supported).
+static const uint8_t client_feature_robust_caching = (1 << 0);
+
+/// ATT errors of robust caching (Core 5.1), not named by older ESP-IDF versions.
+static const esp_gatt_status_t gatt_status_out_of_sync       = (esp_gatt_status_t)0x12;
+static const esp_gatt_status_t gatt_status_value_not_allowed = (esp_gatt_status_t)0x13;
+
+/// Application error answering a read with an offset of a computed value which was computed
+/// again meanwhile (for another client) or is older than BLE_READ_PROVIDER_HOLD_MS, the client
+/// has to read it again from the start.
+static const esp_gatt_status_t gatt_status_value_changed     = (esp_gatt_status_t)0x80;
+
+/// Size of the Database Hash.
+static const uint8_t database_hash_size            = BLECMAC::block_size;
+// ------------------------------------------------------------------------------------------
+typedef BLEVector<esp_gatts_attr_db_t, BLE_MAX_SERVICE_ATTRIBUTES> AttrVector;
 // ------------------------------------------------------------------------------------------
 class BLEService
 {
+    friend class BLEServer;
 public:
     typedef uint8_t size_type;
+# ifdef BLE_SERVER_STATIC_STORAGE
+    /// Services are kept in the storage of the BLEServer instance.
+    typedef BLEService* ptr;
+# else
     typedef std::shared_ptr<BLEService> ptr;
 
     /// Creates a new instance with the given \a uuid using \a service_id as ID for this service.
     /// The returned value is a \c shared_pointer to this instance.
     static ptr Create(uint16_t uuid, uint8_t service_id);
 
+    /// Creates a new instance for the constant attribute table \a attributes with \a count entries,
+    /// e.g. built by BLEServiceTable. The table is referenced, not copied, and no attributes can be added.
+    static ptr Create(const esp_gatts_attr_db_t* attributes, uint8_t count, uint8_t service_id);
+# endif
+
     /// Adds an attribute defined by \a attr.
     /// \returns ID of attribute value currently added (or \c npos in case of error)
     size_type AddAttributeDB(const esp_gatts_attr_db_t& attr);
@@ -50,7 +94,9 @@ public:
 
     /// Adds a configuration description attribute (0x2902).
     /// \returns ID of attribute value currently added (or \c npos in case of error)
-    size_type AddConfigDescription(uint8_t* config_descr);
+    /// The server answers reads and writes of a descriptor with \c ESP_GATT_RSP_BY_APP
+    /// with the state of the connection, see BLEServer::IsSubscribed().
+    size_type AddConfigDescription(uint8_t* config_descr, uint8_t response=ESP_GATT_AUTO_RSP);
 
     /// Sets a new characteristic followed by its value.
     /// \param uuid Pointer to a static 2-Byte UUID of the value.
@@ -68,13 +114,13 @@ public:
     );
 
     /// Returns a pointer to the GATT structure.
-    //const esp_gatts_attr_db_t* GetAttributes(void) const;
+    const esp_gatts_attr_db_t* GetAttributes(void) const { return m_const_db ? m_const_db : m_gatt_db.data(); }
 
     /// Returns the primary UUID of this attribute table.
     uint16_t GetUUID(void) const { return m_uuid; }
 
     /// Current count of all attributes.
-    size_type GetCount(void) const { return (size_type)m_gatt_db.size(); }
+    size_type GetCount(void) const { return m_const_db ? m_const_count : (size_type)m_gatt_db.size(); }
 
     /// ID of service
     uint8_t GetID(void) const { return m_service_id; }
@@ -87,61 +133,686 @@ public:
     uint16_t GetHandle(uint8_t index);
     void SetHandles(uint16_t* handles, uint8_t count);
 
+    /// Sets the value of attribute \a index, see BLEServer::SetAttributeValue().
+    esp_err_t SetValue(size_type index, uint16_t length, const uint8_t* value);
+
+    /// Whether the handles have been set after creating the attribute table.
+    bool HasHandles(void) const { return !m_handles.empty(); }
+
 protected:
     /// Service-ID this instance is using
     uint16_t m_uuid;
     uint8_t m_service_id;
     AttrVector m_gatt_db;
-    std::vector<uint16_t> m_handles;
+    /// Constant attribute table used instead of m_gatt_db (or \c nullptr)
+    const esp_gatts_attr_db_t* m_const_db = nullptr;
+    size_type m_const_count = 0;
+    BLEVector<uint16_t, BLE_MAX_SERVICE_ATTRIBUTES> m_handles;
+    /// Whether the attribute table was handed to the stack, which copied the initial values.
+    bool m_registered = false;
+    /// Attributes whose value changed after that, handed to the stack as soon as the handles are set.
+    BLEVector<size_type, BLE_MAX_SERVICE_ATTRIBUTES> m_changed;
     BLEService(uint16_t uuid, uint8_t service_id);
+    BLEService(const esp_gatts_attr_db_t* attributes, uint8_t count, uint8_t service_id);
+};
+// ------------------------------------------------------------------------------------------
+/// Event mask bits selecting the events an event handler is called for.
+static const uint8_t evt_mask_read                 = (1 << 0);
+static const uint8_t evt_mask_write                = (1 << 1);
+static const uint8_t evt_mask_conf                 = (1 << 2);
+static const uint8_t evt_mask_response             = (1 << 3);
+static const uint8_t evt_mask_all                  = evt_mask_read | evt_mask_write | evt_mask_conf | evt_mask_response;
+// ------------------------------------------------------------------------------------------
+typedef BLEVector<BLEService::ptr, BLE_MAX_SERVICES> ServiceVector;
+// ------------------------------------------------------------------------------------------
+/// Statistics of the notification queue of a connection, see BLEServer::Notify().
+struct BLENotifyStats
+{
+    /// Notifications queued and not confirmed by the stack yet.
+    uint16_t depth;
+    /// Highest depth seen.
+    uint16_t max_depth;
+    /// Notifications accepted by the stack.
+    uint32_t sent;
+    /// Notifications dropped because the queue was full.
+    uint32_t dropped;
+    /// Notifications rejected by the stack with an error, not sent again.
+    uint32_t failed;
+    /// Notifications sent again after the stack rejected them because of congestion.
+    uint32_t retransmitted;
+    /// Number of times the stack reported congestion.
+    uint32_t congestions;
+    /// Whether the connection is congested right now.
+    bool congested;
+    /// Notifications per second accepted by the stack since the connection was
+    /// established or ResetNotifyStats() was called.
+    float rate;
+    /// Messages of SendReliable() confirmed by the client, sent again and failed.
+    uint32_t reliable_delivered;
+    uint32_t reliable_retried;
+    uint32_t reliable_failed;
+};
+// ------------------------------------------------------------------------------------------
+/// Type of function computing the value of a characteristic when it's read, see BLEServer::AddCharacteristic().
+/// \a len is the space at \a value on entry and has to be set to the length written.
+/// \returns \c ESP_GATT_OK or the error status answered to the client.
+typedef esp_gatt_status_t (*read_provider_func)(uint16_t conn_id, uint16_t handle, uint8_t* value, uint16_t& len);
+// ------------------------------------------------------------------------------------------
+/// Element types of a value compared against a deadband, see BLENotifyLimit.
+static const uint8_t deadband_none = 0;     ///< any change of a byte counts
+static const uint8_t deadband_u8 = 1;
+static const uint8_t deadband_s8 = 2;
+static const uint8_t deadband_u16 = 3;      ///< little endian, like all GATT values
+static const uint8_t deadband_s16 = 4;
+static const uint8_t deadband_u32 = 5;
+static const uint8_t deadband_s32 = 6;
+
+/// Limits notifications of a characteristic value updated by BLEServer::UpdateValue().
+struct BLENotifyLimit
+{
+    /// Minimum time between two notifications (ms), updates meanwhile are coalesced into the latest value.
+    uint16_t min_interval_ms;
+    /// Element type of the value (\c deadband_*). The value is an array of such elements.
+    uint8_t deadband_type;
+    /// An update is notified only if an element differs by more than this from the value notified last
+    /// (ignored with \c deadband_none).
+    uint32_t deadband;
+};
+// ------------------------------------------------------------------------------------------
+/// Part of the data sent by BLEServer::Stream().
+struct BLEStreamBuffer
+{
+    const uint8_t* data;
+    size_t len;
 };
+
+/// Stream flag: every fragment starts with a 2 byte header, the flags
+/// (\c stream_frame_start, \c stream_frame_end) and the fragment number (modulo 256).
+static const uint8_t stream_flag_header            = (1 << 0);
+static const uint8_t stream_frame_start            = (1 << 7);
+static const uint8_t stream_frame_end              = (1 << 6);
+static const uint8_t stream_header_size            = 2;
+
+/// Type of function called when a stream is done.
+/// \a result is \c ESP_OK if the stack took all fragments, else the stream was aborted.
+typedef void (*stream_done_func)(uint16_t conn_id, esp_err_t result);
+
+/// Type of function called when a message of BLEServer::SendReliable() is done.
+/// \a result is \c ESP_OK if the client confirmed it, \c ESP_ERR_TIMEOUT if it didn't in time
+/// (BLE_RELIABLE_TIMEOUT_MS, BLE_RELIABLE_RETRIES), \c ESP_ERR_INVALID_STATE if the client
+/// disconnected and \c ESP_FAIL if the stack rejected it.
+typedef void (*reliable_done_func)(uint16_t conn_id, uint16_t handle, uint32_t id, esp_err_t result);
 // ------------------------------------------------------------------------------------------
-/// Type of handler function for read access to an attribute.
-/// Params are interface number and read parameter.
-typedef void (*event_handler_func)(esp_gatts_cb_event_t, esp_gatt_if_t, esp_ble_gatts_cb_param_t*);
+/// Statistics of the handler task, see BLEServer::GetHandlerStats().
+struct BLEHandlerStats
+{
+    /// Whether the handler task is running.
+    bool running;
+    /// Events passed to the handler task.
+    uint32_t queued;
+    /// Events the handlers were called for by the handler task.
+    uint32_t dispatched;
+    /// Events dropped because the ring was full.
+    uint32_t dropped;
+    /// Events waiting in the ring.
+    uint16_t pending;
+    /// Bytes of the ring occupied now / at most so far, and its size.
+    uint16_t used;
+    uint16_t max_used;
+    uint16_t capacity;
+};
 // ------------------------------------------------------------------------------------------
-typedef std::vector<BLEService::ptr> ServiceVector;
+/// AD types of the broadcast data (see BLEServer::StartBroadcast()): manufacturer specific
+/// data following a company identifier, or service data following a 16 bit service UUID.
+static const uint8_t broadcast_manufacturer_data   = 0xFF;
+static const uint8_t broadcast_service_data        = 0x16;
+
+/// Maximum bytes of broadcast data, leaving no room for the device name in the advertising data.
+static const uint8_t broadcast_max_data            = 17;
+// ------------------------------------------------------------------------------------------
+/// PHY preference bits of BLEConnProfile::phy_mask (same as ESP_BLE_GAP_PHY_*_PREF_MASK).
+static const uint8_t ble_phy_1m                    = (1 << 0);
+static const uint8_t ble_phy_2m                    = (1 << 1);
+static const uint8_t ble_phy_coded                 = (1 << 2);
+
+/// Connection parameters the server requests for a connection, see BLEServer::SetConnectionProfile().
+/// The central decides, the granted values are reported in BLEConnection.
+struct BLEConnProfile
+{
+    const char* name;
+    /// Connection interval range (1.25ms units).
+    uint16_t min_int;
+    uint16_t max_int;
+    /// Slave latency (connection events the server may skip).
+    uint16_t latency;
+    /// Supervision timeout (10ms units), has to exceed (1 + latency) * max_int * 2.
+    uint16_t timeout;
+    /// Link layer payload to request (27..251 bytes), 0 keeps the current one.
+    uint16_t tx_octets;
+    /// Preferred PHYs (\c ble_phy_*), 0 keeps the current one. Needs a BLE 5.0
+    /// controller (CONFIG_BT_BLE_50_FEATURES_SUPPORTED), ignored otherwise.
+    uint8_t phy_mask;
+};
+
+/// Requested when a client connects unless changed with BLEServer::SetDefaultProfile(): 20-40ms.
+inline constexpr BLEConnProfile ble_profile_default     = {"default", 0x10, 0x20, 0, 400, 0, 0};
+/// Interactive traffic: 7.5-15ms, no latency.
+inline constexpr BLEConnProfile ble_profile_low_latency = {"low-latency", 6, 12, 0, 200, 0, 0};
+/// Bulk transfers: 15-30ms leaving room for several packets per event, longest packets, 2M PHY.
+inline constexpr BLEConnProfile ble_profile_bulk        = {"bulk", 12, 24, 0, 400, 251, ble_phy_2m};
+/// Idle connections: 100-200ms, the server may skip 4 connection events.
+inline constexpr BLEConnProfile ble_profile_low_power   = {"low-power", 80, 160, 4, 600, 0, 0};
+/// Idle connections which have to become busy quickly: 30-50ms, the server may skip 10
+/// connection events, so it sends at the next event and listens every 330-550ms.
+inline constexpr BLEConnProfile ble_profile_idle        = {"idle", 24, 40, 10, 600, 0, 0};
+
+/// Profiles the server switches between by the traffic of a connection, see BLEServer::SetAdaptiveProfiles().
+struct BLEAdaptiveProfiles
+{
+    /// Requested while the connection is busy: requests of the client, congestion or
+    /// at least \a busy_notifications within a second.
+    const BLEConnProfile* active;
+    /// Requested after \a idle_ms without being busy.
+    const BLEConnProfile* idle;
+    /// Notifications per second making a connection busy, 0 if notifications don't count.
+    uint16_t busy_notifications;
+    uint32_t idle_ms;
+    /// Minimum time a connection keeps a profile (ms), against switching back and forth.
+    uint32_t hold_ms;
+};
+
+/// Low latency while busy, ble_profile_idle after 3s without requests of the client.
+inline constexpr BLEAdaptiveProfiles ble_adaptive_default = {&ble_profile_low_latency, &ble_profile_idle, 5, 3000, 1000};
+
+// ------------------------------------------------------------------------------------------
+/// State of a connected client, see BLEServer::GetConnection().
+struct BLEConnection
+{
+    bool connected = false;
+    uint16_t conn_id = 0;
+    esp_bd_addr_t bda = {0};
+    /// ATT MTU exchanged with the client.
+    uint16_t mtu = ESP_GATT_DEF_BLE_MTU_SIZE;
+    /// Connection interval (1.25ms units).
+    uint16_t interval = 0;
+    /// Slave latency (connection events).
+    uint16_t latency = 0;
+    /// Supervision timeout (10ms units).
+    uint16_t timeout = 0;
+    /// Profile requested last (or \c nullptr), see BLEServer::SetConnectionProfile().
+    const BLEConnProfile* profile = nullptr;
+    /// Profiles requested since the client connected.
+    uint32_t profile_requests = 0;
+    /// Status of the last connection parameter update (\c ESP_BT_STATUS_UNACCEPT_CONN_INTERVAL
+    /// if the central rejected the interval range).
+    esp_bt_status_t update_status = ESP_BT_STATUS_SUCCESS;
+    /// Link layer payload granted for sending (bytes).
+    uint16_t tx_octets = 27;
+    /// PHY used for sending and receiving (\c ESP_BLE_GAP_PHY_1M, 2M or CODED).
+    uint8_t tx_phy = 1;
+    uint8_t rx_phy = 1;
+    /// Bit n is set if the client enabled notifications in the client configuration
+    /// descriptor (0x2902) n of the server, counting in order of the handles.
+    uint32_t notify_bits = 0;
+    /// Same for indications.
+    uint32_t indicate_bits = 0;
+    /// Whether the client is bonded, its subscriptions are kept by the bond store (see BLEServer::SetBondStore()).
+    bool bonded = false;
+    /// Read and write requests of the client.
+    uint32_t reads = 0;
+    uint32_t writes = 0;
+};
+
+/// Type of function called when the central answered a request of a profile
+/// (connection parameters, data length or PHY), see BLEServer::SetConnectionUpdateHandler().
+typedef void (*conn_update_func)(const BLEConnection& connection);
 // ------------------------------------------------------------------------------------------
 class BLEServer
 {
 protected:
-    /// Mapping of event handler functions.
-    /// Initially when registering attributes, the key is constructed from
-    /// the service instance id and the attribute index within this service.
-    /// As soon as the OnRegisterAttributes() method was successfully called,
-    /// the key is the global handle of the attribute.
-    std::map<uint16_t, event_handler_func> m_event_handlers;
+    /// Event handler of an attribute, registered before its handle is known.
+    struct EventHandler
+    {
+        uint8_t service_id;
+        BLEService::size_type attribute_index;
+        uint8_t event_mask;
+        /// Attribute bound for replies (BLEService::npos if none) and its handle.
+        uint8_t reply_service_id;
+        BLEService::size_type reply_index;
+        uint16_t reply_handle;
+        BLEEventHandler handler;
+    };
+
+    /// Entry of the handle indexed dispatch table.
+    struct HandlerEntry
+    {
+        /// Index into m_event_handlers + 1, 0 if the handle has no handler.
+        uint8_t handler;
+        uint8_t event_mask;
+    };
+    static_assert(BLE_MAX_EVENT_HANDLERS < 256, "BLE_MAX_EVENT_HANDLERS must be less than 256");
+
+    /// Event handlers added with AddCharacteristic() or SetEventHandler(), keyed by
+    /// service id and attribute index. Fixed once the dispatch table is built, the
+    /// handler ring refers to its entries.
+    BLEVector<EventHandler, BLE_MAX_EVENT_HANDLERS> m_event_handlers;
+
+    /// Dispatch table indexed by (attribute handle - m_handler_base).
+    /// Built once when the last attribute table was created, so looking up
+    /// the handler of an event is a single indexed load.
+    BLEVector<HandlerEntry, BLE_MAX_HANDLE_RANGE> m_handlers;
+
+    /// Lowest attribute handle of all services (index 0 of m_handlers).
+    uint16_t m_handler_base = 0;
+
+    /// Number of attribute table creation events received so far.
+    uint8_t m_tables_created = 0;
 
     /// Vector of service pointers.
     ServiceVector m_services;
 
+    /// Data sent by Stream(), fragments are read from the buffers of the caller.
+    struct StreamState
+    {
+        const BLEStreamBuffer* parts = nullptr;
+        uint8_t part_count = 0;
+        /// Single buffer of Stream(conn_id, handle, data, len).
+        BLEStreamBuffer single = {nullptr, 0};
+        uint16_t handle = 0;
+        uint8_t flags = 0;
+        /// Data bytes per fragment.
+        uint16_t payload = 0;
+        size_t total = 0;
+        uint32_t fragments = 0;
+        /// Next fragment to send.
+        uint32_t next = 0;
+        /// Fragments taken by the stack.
+        uint32_t confirmed = 0;
+        /// Fragments sent and not confirmed yet.
+        uint8_t in_flight = 0;
+        /// Part containing the last fragment read and its offset in the stream.
+        uint8_t cursor_part = 0;
+        size_t cursor_offset = 0;
+        stream_done_func on_done = nullptr;
+
+        bool IsActive(void) const { return parts != nullptr; }
+    };
+
+    /// Tag of the indications of SendReliable() in the notification queue of a connection.
+    static const uint8_t reliable_tag = 1;
+
+    /// Message of SendReliable().
+    struct ReliableMessage
+    {
+        uint32_t id;
+        /// Time (us) the confirmation or acknowledgement is due, while sent.
+        int64_t deadline;
+        uint16_t handle;
+        uint16_t len;
+        /// Notified with a sequence number and acknowledged by the client, otherwise indicated.
+        bool ack;
+        /// Indication in the notification queue, its confirmation is still to come after a timeout.
+        bool queued;
+        uint8_t seq;
+        uint8_t retries;
+        uint8_t value[BLE_RELIABLE_VALUE_SIZE];
+    };
+
+    /// Ring of the reliable messages of a connection. Messages are sent in order: up to
+    /// BLE_RELIABLE_WINDOW acknowledged ones at a time, an indication alone.
+    struct ReliableState
+    {
+        ReliableMessage messages[BLE_RELIABLE_QUEUE_LENGTH];
+        uint8_t head = 0;
+        uint8_t count = 0;
+        /// Messages from the head on sent and not confirmed yet.
+        uint8_t sent = 0;
+        uint8_t next_seq = 0;
+        /// Indications in the notification queue of messages that timed out, their confirmations
+        /// come first and are ignored.
+        uint8_t late = 0;
+
+        ReliableMessage& Get(uint8_t i) { return messages[(head + i) % BLE_RELIABLE_QUEUE_LENGTH]; }
+    };
+
+    /// Traffic of a connection for the adaptive profiles (m_adaptive).
+    struct AdaptiveState
+    {
+        /// Whether the profiles of the connection adapt (not chosen by SetConnectionProfile()).
+        bool enabled = false;
+        /// Whether the active profile was requested last, otherwise the idle one.
+        bool active = false;
+        /// Notifications since window_start (us), counted per second.
+        uint16_t notifications = 0;
+        int64_t window_start = 0;
+        /// Time (us) the connection was busy last.
+        int64_t last_busy = 0;
+        /// Time (us) a profile was requested last (or -1).
+        int64_t last_request = -1;
+    };
+
+    /// Long write (prepare write requests) of a connection answered by the server.
+    struct PrepareState
+    {
+        static const uint8_t no_buffer = 0xFF;
+        /// Buffer of m_prepare_pool or \c no_buffer
+        uint8_t buffer = no_buffer;
+        uint16_t handle = 0;
+        /// Length of the value written so far.
+        uint16_t len = 0;
+        /// Maximum length of the attribute value (at most BLE_PREPARE_BUFFER_SIZE).
+        uint16_t max_len = 0;
+        /// Error to report with the execute write response.
+        esp_gatt_status_t status = ESP_GATT_OK;
+        /// The stack answered prepare writes itself (attributes with \c ESP_GATT_AUTO_RSP).
+        bool stack_prepared = false;
+    };
+
+    /// Connection table entry: the public state and everything needed for sending and long writes.
+    struct Connection : public BLEConnection
+    {
+        /// Set by ESP_GATTS_CONGEST_EVT or a confirmation with ESP_GATT_CONGESTED, nothing is sent until cleared.
+        bool congested = false;
+        /// Confirmations of packets sent again after a rejection, still to be ignored.
+        uint8_t stale = 0;
+        /// Time (us) the statistics were reset.
+        int64_t stats_start = 0;
+        BLENotifyStats stats = BLENotifyStats();
+        BLENotifyQueue queue;
+        StreamState stream;
+        ReliableState reliable;
+        AdaptiveState adaptive;
+        PrepareState prepare;
+        /// Profile to restore when the stream is done (m_stream_profile was applied).
+        const BLEConnProfile* stream_restore = nullptr;
+        /// Subscriptions of a bonded client changed and are not saved yet.
+        bool bond_dirty = false;
+        /// Limited values missed this connection (LimitedValue::pending).
+        bool limited_pending = false;
+# ifdef BLE_SERVER_INSTRUMENTATION
+        /// Time (us) of the last write not answered by a notification yet (or -1).
+        int64_t write_time = -1;
+# endif
+    };
+
+    /// Connection table indexed by connection id.
+    Connection m_connections[BLE_MAX_CONNECTIONS];
+
+    /// Client configuration descriptor (0x2902) of a characteristic.
+    struct ConfigEntry
+    {
+        /// Handle of the descriptor.
+        uint16_t handle;
+        /// Handle of the characteristic value it belongs to.
+        uint16_t value_handle;
+        /// Whether the server answers reads and writes with the state of the connection.
+        bool by_app;
+    };
+
+    /// Client configuration descriptors of all services, the index is the bit in
+    /// BLEConnection::notify_bits and indicate_bits.
+    BLEVector<ConfigEntry, BLE_MAX_CONFIG_DESCRIPTORS> m_configs;
+
+    /// Characteristic whose value is computed when it's read.
+    struct ReadProvider
+    {
+        uint8_t service_id;
+        BLEService::size_type attribute_index;
+        /// Handle of the value (0 until the attribute tables are created).
+        uint16_t handle;
+        read_provider_func func;
+        /// Time (us) a computed value answers reads again, 0 computes it for every read.
+        uint32_t cache_us;
+        /// Last computed value, also answering reads with an offset (long values).
+        uint8_t* value;
+        uint16_t max_length;
+        uint16_t length;
+        /// Time (us) the value was computed (or -1) and the connection it was computed for.
+        int64_t computed;
+        uint16_t conn_id;
+    };
+
+    BLEVector<ReadProvider, BLE_MAX_READ_PROVIDERS> m_read_providers;
+
+    /// Characteristic value with limited notifications, see SetNotifyLimit().
+    struct LimitedValue
+    {
+        uint8_t service_id;
+        BLEService::size_type attribute_index;
+        /// Handle of the value (0 until the attribute tables are created).
+        uint16_t handle;
+        BLENotifyLimit limit;
+        /// Whether value differs from sent beyond the deadband and has to be notified.
+        bool dirty;
+        uint16_t length;
+        uint16_t sent_length;
+        /// Time (us) of the last flush of the value (or -1).
+        int64_t flushed;
+        /// Bit n is set if connection n missed the value flushed last because its queue
+        /// was full, it's queued again when the queue has room.
+        uint16_t pending;
+        /// Latest value and the one notified last.
+        uint8_t value[BLE_NOTIFY_LIMIT_VALUE_SIZE];
+        uint8_t sent[BLE_NOTIFY_LIMIT_VALUE_SIZE];
+    };
+
+    BLEVector<LimitedValue, BLE_MAX_NOTIFY_LIMITS> m_limited_values;
+    static_assert(BLE_MAX_CONNECTIONS <= 16, "LimitedValue::pending has a bit per connection.");
+    /// Called when a reliable message is done (or \c nullptr).
+    reliable_done_func m_reliable_done = nullptr;
+    /// Whether clients acknowledge reliable messages sent as notifications (SetReliableAck()).
+    bool m_reliable_ack = false;
+    /// One-shot timer of the next reliable message timing out.
+    esp_timer_handle_t m_reliable_timer = nullptr;
+    /// Time (us) m_reliable_timer fires (or -1 if not started).
+    int64_t m_reliable_due = -1;
+
+    /// One-shot timer of the next flush pass of dirty values.
+    esp_timer_handle_t m_flush_timer = nullptr;
+    /// Time (us) m_flush_timer fires (or -1 if not started).
+    int64_t m_flush_due = -1;
+
+    /// Set by EnableGATTCaching().
+    bool m_gatt_caching = false;
+    /// Hash of the attribute tables of the server (little endian), computed when they are created
+    /// for GATT caching or a bond store.
+    uint8_t m_database_hash[database_hash_size] = {0};
+    bool m_database_hash_valid = false;
+
+    /// Storage of the subscriptions of bonded clients (or \c nullptr), see SetBondStore().
+    BLEBondStore* m_bond_store = nullptr;
+    /// Records of disconnected clients not saved yet, newer than the ones in the store.
+    BLEBondRecord m_bond_pending[BLE_MAX_CONNECTIONS];
+    uint8_t m_bond_pending_count = 0;
+    /// One-shot timer saving the changed records.
+    esp_timer_handle_t m_bond_timer = nullptr;
+    /// Time (us) m_bond_timer fires (or -1 if not started).
+    int64_t m_bond_due = -1;
+    /// Set by the destructor with the final save, a callback of m_bond_timer saves nothing anymore.
+    bool m_bond_closed = false;
+    /// Callbacks of m_bond_timer running, the destructor waits for them.
+    std::atomic<uint8_t> m_bond_callbacks = 0;
+
+    /// Whether advertising was started and not stopped by a connection yet.
+    bool m_advertising = false;
+
+    /// Profile requested for new connections.
+    const BLEConnProfile* m_default_profile = &ble_profile_default;
+    /// Profile applied while a connection streams (or \c nullptr).
+    const BLEConnProfile* m_stream_profile = nullptr;
+    conn_update_func m_on_conn_update = nullptr;
+    /// Profiles switched by the traffic of a connection (or \c nullptr).
+    const BLEAdaptiveProfiles* m_adaptive = nullptr;
+    /// One-shot timer of the next connection going idle.
+    esp_timer_handle_t m_adaptive_timer = nullptr;
+    /// Time (us) m_adaptive_timer fires (or -1 if not started).
+    int64_t m_adaptive_due = -1;
+
+    /// Connections with a data length request pending, in order of the requests
+    /// (the completion event doesn't tell the connection).
+    uint8_t m_data_length_pending[BLE_MAX_CONNECTIONS];
+    uint8_t m_data_length_count = 0;
+
+    /// Events passed from the BTC task to the handler task.
+    BLEEventRing m_event_ring;
+
+    /// Handler task (or \c nullptr if handlers are called on the BTC task). It's cleared by the
+    /// task itself, with the lock held, when it stops with the ring empty, so events keep going
+    /// into the ring while it's stopping.
+    TaskHandle_t m_handler_task = nullptr;
+    std::atomic<bool> m_handler_stop = false;
+    std::atomic<bool> m_handler_running = false;
+    std::atomic<uint32_t> m_handler_dropped = 0;
+# ifdef BLE_SERVER_STATIC_STORAGE
+    StackType_t m_handler_stack[BLE_HANDLER_TASK_STACK_SIZE];
+    StaticTask_t m_handler_tcb;
+# endif
+
+# ifdef BLE_SERVER_INSTRUMENTATION
+    BLEInstrumentation m_instrumentation;
+# endif
+
+# ifdef BLE_SERVER_TRACE
+    BLETraceRing m_trace;
+# endif
+
+# ifdef BLE_SERVER_RECORD
+    BLEEventRecorder m_recorder;
+# endif
+
+    /// Guards the server state against the handler task and other application tasks,
+    /// held while the stack events are handled.
+    SemaphoreHandle_t m_lock;
+    StaticSemaphore_t m_lock_buffer;
+
+    /// Buffers for long writes, no allocation per request.
+    uint8_t m_prepare_pool[BLE_PREPARE_BUFFERS][BLE_PREPARE_BUFFER_SIZE];
+
+    /// Connection id using the buffer of m_prepare_pool (or BLE_MAX_CONNECTIONS if free).
+    uint8_t m_prepare_owner[BLE_PREPARE_BUFFERS];
+
+    /// Response of prepare writes and reads answered by the server, too large for the stack of the BTC task.
+    esp_gatt_rsp_t m_rsp;
+
+    /// Assembles stream fragments with a header or spanning several buffers.
+    uint8_t m_fragment[ESP_GATT_MAX_MTU_SIZE - 3];
+
+# ifdef BLE_SERVER_STATIC_STORAGE
+    /// Storage of the services pointed to by m_services.
+    alignas(BLEService) uint8_t m_service_storage[BLE_MAX_SERVICES][sizeof(BLEService)];
+# endif
+
     /// Name of the device which this server represents.
-    std::string m_device_name;
+    BLEString m_device_name;
 
     uint8_t m_adv_config_done = 0;
 
+    /// Data broadcast in the advertising data (see StartBroadcast()), no allocation per update.
+    uint8_t m_broadcast_data[broadcast_max_data];
+    uint8_t m_broadcast_len = 0;
+    /// AD type (0 if not broadcasting) and company identifier or service UUID.
+    uint8_t m_broadcast_type = 0;
+    uint16_t m_broadcast_id = 0;
+    /// Whether the advertising data has to be set again.
+    bool m_broadcast_changed = false;
+    /// Periodic timer setting changed broadcast data.
+    esp_timer_handle_t m_broadcast_timer = nullptr;
+
     /// Maximum transfer unit size. Data blocks should not
     /// exceed this.
     uint16_t m_mtu = 500;
 
-    /// Global advertising parameters. 
-    static esp_ble_adv_params_t adv_params;
+    /// Advertising parameters of this instance, see SetAdvertisingParams().
+    esp_ble_adv_params_t m_adv_params;
+    static const esp_ble_adv_params_t default_adv_params;
 
     /// Interface for this instance.
-    esp_gatt_if_t m_gatts_if;
+    esp_gatt_if_t m_gatts_if = ESP_GATT_IF_NONE;
 
     void OnAttributesTableCreated(esp_ble_gatts_cb_param_t *param);
+    void BuildHandlerTable(void);
+
+    /// Calls the handler \a entry with the context of the event.
+    void CallHandler(
+        const EventHandler& entry, uint16_t handle,
+        esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param
+    );
     void OnRegisterAttributes(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param);
     void OnConnect(esp_ble_gatts_cb_param_t* param);
+    void OnDisconnect(esp_ble_gatts_cb_param_t* param);
+    void OnCongest(esp_ble_gatts_cb_param_t* param);
+    void OnNotifyConfirm(esp_ble_gatts_cb_param_t* param);
+    esp_err_t QueueNotification(uint16_t conn_id, uint16_t handle, const uint8_t* value, uint16_t len, bool need_confirm, uint8_t tag = 0);
+    void FlushNotifications(uint16_t conn_id);
+    LimitedValue* FindLimitedValue(uint16_t handle);
+    void ScheduleFlush(void);
+    static void OnFlushTimer(void* arg);
+    bool GetSubscription(uint16_t conn_id, uint16_t handle, bool& notify, bool& indicate) const;
+    void FlushReliable(uint16_t conn_id);
+    bool SendReliableMessage(uint16_t conn_id, ReliableMessage& message);
+    void OnReliableConfirm(uint16_t conn_id, bool delivered);
+    void FinishReliable(uint16_t conn_id, esp_err_t result);
+    void ScheduleReliableTimer(void);
+    static void OnReliableTimer(void* arg);
+    void CheckReliableTimeouts(void);
+    void FlushLimitedValues(void);
+    void RequeueLimitedValues(uint16_t conn_id);
+    void SendStreamFragments(uint16_t conn_id);
+    void OnStreamConfirm(uint16_t conn_id, esp_ble_gatts_cb_param_t* param);
+    void FinishStream(uint16_t conn_id, esp_err_t result);
+    const uint8_t* GetStreamFragment(StreamState& stream, uint32_t index, uint16_t& len);
     void OnEvent(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param);
     void OnExecWrite(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param);
     void OnPrepareWrite(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param);
+    void ReleasePrepareBuffer(uint16_t conn_id);
+    uint16_t GetMaxLength(uint16_t handle);
+    void AddConfigDescriptors(const BLEService& service);
+    size_t FindConfig(uint16_t handle) const;
+    bool OnConfigRead(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param);
+    void SendReadResponse(esp_gatt_if_t gatts_if, const esp_ble_gatts_cb_param_t::gatts_read_evt_param& read, const uint8_t* value, uint16_t len);
+    void ComputeDatabaseHash(void);
+    bool OnProviderRead(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param);
+    void GetBondRecord(const Connection& connection, BLEBondRecord& record) const;
+    void RestoreBond(Connection& connection);
+    void OnAuthComplete(esp_ble_gap_cb_param_t* param);
+    void OnRemoveBond(esp_ble_gap_cb_param_t* param);
+    void MarkBondDirty(Connection& connection);
+    void ScheduleBondSave(uint32_t delay_ms);
+    static void OnBondTimer(void* arg);
+    void SaveBonds(void);
+    void OnConfigWrite(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param);
+    void OnUpdateConnParams(esp_ble_gap_cb_param_t* param);
+    void CountNotification(Connection& channel, uint16_t handle);
+    void OnDataLength(esp_ble_gap_cb_param_t* param);
+    void OnPHYUpdate(esp_ble_gap_cb_param_t* param);
+    Connection* FindConnection(const esp_bd_addr_t bda);
+    esp_err_t ApplyProfile(Connection& connection, const BLEConnProfile* profile);
+    void NoteTraffic(Connection& channel, bool busy);
+    int64_t AdaptProfile(Connection& channel, int64_t now);
+    void ScheduleAdaptiveTimer(int64_t due);
+    static void OnAdaptiveTimer(void* arg);
+    void StartAdvertising(void);
+    void ConfigAdvertisingData(void);
+    static void OnBroadcastTimer(void* arg);
+    void UpdateBroadcast(void);
+    static void HandlerTask(void* arg);
+    void RunHandlers(void);
+    bool CanAddService(void) const;
 public:
     /// Create a server instance with given device name.
     /// \param mtu The initial maximum transfer unit set. May change when a client is connected,
     ///            so always use GetMTU().
     BLEServer(const char* device_name, uint16_t mtu = 500);
 
+    ~BLEServer();
+
+    BLEServer(const BLEServer&) = delete;
+    BLEServer& operator=(const BLEServer&) = delete;
+
+    /// Returns the memory used by the containers of all server instances together (not per
+    /// instance): heap bytes requested, or the occupied part of the fixed storage with BLE_SERVER_STATIC_STORAGE.
+    static BLEMemoryUsage GetMemoryUsage(void) { return BLEMemory::GetUsage(); }
+
     /// Adds a new characteristic followed by its value and an optional \a description.
     /// \param uuid Pointer to a static 2-Byte UUID of the value.
     /// \param properties Pointer to the static property flags (e.g. ESP_GATT_CHAR_PROP_BIT_WRITE | ESP_GATT_CHAR_PROP_BIT_READ)
@@ -150,8 +821,10 @@ public:
     /// \param length Current length of buffer pointer to by \a value
     /// \param value Pointer to the static buffer of current value.
     /// \param description Optional description string.
-    /// \param on_event Optional pointer to a function to be called when an event for this attribute is raised.
+    /// \param on_event Optional handler (function, lambda or bound member, see BLEEventHandler)
+    ///     to be called when an event for this attribute is raised.
     /// \param config_descr Optional configuration description value. If set, this adds an 0x2902 Attrbi
+    /// \param event_mask Events \a on_event is called for (\c evt_mask_*), default is all.
     /// \returns ID of characteristic value (!) currently added (or \c npos in case of error)
     ///     This is not the ID of the UUID charactistic, but this of its value.
     BLEService::size_type AddCharacteristic(
@@ -159,26 +832,352 @@ public:
         uint16_t permissions,
         uint16_t max_length, uint16_t length, uint8_t* value,
         const char* description = nullptr,
-        event_handler_func on_event = nullptr,
+        BLEEventHandler on_event = BLEEventHandler(),
         uint8_t* config_descr = nullptr,
-        uint8_t response = ESP_GATT_AUTO_RSP
+        uint8_t response = ESP_GATT_AUTO_RSP,
+        uint8_t event_mask = evt_mask_all
+    );
+
+    /// Adds a new characteristic whose value is computed by \a provider when a client reads it
+    /// (answered with \c ESP_GATT_RSP_BY_APP), instead of keeping a value buffer up to date.
+    /// \param value Buffer of \a max_length bytes receiving the computed value. It answers reads
+    ///     with an offset (long values read in parts) and, within \a cache_ms of the computation,
+    ///     further reads of the client it was computed for. With \a cache_ms 0 every read at offset 0
+    ///     computes the value again. Reads with an offset of a value computed again meanwhile are
+    ///     refused with \c gatt_status_value_changed.
+    /// The server answers the reads, they are not passed to \a on_event.
+    /// The other parameters and the result are the same as above.
+    BLEService::size_type AddCharacteristic(
+        const uint16_t* uuid, const uint8_t* properties,
+        uint16_t permissions,
+        uint16_t max_length, uint8_t* value,
+        read_provider_func provider,
+        uint32_t cache_ms = 0,
+        const char* description = nullptr,
+        BLEEventHandler on_event = BLEEventHandler(),
+        uint8_t* config_descr = nullptr,
+        uint8_t event_mask = evt_mask_all
+    );
+
+    /// Sets the read provider of attribute \a attribute_index of service \a service_id, which must be
+    /// added with \c ESP_GATT_RSP_BY_APP (e.g. a compile-time table). See AddCharacteristic() above.
+    /// Must be called before the attributes are registered. Its reads don't reach the event handler.
+    void SetReadProvider(
+        uint8_t service_id, BLEService::size_type attribute_index,
+        uint8_t* value, uint16_t max_length, read_provider_func provider, uint32_t cache_ms = 0
+    );
+
+    /// Sets the event handler \a on_event for attribute \a attribute_index of service \a service_id.
+    /// Must be called before the attributes are registered, an existing handler is replaced.
+    /// \param event_mask Events \a on_event is called for (\c evt_mask_*), default is all.
+    /// \param reply_service_id, reply_index Optional attribute whose handle is passed to
+    ///     \a on_event as BLEEventContext::reply_handle, e.g. the one notified with replies.
+    void SetEventHandler(
+        uint8_t service_id, BLEService::size_type attribute_index,
+        BLEEventHandler on_event, uint8_t event_mask = evt_mask_all,
+        uint8_t reply_service_id = BLEService::npos, BLEService::size_type reply_index = BLEService::npos
     );
 
     /// Adds a service \a uuid.
     /// All characteristics added using AddCharacteristic() are for this service now, until
     /// a new one follows.
+    /// \returns ID of the service (or \c BLEService::npos if BLE_MAX_SERVICES is reached)
     uint8_t AddService(uint16_t uuid);
 
-    /// Gets handle of attribute with index \a attribute_index registered at service \a service_id.
+    /// Adds a service defined by the constant attribute table \a attributes with \a count entries.
+    /// The first entry has to be the primary service declaration. The table is referenced, not copied,
+    /// so it has to stay valid. AddCharacteristic() cannot add to this service.
+    uint8_t AddService(const esp_gatts_attr_db_t* attributes, uint8_t count);
+
+    /// Adds the service declared at compile time by the BLEServiceTable type \a TABLE (see ble_gatt_table.h).
+    template <class TABLE>
+    uint8_t AddService(void) { return AddService(TABLE::table.data(), TABLE::count); }
+
+    /// Enables GATT caching. The Generic Attribute service (0x1801) is the stack's own, bluedroid
+    /// registers it below the handles of the application; with CONFIG_BT_GATTS_ROBUST_CACHING_ENABLED
+    /// it has Client Supported Features and the Database Hash of the whole database, and refuses the
+    /// requests of change-unaware clients. A client reading an unchanged hash on reconnect can skip
+    /// the service discovery. The server computes the hash of its own tables (GetDatabaseHash()).
+    /// \returns \c ESP_OK, \c ESP_ERR_NOT_SUPPORTED without robust caching in the stack.
+    esp_err_t EnableGATTCaching(void);
+
+    /// Copies the hash (little endian, computed like the Database Hash) of the attribute tables of the
+    /// server to \a hash, e.g. to store it with the bond of a client and to call SendServiceChanged()
+    /// if it differs when the client connects again. Clients read the hash of the stack instead,
+    /// which covers its GAP and GATT services as well.
+    /// \returns \c false if the attribute tables are not created yet or neither EnableGATTCaching()
+    /// nor SetBondStore() was called.
+    bool GetDatabaseHash(uint8_t hash[database_hash_size]) const;
+
+    /// Tells client \a conn_id its cache of the attribute tables is stale: the stack indicates
+    /// Service Changed for all handles if the client subscribed and, if it enabled robust caching,
+    /// answers its requests with \c gatt_status_out_of_sync until it is change-aware again.
+    /// \returns \c ESP_OK, \c ESP_ERR_INVALID_STATE if not connected or the error of the stack.
+    esp_err_t SendServiceChanged(uint16_t conn_id);
+
+    /// Keeps the subscriptions (client configuration descriptors) of bonded clients in \a store (e.g. a BLENVSBondStore), keyed by their identity address.
+    /// A client becomes bonded with ESP_GAP_BLE_AUTH_CMPL_EVT and its record is erased with
+    /// ESP_GAP_BLE_REMOVE_BOND_DEV_COMPLETE_EVT (esp_ble_remove_bond_device()). When it connects
+    /// again, even after a restart, its subscriptions are restored before the first notification,
+    /// so notifications flow without the client writing the descriptors again. If the Database
+    /// Hash changed meanwhile, nothing is restored and Service Changed is indicated (SendServiceChanged()).
+    /// Changes are saved by the timer task after BLE_BOND_SAVE_DELAY_MS, batched with one commit,
+    /// and at once when the client disconnects. The store is referenced, so it has to stay valid.
+    /// Call it before clients connect, \c nullptr (the default) keeps nothing.
+    void SetBondStore(BLEBondStore* store);
+
+    /// Number of services added, the one added last has the ID GetServiceCount() - 1.
+    uint8_t GetServiceCount(void) const { return (uint8_t)m_services.size(); }
+
+    /// Gets handle of attribute with index \a attribute_index registered at service \a service_id
+    /// (0 until the attribute table of the service is created).
     uint16_t GetHandle(uint8_t service_id, uint8_t attribute_index);
 
+    /// Sets the value of attribute \a attribute_index of service \a service_id to \a length bytes
+    /// of \a value, answering reads by the stack from now on. Before the attribute table is created
+    /// \a value is copied to the buffer passed to AddCharacteristic() and becomes the initial value,
+    /// a table already handed to the stack gets it as soon as its handles are known.
+    /// \returns \c ESP_ERR_INVALID_SIZE if \a length exceeds the maximum length, \c ESP_ERR_NOT_SUPPORTED
+    ///     for a constant table not created yet, otherwise the result of esp_ble_gatts_set_attr_value().
+    esp_err_t SetAttributeValue(uint8_t service_id, BLEService::size_type attribute_index, uint16_t length, const uint8_t* value);
+
     /// Returns the current maximum transfer unit. After beeing connected to a client this value
-    /// may be changed.
+    /// may be changed. With several clients this is the MTU exchanged last, see GetMTU(conn_id).
     uint16_t GetMTU(void) const { return m_mtu; }
 
+    /// Returns the MTU of connection \a conn_id (default MTU if not connected).
+    uint16_t GetMTU(uint16_t conn_id) const;
+
+    /// Returns the state of connection \a conn_id (or \c nullptr if not connected).
+    /// Valid in event handlers for the connection of the event.
+    const BLEConnection* GetConnection(uint16_t conn_id) const;
+
+    /// Number of connected clients.
+    uint8_t GetConnectionCount(void) const;
+
+    /// Requests the connection parameters of \a profile for the client \a conn_id: interval,
+    /// latency and timeout, the data length and the PHY if set. The profile is referenced,
+    /// so it has to stay valid (e.g. \c ble_profile_low_latency). What the central granted is
+    /// reported in GetConnection() and to the handler set by SetConnectionUpdateHandler().
+    /// The profile of the connection doesn't adapt anymore (SetAdaptiveProfiles()).
+    /// \returns \c ESP_OK if the requests were passed to the stack, \c ESP_ERR_INVALID_STATE if not connected.
+    esp_err_t SetConnectionProfile(uint16_t conn_id, const BLEConnProfile* profile);
+
+    /// Sets the profile requested when a client connects (\c ble_profile_default initially).
+    void SetDefaultProfile(const BLEConnProfile* profile);
+
+    /// Sets the profile requested while Stream() sends to a connection, the one requested before
+    /// is restored when the stream is done. \c nullptr (the default) keeps the profile.
+    void SetStreamProfile(const BLEConnProfile* profile);
+
+    /// Lets the server choose the profile of every connection by its traffic: \a profiles->active
+    /// when a client connects and whenever it's busy, \a profiles->idle when it wasn't busy for
+    /// \a profiles->idle_ms. Requests of the client and congestion make a connection busy,
+    /// notifications from \a profiles->busy_notifications per second on. A connection keeps a
+    /// profile for \a profiles->hold_ms at least. The profiles are referenced (e.g. \c ble_adaptive_default).
+    /// SetConnectionProfile() ends the adaptation of a connection, the stream profile is kept while
+    /// streaming. \c nullptr (the default) stops adapting, the connections keep their profiles.
+    void SetAdaptiveProfiles(const BLEAdaptiveProfiles* profiles);
+
+    /// Sets the function called when the central answered a request of a profile
+    /// or changed the connection parameters itself, may be \c nullptr.
+    void SetConnectionUpdateHandler(conn_update_func on_update);
+
+    /// Whether client \a conn_id enabled notifications or indications for the characteristic
+    /// value \a handle in its client configuration descriptor.
+    bool IsSubscribed(uint16_t conn_id, uint16_t handle) const;
+
+    /// Sends \a len bytes of \a value for the characteristic value \a handle to all clients
+    /// which subscribed to it, as indication if a client enabled indications only.
+    /// \returns Number of connections the value was queued for.
+    uint8_t NotifyAll(uint16_t handle, const uint8_t* value, uint16_t len);
+
+    /// Limits the notifications of the value of attribute \a attribute_index of service \a service_id
+    /// (a characteristic value with a client configuration descriptor) to \a limit. Its value is then set
+    /// by UpdateValue() as often as it's sampled, and notified to the subscribed clients at most every
+    /// \a limit.min_interval_ms and only if it changed beyond the deadband.
+    /// Must be called before the attributes are registered.
+    void SetNotifyLimit(uint8_t service_id, BLEService::size_type attribute_index, const BLENotifyLimit& limit);
+
+    /// Sets the latest value of a characteristic with a notification limit. Nothing is sent here:
+    /// the value is marked dirty if it changed beyond the deadband, and dirty values are flushed
+    /// together by one pass on the timer task as soon as their interval allows. Each subscribed
+    /// connection gets all due values queued before its notifications are handed to the stack,
+    /// so they can go out in the same connection event. The flush sets the attribute value, too,
+    /// so reads answered by the stack return the value notified last.
+    /// \returns \c ESP_OK, \c ESP_ERR_NOT_FOUND if \a handle has no limit,
+    ///     \c ESP_ERR_INVALID_SIZE if \a len exceeds BLE_NOTIFY_LIMIT_VALUE_SIZE.
+    esp_err_t UpdateValue(uint16_t handle, const uint8_t* value, uint16_t len);
+
+    /// Sets the latest value of a characteristic with a notification limit to \a value, see above.
+    template <class T>
+    esp_err_t UpdateValue(uint16_t handle, const T& value) { return UpdateValue(handle, (const uint8_t*)&value, sizeof(T)); }
+
+    /// Sends a notification (or an indication if \a need_confirm) with \a len bytes of \a value
+    /// for the attribute \a handle to the client \a conn_id.
+    /// The value is copied into the queue of the connection and handed to the stack at once
+    /// if it isn't congested, otherwise as soon as the stack reports the congestion is over.
+    /// Packets rejected by the stack because of congestion are sent again, so the order is kept.
+    /// Don't mix it with esp_ble_gatts_send_indicate() for the same connection.
+    /// \returns \c ESP_OK, \c ESP_ERR_NO_MEM if the queue is full (counted as dropped),
+    ///     \c ESP_ERR_INVALID_SIZE if \a len exceeds MTU - 3, \c ESP_ERR_INVALID_STATE if not connected.
+    esp_err_t Notify(uint16_t conn_id, uint16_t handle, const uint8_t* value, uint16_t len, bool need_confirm = false);
+
+    /// Like Notify(), but the value is written by \a build with \a context directly into the
+    /// queue of the connection, up to \a max_len bytes (at most MTU - 3). \a build is called with
+    /// the server locked, so it must not block.
+    /// \returns \c ESP_OK (also if \a build sent nothing), \c ESP_ERR_NO_MEM if the queue is full
+    ///     (counted as dropped), \c ESP_ERR_INVALID_STATE if not connected.
+    esp_err_t NotifyInPlace(
+        uint16_t conn_id, uint16_t handle, uint16_t max_len,
+        notify_build_func build, void* context, bool need_confirm = false
+    );
+
+    /// Sends \a count buffers \a parts as one stream of notifications for the attribute \a handle
+    /// to the client \a conn_id, fragmented at the current ATT payload size (MTU - 3).
+    /// Fragments are read from the buffers when they are sent, so \a parts and the data
+    /// have to stay valid until \a on_done is called (or IsStreaming() is \c false).
+    /// Fragments are sent back-to-back with the flow control of Notify(), notifications
+    /// sent by Notify() meanwhile go first.
+    /// \param flags \c stream_flag_header adds a header to each fragment for reassembly.
+    /// \returns \c ESP_OK, \c ESP_ERR_INVALID_STATE if not connected or another stream is running.
+    esp_err_t Stream(
+        uint16_t conn_id, uint16_t handle, const BLEStreamBuffer* parts, uint8_t count,
+        uint8_t flags = 0, stream_done_func on_done = nullptr
+    );
+
+    /// Sends \a len bytes of \a data as one stream, see above.
+    esp_err_t Stream(
+        uint16_t conn_id, uint16_t handle, const uint8_t* data, size_t len,
+        uint8_t flags = 0, stream_done_func on_done = nullptr
+    );
+
+    /// Whether a stream is running for connection \a conn_id.
+    bool IsStreaming(uint16_t conn_id) const;
+
+    /// Delivers \a len bytes of \a value (at most BLE_RELIABLE_VALUE_SIZE) of attribute \a handle
+    /// reliably to the client \a conn_id, e.g. an alarm, and reports the result with \a id to the
+    /// handler of SetReliableHandler(). Messages are queued per connection (BLE_RELIABLE_QUEUE_LENGTH)
+    /// and delivered in order:
+    /// - as indication if the client subscribed to indications, the next one is sent when the
+    ///   client confirmed it. It goes through the notification queue of the connection like Notify()
+    ///   with \a need_confirm, tagged, so only its own confirmation counts. The stack keeps an
+    ///   indication until it's confirmed, so it's not sent again, the next one waits for it.
+    /// - as notification with a sequence number in front if the client subscribed to notifications
+    ///   and SetReliableAck() is set: up to BLE_RELIABLE_WINDOW are sent before the client
+    ///   acknowledges them, unacknowledged ones are sent again after the timeout.
+    /// With acknowledgements the characteristic should not be notified by Notify() or Stream() at the same time.
+    /// \returns \c ESP_OK, \c ESP_ERR_INVALID_STATE if not connected or not subscribed, \c ESP_ERR_NO_MEM
+    ///     if the queue is full, \c ESP_ERR_INVALID_SIZE if the value is too long.
+    esp_err_t SendReliable(uint16_t conn_id, uint16_t handle, const uint8_t* value, uint16_t len, uint32_t id = 0);
+
+    /// Sets the function called when a message of SendReliable() is done (may be \c nullptr).
+    /// It's called with the server locked.
+    void SetReliableHandler(reliable_done_func on_done);
+
+    /// Lets clients subscribed to notifications acknowledge reliable messages by writing the
+    /// sequence number (1 byte) of the last one received in order to attribute \a attribute_index
+    /// of service \a service_id (sets its event handler). Must be called before the attributes are registered.
+    void SetReliableAck(uint8_t service_id, BLEService::size_type attribute_index);
+
+    /// Acknowledges the reliable messages of \a conn_id up to sequence number \a seq, for
+    /// acknowledgements received another way than SetReliableAck().
+    void AckReliable(uint16_t conn_id, uint8_t seq);
+
+    /// Number of reliable messages of \a conn_id queued and not confirmed yet.
+    uint8_t GetReliableCount(uint16_t conn_id) const;
+
+    /// Returns the notification queue statistics of connection \a conn_id.
+    BLENotifyStats GetNotifyStats(uint16_t conn_id) const;
+
+    /// Resets the counters and the rate measurement of connection \a conn_id.
+    void ResetNotifyStats(uint16_t conn_id);
+
+    /// Copies the counters and histograms of the server into \a snapshot.
+    /// \returns \c false if the library is built without BLE_SERVER_INSTRUMENTATION.
+    bool GetInstrumentation(BLEInstrumentation& snapshot) const;
+
+    /// Clears the counters and histograms.
+    void ResetInstrumentation(void);
+
+    /// Moves as many trace records (see ble_trace.h) as fit into \a buffer, e.g. answering
+    /// the read of a diagnostics characteristic. Doesn't take the server mutex, but only one
+    /// task may read the trace.
+    /// \returns Bytes written (0 if the library is built without BLE_SERVER_TRACE).
+    size_t ReadTrace(uint8_t* buffer, size_t size);
+
+    /// Prints all trace records as hex lines to the console.
+    /// \returns Number of records printed (0 if the library is built without BLE_SERVER_TRACE).
+    size_t PrintTrace(void);
+
+    /// Passes every event entering HandleGATTEvent() and HandleGAPEvent() as binary record
+    /// (see ble_record.h) to \a write, starting with the file header. \a write is called on
+    /// the BTC task with the server locked, so it should just append the record to a buffer
+    /// or file. \c nullptr stops recording.
+    /// \returns \c ESP_OK, \c ESP_ERR_NOT_SUPPORTED if the library is built without BLE_SERVER_RECORD.
+    esp_err_t SetRecorder(record_write_func write, void* context = nullptr);
+
+    /// Calls the event handlers on a task of its own instead of the BTC task, so slow handlers
+    /// don't hold up the stack. Events are copied into a ring of BLE_HANDLER_RING_SIZE bytes
+    /// (including the written value) and handled in order by the task. Events not fitting into
+    /// the ring are dropped and counted (GetHandlerStats()), handlers never run on the BTC task
+    /// while the task is running.
+    /// Handlers answering reads or writes (\c ESP_GATT_RSP_BY_APP) have to do so within the
+    /// ATT timeout of 30 s. GetConnection() may change meanwhile, Notify() and the other
+    /// methods can be called from the handlers.
+    /// \returns \c ESP_OK, \c ESP_ERR_INVALID_STATE if already running, \c ESP_ERR_NO_MEM if the task cannot be created.
+    esp_err_t StartHandlerTask(UBaseType_t priority = BLE_HANDLER_TASK_PRIORITY, BaseType_t core = BLE_HANDLER_TASK_CORE);
+
+    /// Stops the handler task after it handled the queued events, including the ones arriving
+    /// while it's stopping. Handlers are called on the BTC task again when it returns.
+    /// Must not be called by a handler.
+    void StopHandlerTask(void);
+
+    /// Returns the statistics of the handler task and the occupancy of its ring.
+    BLEHandlerStats GetHandlerStats(void) const;
+
+    /// Sets the parameters used when this server (re)starts advertising, e.g. the interval.
+    /// Takes effect with the next start, each server instance has its own.
+    void SetAdvertisingParams(const esp_ble_adv_params_t& params);
+    const esp_ble_adv_params_t& GetAdvertisingParams(void) const { return m_adv_params; }
+
+    /// Broadcasts the data set by SetBroadcastData() in the advertising data, so any number of
+    /// observers can read it without connecting: as manufacturer specific data of company \a id
+    /// (\c broadcast_manufacturer_data) or as service data of service \a id (\c broadcast_service_data).
+    /// Changed data is put into the advertising data at most every \a interval_ms, advertising
+    /// goes on meanwhile. The device name is shortened to the room left.
+    /// Like advertising, the broadcast pauses while all BLE_MAX_CONNECTIONS are in use.
+    esp_err_t StartBroadcast(uint16_t id, uint8_t type = broadcast_manufacturer_data, uint32_t interval_ms = 1000);
+
+    /// Removes the broadcast data from the advertising data.
+    void StopBroadcast(void);
+
+    /// Copies \a len bytes of \a data (at most \c broadcast_max_data) to be broadcast with the
+    /// next update, cheap enough to be called for every measurement.
+    esp_err_t SetBroadcastData(const void* data, uint8_t len);
+
+    /// Broadcasts the bytes of \a data, a packed struct of the telemetry values (little endian on the ESP32).
+    template <typename T>
+    esp_err_t SetBroadcastData(const T& data)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "Broadcast data must be a plain struct");
+        static_assert(sizeof(T) <= broadcast_max_data, "Broadcast data exceeds broadcast_max_data");
+        return SetBroadcastData(&data, (uint8_t)sizeof(T));
+    }
+
     /// Event handler to be called for GATT events.
     void HandleGATTEvent(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param);
 
     /// Event handler to be called for GAP events.
     void HandleGAPEvent(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param);
-};
\ No newline at end of file
+};
+// ------------------------------------------------------------------------------------------
+inline esp_err_t BLEEventContext::Reply(const uint8_t* value, uint16_t len, bool need_confirm) const
+{
+    return server->Notify(conn_id, reply_handle, value, len, need_confirm);
+}
+// ------------------------------------------------------------------------------------------
+inline esp_err_t BLEEventContext::ReplyInPlace(uint16_t max_len, notify_build_func build, void* context, bool need_confirm) const
+{
+    return server->NotifyInPlace(conn_id, reply_handle, max_len, build, context, need_confirm);
+}
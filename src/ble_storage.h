@@ -0,0 +1,211 @@
+# pragma once
+// ------------------------------------------------------------------------------------------
+/*
+Storage used by the BLE server: either heap based standard containers with an
+allocator accounting every byte, or fixed-capacity inline containers
+(BLE_SERVER_STATIC_STORAGE, see ble_config.h). Both report to BLEMemory.
+*/
+// ------------------------------------------------------------------------------------------
+# include "ble_config.h"
+# include <cstddef>
+# include <cstdint>
+# include <cstring>
+# include <cassert>
+# include <new>
+# include <atomic>
+# include <vector>
+# include <string>
+// ------------------------------------------------------------------------------------------
+/// Memory used by the BLE server containers, in bytes.
+struct BLEMemoryUsage
+{
+    /// Bytes currently used: heap bytes requested plus the occupied bytes of the reserved
+    /// buffers (records of a notification queue, prepare buffers in use, elements of the fixed
+    /// containers), so \c used never exceeds the heap bytes plus \c reserved.
+    size_t used;
+    /// Highest value of \c used seen so far.
+    size_t high_water;
+    /// Bytes of the fixed buffers inside the instances, in every storage mode: notification
+    /// queues, the event ring, the trace ring, the prepare pool and, with BLE_SERVER_STATIC_STORAGE,
+    /// the fixed containers.
+    size_t reserved;
+};
+// ------------------------------------------------------------------------------------------
+/// Accounting of the memory used by the BLE server containers. The counters are global,
+/// summed over all server instances, and atomic: the containers are changed by the
+/// application, the BTC task and the esp_timer task.
+class BLEMemory
+{
+public:
+    static void Acquire(size_t bytes)
+    {
+        size_t used = s_used.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+        size_t high_water = s_high_water.load(std::memory_order_relaxed);
+        while (used > high_water && !s_high_water.compare_exchange_weak(high_water, used, std::memory_order_relaxed))
+            ;
+    }
+    static void Release(size_t bytes) { s_used.fetch_sub(bytes, std::memory_order_relaxed); }
+    static void Reserve(size_t bytes) { s_reserved.fetch_add(bytes, std::memory_order_relaxed); }
+    static void Unreserve(size_t bytes) { s_reserved.fetch_sub(bytes, std::memory_order_relaxed); }
+
+    static BLEMemoryUsage GetUsage(void)
+    {
+        return {s_used.load(std::memory_order_relaxed), s_high_water.load(std::memory_order_relaxed),
+            s_reserved.load(std::memory_order_relaxed)};
+    }
+
+    /// Sets the high-water mark to the current usage.
+    static void ResetHighWater(void) { s_high_water.store(s_used.load(std::memory_order_relaxed), std::memory_order_relaxed); }
+
+protected:
+    static std::atomic<size_t> s_used;
+    static std::atomic<size_t> s_high_water;
+    static std::atomic<size_t> s_reserved;
+};
+// ------------------------------------------------------------------------------------------
+/// Allocator accounting all bytes requested by a standard container in BLEMemory.
+template <class T>
+struct BLECountingAllocator
+{
+    typedef T value_type;
+
+    BLECountingAllocator() noexcept {}
+    template <class U> BLECountingAllocator(const BLECountingAllocator<U>&) noexcept {}
+
+    T* allocate(size_t n)
+    {
+        BLEMemory::Acquire(n * sizeof(T));
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t n) noexcept
+    {
+        BLEMemory::Release(n * sizeof(T));
+        ::operator delete(p);
+    }
+};
+
+template <class T, class U>
+bool operator==(const BLECountingAllocator<T>&, const BLECountingAllocator<U>&) { return true; }
+template <class T, class U>
+bool operator!=(const BLECountingAllocator<T>&, const BLECountingAllocator<U>&) { return false; }
+// ------------------------------------------------------------------------------------------
+/// Vector with inline storage for \a N elements of the POD type \a T.
+/// Implements the subset of std::vector used by the server, adding beyond the
+/// capacity is ignored (check full() before).
+template <class T, size_t N>
+class BLEFixedVector
+{
+public:
+    typedef T value_type;
+    typedef T* iterator;
+    typedef const T* const_iterator;
+
+    BLEFixedVector() { BLEMemory::Reserve(sizeof(m_data)); }
+    ~BLEFixedVector() { clear(); BLEMemory::Unreserve(sizeof(m_data)); }
+    BLEFixedVector(const BLEFixedVector&) = delete;
+    BLEFixedVector& operator=(const BLEFixedVector&) = delete;
+
+    size_t size(void) const { return m_size; }
+    static constexpr size_t capacity(void) { return N; }
+    bool empty(void) const { return m_size == 0; }
+    bool full(void) const { return m_size == N; }
+
+    T* data(void) { return m_data; }
+    const T* data(void) const { return m_data; }
+    T& operator[](size_t i) { return m_data[i]; }
+    const T& operator[](size_t i) const { return m_data[i]; }
+    T& back(void) { return m_data[m_size - 1]; }
+    const T& back(void) const { return m_data[m_size - 1]; }
+
+    iterator begin(void) { return m_data; }
+    iterator end(void) { return m_data + m_size; }
+    const_iterator begin(void) const { return m_data; }
+    const_iterator end(void) const { return m_data + m_size; }
+
+    void push_back(const T& value)
+    {
+        assert(!full());
+        if (full())
+            return;
+        m_data[m_size++] = value;
+        BLEMemory::Acquire(sizeof(T));
+    }
+
+    void resize(size_t count)
+    {
+        assert(count <= N);
+        if (count > N)
+            count = N;
+        for (size_t i = m_size; i < count; ++i)
+            m_data[i] = T();
+        SetSize(count);
+    }
+
+    void assign(size_t count, const T& value)
+    {
+        resize(count);
+        for (size_t i = 0; i < m_size; ++i)
+            m_data[i] = value;
+    }
+
+    void clear(void) { SetSize(0); }
+
+    /// Nothing to release, exists for the same usage as std::vector.
+    void shrink_to_fit(void) {}
+
+protected:
+    T m_data[N];
+    size_t m_size = 0;
+
+    void SetSize(size_t count)
+    {
+        if (count > m_size)
+            BLEMemory::Acquire((count - m_size) * sizeof(T));
+        else
+            BLEMemory::Release((m_size - count) * sizeof(T));
+        m_size = count;
+    }
+};
+// ------------------------------------------------------------------------------------------
+/// Zero-terminated string with inline storage for \a N characters, longer strings are truncated.
+template <size_t N>
+class BLEFixedString
+{
+public:
+    BLEFixedString(const char* str)
+    {
+        m_size = strnlen(str, N);
+        memcpy(m_data, str, m_size);
+        m_data[m_size] = '\0';
+    }
+
+    const char* c_str(void) const { return m_data; }
+    size_t size(void) const { return m_size; }
+
+protected:
+    char m_data[N + 1];
+    size_t m_size;
+};
+// ------------------------------------------------------------------------------------------
+/// Whether no element can be added to \a container.
+template <class T, class A>
+inline bool BLEIsFull(const std::vector<T, A>&) { return false; }
+
+template <class T, size_t N>
+inline bool BLEIsFull(const BLEFixedVector<T, N>& container) { return container.full(); }
+// ------------------------------------------------------------------------------------------
+# ifdef BLE_SERVER_STATIC_STORAGE
+/// Container for at most \a N elements of \a T.
+template <class T, size_t N>
+using BLEVector = BLEFixedVector<T, N>;
+
+typedef BLEFixedString<BLE_MAX_DEVICE_NAME> BLEString;
+# else
+/// Container for (typically at most) \a N elements of \a T.
+template <class T, size_t N>
+using BLEVector = std::vector<T, BLECountingAllocator<T>>;
+
+typedef std::basic_string<char, std::char_traits<char>, BLECountingAllocator<char>> BLEString;
+# endif
+// ------------------------------------------------------------------------------------------
@@ -0,0 +1,140 @@
+# include "ble_trace.h"
+# include "ble_storage.h"
+# include <esp_timer.h>
+# include <cstdio>
+# include <cstring>
+# include <algorithm>
+// -------------------------------------------------------------------------------------------------------------------
+BLETraceRing::BLETraceRing()
+:m_head(0)
+,m_tail(0)
+,m_lost(0)
+,m_lost_pending(0)
+{
+    BLEMemory::Reserve(sizeof(m_records));
+}
+// -------------------------------------------------------------------------------------------------------------------
+BLETraceRing::~BLETraceRing()
+{
+    BLEMemory::Unreserve(sizeof(m_records));
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLETraceRing::Add(BLETraceKind kind, uint8_t id, uint16_t conn_id, uint16_t handle, uint16_t arg,
+    const uint8_t* value, uint16_t len)
+{
+    uint32_t tail = m_tail.load(std::memory_order_relaxed);
+    uint32_t head = m_head.load(std::memory_order_acquire);
+    // lost records are reported before the next one
+    uint32_t needed = m_lost_pending ? 2 : 1;
+    if (capacity - (tail - head) < needed)
+    {
+        ++m_lost_pending;
+        m_lost.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    uint32_t time = (uint32_t)esp_timer_get_time();
+    if (m_lost_pending)
+    {
+        BLETraceRecord& lost = m_records[tail++ & (capacity - 1)];
+        memset(&lost, 0, sizeof(lost));
+        lost.time_us = time;
+        lost.kind = trace_lost;
+        lost.conn_id = BLETraceRecord::no_conn;
+        lost.data_len = sizeof(m_lost_pending);
+        memcpy(lost.data, &m_lost_pending, sizeof(m_lost_pending));
+        m_lost_pending = 0;
+    }
+
+    BLETraceRecord& record = m_records[tail++ & (capacity - 1)];
+    record.time_us = time;
+    record.kind = kind;
+    record.id = id;
+    record.conn_id = conn_id < BLETraceRecord::no_conn ? (uint8_t)conn_id : BLETraceRecord::no_conn;
+    record.handle = handle;
+    record.arg = arg;
+    record.data_len = value ? (uint8_t)std::min<uint16_t>(len, BLETraceRecord::max_data) : 0;
+    if (record.data_len)
+        memcpy(record.data, value, record.data_len);
+    memset(record.data + record.data_len, 0, BLETraceRecord::max_data - record.data_len);
+
+    m_tail.store(tail, std::memory_order_release);
+}
+// -------------------------------------------------------------------------------------------------------------------
+void BLETraceRing::AddGATTSEvent(esp_gatts_cb_event_t event, const esp_ble_gatts_cb_param_t& param)
+{
+    switch (event)
+    {
+        case ESP_GATTS_READ_EVT:
+            Add(trace_gatts_event, event, param.read.conn_id, param.read.handle, param.read.offset);
+            break;
+        case ESP_GATTS_WRITE_EVT:
+            Add(trace_gatts_event, event, param.write.conn_id, param.write.handle, param.write.len, param.write.value, param.write.len);
+            break;
+        case ESP_GATTS_EXEC_WRITE_EVT:
+            Add(trace_gatts_event, event, param.exec_write.conn_id, 0, param.exec_write.exec_write_flag);
+            break;
+        case ESP_GATTS_MTU_EVT:
+            Add(trace_gatts_event, event, param.mtu.conn_id, 0, param.mtu.mtu);
+            break;
+        case ESP_GATTS_CONF_EVT:
+            Add(trace_gatts_event, event, param.conf.conn_id, param.conf.handle, param.conf.status);
+            break;
+        case ESP_GATTS_CONNECT_EVT:
+            Add(trace_gatts_event, event, param.connect.conn_id, 0, 0, param.connect.remote_bda, sizeof(esp_bd_addr_t));
+            break;
+        case ESP_GATTS_DISCONNECT_EVT:
+            Add(trace_gatts_event, event, param.disconnect.conn_id, 0, param.disconnect.reason);
+            break;
+        case ESP_GATTS_CONGEST_EVT:
+            Add(trace_gatts_event, event, param.congest.conn_id, 0, param.congest.congested);
+            break;
+        case ESP_GATTS_RESPONSE_EVT:
+            Add(trace_gatts_event, event, BLETraceRecord::no_conn, param.rsp.handle, param.rsp.status);
+            break;
+        default:
+            Add(trace_gatts_event, event, BLETraceRecord::no_conn, 0, 0);
+            break;
+    }
+}
+// -------------------------------------------------------------------------------------------------------------------
+bool BLETraceRing::Pop(BLETraceRecord& record)
+{
+    uint32_t head = m_head.load(std::memory_order_relaxed);
+    if (head == m_tail.load(std::memory_order_acquire))
+        return false;
+    record = m_records[head & (capacity - 1)];
+    m_head.store(head + 1, std::memory_order_release);
+    return true;
+}
+// -------------------------------------------------------------------------------------------------------------------
+size_t BLETraceRing::Read(uint8_t* buffer, size_t size)
+{
+    size_t written = 0;
+    BLETraceRecord record;
+    while (size - written >= sizeof(record) && Pop(record))
+    {
+        memcpy(buffer + written, &record, sizeof(record));
+        written += sizeof(record);
+    }
+    return written;
+}
+// -------------------------------------------------------------------------------------------------------------------
+size_t BLETraceRing::Print(void)
+{
+    size_t count = 0;
+    BLETraceRecord record;
+    while (Pop(record))
+    {
+        // one line per record, so other console output can't tear it apart
+        char line[sizeof("BLETRACE ") + 2 * sizeof(record)] = "BLETRACE ";
+        char* out = line + sizeof("BLETRACE ") - 1;
+        const uint8_t* bytes = (const uint8_t*)&record;
+        for (size_t i = 0; i < sizeof(record); ++i, out += 2)
+            snprintf(out, 3, "%02x", bytes[i]);
+        puts(line);
+        ++count;
+    }
+    return count;
+}
+// -------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,114 @@
+# pragma once
+// ------------------------------------------------------------------------------------------
+/*
+Binary trace of a BLEServer, compiled in with BLE_SERVER_TRACE (see ble_config.h).
+
+Instead of formatting log strings on the BTC task, the server writes a fixed-size
+record per event into a RAM ring, drained later from another task: as raw records
+(BLEServer::ReadTrace(), e.g. answering the read of a diagnostics characteristic)
+or as hex lines to the console (BLEServer::PrintTrace()). host/tools/ble_trace_decode.py
+turns both back into readable lines.
+
+A record is 20 bytes, little endian (the layout of BLETraceRecord on the ESP32):
+
+    offset  size  content
+    0       4     time (us, esp_timer_get_time() truncated)
+    4       1     kind (trace_*)
+    5       1     event id (GATT server or GAP event, 1 for indications)
+    6       1     conn_id (0xFF if none)
+    7       1     bytes of value in data
+    8       2     attribute handle (0 if none)
+    10      2     argument: length, offset, status, MTU depending on the event
+    12      8     first bytes of the value
+
+Printed records are lines of "BLETRACE " followed by the 40 hex digits of a record.
+
+The ring is written by the server with its mutex held, so there's a single producer
+at any time, and read by one consumer without taking the mutex. If the ring is
+full, new records are counted and reported by a trace_lost record once there's
+room again.
+*/
+// ------------------------------------------------------------------------------------------
+# include "ble_config.h"
+# include <esp_gatts_api.h>
+# include <esp_gap_ble_api.h>
+# include <atomic>
+# include <cstddef>
+# include <cstdint>
+// ------------------------------------------------------------------------------------------
+/// Kinds of trace records.
+enum BLETraceKind : uint8_t
+{
+    trace_gatts_event = 0,  ///< GATT server event, id is the esp_gatts_cb_event_t
+    trace_gap_event = 1,    ///< GAP event, id is the esp_gap_ble_cb_event_t
+    trace_notify = 2,       ///< notification (id 0) or indication (id 1) queued, arg is the length
+    trace_dropped = 3,      ///< notification dropped as the queue is full, arg is the length
+    trace_send_failed = 4,  ///< sending a notification failed, arg is the esp_err_t
+    trace_lost = 5,         ///< records lost while the ring was full, data holds their number (u32)
+};
+// ------------------------------------------------------------------------------------------
+struct BLETraceRecord
+{
+    static constexpr uint8_t max_data = 8;
+    static constexpr uint8_t no_conn = 0xFF;
+
+    uint32_t time_us;
+    uint8_t kind;
+    uint8_t id;
+    uint8_t conn_id;
+    uint8_t data_len;
+    uint16_t handle;
+    uint16_t arg;
+    uint8_t data[max_data];
+};
+static_assert(sizeof(BLETraceRecord) == 20, "BLETraceRecord is read by ble_trace_decode.py");
+// ------------------------------------------------------------------------------------------
+class BLETraceRing
+{
+public:
+    BLETraceRing();
+    ~BLETraceRing();
+    BLETraceRing(const BLETraceRing&) = delete;
+    BLETraceRing& operator=(const BLETraceRing&) = delete;
+
+    /// Producer: appends a record with the first bytes of \a value.
+    void Add(BLETraceKind kind, uint8_t id, uint16_t conn_id, uint16_t handle, uint16_t arg,
+        const uint8_t* value = nullptr, uint16_t len = 0);
+
+    /// Producer: appends a record of a GATT server event.
+    void AddGATTSEvent(esp_gatts_cb_event_t event, const esp_ble_gatts_cb_param_t& param);
+
+    /// Producer: appends a record of a GAP event.
+    void AddGAPEvent(esp_gap_ble_cb_event_t event) { Add(trace_gap_event, (uint8_t)event, BLETraceRecord::no_conn, 0, 0); }
+
+    /// Consumer: moves as many records as fit into \a buffer.
+    /// \returns Bytes written, a multiple of sizeof(BLETraceRecord).
+    size_t Read(uint8_t* buffer, size_t size);
+
+    /// Consumer: prints all records as hex lines to stdout (the console UART on the ESP32).
+    /// \returns Number of records printed.
+    size_t Print(void);
+
+    /// Records written into the ring (including trace_lost ones) and lost so far.
+    uint32_t GetAddedCount(void) const { return m_tail.load(std::memory_order_relaxed); }
+    uint32_t GetLostCount(void) const { return m_lost.load(std::memory_order_relaxed); }
+
+    static constexpr size_t capacity = BLE_TRACE_RING_SIZE;
+    static_assert(capacity && (capacity & (capacity - 1)) == 0, "BLE_TRACE_RING_SIZE must be a power of two");
+
+protected:
+    BLETraceRecord m_records[capacity];
+    /// Records consumed (written by the consumer only).
+    std::atomic<uint32_t> m_head;
+    /// Records produced (written by the producer only).
+    std::atomic<uint32_t> m_tail;
+    /// Records lost (written by the producer only).
+    std::atomic<uint32_t> m_lost;
+    /// Records lost since the last trace_lost record (producer only).
+    uint32_t m_lost_pending;
+
+    /// Consumer: removes the oldest record into \a record.
+    /// \returns \c false if the ring is empty.
+    bool Pop(BLETraceRecord& record);
+};
+// ------------------------------------------------------------------------------------------
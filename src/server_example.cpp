@@ -13,6 +13,7 @@
 #include "esp_gatt_common_api.h"
 
 #include "ble_server.h" // contains BLE the Server-Class.
+#include "ble_command.h" // dispatcher of the commands written to the TX channel
 
 #include <string.h> // for memcpy
 
@@ -33,9 +34,7 @@ static const uint16_t
 static uint8_t
     v_rx[20] = {0},                    // readable value
     v_rx_config[2] = {0x00, 0x00},     // config for rx characteristic (required for notification)
-    v_tx[20] = {0},                    // writeable value
-    rx_svc_idx = 0,                    // index of service containing the rx characteristic
-    rx_char_idx = 0;                   // index of rx characteristic
+    v_tx[20] = {0};                    // writeable value
 
 // -------------------------------------------------------------------------------------------------------------------
 
@@ -53,65 +52,59 @@ static void OnGAPEvent(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *par
 
 // -------------------------------------------------------------------------------------------------------------------
 
-void OnChannelWrite(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param)
-{
-    // the characteristic to which this handler belongs to is write only.
-    // so the only event we receive here is ESP_GATTS_WRITE_EVT
-    assert(event == ESP_GATTS_WRITE_EVT);
-
-    esp_ble_gatts_cb_param_t::gatts_write_evt_param &data = param->write;
-
-    // we expect a command as header (0xAA), command id (1 Byte), footer (0x55)
-    if (data.len != 3)
-        return;
+// Commands written to the TX channel: header (0xAA), command id (1 Byte), footer (0x55).
+// Every command is answered with a notification of the RX channel.
 
-    // check header and footer
-    if (data.value[0] != 0xAA || data.value[2] != 0x55)
-        return;
-
-    uint8_t command = data.value[1]; // id of the command
-    uint8_t response_length = 0;
+static bool OnHello(uint16_t conn_id, const uint8_t* request, uint16_t len, uint8_t* reply, uint16_t& reply_len)
+{
+    reply_len = 5;
+    memcpy(reply, "Hello", reply_len);
+    return true;
+}
 
-    switch(command)
-    {
-        case 0x01:
-            response_length = 5;
-            memcpy(v_tx, "Hello", response_length);
-            break;
-        case 0x02:
-            response_length = 3;
-            memcpy(v_tx, "Bye", response_length);
-            break;
-        default:
-            response_length = 4;
-            memcpy(v_tx, "WTF?", response_length);
-            break;
-    }
+static bool OnBye(uint16_t conn_id, const uint8_t* request, uint16_t len, uint8_t* reply, uint16_t& reply_len)
+{
+    reply_len = 3;
+    memcpy(reply, "Bye", reply_len);
+    return true;
+}
 
-    // Get the handle of the notification characteristic
-    uint16_t hdl = pServer->GetHandle(rx_svc_idx, rx_char_idx);
-    // Send the notification
-    esp_ble_gatts_send_indicate(gatts_if, data.conn_id, hdl, response_length, v_tx, false);
+static bool OnUnknownCommand(uint16_t conn_id, const uint8_t* request, uint16_t len, uint8_t* reply, uint16_t& reply_len)
+{
+    reply_len = 4;
+    memcpy(reply, "WTF?", reply_len);
+    return true;
 }
 
+typedef BLECommandDispatcher<
+    BLEFrame<0xAA, 0x55>,
+    BLECommandTable<
+        BLECommand<0x01, OnHello, 0, 0>,    // no payload
+        BLECommand<0x02, OnBye, 0, 0>
+    >,
+    OnUnknownCommand
+> ChannelCommands;
+
 static void AddAttributes(BLEServer *pServ)
 {
-    pServ->AddService(0xffe5);
+    // clients can cache the tables below (Database Hash of the stack's Generic Attribute service)
+    pServ->EnableGATTCaching();
+
+    uint8_t tx_svc_idx = pServ->AddService(0xffe5);
 
-    pServ->AddCharacteristic(
+    uint8_t tx_char_idx = pServ->AddCharacteristic(
         &uuid_0xffe9,            // UUID of the characteristic
         &char_prop_write_norsp,  // property definition (write without response)
         ESP_GATT_PERM_WRITE,     // permission flag (write)
         sizeof(v_tx),            // maximum data size
         0,                       // current data size
         v_tx,                    // the data block itself
-        "TX-Channel",            // name of the characteristic (user description 0x2901)
-        OnChannelWrite           // event handler for the characteristics
+        "TX-Channel"             // name of the characteristic (user description 0x2901)
     );
 
-    rx_svc_idx = pServ->AddService(0xffe0);
+    uint8_t rx_svc_idx = pServ->AddService(0xffe0);
 
-    rx_char_idx = pServ->AddCharacteristic(
+    uint8_t rx_char_idx = pServ->AddCharacteristic(
         &uuid_0xffe4,
         &char_prop_notify,
         ESP_GATT_PERM_READ,
@@ -121,6 +114,9 @@ static void AddAttributes(BLEServer *pServ)
         v_rx_config
     );
 
+    // commands are handled with the server and the handle of the RX channel, which
+    // the replies are notified on, passed in the context of each event
+    pServ->SetEventHandler(tx_svc_idx, tx_char_idx, ChannelCommands::HandleEvent, evt_mask_write, rx_svc_idx, rx_char_idx);
 }
 
 // -------------------------------------------------------------------------------------------------------------------